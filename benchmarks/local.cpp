@@ -1,4 +1,5 @@
 #include "cofhe.hpp"
+#include "common/memory.hpp"
 
 #include <iostream>
 #include "./benchmark.hpp"
@@ -8,6 +9,9 @@ using namespace CoFHE;
 
 auto get_crypto_system()
 {
+    // fixed group, keys and encryption randomness, so that runs can be compared
+    if (const char *seed = std::getenv("COFHE_RANDOM_SEED"))
+        return CPUCryptoSystem(128, 128, false, std::stoull(seed));
     return make_cryptosystem(128, 128, Device::CPU);
 }
 
@@ -214,6 +218,100 @@ void benchmark_scal_matmul()
     b.print_summary();
 }
 
+void benchmark_multi_exponent()
+{
+    // scal_matmul through the multi-exponent engine at several windows, against
+    // the same product done with one BICYCL nupow per (ciphertext, scalar) pair
+    auto cs = get_crypto_system();
+    using CryptoSystem = decltype(cs);
+    auto [sk, pk] = get_keys(cs);
+    size_t ni = 8, mi = 64, pi = 64;
+    Tensor<CryptoSystem::PlainText *> pt1(ni, mi, nullptr);
+    pt1.flatten();
+    for (size_t i = 0; i < ni * mi; i++)
+    {
+        pt1.at(i) = new CryptoSystem::PlainText(cs.make_plaintext(i + 1));
+    }
+    pt1.reshape({ni, mi});
+    auto ct1 = cs.encrypt_tensor(pk, pt1);
+    Tensor<CryptoSystem::PlainText *> pt2(mi, pi, nullptr);
+    pt2.flatten();
+    for (size_t i = 0; i < mi * pi; i++)
+    {
+        pt2.at(i) = new CryptoSystem::PlainText(cs.make_plaintext(i + 1));
+    }
+    pt2.reshape({mi, pi});
+
+    auto Cl_G = cs.get_hsm2k().Cl_G();
+    auto Cl_Delta = cs.get_hsm2k().Cl_Delta();
+    auto scal_matmul_nupow = [&]()
+    {
+        auto cts = ct1;
+        auto s = pt2;
+        cts.flatten();
+        s.flatten();
+        Vector<BICYCL::QFI> c1(ni * mi * pi), c2(ni * mi * pi);
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < ni; i++) for (size_t j = 0; j < mi; j++)
+        {
+            for (size_t k = 0; k < pi; k++)
+            {
+                Cl_G.nupow(c1[i * mi * pi + j * pi + k], cts.at(i * mi + j)->c1(), *s.at(j * pi + k));
+                Cl_Delta.nupow(c2[i * mi * pi + j * pi + k], cts.at(i * mi + j)->c2(), *s.at(j * pi + k));
+            }
+        }
+    };
+    Benchmark b_nupow("scal_matmul_nupow");
+    b_nupow.run(scal_matmul_nupow, 5);
+    b_nupow.print_summary();
+
+    for (size_t w : {0, 4, 5, 6, 7, 8})
+    {
+        cs.set_multi_exponent_window(w);
+        auto scal_matmul = [&cs, &pk, &pt2, &ct1]()
+        {
+            auto res = cs.scal_ciphertext_tensors(pk, pt2, ct1);
+            res.flatten();
+            for (size_t i = 0; i < res.num_elements(); i++)
+            {
+                delete res.at(i);
+            }
+        };
+        Benchmark b("scal_matmul_multi_exp_w" + std::to_string(w));
+        b.run(scal_matmul, 5);
+        b.print_summary();
+    }
+
+    // same number of exponentiations, accumulated by the bucketed multi-exponentiation
+    auto ct2 = cs.encrypt_tensor(pk, pt2);
+    auto matmul_pippenger = [&cs, &pk, &pt1, &ct2]()
+    {
+        auto res = cs.matmul_plaintext_ciphertext_tensors(pk, pt1, ct2);
+        res.flatten();
+        for (size_t i = 0; i < res.num_elements(); i++)
+        {
+            delete res.at(i);
+        }
+    };
+    Benchmark b_pippenger("matmul_pippenger");
+    b_pippenger.run(matmul_pippenger, 5);
+    b_pippenger.print_summary();
+
+    pt1.flatten();
+    ct1.flatten();
+    pt2.flatten();
+    ct2.flatten();
+    for (size_t i = 0; i < ni * mi; i++)
+    {
+        delete pt1.at(i);
+        delete ct1.at(i);
+    }
+    for (size_t i = 0; i < mi * pi; i++)
+    {
+        delete pt2.at(i);
+        delete ct2.at(i);
+    }
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
@@ -221,6 +319,13 @@ int main(int argc, char **argv)
         std::cerr << "Usage: " << argv[0] << " <benchmark>" << std::endl;
         return EXIT_FAILURE;
     }
+    // same switch as the node binary, compares malloc against the GMP arenas
+    if (const char *arena = std::getenv("COFHE_GMP_ARENA"))
+    {
+        ArenaOptions options;
+        options.huge_pages = std::string(arena) == "huge";
+        install_gmp_arena_allocator(options);
+    }
     std::string benchmark = argv[1];
     if (benchmark == "encrypt_decrypt")
     {
@@ -234,10 +339,19 @@ int main(int argc, char **argv)
     {
         benchmark_ciphertext_matadd();
     }
+    else if (benchmark == "multi_exponent")
+    {
+        benchmark_multi_exponent();
+    }
     else
     {
         std::cerr << "Unknown benchmark: " << benchmark << std::endl;
         return EXIT_FAILURE;
     }
+    if (gmp_arena_allocator_installed())
+    {
+        auto stats = gmp_arena_stats();
+        std::cout << "GMP arenas: peak " << stats.peak_bytes_allocated << " bytes, reserved " << stats.bytes_reserved << " bytes, " << stats.num_allocations << " allocations" << std::endl;
+    }
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -7,12 +7,20 @@
 #include "node/nodes.hpp"
 #include "node/client_node.hpp"
 #include "node/compute_request_handler.hpp"
+#include "common/memory.hpp"
 
 #define MALLOC_CHECK_ 3
 
 using namespace CoFHE;
 int main(int argc, char const *argv[])
 {
+    // COFHE_GMP_ARENA=1 (or =huge for huge page backed chunks) moves the GMP limbs to per-thread arenas
+    if (const char *arena = std::getenv("COFHE_GMP_ARENA"))
+    {
+        ArenaOptions options;
+        options.huge_pages = std::string(arena) == "huge";
+        install_gmp_arena_allocator(options);
+    }
     if (argc != 6 && argc != 4)
     {
         std::cerr << "Usage: " << argv[0] << " node_type[setup_node, cofhe_node, compute_node, client_node] self_node_ip self_node_port setup_node_ip setup_node_port" << std::endl;
@@ -48,7 +56,9 @@ int main(int argc, char const *argv[])
     {
         auto self_details = NodeDetails{argv[2], argv[3], NodeType::COMPUTE_NODE};
         auto setup_node_details = NodeDetails{argv[4], argv[5], NodeType::SETUP_NODE};
-        auto compute_node = make_compute_node<CPUCryptoSystem>(self_details, setup_node_details);
+        // COFHE_TENSOR_DIR is the directory of the stored ciphertext tensors requests refer to by id
+        const char *tensor_directory = std::getenv("COFHE_TENSOR_DIR");
+        auto compute_node = make_compute_node<CPUCryptoSystem>(self_details, setup_node_details, tensor_directory ? tensor_directory : "");
         compute_node.run();
     }
     else if (node_type == "client_node")
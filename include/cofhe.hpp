@@ -19,6 +19,7 @@ namespace CoFHE
   concept CryptoSystemConcept = requires(CryptoSystemImpl cs, SecretKeyImpl sk, PublicKeyImpl pk, PlainTextImpl pt, CipherTextImpl ct, SecretKeyShareImpl sks, PartDecryptionResult pdr) {
     { cs.keygen() } -> std::same_as<SecretKeyImpl>;
     { cs.keygen(sk) } -> std::same_as<PublicKeyImpl>;
+    { cs.threshold_keygen(4) } -> std::same_as<SecretKeyImpl>;
     // in sorted order per party
     { cs.keygen(sk, 2, 4) } -> std::same_as<Vector<Vector<SecretKeyShareImpl>>>;
     { cs.encrypt(pk, pt) } -> std::same_as<CipherTextImpl>;
@@ -30,15 +31,20 @@ namespace CoFHE
     { cs.part_decrypt(SecretKeyShareImpl{}, ct) } -> std::same_as<PartDecryptionResult>;
     {cs.part_decrypt_vector(SecretKeyShareImpl{}, Vector<CipherTextImpl>{})} -> std::same_as<Vector<PartDecryptionResult>>;
     {cs.part_decrypt_tensor(SecretKeyShareImpl{}, Tensor<CipherTextImpl>{})} -> std::same_as<Tensor<PartDecryptionResult>>;
-    { cs.combine_part_decryption_results(ct, Vector<PartDecryptionResult>{}) } -> std::same_as<PlainTextImpl>;
-    {cs.combine_part_decryption_results_vector(ct, Vector<PartDecryptionResult>{})} -> std::same_as<Vector<PlainTextImpl>>;
-    {cs.combine_part_decryption_results_tensor(ct, Vector<Tensor<PartDecryptionResult>>{})} -> std::same_as<Tensor<PlainTextImpl>>;
+    // partial decryptions of any threshold of the parties, with their indices and the number of parties
+    { cs.combine_part_decryption_results(ct, Vector<PartDecryptionResult>{}, Vector<size_t>{}, 4) } -> std::same_as<PlainTextImpl>;
+    {cs.combine_part_decryption_results_vector(Vector<CipherTextImpl>{}, Vector<Vector<PartDecryptionResult>>{}, Vector<size_t>{}, 4)} -> std::same_as<Vector<PlainTextImpl>>;
+    {cs.combine_part_decryption_results_tensor(Tensor<CipherTextImpl>{}, Vector<Tensor<PartDecryptionResult>>{}, Vector<size_t>{}, 4)} -> std::same_as<Tensor<PlainTextImpl>>;
     { cs.add_ciphertexts(pk, ct, ct) } -> std::same_as<CipherTextImpl>;
     { cs.scal_ciphertext(pk, pt, ct) } -> std::same_as<CipherTextImpl>;
+    { cs.subtract_ciphertexts(pk, ct, ct) } -> std::same_as<CipherTextImpl>;
+    { cs.add_plaintext_to_ciphertext(pk, pt, ct) } -> std::same_as<CipherTextImpl>;
     { cs.add_ciphertext_vectors(pk, Vector<CipherTextImpl>{}, Vector<CipherTextImpl>{}) } -> std::same_as<Vector<CipherTextImpl>>;
     { cs.scal_ciphertext_vector(pk, pt, Vector<CipherTextImpl>{}) } -> std::same_as<Vector<CipherTextImpl>>;
     { cs.scal_ciphertext_vector(pk, Vector<PlainTextImpl>{}, Vector<CipherTextImpl>{}) } -> std::same_as<Vector<CipherTextImpl>>;
     { cs.add_ciphertext_tensors(pk, Tensor<CipherTextImpl>{}, Tensor<CipherTextImpl>{}) } -> std::same_as<Tensor<CipherTextImpl>>;
+    { cs.subtract_ciphertext_tensors(pk, Tensor<CipherTextImpl>{}, Tensor<CipherTextImpl>{}) } -> std::same_as<Tensor<CipherTextImpl>>;
+    { cs.add_plaintext_to_ciphertext_tensors(pk, Tensor<PlainTextImpl>{}, Tensor<CipherTextImpl>{}) } -> std::same_as<Tensor<CipherTextImpl>>;
     {cs.scal_ciphertext_tensors(pk, Tensor<PlainTextImpl>{}, Tensor<CipherTextImpl>{})} -> std::same_as<Tensor<CipherTextImpl>>;
     { cs.generate_random_plaintext() } -> std::same_as<PlainTextImpl>;
     {cs.generate_random_beavers_triplet()} -> std::same_as<Vector<PlainTextImpl>>;
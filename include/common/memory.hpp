@@ -5,13 +5,504 @@
 
 #ifndef CoFHE_CUDA
 #include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <gmp.h>
+#include <sys/mman.h>
+#include "./common/synchronization.hpp"
 #else
 #include <cuda_runtime.h>
 #endif
 
-namespace CoFHE{
-    // Allocator class, similiar to std::polymorphic byte allocator
-    // Always returns byte
+#ifndef CoFHE_ARENA_CHUNK_SIZE
+#define CoFHE_ARENA_CHUNK_SIZE ((size_t)(2) << 20)
+#endif
+// blocks of 32 B .. 64 KiB come from the arenas, larger ones from malloc
+#ifndef CoFHE_ARENA_NUM_SIZE_CLASSES
+#define CoFHE_ARENA_NUM_SIZE_CLASSES 12
+#endif
+
+namespace CoFHE
+{
+#ifndef CoFHE_CUDA
+    // Per-thread arenas for the limbs of GMP, installed with mp_set_memory_functions.
+    // Each thread carves power of two blocks out of its own chunks and recycles
+    // them through per size class free lists, so the mpz temporaries of the
+    // OpenMP loops never meet in malloc. A block freed by another thread is
+    // handed back to its owner, which picks it up on its next allocation.
+
+    struct ArenaOptions
+    {
+        // map the chunks with MAP_HUGETLB, falling back to transparent huge pages
+        bool huge_pages = false;
+        size_t chunk_size = CoFHE_ARENA_CHUNK_SIZE;
+    };
+
+    struct ArenaStats
+    {
+        // in blocks, including the 16 byte header
+        size_t bytes_allocated = 0;
+        size_t peak_bytes_allocated = 0;
+        size_t bytes_reserved = 0;
+        size_t num_allocations = 0;
+    };
+
+    class Arena
+    {
+    public:
+        struct alignas(16) Header
+        {
+            // nullptr for the blocks that come from malloc
+            Arena *owner;
+            // chunk << 16 | size class, or the size of a malloc block
+            uint64_t info;
+        };
+
+        explicit Arena(const ArenaOptions &options) : options_m(options) {}
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+        ~Arena()
+        {
+            for (auto &chunk : chunks_m)
+                munmap(chunk.base, chunk.size);
+        }
+
+        static size_t block_size(size_t size_class) { return (size_t)(32) << size_class; }
+
+        void *allocate(size_t size)
+        {
+            size_t need = size + sizeof(Header), size_class = 0;
+            while (size_class < CoFHE_ARENA_NUM_SIZE_CLASSES && block_size(size_class) < need)
+                size_class++;
+            if (size_class == CoFHE_ARENA_NUM_SIZE_CLASSES)
+                return allocate_unpooled(size);
+            if (has_remote_m.load(std::memory_order_acquire))
+                drain_remote();
+            Header *h;
+            if (free_m[size_class])
+            {
+                FreeBlock *b = free_m[size_class];
+                free_m[size_class] = b->next;
+                h = reinterpret_cast<Header *>(b) - 1;
+            }
+            else
+            {
+                h = carve(size_class);
+                if (!h)
+                    return nullptr;
+            }
+            if (Mark *m = mark_of(h))
+                m->live++;
+            add_allocated(block_size(size_class));
+            return h + 1;
+        }
+
+        // blocks of this arena only, called by the owning thread
+        void release(Header *h)
+        {
+            bytes_allocated_m.fetch_sub(block_size(h->info & 0xffff), std::memory_order_relaxed);
+            recycle(h);
+        }
+
+        // from any other thread, the block is recycled by the owner
+        void release_remote(Header *h)
+        {
+            bytes_allocated_m.fetch_sub(block_size(h->info & 0xffff), std::memory_order_relaxed);
+            LockGuard lock(remote_mutex_m);
+            remote_m.push_back(h);
+            has_remote_m.store(true, std::memory_order_release);
+        }
+
+        static void *allocate_unpooled(size_t size)
+        {
+            Header *h = static_cast<Header *>(std::malloc(size + sizeof(Header)));
+            if (!h)
+                return nullptr;
+            h->owner = nullptr;
+            h->info = size + sizeof(Header);
+            unpooled_bytes().fetch_add(h->info, std::memory_order_relaxed);
+            return h + 1;
+        }
+
+        static void deallocate_unpooled(Header *h)
+        {
+            unpooled_bytes().fetch_sub(h->info, std::memory_order_relaxed);
+            std::free(h);
+        }
+
+        static std::atomic<size_t> &unpooled_bytes()
+        {
+            static std::atomic<size_t> bytes{0};
+            return bytes;
+        }
+
+        // reset point: when the scope ends with every block carved after the mark
+        // freed again, the arena rewinds to the mark and the memory is reused as is
+        void push_mark()
+        {
+            drain_remote();
+            marks_m.push_back(Mark{chunk_m, offset_m, 0});
+        }
+
+        bool pop_mark()
+        {
+            drain_remote();
+            Mark m = marks_m.back();
+            marks_m.pop_back();
+            if (m.live != 0)
+            {
+                // still in use, the blocks now belong to the enclosing mark
+                if (!marks_m.empty())
+                    marks_m.back().live += m.live;
+                return false;
+            }
+            for (size_t c = 0; c < CoFHE_ARENA_NUM_SIZE_CLASSES; c++)
+            {
+                FreeBlock **b = &free_m[c];
+                while (*b)
+                {
+                    if (above(reinterpret_cast<Header *>(*b) - 1, m))
+                        *b = (*b)->next;
+                    else
+                        b = &(*b)->next;
+                }
+            }
+            chunk_m = m.chunk;
+            offset_m = m.offset;
+            return true;
+        }
+
+        ArenaStats stats() const
+        {
+            ArenaStats s;
+            s.bytes_allocated = bytes_allocated_m.load(std::memory_order_relaxed);
+            s.peak_bytes_allocated = peak_bytes_allocated_m.load(std::memory_order_relaxed);
+            s.bytes_reserved = bytes_reserved_m.load(std::memory_order_relaxed);
+            s.num_allocations = num_allocations_m.load(std::memory_order_relaxed);
+            return s;
+        }
+
+        void reset_peak() { peak_bytes_allocated_m.store(bytes_allocated_m.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+        struct Chunk
+        {
+            char *base;
+            size_t size;
+        };
+        struct Mark
+        {
+            size_t chunk;
+            size_t offset;
+            // blocks at or after the mark that are allocated
+            size_t live;
+        };
+
+        ArenaOptions options_m;
+        std::vector<Chunk> chunks_m;
+        // bump position
+        size_t chunk_m = 0;
+        size_t offset_m = 0;
+        FreeBlock *free_m[CoFHE_ARENA_NUM_SIZE_CLASSES] = {};
+        std::vector<Mark> marks_m;
+        Mutex remote_mutex_m;
+        std::vector<Header *> remote_m;
+        std::atomic<bool> has_remote_m{false};
+        std::atomic<size_t> bytes_allocated_m{0};
+        std::atomic<size_t> peak_bytes_allocated_m{0};
+        std::atomic<size_t> bytes_reserved_m{0};
+        std::atomic<size_t> num_allocations_m{0};
+
+        bool above(const Header *h, const Mark &m) const
+        {
+            size_t chunk = h->info >> 16;
+            size_t offset = reinterpret_cast<const char *>(h) - chunks_m[chunk].base;
+            return chunk > m.chunk || (chunk == m.chunk && offset >= m.offset);
+        }
+
+        // innermost mark the block was carved after
+        Mark *mark_of(const Header *h)
+        {
+            for (size_t i = marks_m.size(); i-- > 0;)
+                if (above(h, marks_m[i]))
+                    return &marks_m[i];
+            return nullptr;
+        }
+
+        void recycle(Header *h)
+        {
+            size_t size_class = h->info & 0xffff;
+            if (Mark *m = mark_of(h))
+                m->live--;
+            FreeBlock *b = reinterpret_cast<FreeBlock *>(h + 1);
+            b->next = free_m[size_class];
+            free_m[size_class] = b;
+        }
+
+        void add_allocated(size_t bytes)
+        {
+            size_t now = bytes_allocated_m.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+            if (now > peak_bytes_allocated_m.load(std::memory_order_relaxed))
+                peak_bytes_allocated_m.store(now, std::memory_order_relaxed);
+            num_allocations_m.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void drain_remote()
+        {
+            std::vector<Header *> remote;
+            {
+                LockGuard lock(remote_mutex_m);
+                remote.swap(remote_m);
+                has_remote_m.store(false, std::memory_order_release);
+            }
+            for (auto h : remote)
+                recycle(h);
+        }
+
+        Header *carve(size_t size_class)
+        {
+            size_t bytes = block_size(size_class);
+            while (true)
+            {
+                if (chunk_m < chunks_m.size() && offset_m + bytes <= chunks_m[chunk_m].size)
+                {
+                    Header *h = reinterpret_cast<Header *>(chunks_m[chunk_m].base + offset_m);
+                    offset_m += bytes;
+                    h->owner = this;
+                    h->info = ((uint64_t)(chunk_m) << 16) | size_class;
+                    return h;
+                }
+                if (chunk_m + 1 < chunks_m.size())
+                {
+                    chunk_m++;
+                    offset_m = 0;
+                    continue;
+                }
+                if (!map_chunk())
+                    return nullptr;
+                chunk_m = chunks_m.size() - 1;
+                offset_m = 0;
+            }
+        }
+
+        bool map_chunk()
+        {
+            size_t size = options_m.chunk_size;
+            void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            if (options_m.huge_pages)
+                p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+            if (p == MAP_FAILED)
+            {
+                p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                    return false;
+#ifdef MADV_HUGEPAGE
+                if (options_m.huge_pages)
+                    madvise(p, size, MADV_HUGEPAGE);
+#endif
+            }
+            chunks_m.push_back(Chunk{static_cast<char *>(p), size});
+            bytes_reserved_m.fetch_add(size, std::memory_order_relaxed);
+            return true;
+        }
+    };
+
+    // Owns every arena. Arenas outlive their threads (their blocks may still be
+    // in use), an exiting thread parks its arena for the next thread to take.
+    class ArenaRegistry
+    {
+    public:
+        static ArenaRegistry &instance()
+        {
+            // never destroyed, GMP objects of other statics may be freed after it
+            static ArenaRegistry *registry = new ArenaRegistry();
+            return *registry;
+        }
+
+        void set_options(const ArenaOptions &options)
+        {
+            LockGuard lock(mutex_m);
+            options_m = options;
+        }
+
+        Arena *acquire()
+        {
+            LockGuard lock(mutex_m);
+            if (!idle_m.empty())
+            {
+                Arena *arena = idle_m.back();
+                idle_m.pop_back();
+                return arena;
+            }
+            arenas_m.push_back(std::make_unique<Arena>(options_m));
+            return arenas_m.back().get();
+        }
+
+        void release(Arena *arena)
+        {
+            LockGuard lock(mutex_m);
+            idle_m.push_back(arena);
+        }
+
+        // summed over all arenas, the peak is the sum of the per arena peaks
+        ArenaStats stats() const
+        {
+            LockGuard lock(mutex_m);
+            ArenaStats total;
+            for (const auto &arena : arenas_m)
+            {
+                ArenaStats s = arena->stats();
+                total.bytes_allocated += s.bytes_allocated;
+                total.peak_bytes_allocated += s.peak_bytes_allocated;
+                total.bytes_reserved += s.bytes_reserved;
+                total.num_allocations += s.num_allocations;
+            }
+            total.bytes_allocated += Arena::unpooled_bytes().load(std::memory_order_relaxed);
+            return total;
+        }
+
+        void reset_peak()
+        {
+            LockGuard lock(mutex_m);
+            for (auto &arena : arenas_m)
+                arena->reset_peak();
+        }
+
+        std::atomic<bool> installed{false};
+
+    private:
+        mutable Mutex mutex_m;
+        ArenaOptions options_m;
+        std::vector<std::unique_ptr<Arena>> arenas_m;
+        std::vector<Arena *> idle_m;
+    };
+
+    namespace detail
+    {
+        // trivially destructible, still readable from other thread_local destructors
+        inline thread_local Arena *thread_arena_p = nullptr;
+        inline thread_local bool thread_arena_exited = false;
+
+        struct ThreadArenaHolder
+        {
+            bool active = false;
+            ~ThreadArenaHolder()
+            {
+                if (thread_arena_p)
+                    ArenaRegistry::instance().release(thread_arena_p);
+                thread_arena_p = nullptr;
+                thread_arena_exited = true;
+            }
+        };
+
+        inline Arena *thread_arena()
+        {
+            if (!thread_arena_p && !thread_arena_exited)
+            {
+                static thread_local ThreadArenaHolder holder;
+                holder.active = true;
+                thread_arena_p = ArenaRegistry::instance().acquire();
+            }
+            return thread_arena_p;
+        }
+
+        inline void *gmp_arena_allocate(size_t size)
+        {
+            Arena *arena = thread_arena();
+            void *p = arena ? arena->allocate(size) : Arena::allocate_unpooled(size);
+            if (!p)
+            {
+                std::fprintf(stderr, "CoFHE: GMP arena allocation of %zu bytes failed\n", size);
+                std::abort();
+            }
+            return p;
+        }
+
+        inline void gmp_arena_free(void *p, size_t)
+        {
+            if (!p)
+                return;
+            Arena::Header *h = static_cast<Arena::Header *>(p) - 1;
+            if (!h->owner)
+                Arena::deallocate_unpooled(h);
+            else if (h->owner == thread_arena_p)
+                h->owner->release(h);
+            else
+                h->owner->release_remote(h);
+        }
+
+        inline void *gmp_arena_reallocate(void *p, size_t old_size, size_t new_size)
+        {
+            if (!p)
+                return gmp_arena_allocate(new_size);
+            Arena::Header *h = static_cast<Arena::Header *>(p) - 1;
+            if (h->owner && new_size + sizeof(Arena::Header) <= Arena::block_size(h->info & 0xffff))
+                return p;
+            void *q = gmp_arena_allocate(new_size);
+            std::memcpy(q, p, old_size < new_size ? old_size : new_size);
+            gmp_arena_free(p, old_size);
+            return q;
+        }
+    }
+
+    // Must run before GMP allocates anything (first thing in main), the blocks
+    // of the previous functions cannot be told apart from ours.
+    inline void install_gmp_arena_allocator(const ArenaOptions &options = ArenaOptions())
+    {
+        auto &registry = ArenaRegistry::instance();
+        if (registry.installed.exchange(true))
+            return;
+        registry.set_options(options);
+        mp_set_memory_functions(detail::gmp_arena_allocate, detail::gmp_arena_reallocate, detail::gmp_arena_free);
+    }
+
+    inline bool gmp_arena_allocator_installed() { return ArenaRegistry::instance().installed.load(); }
+    inline ArenaStats gmp_arena_stats() { return ArenaRegistry::instance().stats(); }
+    inline ArenaStats gmp_thread_arena_stats()
+    {
+        Arena *arena = detail::thread_arena_p;
+        return arena ? arena->stats() : ArenaStats{};
+    }
+    inline void gmp_arena_reset_peak() { ArenaRegistry::instance().reset_peak(); }
+
+    // Reset point for the calling thread's arena. Nothing is reclaimed while a
+    // block carved inside the scope is still alive, so objects that outlive the
+    // scope stay valid. A no-op without the allocator.
+    // Only the calling thread's arena is marked: open it around work that runs
+    // its GMP code on this thread and keeps none of it, e.g. a request served
+    // on the handler thread. The temporaries of OpenMP workers are in their own
+    // arenas, and forms that are cached or returned keep the scope from rewinding.
+    class ArenaScope
+    {
+    public:
+        ArenaScope() : arena_m(gmp_arena_allocator_installed() ? detail::thread_arena() : nullptr)
+        {
+            if (arena_m)
+                arena_m->push_mark();
+        }
+        ArenaScope(const ArenaScope &) = delete;
+        ArenaScope &operator=(const ArenaScope &) = delete;
+        ~ArenaScope()
+        {
+            if (arena_m)
+                arena_m->pop_mark();
+        }
+
+    private:
+        Arena *arena_m;
+    };
+#endif
 }
 
-#endif // CoFHE_MEMORY_HPP_INCLUDED
\ No newline at end of file
+#endif // CoFHE_MEMORY_HPP_INCLUDED
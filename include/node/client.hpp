@@ -1,9 +1,18 @@
 #ifndef CoFHE_NODE_CLIENT_HPP_INCLUDED
 #define CoFHE_NODE_CLIENT_HPP_INCLUDED
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
@@ -21,10 +30,40 @@ namespace CoFHE
         namespace ssl = boost::asio::ssl;
         using tcp = boost::asio::ip::tcp;
 
+        // the server turned the request away without running it, it can be retried
+        class ServerBusy : public std::runtime_error
+        {
+        public:
+            using std::runtime_error::runtime_error;
+        };
+
+        // no response came before the deadline of the request, the connection stays usable
+        class DeadlineExceeded : public std::runtime_error
+        {
+        public:
+            using std::runtime_error::runtime_error;
+        };
+
+        // One TLS connection with any number of requests in flight. Requests are
+        // written as they are issued and each response is matched to its request
+        // by the id in the V2 frame, so they can complete out of order. A V1
+        // server answers in order, its responses go to the oldest request. A
+        // request can carry a deadline: when it passes the request fails with
+        // DeadlineExceeded and is forgotten, its response, if it still comes, is
+        // read and dropped. A response that comes as chunk frames is put back
+        // together before the callback, or handed piece by piece to the chunk
+        // callback of its request as the frames arrive; the deadline covers the
+        // whole of it. The connection is driven by its own I/O thread.
         class Client
         {
         public:
-            Client(const std::string &address, const std::string &port, bool keep_session_alive = false) : io_context_m(), context_m(asio::ssl::context::sslv23), socket_m(io_context_m, context_m), keep_session_alive_m(keep_session_alive)
+            // called on the I/O thread with the response, or with the error that ended the request
+            using Callback = std::function<void(std::exception_ptr, Response)>;
+            // called on the I/O thread with each piece of a chunked response, in order; the
+            // callback then gets the response without its data
+            using ChunkCallback = std::function<void(std::string_view)>;
+
+            Client(const std::string &address, const std::string &port, bool keep_session_alive = false) : io_context_m(), work_m(asio::make_work_guard(io_context_m)), context_m(asio::ssl::context::sslv23), socket_m(io_context_m, context_m), keep_session_alive_m(keep_session_alive)
             {
                 context_m.set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 | asio::ssl::context::single_dh_use);
                 // context_m.set_verify_mode(asio::ssl::verify_peer);
@@ -36,33 +75,153 @@ namespace CoFHE
                 // socket_m.set_verify_mode(asio::ssl::verify_peer);
                 socket_m.set_verify_callback(asio::ssl::rfc2818_verification(address));
                 socket_m.handshake(asio::ssl::stream_base::client);
+                io_thread_m = std::thread([this]()
+                                          { io_context_m.run(); });
             }
 
             Client(const Client &) = delete;
             Client &operator=(const Client &) = delete;
-            Client(Client &&) = default;
-            Client &operator=(Client &&) = default;
-            ~Client() = default;
+            Client(Client &&) = delete;
+            Client &operator=(Client &&) = delete;
+            ~Client()
+            {
+                close();
+                work_m.reset();
+                if (io_thread_m.joinable())
+                {
+                    io_thread_m.join();
+                }
+            }
 
+            // blocks until the response arrives, the error of a failed request is thrown and *res is left untouched
             template <typename T>
                 requires RequestType<T> && ResponseType<typename T::ResponseType>
             void run(ServiceType type, const T &r, typename T::ResponseType **res)
             {
+                *res = new typename T::ResponseType(run_async(type, r).get());
+            }
+
+            // a timeout of zero means the default of the client
+            template <typename T>
+                requires RequestType<T> && ResponseType<typename T::ResponseType>
+            std::future<typename T::ResponseType> run_async(ServiceType type, const T &r, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero())
+            {
+                using Res = typename T::ResponseType;
+                auto promise = std::make_shared<std::promise<Res>>();
+                auto future = promise->get_future();
+                // the payload of a request that can encode itself in pieces is shared, not copied
+                BufferChain data;
+                if constexpr (requires { r.to_buffers(protocol_version_m); })
+                {
+                    data = r.to_buffers(protocol_version_m);
+                }
+                else if constexpr (requires { r.to_string(protocol_version_m); })
+                {
+                    data = BufferChain(r.to_string(protocol_version_m));
+                }
+                else
+                {
+                    data = BufferChain(r.to_string());
+                }
+                async_request(type, std::move(data), [promise](std::exception_ptr error, Response res)
+                              {
+                    try
+                    {
+                        promise->set_value(decode_response<Res>(error, std::move(res)));
+                    }
+                    catch (...)
+                    {
+                        promise->set_exception(std::current_exception());
+                    } }, timeout);
+                return future;
+            }
+
+            // the inner response of a finished request, for async_request callbacks; the error of
+            // the request or a status other than OK is thrown instead
+            template <typename Res>
+                requires ResponseType<Res>
+            static Res decode_response(std::exception_ptr error, Response res)
+            {
+                if (error)
+                {
+                    std::rethrow_exception(error);
+                }
+                if (res.status() == Response::Status::BUSY)
+                {
+                    throw ServerBusy("Server busy: " + res.data());
+                }
+                if (res.status() != Response::Status::OK)
+                {
+                    throw std::runtime_error("Request failed: " + res.data());
+                }
+                return Res::from_string(std::move(res.data()));
+            }
 
-                if (io_context_m.stopped())
+            // data is the already encoded inner request, a timeout of zero means the default of the client
+            void async_request(ServiceType type, BufferChain data, Callback callback, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(), ChunkCallback on_chunk = nullptr)
+            {
+                if (timeout == std::chrono::milliseconds::zero())
                 {
-                    io_context_m.restart();
-                    read_buffer.clear();
+                    timeout = timeout_m.load();
                 }
-                auto req = Request(ProtocolVersion::V1, type, r.to_string());
-                write_buffer = req.to_string();
-                do_write(res);
-                io_context_m.run();
+                in_flight_m++;
+                callback = [this, callback = std::move(callback)](std::exception_ptr error, Response res)
+                {
+                    in_flight_m--;
+                    callback(error, std::move(res));
+                };
+                asio::post(io_context_m, [this, type, timeout, data = std::move(data), callback = std::move(callback), on_chunk = std::move(on_chunk)]() mutable
+                           {
+                    if (!open_m)
+                    {
+                        callback(std::make_exception_ptr(std::runtime_error("Session is closed")), Response());
+                        return;
+                    }
+                    auto req = Request(protocol_version_m, type, std::move(data));
+                    uint64_t id = next_request_id_m++;
+                    req.header().request_id() = id;
+                    auto &entry = pending_m[id];
+                    entry.callback = std::move(callback);
+                    entry.on_chunk = std::move(on_chunk);
+                    entry.version = protocol_version_m;
+                    if (timeout > std::chrono::milliseconds::zero())
+                    {
+                        entry.timer = std::make_unique<asio::steady_timer>(io_context_m, timeout);
+                        entry.timer->async_wait([this, id](const std::error_code &error)
+                                                {
+                            if (!error)
+                            {
+                                expire(id);
+                            } });
+                    }
+                    write_queue_m.push_back(req.to_buffers());
+                    if (write_queue_m.size() == 1)
+                    {
+                        do_write();
+                    }
+                    if (!reading_m)
+                    {
+                        reading_m = true;
+                        do_read();
+                    } });
             }
 
             void close()
             {
-                end_session();
+                asio::post(io_context_m, [this]()
+                           { end_session(); });
+            }
+
+            // false once the connection failed or was closed, requests fail at once then
+            bool is_open() const
+            {
+                return open_m;
+            }
+
+            // requests issued and not completed yet
+            size_t in_flight() const
+            {
+                return in_flight_m;
             }
 
             bool is_session_alive()
@@ -75,106 +234,377 @@ namespace CoFHE
                 keep_session_alive_m = keep_session_alive;
             }
 
+            // V2 by default, V1 to talk to servers that predate it; set before the first request
+            ProtocolVersion protocol_version() const
+            {
+                return protocol_version_m;
+            }
+
+            void set_protocol_version(ProtocolVersion ver)
+            {
+                protocol_version_m = ver;
+            }
+
+            // deadline of the requests issued without one, zero (the default) for none
+            std::chrono::milliseconds timeout() const
+            {
+                return timeout_m;
+            }
+
+            void set_timeout(std::chrono::milliseconds timeout)
+            {
+                timeout_m = timeout;
+            }
+
         private:
+            struct PendingRequest
+            {
+                Callback callback;
+                ChunkCallback on_chunk;
+                std::unique_ptr<asio::steady_timer> timer;
+                ProtocolVersion version;
+                // the chunks so far, without an on_chunk
+                std::string chunks;
+            };
+
             asio::io_context io_context_m;
+            asio::executor_work_guard<asio::io_context::executor_type> work_m;
             asio::ssl::context context_m;
             asio::ssl::stream<asio::ip::tcp::socket> socket_m;
-            bool keep_session_alive_m;
+            std::thread io_thread_m;
+            std::atomic<bool> keep_session_alive_m;
+            ProtocolVersion protocol_version_m = ProtocolVersion::V2;
+            std::atomic<bool> open_m{true};
+            std::atomic<size_t> in_flight_m{0};
+            std::atomic<std::chrono::milliseconds> timeout_m{std::chrono::milliseconds::zero()};
+            // only touched on the I/O thread
+            std::map<uint64_t, PendingRequest> pending_m;
+            // V1 requests that expired before their response, it still comes in its turn
+            std::set<uint64_t> expired_v1_m;
+            std::deque<BufferChain> write_queue_m;
+            uint64_t next_request_id_m = 1;
+            bool reading_m = false;
             std::string read_buffer;
-            std::string write_buffer;
 
-            template <typename T>
-                requires ResponseType<T>
-            void do_read(T **res)
+            void do_read()
+            {
+                if (read_buffer.empty())
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_at_least(1), [this](const std::error_code &error, size_t bytes_transferred)
+                                     {
+                        if (!error)
+                        {
+                            do_read();
+                        }
+                        else
+                        {
+                            fail(error);
+                        } });
+                    return;
+                }
+                // a V1 server answers in V1 whatever was sent, so the framing is taken from the response
+                if (is_wire_v2(read_buffer))
+                {
+                    do_read_v2_header();
+                }
+                else
+                {
+                    do_read_v1_header();
+                }
+            }
+
+            void do_read_v2_header()
             {
-                asio::async_read_until(socket_m, asio::dynamic_buffer(read_buffer), '\n', [this, res](const std::error_code &error, size_t bytes_transferred)
+                if (read_buffer.size() < WIRE_V2_FRAME_HEADER_SIZE)
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(WIRE_V2_FRAME_HEADER_SIZE - read_buffer.size()), [this](const std::error_code &error, size_t bytes_transferred)
+                                     {
+                        if (!error)
+                        {
+                            do_read_v2_header();
+                        }
+                        else
+                        {
+                            fail(error);
+                        } });
+                    return;
+                }
+                try
+                {
+                    auto res_header = Response::ResponseHeader::from_string(read_buffer);
+                    read_buffer.erase(0, WIRE_V2_FRAME_HEADER_SIZE);
+                    do_read_data(res_header);
+                }
+                catch (const std::exception &e)
+                {
+                    fail(std::current_exception());
+                }
+            }
+
+            void do_read_v1_header()
+            {
+                asio::async_read_until(socket_m, asio::dynamic_buffer(read_buffer), '\n', [this](const std::error_code &error, size_t bytes_transferred)
                                        {
                     if (!error)
                     {
                         try
                         {
-                            auto res_header_str = read_buffer.substr(0, bytes_transferred);
-                            if (read_buffer.size() > bytes_transferred)
-                            {
-                                read_buffer = read_buffer.erase(0, bytes_transferred);
-                            }
-                            else
-                            {
-                                read_buffer.clear();
-                            }
-                            auto res_header = Response::ResponseHeader::from_string(res_header_str);
-                            if (res_header.data_size()>read_buffer.size())
-                            {
-                            asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(res_header.data_size()-read_buffer.size()), [this, res_header, res](const std::error_code &error, size_t bytes_transferred)
-                                             {
-                                if (!error)
-                                {   
-                                    process_request(res_header, read_buffer, res);
-                                }
-                                else
-                                {
-                                    std::cerr << "Read failed: " << error.message() << std::endl;
-                                    end_session();
-                                }
-                            });
-                            }
-                            else{
-                                process_request(res_header, read_buffer, res);
-                            }
+                            auto res_header = Response::ResponseHeader::from_string(read_buffer.substr(0, bytes_transferred));
+                            read_buffer.erase(0, bytes_transferred);
+                            do_read_data(res_header);
                         }
                         catch(const std::exception &e){
-                            std::cerr << "Error: " << e.what() << std::endl;
-                            end_session();
+                            fail(std::current_exception());
                         }
                     }
                     else
                     {
-                        std::cerr << "Read failed: " << error.message() << std::endl;
-                        end_session();
+                        fail(error);
                     } });
             }
 
-            template <typename T>
-                requires ResponseType<T>
-            void process_request(const Response::ResponseHeader &header, std::string &data, T **res)
+            void do_read_data(Response::ResponseHeader res_header)
+            {
+                if (res_header.data_size() > read_buffer.size())
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(res_header.data_size() - read_buffer.size()), [this, res_header](const std::error_code &error, size_t bytes_transferred)
+                                     {
+                        if (!error)
+                        {
+                            process_response(res_header);
+                        }
+                        else
+                        {
+                            fail(error);
+                        } });
+                }
+                else
+                {
+                    process_response(res_header);
+                }
+            }
+
+            void process_response(const Response::ResponseHeader &header)
             {
+                auto data = take_frame_data(read_buffer, header.data_size());
+                if (header.protocol_version() == ProtocolVersion::V2 && (header.flags() & WIRE_V2_CHUNK))
+                {
+                    process_chunk(header, std::move(data));
+                    return;
+                }
+                Callback callback;
+                if (header.protocol_version() == ProtocolVersion::V2)
+                {
+                    auto it = pending_m.find(header.request_id());
+                    if (it != pending_m.end())
+                    {
+                        callback = take_pending(it);
+                    }
+                    else if (header.request_id() == 0 || header.request_id() >= next_request_id_m)
+                    {
+                        fail(std::make_exception_ptr(std::runtime_error("Response to an unknown request")));
+                        return;
+                    }
+                    // otherwise the request expired, its late response is dropped
+                }
+                else if (!expired_v1_m.empty() && (pending_m.empty() || *expired_v1_m.begin() < pending_m.begin()->first))
+                {
+                    expired_v1_m.erase(expired_v1_m.begin());
+                }
+                else if (!pending_m.empty())
+                {
+                    callback = take_pending(pending_m.begin());
+                }
+                else
+                {
+                    fail(std::make_exception_ptr(std::runtime_error("Response to an unknown request")));
+                    return;
+                }
                 try
                 {
-                    *res = new T(T::from_string(read_buffer.substr(0, header.data_size())));
-                    if (!keep_session_alive_m)
+                    if (callback)
                     {
-                        end_session();
+                        callback(nullptr, Response(header, std::move(data)));
                     }
-                    data.erase(0, header.data_size());
                 }
                 catch (const std::exception &e)
                 {
                     std::cerr << "Error: " << e.what() << std::endl;
+                }
+                if (!pending_m.empty() || !expired_v1_m.empty())
+                {
+                    do_read();
+                    return;
+                }
+                reading_m = false;
+                if (!keep_session_alive_m)
+                {
                     end_session();
                 }
             }
 
-            template <typename T>
-                requires ResponseType<T>
-            void do_write(T **res)
+            // a frame of a chunked response, the request completes with the last one
+            void process_chunk(Response::ResponseHeader header, std::string data)
+            {
+                auto it = pending_m.find(header.request_id());
+                if (it == pending_m.end() && (header.request_id() == 0 || header.request_id() >= next_request_id_m))
+                {
+                    fail(std::make_exception_ptr(std::runtime_error("Response to an unknown request")));
+                    return;
+                }
+                // otherwise the request expired, the rest of its response is dropped
+                if (it != pending_m.end())
+                {
+                    bool last = (header.flags() & WIRE_V2_LAST_CHUNK) != 0;
+                    bool ok = header.status() == Response::Status::OK;
+                    try
+                    {
+                        if (ok && !data.empty() && it->second.on_chunk)
+                        {
+                            it->second.on_chunk(data);
+                        }
+                        else if (ok)
+                        {
+                            it->second.chunks.append(data);
+                        }
+                    }
+                    catch (...)
+                    {
+                        // the consumer gave up on the response, the request fails with its error and the rest is dropped
+                        auto callback = take_pending(it);
+                        complete(callback, std::current_exception(), Response());
+                        it = pending_m.end();
+                    }
+                    if (it != pending_m.end() && last)
+                    {
+                        // a failed response carries the error in its last frame instead of the data
+                        std::string assembled = ok ? std::move(it->second.chunks) : std::move(data);
+                        auto callback = take_pending(it);
+                        header.flags() = 0;
+                        header.data_size() = assembled.size();
+                        complete(callback, nullptr, Response(header, std::move(assembled)));
+                    }
+                }
+                if (!pending_m.empty() || !expired_v1_m.empty() || !(header.flags() & WIRE_V2_LAST_CHUNK))
+                {
+                    do_read();
+                    return;
+                }
+                reading_m = false;
+                if (!keep_session_alive_m)
+                {
+                    end_session();
+                }
+            }
+
+            void complete(Callback &callback, std::exception_ptr error, Response res)
             {
-                asio::async_write(socket_m, asio::buffer(write_buffer, write_buffer.size()), [this, res](const std::error_code &error, size_t bytes_transferred)
+                try
+                {
+                    callback(error, std::move(res));
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                }
+            }
+
+            Callback take_pending(std::map<uint64_t, PendingRequest>::iterator it)
+            {
+                auto entry = std::move(it->second);
+                pending_m.erase(it);
+                if (entry.timer)
+                {
+                    entry.timer->cancel();
+                }
+                return std::move(entry.callback);
+            }
+
+            void do_write()
+            {
+                asio::async_write(socket_m, write_queue_m.front().buffers<asio::const_buffer>(), [this](const std::error_code &error, size_t bytes_transferred)
                                   {
                     if (!error)
                     {
-                        do_read(res);
+                        write_queue_m.pop_front();
+                        if (!write_queue_m.empty())
+                        {
+                            do_write();
+                        }
                     }
                     else
                     {
-                        std::cerr << "Write failed: " << error.message() << std::endl;
-                        end_session();
+                        fail(error);
                     } });
             }
-            void end_session()
+
+            void fail(const std::error_code &error)
+            {
+                if (open_m)
+                {
+                    std::cerr << "Connection failed: " << error.message() << std::endl;
+                }
+                fail(std::make_exception_ptr(std::runtime_error("Connection failed: " + error.message())));
+            }
+
+            // every request still in flight fails with the error and the session is closed
+            void fail(std::exception_ptr error)
+            {
+                auto pending = std::move(pending_m);
+                pending_m.clear();
+                expired_v1_m.clear();
+                reading_m = false;
+                end_session(false);
+                for (auto &entry : pending)
+                {
+                    if (entry.second.timer)
+                    {
+                        entry.second.timer->cancel();
+                    }
+                    if (entry.second.callback)
+                    {
+                        entry.second.callback(error, Response());
+                    }
+                }
+            }
+
+            // a V1 request is remembered until its response comes, so the responses after it still go to the right requests
+            void expire(uint64_t id)
             {
+                auto it = pending_m.find(id);
+                if (it == pending_m.end())
+                {
+                    return;
+                }
+                if (it->second.version == ProtocolVersion::V1)
+                {
+                    expired_v1_m.insert(id);
+                }
+                auto callback = take_pending(it);
                 try
                 {
-                    socket_m.shutdown();
+                    callback(std::make_exception_ptr(DeadlineExceeded("No response before the deadline")), Response());
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                }
+            }
+
+            // the TLS shutdown is skipped while a read is outstanding, closing the socket aborts it
+            void end_session(bool graceful = true)
+            {
+                if (!open_m)
+                {
+                    return;
+                }
+                open_m = false;
+                try
+                {
+                    if (graceful && !reading_m)
+                    {
+                        socket_m.shutdown();
+                    }
                     socket_m.lowest_layer().close();
                 }
                 catch (const std::exception &e)
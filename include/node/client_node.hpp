@@ -21,6 +21,90 @@ namespace CoFHE
             client_m->run(Network::ServiceType::COMPUTE_REQUEST, request, response);
         }
 
+        // independent requests can be issued back to back, they share the connection
+        std::future<ComputeResponse> compute_async(const ComputeRequest &request)
+        {
+            return client_m->run_async(Network::ServiceType::COMPUTE_REQUEST, request);
+        }
+
+        // a request whose result is a ciphertext tensor; a result that comes as chunk frames is
+        // decoded block by block while the rest of it is still on the wire
+        std::future<Tensor<typename CryptoSystem::CipherText *>> compute_ciphertext_tensor_async(const ComputeRequest &request)
+        {
+            using CipherTextTensor = Tensor<typename CryptoSystem::CipherText *>;
+            if constexpr (requires { typename CryptoSystem::CipherTextTensorStreamReader; })
+            {
+                struct ChunkedResult
+                {
+                    // the header ComputeResponse puts in front of the data
+                    std::string header;
+                    std::unique_ptr<typename CryptoSystem::CipherTextTensorStreamReader> reader;
+                };
+                auto promise = std::make_shared<std::promise<CipherTextTensor>>();
+                auto future = promise->get_future();
+                auto result = std::make_shared<ChunkedResult>();
+                auto on_chunk = [result](std::string_view piece)
+                {
+                    if (result->reader == nullptr)
+                    {
+                        size_t take = std::min(piece.size(), ComputeResponse::V2_HEADER_SIZE - result->header.size());
+                        result->header.append(piece.substr(0, take));
+                        piece.remove_prefix(take);
+                        if (result->header.size() < ComputeResponse::V2_HEADER_SIZE)
+                        {
+                            return;
+                        }
+                        if (!Network::is_wire_v2(result->header) || static_cast<ComputeResponse::Status>(result->header[1]) != ComputeResponse::Status::OK)
+                        {
+                            throw std::runtime_error("Chunked compute response is not a result");
+                        }
+                        result->reader = std::make_unique<typename CryptoSystem::CipherTextTensorStreamReader>();
+                    }
+                    result->reader->feed(piece);
+                };
+                client_m->async_request(Network::ServiceType::COMPUTE_REQUEST, request.to_buffers(client_m->protocol_version()), [this, promise, result](std::exception_ptr error, Network::Response res)
+                                        {
+                    try
+                    {
+                        if (result->reader != nullptr)
+                        {
+                            if (error)
+                            {
+                                std::rethrow_exception(error);
+                            }
+                            if (res.status() != Network::Response::Status::OK)
+                            {
+                                throw std::runtime_error("Request failed: " + res.data());
+                            }
+                            promise->set_value(result->reader->finish());
+                            return;
+                        }
+                        auto compute_res = Network::Client::decode_response<ComputeResponse>(error, std::move(res));
+                        if (compute_res.status() != ComputeResponse::Status::OK)
+                        {
+                            throw std::runtime_error("Compute failed: " + compute_res.data());
+                        }
+                        promise->set_value(crypto_system_m.deserialize_ciphertext_tensor(compute_res.data()));
+                    }
+                    catch (...)
+                    {
+                        promise->set_exception(std::current_exception());
+                    } }, std::chrono::milliseconds::zero(), std::move(on_chunk));
+                return future;
+            }
+            else
+            {
+                return std::async(std::launch::deferred, [this, res = compute_async(request)]() mutable
+                                  {
+                    auto compute_res = res.get();
+                    if (compute_res.status() != ComputeResponse::Status::OK)
+                    {
+                        throw std::runtime_error("Compute failed: " + compute_res.data());
+                    }
+                    return crypto_system_m.deserialize_ciphertext_tensor(compute_res.data()); });
+            }
+        }
+
         CryptoSystem &crypto_system() { return crypto_system_m; }
         const CryptoSystem &crypto_system() const { return crypto_system_m; }
         typename CryptoSystem::PublicKey &network_public_key()
@@ -0,0 +1,180 @@
+#ifndef CoFHE_NODE_CLIENT_POOL_HPP_INCLUDED
+#define CoFHE_NODE_CLIENT_POOL_HPP_INCLUDED
+
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "node/client.hpp"
+
+// warm connections per node, requests are pipelined on each so this only spreads the TLS and socket work
+#define CLIENT_POOL_SIZE 8
+
+namespace CoFHE
+{
+    namespace Network
+    {
+        // A fixed number of warm connections to one node, shared by any number of
+        // threads. checkout hands out the open connection with the fewest
+        // requests in flight, so concurrent callers spread over the sockets
+        // instead of queueing on one. A connection that failed is skipped, and
+        // reopened by health_check or by checkout once none is left. Connecting
+        // is done without the lock, the open connections stay usable meanwhile.
+        // Every connection speaks the version the pool was made with.
+        class ClientPool
+        {
+        public:
+            ClientPool(const std::string &address, const std::string &port, size_t size = CLIENT_POOL_SIZE, ProtocolVersion version = ProtocolVersion::V2) : address_m(address), port_m(port), version_m(version), clients_m(size), reconnecting_m(size, false)
+            {
+                if (size == 0)
+                {
+                    throw std::invalid_argument("Pool size must be positive");
+                }
+                health_check();
+                if (healthy() == 0)
+                {
+                    throw std::runtime_error("Cannot connect to " + address_m + ":" + port_m);
+                }
+            }
+
+            ClientPool(const ClientPool &) = delete;
+            ClientPool &operator=(const ClientPool &) = delete;
+
+            // the connection is checked back in when the last copy of the pointer is dropped,
+            // a connection replaced in the meantime stays alive until then
+            std::shared_ptr<Client> checkout()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_m);
+                    std::shared_ptr<Client> best = least_loaded();
+                    if (best != nullptr)
+                    {
+                        return best;
+                    }
+                }
+                reconnect();
+                // slots another caller is still reopening are waited for
+                std::unique_lock<std::mutex> lock(mutex_m);
+                std::shared_ptr<Client> best;
+                reconnected_m.wait(lock, [this, &best]()
+                                   {
+                    best = least_loaded();
+                    return best != nullptr || std::find(reconnecting_m.begin(), reconnecting_m.end(), true) == reconnecting_m.end(); });
+                if (best == nullptr)
+                {
+                    throw std::runtime_error("No connection to " + address_m + ":" + port_m);
+                }
+                return best;
+            }
+
+            template <typename T>
+                requires RequestType<T> && ResponseType<typename T::ResponseType>
+            std::future<typename T::ResponseType> run_async(ServiceType type, const T &r, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero())
+            {
+                return checkout()->run_async(type, r, timeout);
+            }
+
+            template <typename T>
+                requires RequestType<T> && ResponseType<typename T::ResponseType>
+            void run(ServiceType type, const T &r, typename T::ResponseType **res)
+            {
+                checkout()->run(type, r, res);
+            }
+
+            // reopens every connection that failed, returns how many are open
+            size_t health_check()
+            {
+                reconnect();
+                return healthy();
+            }
+
+            size_t healthy() const
+            {
+                std::lock_guard<std::mutex> lock(mutex_m);
+                return count_open();
+            }
+
+            size_t size() const { return clients_m.size(); }
+            const std::string &address() const { return address_m; }
+            const std::string &port() const { return port_m; }
+            // requests nested in the ones sent over the pool are encoded in it too
+            ProtocolVersion protocol_version() const { return version_m; }
+
+        private:
+            std::string address_m;
+            std::string port_m;
+            ProtocolVersion version_m;
+            mutable std::mutex mutex_m;
+            std::condition_variable reconnected_m;
+            std::vector<std::shared_ptr<Client>> clients_m;
+            // slots some caller is connecting, without the lock
+            std::vector<bool> reconnecting_m;
+
+            std::shared_ptr<Client> least_loaded() const
+            {
+                std::shared_ptr<Client> best;
+                for (const auto &client : clients_m)
+                {
+                    if (client != nullptr && client->is_open() && (best == nullptr || client->in_flight() < best->in_flight()))
+                    {
+                        best = client;
+                    }
+                }
+                return best;
+            }
+
+            // the failed slots are claimed under the lock and connected without it, a slot
+            // that is being connected by another caller is left to it
+            void reconnect()
+            {
+                std::vector<size_t> slots;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_m);
+                    for (size_t i = 0; i < clients_m.size(); i++)
+                    {
+                        if (reconnecting_m[i] || (clients_m[i] != nullptr && clients_m[i]->is_open()))
+                            continue;
+                        reconnecting_m[i] = true;
+                        slots.push_back(i);
+                    }
+                }
+                for (size_t i : slots)
+                {
+                    std::shared_ptr<Client> client;
+                    try
+                    {
+                        client = std::make_shared<Client>(address_m, port_m, true);
+                        client->set_protocol_version(version_m);
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::cerr << "Cannot connect to " << address_m << ":" << port_m << ": " << e.what() << std::endl;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_m);
+                        // the failed connection is closed below, outside of the lock
+                        std::swap(clients_m[i], client);
+                        reconnecting_m[i] = false;
+                    }
+                    reconnected_m.notify_all();
+                }
+            }
+
+            size_t count_open() const
+            {
+                size_t n = 0;
+                for (const auto &client : clients_m)
+                {
+                    if (client != nullptr && client->is_open())
+                        n++;
+                }
+                return n;
+            }
+        };
+    } // namespace Network
+} // namespace CoFHE
+#endif
@@ -6,6 +6,7 @@
 #include <sstream>
 
 #include "node/network_details.hpp"
+#include "node/request_response.hpp"
 #include "node/partial_decryption_request_handler.hpp"
 
 namespace CoFHE
@@ -34,12 +35,9 @@ namespace CoFHE
                 return std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_size_m) + "\n";
             }
 
-            static CoFHENodeResponseHeader from_string(std::string str)
+            static CoFHENodeResponseHeader from_string(const std::string &str)
             {
-                std::istringstream iss(str);
-                std::string line;
-                std::getline(iss, line);
-                std::istringstream iss_line(line);
+                std::istringstream iss_line = Network::text_header_line(str);
                 int status;
                 size_t data_size;
                 iss_line >> status >> data_size;
@@ -51,39 +49,62 @@ namespace CoFHE
             size_t data_size_m;
         };
 
-        CoFHENodeResponse(CoFHENodeResponseHeader header, std::string data) : header_m(header), data_m(data)
+        CoFHENodeResponse(CoFHENodeResponseHeader header, std::string data) : header_m(header), data_m(std::move(data))
         {
-            if (data.size() != header.data_size())
+            if (data_m.size() != header_m.data_size())
             {
                 throw std::runtime_error("Data size mismatch");
             }
         }
 
-        CoFHENodeResponse(Status status, std::string data) : header_m(Status::OK, data.size()), data_m(data) {}
+        CoFHENodeResponse(Status status, std::string data) : header_m(status, data.size()), data_m(std::move(data)) {}
+        // data is the encoded inner response, it is not copied
+        CoFHENodeResponse(Status status, Network::BufferChain data) : header_m(status, data.size()), data_m(std::move(data)) {}
 
         CoFHENodeResponseHeader &header() { return header_m; }
         const CoFHENodeResponseHeader &header() const { return header_m; }
-        std::string &data() { return data_m; }
-        const std::string &data() const { return data_m; }
+        std::string &data() { return data_m.flat(); }
+        const std::string &data() const { return data_m.flat(); }
 
-        std::string to_string() const
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return header_m.to_string() + data_m;
+            return to_buffers(ver).str();
+        }
+
+        // V2: marker, u8 status, then the data as one section
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
+        {
+            Network::BufferChain chain = data_m;
+            if (ver == Network::ProtocolVersion::V2)
+            {
+                return chain.prepend(Network::WireWriter(9).u8(static_cast<uint8_t>(header_m.status())).u64(data_m.size()).str());
+            }
+            return chain.prepend(header_m.to_string());
         }
 
         static CoFHENodeResponse from_string(std::string str)
         {
-            return CoFHENodeResponse(CoFHENodeResponseHeader::from_string(str), str.substr(str.find('\n') + 1));
+            if (Network::is_wire_v2(str))
+            {
+                Network::WireReader reader(str);
+                auto status = static_cast<Status>(reader.u8());
+                std::string data = reader.take_last_section();
+                // the size is taken before data is moved into the argument
+                CoFHENodeResponseHeader header(status, data.size());
+                return CoFHENodeResponse(header, std::move(data));
+            }
+            auto header = CoFHENodeResponseHeader::from_string(str);
+            return CoFHENodeResponse(header, Network::take_text_payload(str));
         }
 
         static CoFHENodeResponse from_string(CoFHENodeResponseHeader header, std::string str)
         {
-            return CoFHENodeResponse(header, str);
+            return CoFHENodeResponse(header, std::move(str));
         }
 
     private:
         CoFHENodeResponseHeader header_m;
-        std::string data_m;
+        Network::BufferChain data_m;
     };
 
     class CoFHENodeRequest
@@ -111,12 +132,9 @@ namespace CoFHE
                 return std::to_string(static_cast<int>(type_m)) + " " + std::to_string(data_size_m) + "\n";
             }
 
-            static CoFHENodeRequestHeader from_string(std::string str)
+            static CoFHENodeRequestHeader from_string(const std::string &str)
             {
-                std::istringstream iss(str);
-                std::string line;
-                std::getline(iss, line);
-                std::istringstream iss_line(line);
+                std::istringstream iss_line = Network::text_header_line(str);
                 int type;
                 size_t data_size;
                 iss_line >> type >> data_size;
@@ -128,39 +146,62 @@ namespace CoFHE
             size_t data_size_m;
         };
 
-        CoFHENodeRequest(CoFHENodeRequestHeader header, std::string data) : header_m(header), data_m(data)
+        CoFHENodeRequest(CoFHENodeRequestHeader header, std::string data) : header_m(header), data_m(std::move(data))
         {
-            if (data.size() != header.data_size())
+            if (data_m.size() != header_m.data_size())
             {
                 throw std::runtime_error("Data size mismatch");
             }
         }
 
-        CoFHENodeRequest(RequestType type, std::string data) : header_m(type, data.size()), data_m(data) {}
+        CoFHENodeRequest(RequestType type, std::string data) : header_m(type, data.size()), data_m(std::move(data)) {}
+        // data is the encoded inner request, it is not copied
+        CoFHENodeRequest(RequestType type, Network::BufferChain data) : header_m(type, data.size()), data_m(std::move(data)) {}
 
         CoFHENodeRequestHeader &header() { return header_m; }
         const CoFHENodeRequestHeader &header() const { return header_m; }
-        std::string &data() { return data_m; }
-        const std::string &data() const { return data_m; }
+        std::string &data() { return data_m.flat(); }
+        const std::string &data() const { return data_m.flat(); }
 
-        std::string to_string() const
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return header_m.to_string() + data_m;
+            return to_buffers(ver).str();
+        }
+
+        // V2: marker, u8 type, then the data as one section
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
+        {
+            Network::BufferChain chain = data_m;
+            if (ver == Network::ProtocolVersion::V2)
+            {
+                return chain.prepend(Network::WireWriter(9).u8(static_cast<uint8_t>(header_m.type())).u64(data_m.size()).str());
+            }
+            return chain.prepend(header_m.to_string());
         }
 
         static CoFHENodeRequest from_string(std::string str)
         {
-            return CoFHENodeRequest(CoFHENodeRequestHeader::from_string(str), str.substr(str.find('\n') + 1));
+            if (Network::is_wire_v2(str))
+            {
+                Network::WireReader reader(str);
+                auto type = static_cast<RequestType>(reader.u8());
+                std::string data = reader.take_last_section();
+                // the size is taken before data is moved into the argument
+                CoFHENodeRequestHeader header(type, data.size());
+                return CoFHENodeRequest(header, std::move(data));
+            }
+            auto header = CoFHENodeRequestHeader::from_string(str);
+            return CoFHENodeRequest(header, Network::take_text_payload(str));
         }
 
         static CoFHENodeRequest from_string(CoFHENodeRequestHeader header, std::string str)
         {
-            return CoFHENodeRequest(header, str);
+            return CoFHENodeRequest(header, std::move(str));
         }
 
     private:
         CoFHENodeRequestHeader header_m;
-        std::string data_m;
+        Network::BufferChain data_m;
     };
 
     template <typename CryptoSystem>
@@ -179,7 +220,7 @@ namespace CoFHE
             partial_decryption_handler_m.set_secret_key_shares(sk_shares_m);
         }
 
-        CoFHENodeResponse handle_request(const CoFHENodeRequest &request)
+        CoFHENodeResponse handle_request(CoFHENodeRequest request)
         {
             switch (request.header().type())
             {
@@ -205,11 +246,11 @@ namespace CoFHE
         std::vector<SecretKeyShare> sk_shares_m;
         PartialDecryptionRequestHandler<CryptoSystem> partial_decryption_handler_m;
 
-        CoFHENodeResponse handle_partial_decryption_request(const CoFHENodeRequest &request)
+        CoFHENodeResponse handle_partial_decryption_request(CoFHENodeRequest &request)
         {
-            auto partial_decryption_request = PartialDecryptionRequest::from_string(request.data());
+            auto partial_decryption_request = PartialDecryptionRequest::from_string(std::move(request.data()));
             auto partial_decryption_response = partial_decryption_handler_m.handle_request(partial_decryption_request);
-            return CoFHENodeResponse(CoFHENodeResponse::Status::OK, partial_decryption_response.to_string());
+            return CoFHENodeResponse(CoFHENodeResponse::Status::OK, partial_decryption_response.to_buffers(partial_decryption_request.protocol_version()));
         }
 
         CoFHENodeResponse handle_smpc_request(const CoFHENodeRequest &request)
@@ -0,0 +1,284 @@
+#ifndef CoFHE_NODE_COMPUTE_EXECUTOR_HPP_INCLUDED
+#define CoFHE_NODE_COMPUTE_EXECUTOR_HPP_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+// requests computing at once, 0 for COMPUTE_PARALLEL_REQUESTS; their OpenMP regions split the cores between them
+#define COMPUTE_THREAD_COUNT 0
+// the default of COMPUTE_THREAD_COUNT, at most one per hardware thread
+#define COMPUTE_PARALLEL_REQUESTS 2
+// threads for requests waiting on other nodes for a decryption or a multiplication, on top of the computing ones
+#define COMPUTE_WAIT_THREAD_COUNT 32
+// requests waiting for a compute thread before new ones are turned away
+#define COMPUTE_QUEUE_CAPACITY 64
+
+namespace CoFHE
+{
+    namespace Network
+    {
+        // Runs request handlers off the I/O threads. Workers take tasks from a
+        // bounded queue; when it is full try_submit refuses the task at once, so
+        // the caller can answer BUSY instead of piling up work. A task needs one
+        // of the compute slots to run, and the slots times the OpenMP threads of
+        // each are the cores. A task that waits on other nodes does so in a
+        // RemoteWait, which hands its slot to the next task and takes one back
+        // once the answer is in. The wait threads are the workers beyond the
+        // slots, so that many requests can wait without leaving a core idle.
+        class ComputeExecutor
+        {
+        public:
+            struct Stats
+            {
+                // compute slots, and the threads for tasks waiting on other nodes on top of them
+                size_t threads;
+                size_t wait_threads;
+                size_t capacity;
+                size_t queue_depth;
+                size_t running;
+                // running tasks in a RemoteWait
+                size_t waiting;
+                uint64_t completed;
+                uint64_t rejected;
+                // time spent in the queue before a worker picked the task up
+                double mean_wait_ms;
+                double max_wait_ms;
+            };
+
+            ComputeExecutor(size_t num_threads = COMPUTE_THREAD_COUNT, size_t capacity = COMPUTE_QUEUE_CAPACITY, size_t wait_threads = COMPUTE_WAIT_THREAD_COUNT) : capacity_m(capacity)
+            {
+                if (capacity == 0)
+                {
+                    throw std::invalid_argument("Compute executor needs at least one queue slot");
+                }
+                size_t hardware_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+                if (num_threads == 0)
+                {
+                    num_threads = std::min<size_t>(COMPUTE_PARALLEL_REQUESTS, hardware_threads);
+                }
+                slots_m = free_slots_m = num_threads;
+                wait_threads_m = wait_threads;
+                size_t omp_threads = std::max<size_t>(1, hardware_threads / num_threads);
+                for (size_t i = 0; i < num_threads + wait_threads; i++)
+                    workers_m.emplace_back([this, omp_threads]()
+                                           { run(omp_threads); });
+            }
+
+            ComputeExecutor(const ComputeExecutor &) = delete;
+            ComputeExecutor &operator=(const ComputeExecutor &) = delete;
+            ~ComputeExecutor() { stop(); }
+
+            // Held by a task while it blocks on other nodes: the compute slot of the task goes to
+            // the next one meanwhile and is taken back when this is destroyed. It must not be held
+            // under a lock another task could want, that task would keep its slot while waiting.
+            // Outside of a task, or within another RemoteWait, it does nothing.
+            class RemoteWait
+            {
+            public:
+                RemoteWait() : executor_m(current_m)
+                {
+                    if (executor_m != nullptr)
+                    {
+                        current_m = nullptr;
+                        executor_m->release_slot();
+                    }
+                }
+
+                RemoteWait(const RemoteWait &) = delete;
+                RemoteWait &operator=(const RemoteWait &) = delete;
+
+                ~RemoteWait()
+                {
+                    if (executor_m != nullptr)
+                    {
+                        executor_m->acquire_slot();
+                        current_m = executor_m;
+                    }
+                }
+
+            private:
+                ComputeExecutor *executor_m;
+            };
+
+            // false if the queue is full or the executor stopped, the task is not run then
+            bool try_submit(std::function<void()> task)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_m);
+                    if (stop_m || queue_m.size() >= capacity_m)
+                    {
+                        rejected_m++;
+                        return false;
+                    }
+                    queue_m.push_back(Task{std::move(task), std::chrono::steady_clock::now()});
+                }
+                cv_m.notify_one();
+                return true;
+            }
+
+            // the next step of a task already admitted, e.g. the rest of a chunked response once the
+            // socket caught up; it is queued even when the queue is full, false only once stopped
+            bool submit_continuation(std::function<void()> task)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_m);
+                    if (stop_m)
+                    {
+                        return false;
+                    }
+                    queue_m.push_back(Task{std::move(task), std::chrono::steady_clock::now()});
+                }
+                cv_m.notify_one();
+                return true;
+            }
+
+            // drops the queued tasks and waits for the running ones
+            void stop()
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_m);
+                    if (stop_m)
+                        return;
+                    stop_m = true;
+                    queue_m.clear();
+                }
+                cv_m.notify_all();
+                resume_cv_m.notify_all();
+                for (auto &worker : workers_m)
+                    worker.join();
+                workers_m.clear();
+            }
+
+            Stats stats() const
+            {
+                std::unique_lock<std::mutex> lock(mutex_m);
+                Stats s;
+                s.threads = slots_m;
+                s.wait_threads = wait_threads_m;
+                s.capacity = capacity_m;
+                s.queue_depth = queue_m.size();
+                s.running = running_m;
+                s.waiting = waiting_m;
+                s.completed = completed_m;
+                s.rejected = rejected_m;
+                s.mean_wait_ms = started_m == 0 ? 0.0 : total_wait_m.count() / 1e6 / started_m;
+                s.max_wait_ms = max_wait_m.count() / 1e6;
+                return s;
+            }
+
+        private:
+            struct Task
+            {
+                std::function<void()> fn;
+                std::chrono::steady_clock::time_point enqueued;
+            };
+
+            size_t capacity_m;
+            size_t slots_m = 0;
+            size_t wait_threads_m = 0;
+            mutable std::mutex mutex_m;
+            // workers waiting for a task, and tasks leaving a RemoteWait waiting for a slot; those go first
+            std::condition_variable cv_m;
+            std::condition_variable resume_cv_m;
+            std::vector<std::thread> workers_m;
+            std::deque<Task> queue_m;
+            bool stop_m = false;
+            size_t free_slots_m = 0;
+            size_t resuming_m = 0;
+            size_t running_m = 0;
+            size_t waiting_m = 0;
+            uint64_t started_m = 0;
+            uint64_t completed_m = 0;
+            uint64_t rejected_m = 0;
+            std::chrono::nanoseconds total_wait_m{0};
+            std::chrono::nanoseconds max_wait_m{0};
+            // the executor whose slot the task on this thread holds
+            static inline thread_local ComputeExecutor *current_m = nullptr;
+
+            // called with mutex_m held
+            void slot_freed()
+            {
+                free_slots_m++;
+                if (resuming_m > 0)
+                    resume_cv_m.notify_one();
+                if (free_slots_m > resuming_m)
+                    cv_m.notify_one();
+            }
+
+            void release_slot()
+            {
+                std::lock_guard<std::mutex> lock(mutex_m);
+                waiting_m++;
+                slot_freed();
+            }
+
+            // once stopped the task goes on without one, the slots are not counted anymore
+            void acquire_slot()
+            {
+                std::unique_lock<std::mutex> lock(mutex_m);
+                resuming_m++;
+                resume_cv_m.wait(lock, [this]
+                                 { return stop_m || free_slots_m > 0; });
+                resuming_m--;
+                waiting_m--;
+                if (free_slots_m > 0)
+                    free_slots_m--;
+            }
+
+            void run(size_t omp_threads)
+            {
+#ifdef OPENMP
+                // the OpenMP regions of this worker use its share of the cores
+                omp_set_num_threads((int)(omp_threads));
+#else
+                (void)(omp_threads);
+#endif
+                std::unique_lock<std::mutex> lock(mutex_m);
+                while (true)
+                {
+                    cv_m.wait(lock, [this]
+                              { return stop_m || (!queue_m.empty() && free_slots_m > resuming_m); });
+                    if (stop_m)
+                        return;
+                    Task task = std::move(queue_m.front());
+                    queue_m.pop_front();
+                    free_slots_m--;
+                    auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - task.enqueued);
+                    total_wait_m += wait;
+                    max_wait_m = std::max(max_wait_m, wait);
+                    started_m++;
+                    running_m++;
+                    lock.unlock();
+                    current_m = this;
+                    try
+                    {
+                        task.fn();
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::cerr << "Error: " << e.what() << std::endl;
+                    }
+                    current_m = nullptr;
+                    lock.lock();
+                    running_m--;
+                    completed_m++;
+                    slot_freed();
+                }
+            }
+        };
+    } // namespace Network
+} // namespace CoFHE
+#endif
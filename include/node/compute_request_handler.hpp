@@ -1,6 +1,9 @@
 #ifndef CoFHE_COMPUTE_REQUEST_HANDLER_HPP_INCLUDED
 #define CoFHE_COMPUTE_REQUEST_HANDLER_HPP_INCLUDED
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <sstream>
@@ -8,6 +11,7 @@
 #include "smpc/smpc_client.hpp"
 #include "smpc/ciphertext_multiplications.hpp"
 #include "node/network_details.hpp"
+#include "node/request_response.hpp"
 
 namespace CoFHE
 {
@@ -20,38 +24,89 @@ namespace CoFHE
             ERROR,
         };
 
-        ComputeResponse(Status status, std::string data) : status_m(status), data_m(data) {}
+        ComputeResponse(Status status, std::string data) : status_m(status), data_m(std::move(data)) {}
+        // data produced while it is sent, see to_chunks
+        ComputeResponse(Status status, std::shared_ptr<Network::ChunkSource> chunks) : status_m(status), chunks_m(std::move(chunks)) {}
 
         Status &status() { return status_m; }
         const Status &status() const { return status_m; }
-        std::string &data() { return data_m; }
-        const std::string &data() const { return data_m; }
+        std::string &data()
+        {
+            drain();
+            return data_m.flat();
+        }
+        const std::string &data() const
+        {
+            drain();
+            return data_m.flat();
+        }
+        bool chunked() const { return chunks_m != nullptr; }
+
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
+        {
+            return to_buffers(ver).str();
+        }
 
-        std::string to_string() const
+        // V2: marker, u8 status, then the data as one section
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_m.size()) + "\n" + data_m;
+            drain();
+            Network::BufferChain chain = data_m;
+            if (ver == Network::ProtocolVersion::V2)
+            {
+                return chain.prepend(Network::WireWriter(9).u8(static_cast<uint8_t>(status_m)).u64(data_m.size()).str());
+            }
+            return chain.prepend(std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_m.size()) + "\n");
         }
 
-        static ComputeResponse from_string(const std::string &str)
+        static ComputeResponse from_string(std::string str)
         {
-            std::istringstream iss(str);
-            std::string line;
-            std::getline(iss, line);
-            std::istringstream iss_line(line);
+            if (Network::is_wire_v2(str))
+            {
+                Network::WireReader reader(str);
+                auto status = static_cast<Status>(reader.u8());
+                return ComputeResponse(status, reader.take_last_section());
+            }
+            std::istringstream iss_line = Network::text_header_line(str);
             int status;
             size_t data_size;
             iss_line >> status >> data_size;
-            std::string data = str.substr(line.size() + 1);
+            std::string data = Network::take_text_payload(str);
             if (data.size() != data_size)
             {
                 throw std::runtime_error("Data size mismatch");
             }
-            return ComputeResponse(static_cast<Status>(status), data);
+            return ComputeResponse(static_cast<Status>(status), std::move(data));
         }
 
+        // the V2 encoding of a chunked response as chunks, the header of to_buffers then the pieces of the data
+        std::shared_ptr<Network::ChunkSource> to_chunks() const
+        {
+            if (chunks_m == nullptr)
+            {
+                throw std::runtime_error("Response is not chunked");
+            }
+            return std::make_shared<Network::PrefixedChunkSource>(Network::WireWriter(9).u8(static_cast<uint8_t>(status_m)).u64(chunks_m->size()).str(), chunks_m);
+        }
+
+        // the size of the V2 header in front of the data, a chunked response reader strips it
+        static constexpr size_t V2_HEADER_SIZE = 10;
+
     private:
         Status status_m;
-        std::string data_m;
+        // mutable so a const response can still produce its chunks into data_m
+        mutable Network::BufferChain data_m;
+        mutable std::shared_ptr<Network::ChunkSource> chunks_m;
+
+        void drain() const
+        {
+            if (chunks_m != nullptr)
+            {
+                auto chunks = std::move(chunks_m);
+                chunks_m = nullptr;
+                data_m = Network::BufferChain(Network::drain_chunks(*chunks));
+            }
+        }
     };
 
     class ComputeRequest
@@ -91,18 +146,20 @@ namespace CoFHE
         class ComputeOperationOperand
         {
         public:
-            ComputeOperationOperand(DataType data_type, DataEncrytionType encryption_type, std::string data) : data_type_m(data_type), encryption_type_m(encryption_type), data_m(data) {}
+            ComputeOperationOperand(DataType data_type, DataEncrytionType encryption_type, std::string data) : data_type_m(data_type), encryption_type_m(encryption_type), data_m(std::move(data)) {}
 
             DataType &data_type() { return data_type_m; }
             const DataType &data_type() const { return data_type_m; }
             DataEncrytionType &encryption_type() { return encryption_type_m; }
             const DataEncrytionType &encryption_type() const { return encryption_type_m; }
-            std::string &data() { return data_m; }
-            const std::string &data() const { return data_m; }
+            std::string &data() { return data_m.flat(); }
+            const std::string &data() const { return data_m.flat(); }
 
             std::string to_string() const
             {
-                return std::to_string(static_cast<int>(data_type_m)) + " " + std::to_string(static_cast<int>(encryption_type_m)) + " " + std::to_string(data_m.size()) + "\n" + data_m + "\n";
+                Network::BufferChain chain;
+                append_to(chain, Network::ProtocolVersion::V1);
+                return chain.str();
             }
 
             static ComputeOperationOperand from_string(const std::string &str)
@@ -122,6 +179,28 @@ namespace CoFHE
                 return ComputeOperationOperand(static_cast<DataType>(data_type), static_cast<DataEncrytionType>(encryption_type), data);
             }
 
+            // V2: u8 data type, u8 encryption type, then the data as one section
+            void append_to(Network::BufferChain &chain, Network::ProtocolVersion ver) const
+            {
+                if (ver == Network::ProtocolVersion::V2)
+                {
+                    chain.append(Network::WireWriter(10, false).u8(static_cast<uint8_t>(data_type_m)).u8(static_cast<uint8_t>(encryption_type_m)).u64(data_m.size()).str());
+                    chain.append(data_m);
+                    return;
+                }
+                chain.append(std::to_string(static_cast<int>(data_type_m)) + " " + std::to_string(static_cast<int>(encryption_type_m)) + " " + std::to_string(data_m.size()) + "\n");
+                chain.append(data_m);
+                chain.append("\n");
+            }
+
+            // the last operand of a request takes over the request buffer instead of copying out of it
+            static ComputeOperationOperand read(Network::WireReader &reader, bool last)
+            {
+                auto data_type = static_cast<DataType>(reader.u8());
+                auto encryption_type = static_cast<DataEncrytionType>(reader.u8());
+                return ComputeOperationOperand(data_type, encryption_type, last ? reader.take_last_section() : reader.section());
+            }
+
             static std::vector<ComputeOperationOperand> from_string(const std::string &str, size_t num_operands)
             {
                 std::istringstream iss(str);
@@ -147,7 +226,7 @@ namespace CoFHE
         private:
             DataType data_type_m;
             DataEncrytionType encryption_type_m;
-            std::string data_m;
+            Network::BufferChain data_m;
         };
 
         class ComputeOperationInstance
@@ -155,8 +234,8 @@ namespace CoFHE
         public:
             ComputeOperationInstance(const ComputeOperationType &operation_type,
                                      const ComputeOperation &operation,
-                                     const std::vector<ComputeOperationOperand> &operands) : operation_type_m(operation_type), operation_m(operation),
-                                                                                             operands_m(operands) {}
+                                     std::vector<ComputeOperationOperand> operands) : operation_type_m(operation_type), operation_m(operation),
+                                                                                      operands_m(std::move(operands)) {}
 
             ComputeOperationType &operation_type() { return operation_type_m; }
             const ComputeOperationType &operation_type() const { return operation_type_m; }
@@ -165,29 +244,54 @@ namespace CoFHE
             std::vector<ComputeOperationOperand> &operands() { return operands_m; }
             const std::vector<ComputeOperationOperand> &operands() const { return operands_m; }
 
-            std::string to_string() const
+            std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
+            {
+                return to_buffers(ver).str();
+            }
+
+            // V2: marker, u8 operation type, u8 operation, u32 number of operands, then the operands
+            Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
             {
-                std::string str = std::to_string(static_cast<int>(operation_type_m)) + " " + std::to_string(static_cast<int>(operation_m)) + " " +
-                                  std::to_string(operands_m.size()) + "\n";
+                Network::BufferChain chain;
+                if (ver == Network::ProtocolVersion::V2)
+                {
+                    chain.append(Network::WireWriter(6).u8(static_cast<uint8_t>(operation_type_m)).u8(static_cast<uint8_t>(operation_m)).u32(operands_m.size()).str());
+                }
+                else
+                {
+                    chain.append(std::to_string(static_cast<int>(operation_type_m)) + " " + std::to_string(static_cast<int>(operation_m)) + " " +
+                                 std::to_string(operands_m.size()) + "\n");
+                }
                 for (const auto &operand : operands_m)
                 {
-                    str += operand.to_string();
+                    operand.append_to(chain, ver);
                 }
-                return str;
+                return chain;
             }
 
-            static ComputeOperationInstance from_string(const std::string &str)
+            static ComputeOperationInstance from_string(std::string str)
             {
-                std::istringstream iss(str);
-                std::string line;
-                std::getline(iss, line);
-                std::istringstream iss_line(line);
+                if (Network::is_wire_v2(str))
+                {
+                    Network::WireReader reader(str);
+                    auto operation_type = static_cast<ComputeOperationType>(reader.u8());
+                    auto operation = static_cast<ComputeOperation>(reader.u8());
+                    size_t num_operands = reader.u32();
+                    std::vector<ComputeOperationOperand> operands;
+                    operands.reserve(num_operands);
+                    for (size_t i = 0; i < num_operands; i++)
+                    {
+                        operands.push_back(ComputeOperationOperand::read(reader, i + 1 == num_operands));
+                    }
+                    return ComputeOperationInstance(operation_type, operation, std::move(operands));
+                }
+                std::istringstream iss_line = Network::text_header_line(str);
                 int operation_type, operation;
                 size_t num_operands;
                 iss_line >> operation_type >> operation >> num_operands;
-                std::string operands_str = str.substr(line.size() + 1);
+                std::string operands_str = Network::take_text_payload(str);
                 std::vector<ComputeOperationOperand> operands = ComputeOperationOperand::from_string(operands_str, num_operands);
-                return ComputeOperationInstance(static_cast<ComputeOperationType>(operation_type), static_cast<ComputeOperation>(operation), operands);
+                return ComputeOperationInstance(static_cast<ComputeOperationType>(operation_type), static_cast<ComputeOperation>(operation), std::move(operands));
             }
 
         private:
@@ -196,20 +300,24 @@ namespace CoFHE
             std::vector<ComputeOperationOperand> operands_m;
         };
 
-        ComputeRequest(const ComputeOperationInstance &operation) : operation_m(operation) {}
+        ComputeRequest(ComputeOperationInstance operation) : operation_m(std::move(operation)) {}
 
         ComputeOperationInstance &operation() { return operation_m; }
         const ComputeOperationInstance &operation() const { return operation_m; }
 
-        std::string to_string() const
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return operation_m.to_string();
+            return operation_m.to_string(ver);
         }
 
-        static ComputeRequest from_string(const std::string &str)
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            ComputeOperationInstance operation = ComputeOperationInstance::from_string(str);
-            return ComputeRequest(operation);
+            return operation_m.to_buffers(ver);
+        }
+
+        static ComputeRequest from_string(std::string str)
+        {
+            return ComputeRequest(ComputeOperationInstance::from_string(std::move(str)));
         }
 
     private:
@@ -224,26 +332,21 @@ namespace CoFHE
         using ResponseType = ComputeResponse;
         using CipherText = typename CryptoSystem::CipherText;
         using PlainText = typename CryptoSystem::PlainText;
-        ComputeRequestHandler(const NetworkDetails &nd) : nd_m(nd), crypto_system_m(nd_m.cryptosystem_details().security_level, nd_m.cryptosystem_details().k), public_key_m(crypto_system_m.deserialize_public_key(nd_m.cryptosystem_details().public_key)), smpc_client_m(nd_m), ciphertext_multiplier_m(smpc_client_m)
+        // TENSOR_ID operands name files saved with save_ciphertext_tensor in tensor_directory, none are served without one
+        ComputeRequestHandler(const NetworkDetails &nd, std::string tensor_directory = "") : nd_m(nd), crypto_system_m(nd_m.cryptosystem_details().security_level, nd_m.cryptosystem_details().k), public_key_m(crypto_system_m.deserialize_public_key(nd_m.cryptosystem_details().public_key)), smpc_client_m(std::make_unique<SMPCClient<CryptoSystem>>(nd_m)), ciphertext_multiplier_m(*smpc_client_m), stored_tensors_m(std::make_unique<StoredTensors>())
         {
+            stored_tensors_m->directory = std::move(tensor_directory);
+            // re-randomized additions and the Beaver multiplications encrypt under the network key
+            crypto_system_m.start_randomness_pool(public_key_m);
+            smpc_client_m->crypto_system().start_randomness_pool(smpc_client_m->network_public_key());
         }
 
-        ComputeRequestHandler(ComputeRequestHandler &&other) : nd_m(other.nd_m), crypto_system_m(other.crypto_system_m), public_key_m(other.public_key_m), smpc_client_m(std::move(other.smpc_client_m)), ciphertext_multiplier_m(smpc_client_m)
+        ComputeRequestHandler(ComputeRequestHandler &&other) : nd_m(other.nd_m), crypto_system_m(other.crypto_system_m), public_key_m(other.public_key_m), smpc_client_m(std::move(other.smpc_client_m)), ciphertext_multiplier_m(*smpc_client_m), stored_tensors_m(std::move(other.stored_tensors_m))
         {
         }
 
-        ComputeRequestHandler &operator=(ComputeRequestHandler &&other)
-        {
-            if (this != &other)
-            {
-                nd_m = other.nd_m;
-                crypto_system_m = other.crypto_system_m;
-                public_key_m = other.public_key_m;
-                smpc_client_m = std::move(other.smpc_client_m);
-                ciphertext_multiplier_m = smpc_client_m;
-            }
-            return *this;
-        }
+        // the multiplier is bound to the SMPC client for good
+        ComputeRequestHandler &operator=(ComputeRequestHandler &&other) = delete;
 
         ComputeResponse handle_request(const ComputeRequest &req)
         {
@@ -271,9 +374,39 @@ namespace CoFHE
         NetworkDetails nd_m;
         CryptoSystem crypto_system_m;
         typename CryptoSystem::PublicKey public_key_m;
-        SMPCClient<CryptoSystem> smpc_client_m;
+        // by pointer, the client stays in place while its futures are pending and the handler moves
+        std::unique_ptr<SMPCClient<CryptoSystem>> smpc_client_m;
         SMPCCipherTextMultiplier<CryptoSystem> ciphertext_multiplier_m;
 
+        // the tensors TENSOR_ID operands name, each mapped on first use and kept for the requests after it
+        struct StoredTensors
+        {
+            std::string directory;
+            std::mutex mutex;
+            std::map<std::string, std::shared_ptr<MappedCiphertextTensor>> tensors;
+        };
+        std::unique_ptr<StoredTensors> stored_tensors_m;
+
+        std::shared_ptr<MappedCiphertextTensor> stored_tensor(const std::string &id)
+        {
+            if (stored_tensors_m->directory.empty())
+            {
+                throw std::invalid_argument("No tensors are stored on this node");
+            }
+            // an id is a file name in the directory, never a path out of it
+            if (id.empty() || id[0] == '.' || id.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") != std::string::npos)
+            {
+                throw std::invalid_argument("Invalid tensor id");
+            }
+            std::lock_guard<std::mutex> lock(stored_tensors_m->mutex);
+            auto &tensor = stored_tensors_m->tensors[id];
+            if (tensor == nullptr)
+            {
+                tensor = crypto_system_m.open_ciphertext_tensor(stored_tensors_m->directory + "/" + id);
+            }
+            return tensor;
+        }
+
         ComputeResponse handle_unary_operation(const ComputeRequest::ComputeOperationInstance &operation)
         {
             if (operation.operands().size() != 1)
@@ -305,8 +438,7 @@ namespace CoFHE
             {
                 // tensor id addition
                 // this will support operations for tensors stored in network, for operations like private inference on open source models like llama, etc
-                // gather the tensor from network and convert the operand to tensor data type
-                return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
+                return handle_stored_tensor_operation(operation);
             }
 
             switch (operation.operation())
@@ -340,6 +472,19 @@ namespace CoFHE
                     return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data type");
                 }
             case ComputeRequest::ComputeOperation::SUBTRACT:
+                switch (operation.operands()[0].data_type())
+                {
+                case ComputeRequest::DataType::SINGLE:
+                {
+                    return handle_single_subtraction(operation);
+                }
+                case ComputeRequest::DataType::TENSOR:
+                {
+                    return handle_tensor_subtraction(operation);
+                }
+                default:
+                    return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data type");
+                }
             case ComputeRequest::ComputeOperation::DIVIDE:
                 return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
             default:
@@ -347,6 +492,59 @@ namespace CoFHE
             }
         }
 
+        // a stored tensor with a serialized ciphertext tensor or another stored tensor, read in place:
+        // the stored elements are decoded once for all requests, the sent ones straight from the request
+        ComputeResponse handle_stored_tensor_operation(const ComputeRequest::ComputeOperationInstance &operation)
+        {
+            if constexpr (requires { crypto_system_m.open_ciphertext_tensor(std::string()); })
+            {
+                if (operation.operation() != ComputeRequest::ComputeOperation::ADD && operation.operation() != ComputeRequest::ComputeOperation::SUBTRACT)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
+                }
+                for (const auto &operand : operation.operands())
+                {
+                    if (operand.data_type() == ComputeRequest::DataType::TENSOR_ID)
+                        continue;
+                    if (operand.data_type() != ComputeRequest::DataType::TENSOR || operand.encryption_type() != ComputeRequest::DataEncrytionType::CIPHERTEXT)
+                    {
+                        return ComputeResponse(ComputeResponse::Status::ERROR, "A stored tensor is combined with a ciphertext tensor only");
+                    }
+                    if (is_tensor_stream(operand.data()))
+                    {
+                        return ComputeResponse(ComputeResponse::Status::ERROR, "A stored tensor cannot be combined with a tensor stream");
+                    }
+                }
+                try
+                {
+                    bool subtract = operation.operation() == ComputeRequest::ComputeOperation::SUBTRACT;
+                    auto combine = [this, subtract](const auto &ct1, const auto &ct2)
+                    {
+                        return subtract ? crypto_system_m.subtract_ciphertext_tensors(public_key_m, ct1, ct2) : crypto_system_m.add_ciphertext_tensors(public_key_m, ct1, ct2);
+                    };
+                    const auto &a = operation.operands()[0];
+                    const auto &b = operation.operands()[1];
+                    if (a.data_type() == ComputeRequest::DataType::TENSOR_ID && b.data_type() == ComputeRequest::DataType::TENSOR_ID)
+                    {
+                        return ciphertext_batch_response(combine(*stored_tensor(a.data()), *stored_tensor(b.data())));
+                    }
+                    if (a.data_type() == ComputeRequest::DataType::TENSOR_ID)
+                    {
+                        return ciphertext_batch_response(combine(*stored_tensor(a.data()), crypto_system_m.view_ciphertext_tensor(b.data())));
+                    }
+                    return ciphertext_batch_response(combine(crypto_system_m.view_ciphertext_tensor(a.data()), *stored_tensor(b.data())));
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+            else
+            {
+                return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
+            }
+        }
+
         ComputeResponse handle_ternary_operation(const ComputeRequest::ComputeOperationInstance &operation)
         {
             // to support conditional evaluation
@@ -372,9 +570,9 @@ namespace CoFHE
             {
                 try
                 {
-                    auto c1 = crypto_system_m.encrypt(public_key_m, crypto_system_m.deserialize_plaintext(operation.operands()[0].data()));
-                    auto c2 = crypto_system_m.encrypt(public_key_m, crypto_system_m.deserialize_plaintext(operation.operands()[1].data()));
-                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_ciphertexts(public_key_m, c1, c2)));
+                    auto pt1 = crypto_system_m.deserialize_plaintext(operation.operands()[0].data());
+                    auto pt2 = crypto_system_m.deserialize_plaintext(operation.operands()[1].data());
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.encrypt(public_key_m, crypto_system_m.add_plaintexts(pt1, pt2))));
                 }
                 catch (const std::exception &e)
                 {
@@ -385,9 +583,9 @@ namespace CoFHE
             {
                 try
                 {
-                    auto c1 = crypto_system_m.deserialize_ciphertext(operation.operands()[0].data());
-                    auto c2 = crypto_system_m.encrypt(public_key_m, crypto_system_m.deserialize_plaintext(operation.operands()[1].data()));
-                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_ciphertexts(public_key_m, c1, c2)));
+                    auto ct = crypto_system_m.deserialize_ciphertext(operation.operands()[0].data());
+                    auto pt = crypto_system_m.deserialize_plaintext(operation.operands()[1].data());
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_plaintext_to_ciphertext(public_key_m, pt, ct)));
                 }
                 catch (const std::exception &e)
                 {
@@ -398,9 +596,9 @@ namespace CoFHE
             {
                 try
                 {
-                    auto c1 = crypto_system_m.encrypt(public_key_m, crypto_system_m.deserialize_plaintext(operation.operands()[0].data()));
-                    auto c2 = crypto_system_m.deserialize_ciphertext(operation.operands()[1].data());
-                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_ciphertexts(public_key_m, c1, c2)));
+                    auto pt = crypto_system_m.deserialize_plaintext(operation.operands()[0].data());
+                    auto ct = crypto_system_m.deserialize_ciphertext(operation.operands()[1].data());
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_plaintext_to_ciphertext(public_key_m, pt, ct)));
                 }
                 catch (const std::exception &e)
                 {
@@ -417,12 +615,21 @@ namespace CoFHE
             {
                 try
                 {
+                    if constexpr (requires { crypto_system_m.view_ciphertext_tensor(operation.operands()[0].data()); })
+                    {
+                        // straight from the request buffers into one batch, no ciphertext is allocated on its own;
+                        // an operand sent in blocks has no pointer table to view and is read whole below
+                        if (!is_tensor_stream(operation.operands()[0].data()) && !is_tensor_stream(operation.operands()[1].data()))
+                        {
+                            return ciphertext_batch_response(crypto_system_m.add_ciphertext_tensors(public_key_m, crypto_system_m.view_ciphertext_tensor(operation.operands()[0].data()), crypto_system_m.view_ciphertext_tensor(operation.operands()[1].data())));
+                        }
+                    }
                     auto ct1 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
                     auto ct2 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
                     auto res = crypto_system_m.add_ciphertext_tensors(public_key_m, ct1, ct2);
-                    auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
-                    clear_ciphertext_tensors(ct1, ct2, res);
-                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                    clear_ciphertext_tensor(ct1);
+                    clear_ciphertext_tensor(ct2);
+                    return ciphertext_tensor_response(res);
                 }
                 catch (const std::exception &e)
                 {
@@ -453,23 +660,152 @@ namespace CoFHE
             {
                 auto ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
                 auto pt = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[1].data());
-                auto pt_enc = crypto_system_m.encrypt_tensor(public_key_m, pt);
-                auto res = crypto_system_m.add_ciphertext_tensors(public_key_m, ct, pt_enc);
+                auto res = crypto_system_m.add_plaintext_to_ciphertext_tensors(public_key_m, pt, ct);
+                auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
+                clear_plaintext_ciphertext_tensors(pt, ct, res);
+                return ComputeResponse(ComputeResponse::Status::OK, res_data);
+            }
+
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT)
+            {
+                auto pt = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[0].data());
+                auto ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
+                auto res = crypto_system_m.add_plaintext_to_ciphertext_tensors(public_key_m, pt, ct);
+                auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
+                clear_plaintext_ciphertext_tensors(pt, ct, res);
+                return ComputeResponse(ComputeResponse::Status::OK, res_data);
+            }
+            return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data encryption type");
+        }
+
+        ComputeResponse handle_single_subtraction(const ComputeRequest::ComputeOperationInstance &operation)
+        {
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT)
+            {
+                try
+                {
+                    return ComputeResponse(ComputeResponse::Status::OK,
+                                           crypto_system_m.serialize_ciphertext(
+                                               crypto_system_m.subtract_ciphertexts(public_key_m, crypto_system_m.deserialize_ciphertext(operation.operands()[0].data()), crypto_system_m.deserialize_ciphertext(operation.operands()[1].data()))));
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT)
+            {
+                try
+                {
+                    auto pt1 = crypto_system_m.deserialize_plaintext(operation.operands()[0].data());
+                    auto neg_pt2 = crypto_system_m.negate_plaintext(crypto_system_m.deserialize_plaintext(operation.operands()[1].data()));
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.encrypt(public_key_m, crypto_system_m.add_plaintexts(pt1, neg_pt2))));
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT)
+            {
+                try
+                {
+                    auto ct = crypto_system_m.deserialize_ciphertext(operation.operands()[0].data());
+                    auto neg_pt = crypto_system_m.negate_plaintext(crypto_system_m.deserialize_plaintext(operation.operands()[1].data()));
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_plaintext_to_ciphertext(public_key_m, neg_pt, ct)));
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT)
+            {
+                try
+                {
+                    auto pt = crypto_system_m.deserialize_plaintext(operation.operands()[0].data());
+                    auto neg_ct = crypto_system_m.negate_ciphertext(public_key_m, crypto_system_m.deserialize_ciphertext(operation.operands()[1].data()));
+                    return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext(crypto_system_m.add_plaintext_to_ciphertext(public_key_m, pt, neg_ct)));
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+
+            return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data encryption type");
+        }
+
+        ComputeResponse handle_tensor_subtraction(const ComputeRequest::ComputeOperationInstance &operation)
+        {
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT)
+            {
+                try
+                {
+                    if constexpr (requires { crypto_system_m.view_ciphertext_tensor(operation.operands()[0].data()); })
+                    {
+                        // straight from the request buffers into one batch, no ciphertext is allocated on its own;
+                        // an operand sent in blocks has no pointer table to view and is read whole below
+                        if (!is_tensor_stream(operation.operands()[0].data()) && !is_tensor_stream(operation.operands()[1].data()))
+                        {
+                            return ciphertext_batch_response(crypto_system_m.subtract_ciphertext_tensors(public_key_m, crypto_system_m.view_ciphertext_tensor(operation.operands()[0].data()), crypto_system_m.view_ciphertext_tensor(operation.operands()[1].data())));
+                        }
+                    }
+                    auto ct1 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
+                    auto ct2 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
+                    auto res = crypto_system_m.subtract_ciphertext_tensors(public_key_m, ct1, ct2);
+                    clear_ciphertext_tensor(ct1);
+                    clear_ciphertext_tensor(ct2);
+                    return ciphertext_tensor_response(res);
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT)
+            {
+                try
+                {
+                    auto pt1 = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[0].data());
+                    auto pt2 = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[1].data());
+                    auto neg_pt2 = crypto_system_m.negate_plaintext_tensor(pt2);
+                    auto res = crypto_system_m.add_plaintext_tensors(pt1, neg_pt2);
+                    auto res_enc = crypto_system_m.encrypt_tensor(public_key_m, res);
+                    auto res_data = crypto_system_m.serialize_ciphertext_tensor(res_enc);
+                    clear_plaintext_tensors(pt1, pt2, res_enc);
+                    clear_plaintext_tensor(neg_pt2);
+                    clear_plaintext_tensor(res);
+                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                }
+                catch (const std::exception &e)
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, e.what());
+                }
+            }
+
+            if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT)
+            {
+                auto ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
+                auto pt = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[1].data());
+                auto neg_pt = crypto_system_m.negate_plaintext_tensor(pt);
+                auto res = crypto_system_m.add_plaintext_to_ciphertext_tensors(public_key_m, neg_pt, ct);
                 auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
                 clear_plaintext_ciphertext_tensors(pt, ct, res);
-                clear_ciphertext_tensor(pt_enc);
+                clear_plaintext_tensor(neg_pt);
                 return ComputeResponse(ComputeResponse::Status::OK, res_data);
             }
 
             if (operation.operands()[0].encryption_type() == ComputeRequest::DataEncrytionType::PLAINTEXT && operation.operands()[1].encryption_type() == ComputeRequest::DataEncrytionType::CIPHERTEXT)
             {
                 auto pt = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[0].data());
-                auto pt_enc = crypto_system_m.encrypt_tensor(public_key_m, pt);
                 auto ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
-                auto res = crypto_system_m.add_ciphertext_tensors(public_key_m, ct, pt_enc);
+                auto neg_ct = crypto_system_m.negate_ciphertext_tensor(public_key_m, ct);
+                auto res = crypto_system_m.add_plaintext_to_ciphertext_tensors(public_key_m, pt, neg_ct);
                 auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
                 clear_plaintext_ciphertext_tensors(pt, ct, res);
-                clear_ciphertext_tensor(pt_enc);
+                clear_ciphertext_tensor(neg_ct);
                 return ComputeResponse(ComputeResponse::Status::OK, res_data);
             }
             return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data encryption type");
@@ -535,11 +871,9 @@ namespace CoFHE
                     auto des_ct1 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
                     auto des_ct2 = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
                     auto res = ciphertext_multiplier_m.multiply_ciphertext_tensors(des_ct1, des_ct2);
-                    auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
                     clear_ciphertext_tensor(des_ct1);
                     clear_ciphertext_tensor(des_ct2);
-                    clear_ciphertext_tensor(res);
-                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                    return ciphertext_tensor_response(res);
                 }
                 catch (const std::exception &e)
                 {
@@ -566,11 +900,9 @@ namespace CoFHE
                     auto des_ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
                     auto des_sc = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[1].data());
                     auto res = crypto_system_m.scal_ciphertext_tensors(public_key_m, des_sc, des_ct);
-                    auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
                     clear_plaintext_tensor(des_sc);
                     clear_ciphertext_tensor(des_ct);
-                    clear_ciphertext_tensor(res);
-                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                    return ciphertext_tensor_response(res);
                 }
                 catch (const std::exception &e)
                 {
@@ -583,12 +915,13 @@ namespace CoFHE
                 {
                     auto des_sc = crypto_system_m.deserialize_plaintext_tensor(operation.operands()[0].data());
                     auto des_ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[1].data());
-                    auto res = crypto_system_m.scal_ciphertext_tensors(public_key_m, des_sc, des_ct);
-                    auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
+                    // a plaintext matrix on the left is a matrix product, one multi-exponentiation per output
+                    bool matmul = des_sc.ndim() == 2;
+                    auto res = matmul ? crypto_system_m.matmul_plaintext_ciphertext_tensors(public_key_m, des_sc, des_ct)
+                                      : crypto_system_m.scal_ciphertext_tensors(public_key_m, des_sc, des_ct);
                     clear_plaintext_tensor(des_sc);
                     clear_ciphertext_tensor(des_ct);
-                    clear_ciphertext_tensor(res);
-                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                    return ciphertext_tensor_response(res);
                 }
                 catch (const std::exception &e)
                 {
@@ -600,7 +933,7 @@ namespace CoFHE
 
         ComputeResponse handle_decrypt(const ComputeRequest::ComputeOperationInstance &operation)
         {
-            if (operation.operands()[0].encryption_type() != ComputeRequest::DataEncrytionType::CIPHERTEXT)
+            if (operation.operands()[0].data_type() != ComputeRequest::DataType::TENSOR_ID && operation.operands()[0].encryption_type() != ComputeRequest::DataEncrytionType::CIPHERTEXT)
             {
                 return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data encryption type");
             }
@@ -609,13 +942,13 @@ namespace CoFHE
             case ComputeRequest::DataType::SINGLE:
             {
                 auto ct = crypto_system_m.deserialize_ciphertext(operation.operands()[0].data());
-                auto pt = smpc_client_m.decrypt(ct);
+                auto pt = smpc_client_m->decrypt(ct);
                 return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_plaintext(pt));
             }
             case ComputeRequest::DataType::TENSOR:
             {
                 auto ct = crypto_system_m.deserialize_ciphertext_tensor(operation.operands()[0].data());
-                auto pt = smpc_client_m.decrypt_tensor(ct);
+                auto pt = smpc_client_m->decrypt_tensor(ct);
                 auto res_data = crypto_system_m.serialize_plaintext_tensor(pt);
                 clear_ciphertext_tensor(ct);
                 clear_plaintext_tensor(pt);
@@ -623,25 +956,49 @@ namespace CoFHE
             }
             case ComputeRequest::DataType::TENSOR_ID:
             {
-                return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
+                if constexpr (requires { crypto_system_m.open_ciphertext_tensor(std::string()); })
+                {
+                    // the elements belong to the mapping, which stays open for the next request
+                    auto stored = stored_tensor(operation.operands()[0].data());
+                    auto pt = smpc_client_m->decrypt_tensor(stored->tensor());
+                    auto res_data = crypto_system_m.serialize_plaintext_tensor(pt);
+                    clear_plaintext_tensor(pt);
+                    return ComputeResponse(ComputeResponse::Status::OK, res_data);
+                }
+                else
+                {
+                    return ComputeResponse(ComputeResponse::Status::ERROR, "Not implemented");
+                }
             }
             default:
                 return ComputeResponse(ComputeResponse::Status::ERROR, "Invalid data type");
             }
         }
 
-        void clear_ciphertext_tensors(Tensor<CipherText *> &ct1, Tensor<CipherText *> &ct2, Tensor<CipherText *> &res)
+        // a ciphertext tensor result, its elements are taken over: from CoFHE_TENSOR_STREAM_MIN_ELEMENTS
+        // on it goes out in blocks serialized while they are sent, smaller ones in one piece
+        ComputeResponse ciphertext_tensor_response(Tensor<CipherText *> &res)
         {
-            ct1.flatten();
-            ct2.flatten();
-            res.flatten();
-            CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
-            for (size_t i = 0; i < ct1.num_elements(); i++)
+            if constexpr (requires { crypto_system_m.ciphertext_tensor_stream(res, true); })
             {
-                delete ct1.at(i);
-                delete ct2.at(i);
-                delete res.at(i);
+                if (res.num_elements() >= CoFHE_TENSOR_STREAM_MIN_ELEMENTS)
+                {
+                    return ComputeResponse(ComputeResponse::Status::OK, Network::make_chunk_source(crypto_system_m.ciphertext_tensor_stream(res, true)));
+                }
+            }
+            auto res_data = crypto_system_m.serialize_ciphertext_tensor(res);
+            clear_ciphertext_tensor(res);
+            return ComputeResponse(ComputeResponse::Status::OK, res_data);
+        }
+
+        template <typename Batch>
+        ComputeResponse ciphertext_batch_response(Batch res)
+        {
+            if (res.num_elements() >= CoFHE_TENSOR_STREAM_MIN_ELEMENTS)
+            {
+                return ComputeResponse(ComputeResponse::Status::OK, Network::make_chunk_source(crypto_system_m.ciphertext_batch_stream(std::move(res))));
             }
+            return ComputeResponse(ComputeResponse::Status::OK, crypto_system_m.serialize_ciphertext_batch(res));
         }
 
         void clear_plaintext_tensors(Tensor<PlainText *> &pt1, Tensor<PlainText *> &pt2, Tensor<CipherText *> &res)
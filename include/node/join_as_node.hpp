@@ -368,7 +368,7 @@ namespace CoFHE
             network_details_m.cryptosystem_details() = cryptosystem_details_m;
             network_details_m.nodes().push_back(self_node_m);
             current_node_m = 0;
-            auto sk = crypto_system_m.keygen();
+            auto sk = crypto_system_m.threshold_keygen(total_nodes_m);
             public_key_p_m = new typename CryptoSystem::PublicKey(crypto_system_m.keygen(sk));
             public_key_m = crypto_system_m.serialize_public_key(*public_key_p_m);
             network_details_m.cryptosystem_details().public_key = public_key_m;
@@ -118,7 +118,8 @@ namespace CoFHE
         {
             if (self_node_m.type == NodeType::CoFHE_NODE)
             {
-                if (nCr(cryptosystem_details_m.total_nodes, cryptosystem_details_m.threshold) != secret_key_shares_m.size())
+                // integer Shamir sharing, one share per node
+                if (secret_key_shares_m.size() != 1)
                 {
                     throw std::runtime_error("Invalid number of secret key shares");
                 }
@@ -13,7 +13,8 @@ namespace CoFHE
 {
 
     template <typename CryptoSystem>
-    auto make_compute_node(const NodeDetails &self_details, const NodeDetails &setup_node)
+    // tensor_directory holds the ciphertext tensors TENSOR_ID operands name, empty for none
+    auto make_compute_node(const NodeDetails &self_details, const NodeDetails &setup_node, const std::string &tensor_directory = "")
     {
         auto setup_node_client = Network::Client(setup_node.ip, setup_node.port, true);
         SetupNodeRequest req = SetupNodeRequest(SetupNodeRequest::RequestType::JOIN_AS_NODE_REQUEST, JoinAsNodeRequest(JoinAsNodeRequest::RequestType::JOIN_AS_COMPUTE_NODE,self_details.ip, self_details.port).to_string());
@@ -33,7 +34,7 @@ namespace CoFHE
         NetworkDetails network_details = NetworkDetails::from_string(NetworkDetailsResponse::from_string(res->data()).data());
         network_details.self_node() = self_details;
         delete res;
-        return Network::Server<ComputeRequestHandler<CryptoSystem>, ComputeRequest, ComputeResponse>(self_details.ip, self_details.port, ComputeRequestHandler<CryptoSystem>(network_details));
+        return Network::Server<ComputeRequestHandler<CryptoSystem>, ComputeRequest, ComputeResponse>(self_details.ip, self_details.port, ComputeRequestHandler<CryptoSystem>(network_details, tensor_directory));
     }
 
     template <typename CryptoSystem>
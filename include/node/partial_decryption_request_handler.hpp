@@ -5,6 +5,9 @@
 #include <vector>
 #include <sstream>
 
+#include "common/memory.hpp"
+#include "node/request_response.hpp"
+
 namespace CoFHE
 {
     class PartialDecryptionResponse
@@ -16,38 +19,52 @@ namespace CoFHE
             ERROR,
         };
 
-        PartialDecryptionResponse(Status status, std::string data) : status_m(status), data_m(data) {}
+        PartialDecryptionResponse(Status status, std::string data) : status_m(status), data_m(std::move(data)) {}
 
         Status &status() { return status_m; }
         const Status &status() const { return status_m; }
-        std::string &data() { return data_m; }
-        const std::string &data() const { return data_m; }
+        std::string &data() { return data_m.flat(); }
+        const std::string &data() const { return data_m.flat(); }
 
-        std::string to_string() const
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_m.size()) + "\n" + data_m;
+            return to_buffers(ver).str();
         }
 
-        static PartialDecryptionResponse from_string(const std::string &str)
+        // V2: marker, u8 status, then the data as one section
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            std::istringstream iss(str);
-            std::string line;
-            std::getline(iss, line);
-            std::istringstream iss_line(line);
+            Network::BufferChain chain = data_m;
+            if (ver == Network::ProtocolVersion::V2)
+            {
+                return chain.prepend(Network::WireWriter(9).u8(static_cast<uint8_t>(status_m)).u64(data_m.size()).str());
+            }
+            return chain.prepend(std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_m.size()) + "\n");
+        }
+
+        static PartialDecryptionResponse from_string(std::string str)
+        {
+            if (Network::is_wire_v2(str))
+            {
+                Network::WireReader reader(str);
+                auto status = static_cast<Status>(reader.u8());
+                return PartialDecryptionResponse(status, reader.take_last_section());
+            }
+            std::istringstream iss_line = Network::text_header_line(str);
             int status;
             size_t data_size;
             iss_line >> status >> data_size;
-            std::string data = str.substr(line.size() + 1);
+            std::string data = Network::take_text_payload(str);
             if (data.size() != data_size)
             {
                 throw std::runtime_error("Data size mismatch");
             }
-            return PartialDecryptionResponse(static_cast<Status>(status), data);
+            return PartialDecryptionResponse(static_cast<Status>(status), std::move(data));
         }
 
     private:
         Status status_m;
-        std::string data_m;
+        Network::BufferChain data_m;
     };
 
     class PartialDecryptionRequest
@@ -60,41 +77,61 @@ namespace CoFHE
             TENSOR,
             TENSOR_ID,
         };
-        PartialDecryptionRequest(size_t sk_share_id, DataType data_type, std::string data) : sk_share_id_m(sk_share_id), data_type_m(data_type), data_m(data) {}
+        PartialDecryptionRequest(size_t sk_share_id, DataType data_type, std::string data) : sk_share_id_m(sk_share_id), data_type_m(data_type), data_m(std::move(data)) {}
 
         size_t &sk_share_id() { return sk_share_id_m; }
         const size_t &sk_share_id() const { return sk_share_id_m; }
         DataType &data_type() { return data_type_m; }
         const DataType &data_type() const { return data_type_m; }
-        std::string &data() { return data_m; }
-        const std::string &data() const { return data_m; }
+        std::string &data() { return data_m.flat(); }
+        const std::string &data() const { return data_m.flat(); }
+        // the encoding the request arrived in, the response is sent in the same one
+        Network::ProtocolVersion protocol_version() const { return ver_m; }
 
-        std::string to_string() const
+        std::string to_string(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            return std::to_string(sk_share_id_m) + " " + std::to_string(static_cast<int>(data_type_m)) + " " + std::to_string(data_m.size()) + "\n" + data_m;
+            return to_buffers(ver).str();
         }
 
-        static PartialDecryptionRequest from_string(const std::string &str)
+        // V2: marker, u8 data type, u64 secret key share id, then the data as one section
+        Network::BufferChain to_buffers(Network::ProtocolVersion ver = Network::ProtocolVersion::V2) const
         {
-            std::istringstream iss(str);
-            std::string line;
-            std::getline(iss, line);
-            std::istringstream iss_line(line);
+            Network::BufferChain chain = data_m;
+            if (ver == Network::ProtocolVersion::V2)
+            {
+                return chain.prepend(Network::WireWriter(17).u8(static_cast<uint8_t>(data_type_m)).u64(sk_share_id_m).u64(data_m.size()).str());
+            }
+            return chain.prepend(std::to_string(sk_share_id_m) + " " + std::to_string(static_cast<int>(data_type_m)) + " " + std::to_string(data_m.size()) + "\n");
+        }
+
+        static PartialDecryptionRequest from_string(std::string str)
+        {
+            if (Network::is_wire_v2(str))
+            {
+                Network::WireReader reader(str);
+                auto data_type = static_cast<DataType>(reader.u8());
+                size_t sk_share_id = reader.u64();
+                return PartialDecryptionRequest(sk_share_id, data_type, reader.take_last_section());
+            }
+            std::istringstream iss_line = Network::text_header_line(str);
             int data_type;
             size_t sk_share_id, data_size;
             iss_line >> sk_share_id >> data_type >> data_size;
-            std::string data = str.substr(line.size() + 1);
+            std::string data = Network::take_text_payload(str);
             if (data.size() != data_size)
             {
                 throw std::runtime_error("Data size mismatch");
             }
-            return PartialDecryptionRequest(sk_share_id, static_cast<DataType>(data_type), data);
+            PartialDecryptionRequest request(sk_share_id, static_cast<DataType>(data_type), std::move(data));
+            request.ver_m = Network::ProtocolVersion::V1;
+            return request;
         }
 
     private:
         size_t sk_share_id_m;
         DataType data_type_m;
-        std::string data_m;
+        Network::BufferChain data_m;
+        Network::ProtocolVersion ver_m = Network::ProtocolVersion::V2;
     };
 
     
@@ -109,6 +146,8 @@ namespace CoFHE
         PartialDecryptionRequestHandler(const CryptoSystem &crypto_system, const std::vector<SecretKeyShare> &secret_key_shares) : crypto_system_m(crypto_system), secret_key_shares_m(secret_key_shares) {}
         PartialDecryptionResponse handle_request(const PartialDecryptionRequest &request) const
         {
+            // a single value is decrypted on this thread, so its temporaries go with the scope
+            ArenaScope arena_scope;
             if (request.sk_share_id() >= secret_key_shares_m.size())
             {
                 return PartialDecryptionResponse(PartialDecryptionResponse::Status::ERROR, "Invalid secret key share id");
@@ -143,6 +182,19 @@ namespace CoFHE
         PartialDecryptionResponse handle_tensor(const PartialDecryptionRequest &request) const
         {
             // return PartialDecryptionResponse(PartialDecryptionResponse::Status::OK, crypto_system_m.serialize_part_decryption_result_tensor(crypto_system_m.part_decrypt_tensor(secret_key_shares_m[request.sk_share_id()], crypto_system_m.deserialize_ciphertext_tensor(request.data()))));
+            if constexpr (requires { crypto_system_m.view_ciphertext_tensor(request.data()); })
+            {
+                // partially decrypt out of the request buffer, only the c1 of each ciphertext is decoded
+                auto res = crypto_system_m.part_decrypt_tensor(secret_key_shares_m[request.sk_share_id()], crypto_system_m.view_ciphertext_tensor(request.data()));
+                auto res_data = crypto_system_m.serialize_part_decryption_result_tensor(res);
+                res.flatten();
+                CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
+                for (size_t i = 0; i < res.num_elements(); i++)
+                {
+                    delete res.at(i);
+                }
+                return PartialDecryptionResponse(PartialDecryptionResponse::Status::OK, res_data);
+            }
             auto des_ct = crypto_system_m.deserialize_ciphertext_tensor(request.data());
             auto res = crypto_system_m.part_decrypt_tensor(secret_key_shares_m[request.sk_share_id()], des_ct);
             auto res_data = crypto_system_m.serialize_part_decryption_result_tensor(res);
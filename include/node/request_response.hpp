@@ -1,9 +1,12 @@
 #ifndef CoFHE_NODE_REQUEST_RESPONSE_HPP_INCLUDED
 #define CoFHE_NODE_REQUEST_RESPONSE_HPP_INCLUDED
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 
@@ -15,6 +18,7 @@ namespace CoFHE
         enum class ProtocolVersion
         {
             V1,
+            V2,
         };
         std::string version_to_string(ProtocolVersion ver)
         {
@@ -22,11 +26,390 @@ namespace CoFHE
             {
             case ProtocolVersion::V1:
                 return "V1";
+            case ProtocolVersion::V2:
+                return "V2";
             default:
                 return "Unknown";
             }
         }
 
+        // V2 encodes every layer in binary: a marker byte that no V1 text header
+        // starts with (those start with a decimal number), fixed-size little
+        // endian fields, then the variable parts as u64 length-prefixed sections.
+        // The last section of a layer is moved out of the received buffer instead
+        // of being copied, so a payload is not duplicated on its way up the layers.
+        const unsigned char WIRE_V2_MARKER = 0xC2;
+        // marker, version, service type, status, u32 flags, u64 request id, u64 data size
+        const size_t WIRE_V2_FRAME_HEADER_SIZE = 24;
+        // A V2 response can come as a run of chunk frames with the id of its
+        // request, each with a piece of the data, the last one flagged and empty
+        // unless its status says the response failed midway. Responses to other
+        // requests can go out between them. Requests never set flags.
+        const uint32_t WIRE_V2_CHUNK = 1;
+        const uint32_t WIRE_V2_LAST_CHUNK = 2;
+
+        inline bool is_wire_v2(std::string_view str)
+        {
+            return !str.empty() && static_cast<unsigned char>(str[0]) == WIRE_V2_MARKER;
+        }
+
+        // An encoded message as a list of pieces, for a gather write. Each layer
+        // puts its header in front of the pieces of the layer it wraps, so a
+        // payload is written once by its serializer and shared, not copied, on
+        // its way to the socket. Copies of a chain share the pieces. Small
+        // headers are merged into one piece instead of becoming a TLS record
+        // each.
+        class BufferChain
+        {
+        public:
+            BufferChain() = default;
+            explicit BufferChain(std::string data)
+            {
+                append(std::move(data));
+            }
+
+            // bytes owned by the caller, they have to outlive the chain and its copies
+            static BufferChain view(std::string_view data)
+            {
+                BufferChain chain;
+                chain.pieces_m.push_back(Piece{nullptr, data});
+                return chain;
+            }
+
+            BufferChain &prepend(std::string data)
+            {
+                // two small pieces are copied into a new one, a piece shared with another chain is left as it is
+                if (data.size() <= MERGE_SIZE && !pieces_m.empty() && pieces_m.front().view().size() <= MERGE_SIZE)
+                {
+                    data.append(pieces_m.front().view());
+                    pieces_m.front() = Piece{std::make_shared<std::string>(std::move(data)), {}};
+                    return *this;
+                }
+                pieces_m.insert(pieces_m.begin(), Piece{std::make_shared<std::string>(std::move(data)), {}});
+                return *this;
+            }
+
+            BufferChain &append(std::string data)
+            {
+                if (data.size() <= MERGE_SIZE && !pieces_m.empty() && pieces_m.back().view().size() <= MERGE_SIZE)
+                {
+                    std::string merged(pieces_m.back().view());
+                    merged.append(data);
+                    pieces_m.back() = Piece{std::make_shared<std::string>(std::move(merged)), {}};
+                    return *this;
+                }
+                pieces_m.push_back(Piece{std::make_shared<std::string>(std::move(data)), {}});
+                return *this;
+            }
+
+            BufferChain &append(const BufferChain &other)
+            {
+                pieces_m.insert(pieces_m.end(), other.pieces_m.begin(), other.pieces_m.end());
+                return *this;
+            }
+
+            size_t size() const
+            {
+                size_t size = 0;
+                for (const auto &piece : pieces_m)
+                    size += piece.view().size();
+                return size;
+            }
+
+            bool empty() const { return size() == 0; }
+
+            std::vector<std::string_view> pieces() const
+            {
+                std::vector<std::string_view> views;
+                views.reserve(pieces_m.size());
+                for (const auto &piece : pieces_m)
+                {
+                    if (!piece.view().empty())
+                        views.push_back(piece.view());
+                }
+                return views;
+            }
+
+            // a buffer sequence for a gather write, e.g. of asio::const_buffer; the chain has to outlive the write
+            template <typename Buffer>
+            std::vector<Buffer> buffers() const
+            {
+                std::vector<Buffer> buffers;
+                for (auto piece : pieces())
+                    buffers.push_back(Buffer(piece.data(), piece.size()));
+                return buffers;
+            }
+
+            // a contiguous copy
+            std::string str() const
+            {
+                std::string data;
+                data.reserve(size());
+                for (const auto &piece : pieces_m)
+                    data.append(piece.view());
+                return data;
+            }
+
+            // the bytes as one string, they are only joined if they are spread over
+            // several pieces; moving out of it empties the chain
+            std::string &flat()
+            {
+                join();
+                auto &owner = pieces_m.front().owner;
+                if (owner.use_count() > 1)
+                {
+                    owner = std::make_shared<std::string>(*owner);
+                }
+                return *owner;
+            }
+
+            const std::string &flat() const
+            {
+                join();
+                return *pieces_m.front().owner;
+            }
+
+        private:
+            static const size_t MERGE_SIZE = 1024;
+
+            struct Piece
+            {
+                std::shared_ptr<std::string> owner;
+                std::string_view borrowed;
+
+                std::string_view view() const { return owner != nullptr ? std::string_view(*owner) : borrowed; }
+            };
+
+            // mutable so a const chain can still be joined for flat
+            mutable std::vector<Piece> pieces_m;
+
+            void join() const
+            {
+                if (pieces_m.size() == 1 && pieces_m.front().owner != nullptr)
+                {
+                    return;
+                }
+                auto joined = std::make_shared<std::string>(str());
+                pieces_m.assign(1, Piece{std::move(joined), {}});
+            }
+        };
+
+        // The data of a response produced while it is sent. size() is the total,
+        // known up front; next() gives the following piece, false when there is
+        // none left. Pieces are produced on the compute workers, one at a time.
+        class ChunkSource
+        {
+        public:
+            virtual ~ChunkSource() = default;
+            virtual size_t size() const = 0;
+            virtual bool next(std::string &chunk) = 0;
+        };
+
+        // a ChunkSource over any object with the same size() and next(), e.g. a TensorStreamWriter
+        template <typename Source>
+        class ChunkSourceAdapter : public ChunkSource
+        {
+        public:
+            explicit ChunkSourceAdapter(Source source) : source_m(std::move(source)) {}
+            size_t size() const override { return source_m.size(); }
+            bool next(std::string &chunk) override { return source_m.next(chunk); }
+
+        private:
+            Source source_m;
+        };
+
+        template <typename Source>
+        std::shared_ptr<ChunkSource> make_chunk_source(Source source)
+        {
+            return std::make_shared<ChunkSourceAdapter<Source>>(std::move(source));
+        }
+
+        // the header of a layer as the first piece, then the pieces of the layer it wraps
+        class PrefixedChunkSource : public ChunkSource
+        {
+        public:
+            PrefixedChunkSource(std::string prefix, std::shared_ptr<ChunkSource> inner) : prefix_m(std::move(prefix)), inner_m(std::move(inner)) {}
+            size_t size() const override { return prefix_m.size() + inner_m->size(); }
+            bool next(std::string &chunk) override
+            {
+                if (!prefix_sent_m)
+                {
+                    prefix_sent_m = true;
+                    chunk = std::move(prefix_m);
+                    return true;
+                }
+                return inner_m->next(chunk);
+            }
+
+        private:
+            std::string prefix_m;
+            std::shared_ptr<ChunkSource> inner_m;
+            bool prefix_sent_m = false;
+        };
+
+        // all the pieces of a source in one string, checked against its size
+        inline std::string drain_chunks(ChunkSource &source)
+        {
+            std::string data, chunk;
+            data.reserve(source.size());
+            while (source.next(chunk))
+            {
+                data.append(chunk);
+            }
+            if (data.size() != source.size())
+            {
+                throw std::runtime_error("Chunk source size mismatch");
+            }
+            return data;
+        }
+
+        class WireWriter
+        {
+        public:
+            // without the marker for the fields of a part of a layer, e.g. a section header
+            explicit WireWriter(size_t reserve = 0, bool marker = true)
+            {
+                str_m.reserve(1 + reserve);
+                if (marker)
+                    str_m.push_back(static_cast<char>(WIRE_V2_MARKER));
+            }
+
+            WireWriter &u8(uint8_t v) { return put(v); }
+            WireWriter &u32(uint32_t v) { return put(v); }
+            WireWriter &u64(uint64_t v) { return put(v); }
+            WireWriter &section(const std::string &data)
+            {
+                u64(data.size());
+                str_m.append(data);
+                return *this;
+            }
+
+            std::string str() { return std::move(str_m); }
+
+        private:
+            std::string str_m;
+
+            template <typename T>
+            WireWriter &put(T v)
+            {
+                for (size_t i = 0; i < sizeof(T); i++)
+                    str_m.push_back(static_cast<char>(static_cast<uint64_t>(v) >> (8 * i)));
+                return *this;
+            }
+        };
+
+        class WireReader
+        {
+        public:
+            explicit WireReader(std::string &str) : owner_m(&str), str_m(str), pos_m(1)
+            {
+                if (!is_wire_v2(str))
+                {
+                    throw std::runtime_error("Not a V2 message");
+                }
+            }
+
+            // reads in place, take_last_section is not available
+            explicit WireReader(std::string_view str) : owner_m(nullptr), str_m(str), pos_m(1)
+            {
+                if (!is_wire_v2(str))
+                {
+                    throw std::runtime_error("Not a V2 message");
+                }
+            }
+
+            uint8_t u8() { return get<uint8_t>(); }
+            uint32_t u32() { return get<uint32_t>(); }
+            uint64_t u64() { return get<uint64_t>(); }
+
+            // a copy of the next section, for sections that are followed by others
+            std::string section()
+            {
+                return std::string(section_view());
+            }
+
+            // the next section in place, valid as long as the message
+            std::string_view section_view()
+            {
+                size_t size = section_size();
+                std::string_view data = str_m.substr(pos_m, size);
+                pos_m += size;
+                return data;
+            }
+
+            // the last section, the message itself becomes it; the reader is done after this
+            std::string take_last_section()
+            {
+                size_t size = section_size();
+                if (pos_m + size != str_m.size())
+                {
+                    throw std::runtime_error("Trailing data after the last section");
+                }
+                if (owner_m == nullptr)
+                {
+                    throw std::runtime_error("Cannot take a section out of a view");
+                }
+                owner_m->erase(0, pos_m);
+                return std::move(*owner_m);
+            }
+
+        private:
+            std::string *owner_m;
+            std::string_view str_m;
+            size_t pos_m;
+
+            template <typename T>
+            T get()
+            {
+                if (str_m.size() - pos_m < sizeof(T))
+                {
+                    throw std::runtime_error("Truncated V2 message");
+                }
+                uint64_t v = 0;
+                for (size_t i = 0; i < sizeof(T); i++)
+                    v |= static_cast<uint64_t>(static_cast<unsigned char>(str_m[pos_m + i])) << (8 * i);
+                pos_m += sizeof(T);
+                return static_cast<T>(v);
+            }
+
+            size_t section_size()
+            {
+                uint64_t size = u64();
+                if (size > str_m.size() - pos_m)
+                {
+                    throw std::runtime_error("Data size mismatch");
+                }
+                return size;
+            }
+        };
+
+        // the first line of a V1 text message, without copying the payload after it
+        inline std::istringstream text_header_line(const std::string &str)
+        {
+            return std::istringstream(str.substr(0, str.find('\n')));
+        }
+
+        // drops the V1 text header line and returns the payload in the same buffer
+        inline std::string take_text_payload(std::string &str)
+        {
+            str.erase(0, str.find('\n') + 1);
+            return std::move(str);
+        }
+
+        // the first size bytes of a receive buffer, moved out when they are all of it
+        inline std::string take_frame_data(std::string &buffer, size_t size)
+        {
+            if (buffer.size() == size)
+            {
+                std::string data = std::move(buffer);
+                buffer.clear();
+                return data;
+            }
+            std::string data = buffer.substr(0, size);
+            buffer.erase(0, size);
+            return data;
+        }
+
         // the beavers triplet will be generated in a set of 512, 512*512, 1024, 1024*1024 or bigger as per the requirement and each genration will have a unique id
         // when doing using the beavers triplet, we must use shares of the same id
         // the stock details must include the id and size of the batches of beavers triplet
@@ -115,6 +498,7 @@ namespace CoFHE
             {
                 OK,
                 ERROR,
+                BUSY, // the server's compute queue is full, the request was not run
             };
             static std::string status_to_string(Status status)
             {
@@ -124,6 +508,8 @@ namespace CoFHE
                     return "OK";
                 case Status::ERROR:
                     return "ERROR";
+                case Status::BUSY:
+                    return "BUSY";
                 default:
                     return "Unknown";
                 }
@@ -131,7 +517,7 @@ namespace CoFHE
             class ResponseHeader
             {
             public:
-                ResponseHeader(ProtocolVersion proto_ver, ServiceType type, Status status, size_t data_size) : ver_m(proto_ver), type_m(type), status_m(status), data_size_m(data_size) {}
+                ResponseHeader(ProtocolVersion proto_ver, ServiceType type, Status status, size_t data_size, uint64_t request_id = 0, uint32_t flags = 0) : ver_m(proto_ver), type_m(type), status_m(status), data_size_m(data_size), request_id_m(request_id), flags_m(flags) {}
 
                 ProtocolVersion &protocol_version() { return ver_m; }
                 const ProtocolVersion &protocol_version() const { return ver_m; }
@@ -141,9 +527,19 @@ namespace CoFHE
                 const Status &status() const { return status_m; }
                 size_t &data_size() { return data_size_m; }
                 const size_t &data_size() const { return data_size_m; }
+                // V2 only, echoes the id of the request this answers
+                uint64_t &request_id() { return request_id_m; }
+                const uint64_t &request_id() const { return request_id_m; }
+                // V2 only, WIRE_V2_CHUNK and WIRE_V2_LAST_CHUNK
+                uint32_t &flags() { return flags_m; }
+                const uint32_t &flags() const { return flags_m; }
 
                 std::string to_string() const
                 {
+                    if (ver_m == ProtocolVersion::V2)
+                    {
+                        return WireWriter(WIRE_V2_FRAME_HEADER_SIZE).u8(static_cast<uint8_t>(ver_m)).u8(static_cast<uint8_t>(type_m)).u8(static_cast<uint8_t>(status_m)).u32(flags_m).u64(request_id_m).u64(data_size_m).str();
+                    }
                     return std::to_string(static_cast<int>(ver_m)) + " " + std::to_string(static_cast<int>(type_m)) + " " + std::to_string(static_cast<int>(status_m)) + " " + std::to_string(data_size_m) + "\n";
                 }
 
@@ -155,13 +551,30 @@ namespace CoFHE
                     std::cout << "Data Size: " << data_size_m << std::endl;
                 }
 
-                static ResponseHeader from_string(std::string str)
+                static ResponseHeader from_string(const std::string &str)
                 {
+                    if (is_wire_v2(str))
+                    {
+                        // fixed size frame header
+                        WireReader reader(std::string_view(str).substr(0, WIRE_V2_FRAME_HEADER_SIZE));
+                        ProtocolVersion ver_m = static_cast<ProtocolVersion>(reader.u8());
+                        ServiceType type_m = static_cast<ServiceType>(reader.u8());
+                        Status status_m = static_cast<Status>(reader.u8());
+                        uint32_t flags = reader.u32();
+                        uint64_t request_id = reader.u64();
+                        uint64_t data_size = reader.u64();
+                        if (ver_m != ProtocolVersion::V2)
+                        {
+                            throw std::runtime_error("Unsupported protocol version");
+                        }
+                        if ((flags & ~(WIRE_V2_CHUNK | WIRE_V2_LAST_CHUNK)) || ((flags & WIRE_V2_LAST_CHUNK) && !(flags & WIRE_V2_CHUNK)))
+                        {
+                            throw std::runtime_error("Invalid frame flags");
+                        }
+                        return ResponseHeader(ver_m, type_m, status_m, data_size, request_id, flags);
+                    }
                     // first line contains the protocol version, service type, status and size separated by space
-                    std::istringstream iss(str);
-                    std::string line;
-                    std::getline(iss, line);
-                    std::istringstream iss_line(line);
+                    std::istringstream iss_line = text_header_line(str);
                     int ver, type, status;
                     size_t data_size;
                     iss_line >> ver >> type >> status >> data_size;
@@ -176,12 +589,18 @@ namespace CoFHE
                 ServiceType type_m;
                 Status status_m;
                 size_t data_size_m;
+                uint64_t request_id_m;
+                uint32_t flags_m;
             };
-            Response() : header_m(ProtocolVersion::V1, ServiceType::COMPUTE_REQUEST, Status::OK, 0), data_m("") {}
-            Response(ProtocolVersion proto_ver, ServiceType type, Status status, std::string data) : header_m(proto_ver, type, status, data.size()), data_m(data) {}
-            Response(ResponseHeader header, std::string data) : header_m(header), data_m(data)
+            Response() : header_m(ProtocolVersion::V1, ServiceType::COMPUTE_REQUEST, Status::OK, 0), data_m() {}
+            Response(ProtocolVersion proto_ver, ServiceType type, Status status, std::string data) : header_m(proto_ver, type, status, data.size()), data_m(std::move(data)) {}
+            // data is the encoded inner response, its pieces are sent as they are
+            Response(ProtocolVersion proto_ver, ServiceType type, Status status, BufferChain data) : header_m(proto_ver, type, status, data.size()), data_m(std::move(data)) {}
+            // data produced while it is sent, a V2 session writes it as chunk frames
+            Response(ProtocolVersion proto_ver, ServiceType type, Status status, std::shared_ptr<ChunkSource> chunks) : header_m(proto_ver, type, status, chunks->size()), chunks_m(std::move(chunks)) {}
+            Response(ResponseHeader header, std::string data) : header_m(header), data_m(std::move(data))
             {
-                if (header.data_size() != data.size())
+                if (header_m.data_size() != data_m.size())
                 {
                     throw std::runtime_error("Data size mismatch");
                 }
@@ -197,40 +616,55 @@ namespace CoFHE
             const Status &status() const { return header_m.status(); }
             size_t &data_size() { return header_m.data_size(); }
             const size_t &data_size() const { return header_m.data_size(); }
-            std::string &data() { return data_m; }
-            const std::string &data() const { return data_m; }
+            std::string &data()
+            {
+                drain();
+                return data_m.flat();
+            }
+            const std::string &data() const
+            {
+                drain();
+                return data_m.flat();
+            }
+            // null unless the data is still to be produced, it is gone once data() or to_buffers() took it
+            const std::shared_ptr<ChunkSource> &chunks() const { return chunks_m; }
 
             std::string to_string() const
             {
-                return header_m.to_string() + data_m;
+                return to_buffers().str();
+            }
+
+            // the frame header followed by the pieces of the data, for a gather write; chunked data is produced here in one frame
+            BufferChain to_buffers() const
+            {
+                drain();
+                BufferChain chain = data_m;
+                return chain.prepend(header_m.to_string());
             }
 
             void print() const
             {
                 header_m.print();
-                std::cout << "Data: " << std::hex << data_m << std::endl
+                std::cout << "Data: " << std::hex << data() << std::endl
                           << std::dec;
             }
 
             static Response from_string(std::string str)
             {
-                // first line contains the protocol version, service type, status and size separated by space
-                // the rest of the buffer contains the data
-                std::istringstream iss(str);
-                std::string line;
-                std::getline(iss, line);
-                std::istringstream iss_line(line);
-                int ver, type, status, size;
-                iss_line >> ver >> type >> status >> size;
-                ProtocolVersion ver_m = static_cast<ProtocolVersion>(ver);
-                ServiceType type_m = static_cast<ServiceType>(type);
-                Status status_m = static_cast<Status>(status);
-                auto data = str.substr(line.size() + 1);
-                if (data.size() != size)
+                if (is_wire_v2(str))
                 {
-                    throw std::runtime_error("Data size mismatch");
+                    if (str.size() < WIRE_V2_FRAME_HEADER_SIZE)
+                    {
+                        throw std::runtime_error("Truncated V2 message");
+                    }
+                    auto header = ResponseHeader::from_string(str);
+                    str.erase(0, WIRE_V2_FRAME_HEADER_SIZE);
+                    return Response(header, std::move(str));
                 }
-                return Response(ver_m, type_m, status_m, data);
+                // first line contains the protocol version, service type, status and size separated by space
+                // the rest of the buffer contains the data
+                auto header = ResponseHeader::from_string(str);
+                return Response(header, take_text_payload(str));
             }
 
             static Response from_string(ResponseHeader header, std::string str)
@@ -240,12 +674,24 @@ namespace CoFHE
                 {
                     throw std::runtime_error("Data size mismatch");
                 }
-                return Response(header, str);
+                return Response(header, std::move(str));
             }
 
         private:
             ResponseHeader header_m;
-            std::string data_m;
+            // mutable so a const response can still produce its chunks into data_m
+            mutable BufferChain data_m;
+            mutable std::shared_ptr<ChunkSource> chunks_m;
+
+            void drain() const
+            {
+                if (chunks_m != nullptr)
+                {
+                    auto chunks = std::move(chunks_m);
+                    chunks_m = nullptr;
+                    data_m = BufferChain(drain_chunks(*chunks));
+                }
+            }
         };
 
         class Request
@@ -255,7 +701,7 @@ namespace CoFHE
             class RequestHeader
             {
             public:
-                RequestHeader(ProtocolVersion proto_ver, ServiceType type, size_t data_size) : ver_m(proto_ver), type_m(type), data_size_m(data_size) {}
+                RequestHeader(ProtocolVersion proto_ver, ServiceType type, size_t data_size, uint64_t request_id = 0) : ver_m(proto_ver), type_m(type), data_size_m(data_size), request_id_m(request_id) {}
 
                 ProtocolVersion &protocol_version() { return ver_m; }
                 const ProtocolVersion &protocol_version() const { return ver_m; }
@@ -263,9 +709,16 @@ namespace CoFHE
                 const ServiceType &type() const { return type_m; }
                 size_t &data_size() { return data_size_m; }
                 const size_t &data_size() const { return data_size_m; }
+                // V2 only, chosen by the client and echoed in the response
+                uint64_t &request_id() { return request_id_m; }
+                const uint64_t &request_id() const { return request_id_m; }
 
                 std::string to_string() const
                 {
+                    if (ver_m == ProtocolVersion::V2)
+                    {
+                        return WireWriter(WIRE_V2_FRAME_HEADER_SIZE).u8(static_cast<uint8_t>(ver_m)).u8(static_cast<uint8_t>(type_m)).u8(0).u32(0).u64(request_id_m).u64(data_size_m).str();
+                    }
                     return std::to_string(static_cast<int>(ver_m)) + " " + std::to_string(static_cast<int>(type_m)) + " " + std::to_string(data_size_m) + "\n";
                 }
 
@@ -276,11 +729,28 @@ namespace CoFHE
                     std::cout << "Data Size: " << data_size_m << std::endl;
                 }
 
-                static RequestHeader from_string(std::string str)
+                static RequestHeader from_string(const std::string &str)
                 {
+                    if (is_wire_v2(str))
+                    {
+                        // fixed size frame header, the status byte is unused in requests
+                        WireReader reader(std::string_view(str).substr(0, WIRE_V2_FRAME_HEADER_SIZE));
+                        ProtocolVersion ver_m = static_cast<ProtocolVersion>(reader.u8());
+                        ServiceType type_m = static_cast<ServiceType>(reader.u8());
+                        reader.u8();
+                        reader.u32();
+                        uint64_t request_id = reader.u64();
+                        uint64_t data_size = reader.u64();
+                        if (ver_m != ProtocolVersion::V2)
+                        {
+                            throw std::runtime_error("Unsupported protocol version");
+                        }
+                        return RequestHeader(ver_m, type_m, data_size, request_id);
+                    }
                     // first line contains the protocol version, service type and size separated by space
-                    std::istringstream iss(str);
-                    int ver, type, data_size;
+                    std::istringstream iss = text_header_line(str);
+                    int ver, type;
+                    size_t data_size;
                     iss >> ver >> type >> data_size;
                     ProtocolVersion ver_m = static_cast<ProtocolVersion>(ver);
                     ServiceType type_m = static_cast<ServiceType>(type);
@@ -291,12 +761,15 @@ namespace CoFHE
                 ProtocolVersion ver_m;
                 ServiceType type_m;
                 size_t data_size_m;
+                uint64_t request_id_m;
             };
 
-            Request(ProtocolVersion proto_ver, ServiceType type, std::string data) : header_m(proto_ver, type, data.size()), data_m(data) {}
-            Request(RequestHeader header, std::string data) : header_m(header), data_m(data)
+            Request(ProtocolVersion proto_ver, ServiceType type, std::string data) : header_m(proto_ver, type, data.size()), data_m(std::move(data)) {}
+            // data is the encoded inner request, its pieces are sent as they are
+            Request(ProtocolVersion proto_ver, ServiceType type, BufferChain data) : header_m(proto_ver, type, data.size()), data_m(std::move(data)) {}
+            Request(RequestHeader header, std::string data) : header_m(header), data_m(std::move(data))
             {
-                if (header.data_size() != data.size())
+                if (header_m.data_size() != data_m.size())
                 {
                     throw std::runtime_error("Data size mismatch");
                 }
@@ -310,40 +783,44 @@ namespace CoFHE
             const ServiceType &type() const { return header_m.type(); }
             size_t &data_size() { return header_m.data_size(); }
             const size_t &data_size() const { return header_m.data_size(); }
-            std::string &data() { return data_m; }
-            const std::string &data() const { return data_m; }
+            std::string &data() { return data_m.flat(); }
+            const std::string &data() const { return data_m.flat(); }
 
             std::string to_string() const
             {
-                return header_m.to_string() + data_m;
+                return to_buffers().str();
+            }
+
+            // the frame header followed by the pieces of the data, for a gather write
+            BufferChain to_buffers() const
+            {
+                BufferChain chain = data_m;
+                return chain.prepend(header_m.to_string());
             }
 
             void print() const
             {
                 header_m.print();
-                std::cout << "Data: " << std::hex << data_m << std::endl
+                std::cout << "Data: " << std::hex << data() << std::endl
                           << std::dec;
             }
 
             static Request from_string(std::string str)
             {
-                // first line contains the protocol version, service type and size separated by space
-                // the rest of the buffer contains the data
-                std::istringstream iss(str);
-                std::string line;
-                std::getline(iss, line);
-                std::istringstream iss_line(line);
-                int ver, type;
-                size_t size;
-                iss_line >> ver >> type >> size;
-                ProtocolVersion ver_m = static_cast<ProtocolVersion>(ver);
-                ServiceType type_m = static_cast<ServiceType>(type);
-                auto data = str.substr(line.size() + 1);
-                if (data.size() != size)
+                if (is_wire_v2(str))
                 {
-                    throw std::runtime_error("Data size mismatch");
+                    if (str.size() < WIRE_V2_FRAME_HEADER_SIZE)
+                    {
+                        throw std::runtime_error("Truncated V2 message");
+                    }
+                    auto header = RequestHeader::from_string(str);
+                    str.erase(0, WIRE_V2_FRAME_HEADER_SIZE);
+                    return Request(header, std::move(str));
                 }
-                return Request(ver_m, type_m, data);
+                // first line contains the protocol version, service type and size separated by space
+                // the rest of the buffer contains the data
+                auto header = RequestHeader::from_string(str);
+                return Request(header, take_text_payload(str));
             }
 
             static Request from_string(RequestHeader header, std::string str)
@@ -353,12 +830,12 @@ namespace CoFHE
                 {
                     throw std::runtime_error("Data size mismatch");
                 }
-                return Request(header, str);
+                return Request(header, std::move(str));
             }
 
         private:
             RequestHeader header_m;
-            std::string data_m;
+            BufferChain data_m;
         };
 
     } // namespace Network
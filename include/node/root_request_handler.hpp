@@ -38,21 +38,27 @@ namespace CoFHE
                 {
                     if (req.type() == ServiceType::COMPUTE_REQUEST)
                     {
-                        return Response(req.protocol_version(), req.type(), Response::Status::OK, handler_m.handle_request(ComputeRequest::from_string(req.data())).to_string());
+                        auto res = handler_m.handle_request(ComputeRequest::from_string(std::move(req.data())));
+                        // V1 has no chunk frames, its response is produced in one piece
+                        if (res.chunked() && req.protocol_version() == ProtocolVersion::V2)
+                        {
+                            return Response(req.protocol_version(), req.type(), Response::Status::OK, res.to_chunks());
+                        }
+                        return Response(req.protocol_version(), req.type(), Response::Status::OK, res.to_buffers(req.protocol_version()));
                     }
                 }
                 else if constexpr (std::is_same_v<RequestImpl, CoFHENodeRequest>)
                 {
                     if (req.type() == ServiceType::COFHE_REQUEST)
                     {
-                        return Response(req.protocol_version(), req.type(), Response::Status::OK, handler_m.handle_request(CoFHENodeRequest::from_string(req.data())).to_string());
+                        return Response(req.protocol_version(), req.type(), Response::Status::OK, handler_m.handle_request(CoFHENodeRequest::from_string(std::move(req.data()))).to_buffers(req.protocol_version()));
                     }
                 }
                 else if constexpr (std::is_same_v<RequestImpl, SetupNodeRequest>)
                 {
                     if (req.type() == ServiceType::SETUP_REQUEST)
                     {
-                        return Response(req.protocol_version(), req.type(), Response::Status::OK, handler_m.handle_request(SetupNodeRequest::from_string(req.data())).to_string());
+                        return Response(req.protocol_version(), req.type(), Response::Status::OK, handler_m.handle_request(SetupNodeRequest::from_string(std::move(req.data()))).to_string());
                     }
                 }
                 return Response(req.protocol_version(), req.type(), Response::Status::ERROR, "Invalid request type");
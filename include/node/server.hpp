@@ -1,8 +1,11 @@
 #ifndef CoFHE_NODE_SERVER_HPP_INCLUDED
 #define CoFHE_NODE_SERVER_HPP_INCLUDED
 
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -10,10 +13,13 @@
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/ssl.hpp>
 
+#include "node/compute_executor.hpp"
 #include "node/request_response.hpp"
 #include "node/root_request_handler.hpp"
 
 #define SERVER_THREAD_COUNT 8
+// chunk frames of a response queued for the socket before its producer waits for them to go out
+#define SERVER_CHUNK_WINDOW 4
 
 namespace CoFHE
 {
@@ -24,11 +30,23 @@ namespace CoFHE
         namespace ssl = boost::asio::ssl;
         using tcp = boost::asio::ip::tcp;
 
+        // Reads requests back to back and hands them to the server's compute
+        // executor, the I/O threads only parse and write. V2 requests are read
+        // and queued as they come, so pipelined requests run concurrently and
+        // their responses go out as they finish, tagged with the request id. V1
+        // has no ids, its next request is read once the previous one is
+        // answered. A request the executor has no room for is answered BUSY at
+        // once. A V2 response whose data is produced while it is sent goes out
+        // as chunk frames: its compute worker produces chunks until
+        // SERVER_CHUNK_WINDOW of them wait for the socket, then returns, and the
+        // write that makes room queues the rest as a continuation. A slow reader
+        // holds back its own response without holding a worker. All socket
+        // operations and the write queue are serialized on the strand.
         template <typename RequestHandlerImpl, typename RequestImpl, typename ResponseImpl>
         class Session : public std::enable_shared_from_this<Session<RequestHandlerImpl, RequestImpl, ResponseImpl>>
         {
         public:
-            Session(asio::ssl::stream<tcp::socket> socket, RequestHandlerImpl &handler) : socket_m(std::move(socket)), handler_m(handler) {}
+            Session(asio::ssl::stream<tcp::socket> socket, RequestHandlerImpl &handler, ComputeExecutor &executor) : socket_m(std::move(socket)), strand_m(asio::make_strand(socket_m.get_executor())), handler_m(handler), executor_m(executor) {}
 
             Session(const Session &) = delete;
             Session &operator=(const Session &) = delete;
@@ -38,61 +56,116 @@ namespace CoFHE
 
             void start()
             {
-                do_handshake();
+                auto self(shared_from_this());
+                asio::dispatch(strand_m, [this, self]()
+                               { do_handshake(); });
             }
 
         private:
             using std::enable_shared_from_this<Session<RequestHandlerImpl, RequestImpl, ResponseImpl>>::shared_from_this;
             asio::ssl::stream<tcp::socket> socket_m;
+            asio::strand<asio::any_io_executor> strand_m;
             RequestHandler<RequestHandlerImpl, RequestImpl, ResponseImpl> handler_m;
+            ComputeExecutor &executor_m;
             std::string read_buffer;
-            std::string write_buffer;
+            // written frames, with a hook called once the frame is out or will never be
+            struct Write
+            {
+                BufferChain data;
+                std::function<void(bool)> done;
+            };
+            std::deque<Write> write_queue_m;
+            bool open_m = true;
 
+            // a chunked response between its compute worker and the strand
+            struct ChunkedResponse
+            {
+                Response::ResponseHeader header;
+                std::shared_ptr<ChunkSource> source;
+                std::mutex mutex;
+                // frames queued and not written yet
+                size_t unwritten = 0;
+                // the producer returned on a full window, the next completed write resumes it
+                bool parked = false;
+                bool cancelled = false;
+            };
 
             void do_handshake()
             {
                 auto self(shared_from_this());
-                socket_m.async_handshake(asio::ssl::stream_base::server, [this, self](const std::error_code &error)
-                                         {
+                socket_m.async_handshake(asio::ssl::stream_base::server, asio::bind_executor(strand_m, [this, self](const std::error_code &error)
+                                                                                              {
                     if(!error){
                         do_read();
-                    } });
+                    } }));
             }
 
             void do_read()
             {
                 auto self(shared_from_this());
-                asio::async_read_until(socket_m, asio::dynamic_buffer(read_buffer), '\n', [this, self](const std::error_code &error, size_t bytes_transferred)
-                                       {
+                if (read_buffer.empty())
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_at_least(1), asio::bind_executor(strand_m, [this, self](const std::error_code &error, size_t bytes_transferred)
+                                                                                                                                   {
+                        if(!error){
+                            do_read();
+                        }
+                        else{
+                            read_failed(error);
+                        } }));
+                    return;
+                }
+                // the first byte tells the framing of the request, the response is sent in the same one
+                if (is_wire_v2(read_buffer))
+                {
+                    do_read_v2_header();
+                }
+                else
+                {
+                    do_read_v1_header();
+                }
+            }
+
+            void do_read_v2_header()
+            {
+                auto self(shared_from_this());
+                if (read_buffer.size() < WIRE_V2_FRAME_HEADER_SIZE)
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(WIRE_V2_FRAME_HEADER_SIZE - read_buffer.size()), asio::bind_executor(strand_m, [this, self](const std::error_code &error, size_t bytes_transferred)
+                                                                                                                                                                               {
+                        if(!error){
+                            do_read_v2_header();
+                        }
+                        else{
+                            read_failed(error);
+                        } }));
+                    return;
+                }
+                try
+                {
+                    auto header = Request::RequestHeader::from_string(read_buffer);
+                    read_buffer.erase(0, WIRE_V2_FRAME_HEADER_SIZE);
+                    do_read_data(header);
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    end_session();
+                }
+            }
+
+            void do_read_v1_header()
+            {
+                auto self(shared_from_this());
+                asio::async_read_until(socket_m, asio::dynamic_buffer(read_buffer), '\n', asio::bind_executor(strand_m, [this, self](const std::error_code &error, size_t bytes_transferred)
+                                                                                                                 {
                     if(!error){
                         try{
                             // the data can contain more data than the header specifies
                             // so in next call read the remaining data
-                            auto header_str = read_buffer.substr(0, bytes_transferred);
-                            if (read_buffer.size() > bytes_transferred)
-                            {
-                                read_buffer = read_buffer.substr(bytes_transferred);
-                            }
-                            else
-                            {
-                                read_buffer.clear();
-                            }
-                            auto header = Request::RequestHeader::from_string(header_str);
-                            if (header.data_size() > read_buffer.size())
-                            {
-                            asio::async_read(socket_m, asio::dynamic_buffer(read_buffer),
-                            asio::transfer_exactly(header.data_size()- read_buffer.size()), [this, self, header](const std::error_code &error, size_t bytes_transferred){
-                                if(!error){
-                                    process_request(header, read_buffer);
-                                } else{
-                                    std::cerr << "Read failed: " << error.message() << std::endl;
-                                    end_session();
-                                }
-                            });
-                            }
-                            else{
-                                process_request(header, read_buffer);
-                            }
+                            auto header = Request::RequestHeader::from_string(read_buffer.substr(0, bytes_transferred));
+                            read_buffer.erase(0, bytes_transferred);
+                            do_read_data(header);
                         }
                         catch(const std::exception &e){
                             std::cerr << "Error: " << e.what() << std::endl;
@@ -100,49 +173,242 @@ namespace CoFHE
                         }
                     }
                     else{
-                        std::cerr << "Read failed: " << error.message() << std::endl;
-                        end_session();
-                    } });
+                        read_failed(error);
+                    } }));
+            }
+
+            void do_read_data(Request::RequestHeader header)
+            {
+                auto self(shared_from_this());
+                if (header.data_size() > read_buffer.size())
+                {
+                    asio::async_read(socket_m, asio::dynamic_buffer(read_buffer),
+                                     asio::transfer_exactly(header.data_size() - read_buffer.size()), asio::bind_executor(strand_m, [this, self, header](const std::error_code &error, size_t bytes_transferred)
+                                                                                                                           {
+                        if(!error){
+                            process_request(header);
+                        } else{
+                            read_failed(error);
+                        } }));
+                }
+                else
+                {
+                    process_request(header);
+                }
             }
 
-            void process_request(Request::RequestHeader header, std::string &data)
+            void process_request(Request::RequestHeader header)
+            {
+                auto self(shared_from_this());
+                auto data = take_frame_data(read_buffer, header.data_size());
+                bool in_order = header.protocol_version() != ProtocolVersion::V2;
+                bool accepted = executor_m.try_submit([this, self, header, in_order, data = std::move(data)]() mutable
+                                                      {
+                    auto res = handle(header, std::move(data));
+                    if (res.chunks() != nullptr && !in_order)
+                    {
+                        auto stream = std::make_shared<ChunkedResponse>(res.header(), res.chunks());
+                        stream->header.flags() = WIRE_V2_CHUNK;
+                        produce_chunks(stream);
+                        return;
+                    }
+                    asio::post(strand_m, [this, self, in_order, out = res.to_buffers()]() mutable
+                               {
+                        queue_write(std::move(out));
+                        if (in_order)
+                        {
+                            do_read();
+                        } }); });
+                if (!accepted)
+                {
+                    auto res = Response(header.protocol_version(), header.type(), Response::Status::BUSY, "Compute queue is full");
+                    res.header().request_id() = header.request_id();
+                    queue_write(res.to_buffers());
+                }
+                if (!accepted || !in_order)
+                {
+                    do_read();
+                }
+            }
+
+            // the response, a failure is reported to the client instead of closing the session
+            Response handle(const Request::RequestHeader &header, std::string data)
             {
                 try
                 {
-                    auto req = Request::from_string(header, data.substr(0, header.data_size()));
-                    data.erase(0, header.data_size());
-                    auto res = handler_m.handle_request(req);
-                    write_buffer = res.to_string();
-                    do_write();
+                    auto res = handler_m.handle_request(Request::from_string(header, std::move(data)));
+                    res.header().request_id() = header.request_id();
+                    return res;
                 }
                 catch (const std::exception &e)
                 {
                     std::cerr << "Error: " << e.what() << std::endl;
-                    end_session();
+                    auto res = Response(header.protocol_version(), header.type(), Response::Status::ERROR, e.what());
+                    res.header().request_id() = header.request_id();
+                    return res;
+                }
+            }
+
+            // on a compute worker: chunk frames until the window is full or the data is out, a
+            // failure midway ends the response with a last frame carrying the error
+            void produce_chunks(std::shared_ptr<ChunkedResponse> stream)
+            {
+                auto self(shared_from_this());
+                while (true)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(stream->mutex);
+                        if (stream->cancelled)
+                        {
+                            return;
+                        }
+                        if (stream->unwritten >= SERVER_CHUNK_WINDOW)
+                        {
+                            stream->parked = true;
+                            return;
+                        }
+                        stream->unwritten++;
+                    }
+                    std::string chunk;
+                    bool last = false;
+                    auto header = stream->header;
+                    try
+                    {
+                        if (!stream->source->next(chunk))
+                        {
+                            chunk.clear();
+                            last = true;
+                        }
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::cerr << "Error: " << e.what() << std::endl;
+                        chunk = e.what();
+                        header.status() = Response::Status::ERROR;
+                        last = true;
+                    }
+                    if (last)
+                    {
+                        header.flags() |= WIRE_V2_LAST_CHUNK;
+                    }
+                    header.data_size() = chunk.size();
+                    BufferChain frame(std::move(chunk));
+                    frame.prepend(header.to_string());
+                    std::function<void(bool)> done;
+                    if (!last)
+                    {
+                        done = [this, self, stream](bool written)
+                        { chunk_written(stream, written); };
+                    }
+                    asio::post(strand_m, [this, self, frame = std::move(frame), done = std::move(done)]() mutable
+                               { queue_write(std::move(frame), std::move(done)); });
+                    if (last)
+                    {
+                        return;
+                    }
+                }
+            }
+
+            // on the strand: a frame of the stream went out, or never will
+            void chunk_written(const std::shared_ptr<ChunkedResponse> &stream, bool written)
+            {
+                bool resume = false;
+                {
+                    std::lock_guard<std::mutex> lock(stream->mutex);
+                    stream->unwritten--;
+                    if (!written)
+                    {
+                        stream->cancelled = true;
+                    }
+                    else if (stream->parked)
+                    {
+                        stream->parked = false;
+                        resume = true;
+                    }
+                }
+                if (resume)
+                {
+                    auto self(shared_from_this());
+                    executor_m.submit_continuation([this, self, stream]()
+                                                   { produce_chunks(stream); });
+                }
+            }
+
+            void queue_write(BufferChain data, std::function<void(bool)> done = nullptr)
+            {
+                if (!open_m)
+                {
+                    if (done)
+                    {
+                        done(false);
+                    }
+                    return;
+                }
+                write_queue_m.push_back(Write{std::move(data), std::move(done)});
+                if (write_queue_m.size() == 1)
+                {
+                    do_write();
                 }
             }
 
             void do_write()
             {
                 auto self(shared_from_this());
-                asio::async_write(socket_m, asio::buffer(write_buffer,write_buffer.size()), [this, self](const std::error_code &error, size_t bytes_transferred)
-                                  {
+                asio::async_write(socket_m, write_queue_m.front().data.template buffers<asio::const_buffer>(), asio::bind_executor(strand_m, [this, self](const std::error_code &error, size_t bytes_transferred)
+                                                                                                           {
                     if (!error)
                     {
-                        do_read();
+                        auto done = std::move(write_queue_m.front().done);
+                        write_queue_m.pop_front();
+                        if (done)
+                        {
+                            done(true);
+                        }
+                        if (!write_queue_m.empty())
+                        {
+                            do_write();
+                        }
                     }
                     else
                     {
                         std::cerr << "Write failed: " << error.message() << std::endl;
                         end_session();
-                    } });
+                        // the queued frames are never written, producers waiting on them stop
+                        auto queue = std::move(write_queue_m);
+                        write_queue_m.clear();
+                        for (auto &write : queue)
+                        {
+                            if (write.done)
+                            {
+                                write.done(false);
+                            }
+                        }
+                    } }));
             }
 
-            void end_session()
+            void read_failed(const std::error_code &error)
             {
+                if (open_m)
+                {
+                    std::cerr << "Read failed: " << error.message() << std::endl;
+                }
+                end_session(write_queue_m.empty());
+            }
+
+            // the TLS shutdown is only done when no write is outstanding, closing the socket aborts it
+            void end_session(bool graceful = false)
+            {
+                if (!open_m)
+                {
+                    return;
+                }
+                open_m = false;
                 try
                 {
-                    socket_m.shutdown();
+                    if (graceful)
+                    {
+                        socket_m.shutdown();
+                    }
                     socket_m.lowest_layer().close();
                 }
                 catch (const std::exception &e)
@@ -156,7 +422,8 @@ namespace CoFHE
         class Server
         {
         public:
-            Server(const std::string &address, const std::string &port, RequestHandlerImpl &&handler, size_t thread_pool_size = SERVER_THREAD_COUNT) : thread_pool_size_m(thread_pool_size), acceptor_m(io_context_m), context_m(asio::ssl::context::sslv23), request_handler_m(std::move(handler)), signals_m(io_context_m, SIGINT, SIGTERM)
+            // thread_pool_size threads do the socket I/O, compute_threads (0 for one per hardware thread) run the handlers
+            Server(const std::string &address, const std::string &port, RequestHandlerImpl &&handler, size_t thread_pool_size = SERVER_THREAD_COUNT, size_t compute_threads = COMPUTE_THREAD_COUNT, size_t queue_capacity = COMPUTE_QUEUE_CAPACITY) : thread_pool_size_m(thread_pool_size), acceptor_m(io_context_m), context_m(asio::ssl::context::sslv23), request_handler_m(std::move(handler)), signals_m(io_context_m, SIGINT, SIGTERM), executor_m(compute_threads, queue_capacity)
             {
                 signals_m.add(SIGINT);
                 signals_m.add(SIGTERM);
@@ -196,6 +463,18 @@ namespace CoFHE
                 }
             }
 
+            // run returns once the I/O threads are done with what they are doing, the open sessions are dropped
+            void stop()
+            {
+                io_context_m.stop();
+            }
+
+            // queue depth, wait times and rejections of the compute executor
+            ComputeExecutor::Stats compute_stats() const
+            {
+                return executor_m.stats();
+            }
+
         private:
             size_t thread_pool_size_m;
             asio::io_context io_context_m;
@@ -203,6 +482,8 @@ namespace CoFHE
             asio::ssl::context context_m;
             RequestHandlerImpl request_handler_m;
             asio::signal_set signals_m;
+            // last, so it is stopped before the handler and the io_context go away
+            ComputeExecutor executor_m;
 
             void do_accept()
             {
@@ -210,7 +491,7 @@ namespace CoFHE
                                         {
                     if (!error)
                     {
-                        std::make_shared<Session<RequestHandlerImpl,Request,Response>>(boost::asio::ssl::stream<tcp::socket>(std::move(socket), context_m),request_handler_m
+                        std::make_shared<Session<RequestHandlerImpl,Request,Response>>(boost::asio::ssl::stream<tcp::socket>(std::move(socket), context_m),request_handler_m, executor_m
                         )->start();
                     }
                     do_accept(); });
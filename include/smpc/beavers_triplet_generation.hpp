@@ -12,7 +12,12 @@ namespace CoFHE
     public:
         using CipherText = typename CryptoSystem::CipherText;
         using PlainText = typename CryptoSystem::PlainText;
-        BeaversTripletGenerator(const CryptoSystem &cs, const typename CryptoSystem::PublicKey &pk) : cs_m(cs), pk_m(pk) {}
+        BeaversTripletGenerator(const CryptoSystem &cs, const typename CryptoSystem::PublicKey &pk) : cs_m(cs), pk_m(pk)
+        {
+            // the pool is shared with the other copies of cs, restarting it would throw their pairs away
+            if (!cs_m.randomness_pool_running(pk_m))
+                cs_m.start_randomness_pool(pk_m);
+        }
 
         Tensor<CipherText*> generate(size_t size)
         {
@@ -18,13 +18,13 @@ namespace CoFHE
             auto triplets = client_m.get_beavers_triplets(1);
             auto a = *triplets.at(0, 0);
             auto b = *triplets.at(0, 1);
-            auto neg_a = client_m.crypto_system().negate_ciphertext(client_m.network_public_key(), a);
-            auto neg_b = client_m.crypto_system().negate_ciphertext(client_m.network_public_key(), b);
             auto c = *triplets.at(0, 2);
-            auto ct1_neg_a = client_m.crypto_system().add_ciphertexts(client_m.network_public_key(), ct1, neg_a);
-            auto ct2_neg_b = client_m.crypto_system().add_ciphertexts(client_m.network_public_key(), ct2, neg_b);
-            auto pt1 = client_m.decrypt(ct1_neg_a);
-            auto pt2 = client_m.decrypt(ct2_neg_b);
+            auto ct1_neg_a = client_m.crypto_system().subtract_ciphertexts(client_m.network_public_key(), ct1, a);
+            auto ct2_neg_b = client_m.crypto_system().subtract_ciphertexts(client_m.network_public_key(), ct2, b);
+            auto pt1_future = client_m.decrypt_async(ct1_neg_a);
+            auto pt2_future = client_m.decrypt_async(ct2_neg_b);
+            auto pt1 = pt1_future.get();
+            auto pt2 = pt2_future.get();
             auto pt1_pt2 = client_m.crypto_system().multiply_plaintexts(pt1, pt2);
             auto enc_pt1_pt2 = client_m.crypto_system().encrypt(client_m.network_public_key(), pt1_pt2);
             auto pt1_b = client_m.crypto_system().scal_ciphertext(client_m.network_public_key(), pt1, b);
@@ -124,12 +124,12 @@ namespace CoFHE
                 b_tensor.at(i) = triplets.at(i, 1);
                 c_tensor.at(i) = triplets.at(i, 2);
             }
-            auto neg_a_tensor = client_m.crypto_system().negate_ciphertext_tensor(client_m.network_public_key(), a_tensor);
-            auto neg_b_tensor = client_m.crypto_system().negate_ciphertext_tensor(client_m.network_public_key(), b_tensor);
-            auto ct1_neg_a = client_m.crypto_system().add_ciphertext_tensors(client_m.network_public_key(), ct1, neg_a_tensor);
-            auto ct2_neg_b = client_m.crypto_system().add_ciphertext_tensors(client_m.network_public_key(), ct2, neg_b_tensor);
-            auto pt1 = client_m.decrypt_tensor(ct1_neg_a);
-            auto pt2 = client_m.decrypt_tensor(ct2_neg_b);
+            auto ct1_neg_a = client_m.crypto_system().subtract_ciphertext_tensors(client_m.network_public_key(), ct1, a_tensor);
+            auto ct2_neg_b = client_m.crypto_system().subtract_ciphertext_tensors(client_m.network_public_key(), ct2, b_tensor);
+            auto pt1_future = client_m.decrypt_tensor_async(ct1_neg_a);
+            auto pt2_future = client_m.decrypt_tensor_async(ct2_neg_b);
+            auto pt1 = pt1_future.get();
+            auto pt2 = pt2_future.get();
             auto pt1_pt2 = client_m.crypto_system().multiply_plaintext_tensors(pt1, pt2);
             auto enc_pt1_pt2 = client_m.crypto_system().encrypt_tensor(client_m.network_public_key(), pt1_pt2);
             auto pt1_b = client_m.crypto_system().scal_ciphertext_tensors(client_m.network_public_key(), pt1, b_tensor);
@@ -145,8 +145,6 @@ namespace CoFHE
                 delete triplets.at(i, 0);
                 delete triplets.at(i, 1);
                 delete triplets.at(i, 2);
-                delete neg_a_tensor.at(i);
-                delete neg_b_tensor.at(i);
                 delete  ct1_neg_a.at(i);
                 delete  ct2_neg_b.at(i);
                 delete  pt1.at(i);
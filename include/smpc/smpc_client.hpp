@@ -1,13 +1,22 @@
 #ifndef COFHE_SMPC_CLIENT_HPP_INCLUDED
 #define COFHE_SMPC_CLIENT_HPP_INCLUDED
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
 #include <string>
 #include <vector>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <numeric>
 
 #include "node/network_details.hpp"
 #include "node/client.hpp"
+#include "node/client_pool.hpp"
+#include "node/compute_executor.hpp"
 #include "node/setup_node_request_handler.hpp"
 #include "node/cofhe_node_request_handler.hpp"
 #include "node/beavers_triplet_request_handler.hpp"
@@ -15,6 +24,16 @@
 #include "node/network_details_request_handler.hpp"
 
 #define CACHE_SIZE  10000000
+// a tensor is only split for partial decryption if every chunk gets at least this many ciphertexts
+#define PARTIAL_DECRYPTION_CHUNK_SIZE 4096
+// chunks per CoFHE node a tensor is split into, more make the balance finer and add requests
+#define PARTIAL_DECRYPTION_CHUNKS_PER_NODE 4
+// a partial decryption goes to more nodes once it takes longer than this percentile of recent answers
+#define PARTIAL_DECRYPTION_HEDGE_PERCENTILE 0.95
+// lower bound of that delay in milliseconds, so that round trip jitter does not double the requests
+#define PARTIAL_DECRYPTION_HEDGE_MIN_MS 20
+// a node that has not answered a partial decryption by then is given up, in milliseconds
+#define PARTIAL_DECRYPTION_TIMEOUT_MS 300000
 
 namespace CoFHE
 {
@@ -25,7 +44,8 @@ namespace CoFHE
         using PlainText = typename CryptoSystem::PlainText;
         using CipherText = typename CryptoSystem::CipherText;
         using PartDecryptionResult = typename CryptoSystem::PartDecryptionResult;
-        SMPCClient(const NetworkDetails &nd) : network_details_m(nd), crypto_system_m(CryptoSystem(
+        // the connections to the nodes speak protocol_version, the requests inside theirs as well
+        SMPCClient(const NetworkDetails &nd, Network::ProtocolVersion protocol_version = Network::ProtocolVersion::V2) : network_details_m(nd), protocol_version_m(protocol_version), crypto_system_m(CryptoSystem(
                                                                           network_details_m.cryptosystem_details().security_level,
                                                                           network_details_m.cryptosystem_details().k)),
                                                public_key_m(crypto_system_m.deserialize_public_key(network_details_m.cryptosystem_details().public_key))
@@ -33,30 +53,10 @@ namespace CoFHE
             init();
         }
 
-        SMPCClient(SMPCClient &&other) : network_details_m(other.network_details_m), crypto_system_m(other.crypto_system_m), public_key_m(other.public_key_m)
-        {
-            std::lock_guard<std::mutex> lock(other.beavers_triplets_mutex_m);
-            clients_partial_decryption_m = std::move(other.clients_partial_decryption_m);
-            beavers_triplets_m = std::move(other.beavers_triplets_m);
-            beavers_triplets_index_m = other.beavers_triplets_index_m;
-            client_trusted_node_m = std::move(other.client_trusted_node_m);
-        }
-
-        SMPCClient &operator=(SMPCClient &&other)
-        {
-            if (this != &other)
-            {
-                network_details_m = other.network_details_m;
-                crypto_system_m = other.crypto_system_m;
-                public_key_m = other.public_key_m;
-                std::lock_guard<std::mutex> lock(other.beavers_triplets_mutex_m);
-                clients_partial_decryption_m = std::move(other.clients_partial_decryption_m);
-                beavers_triplets_m = std::move(other.beavers_triplets_m);
-                beavers_triplets_index_m = other.beavers_triplets_index_m;
-                client_trusted_node_m = std::move(other.client_trusted_node_m);
-            }
-            return *this;
-        }
+        // the futures of decrypt_async and decrypt_tensor_async use the client when they are waited on, it
+        // stays where it is; hold it by pointer to move it around
+        SMPCClient(const SMPCClient &) = delete;
+        SMPCClient &operator=(const SMPCClient &) = delete;
 
         Tensor<CipherText *> get_beavers_triplets(size_t size)
         {
@@ -115,59 +115,79 @@ namespace CoFHE
 
         PlainText decrypt(CipherText ct)
         {
-            if (clients_partial_decryption_m.size() < network_details_m.cryptosystem_details().threshold)
-            {
-                reinit_partial_decryption_clients();
-            }
+            return decrypt_async(std::move(ct)).get();
+        }
+
+        // the partial decryptions are requested right away and combined when the result is taken,
+        // so independent decryptions overlap on the connections; slow or failed nodes are replaced
+        // while the result is waited for (see wait_partial_decryption)
+        std::future<PlainText> decrypt_async(CipherText ct)
+        {
             // auto request = PartialDecryptionRequest(PartialDecryptionRequest::DataType::SINGLE, crypto_system_m.serialize_ciphertext(ct));
-            auto request = CoFHENodeRequest(CoFHENodeRequest::RequestType::PartialDecryption, PartialDecryptionRequest(part_decryption_index_m, PartialDecryptionRequest::DataType::SINGLE, crypto_system_m.serialize_ciphertext(ct)).to_string());
-            std::vector<CoFHE::CoFHENodeResponse *> res(network_details_m.cryptosystem_details().threshold, nullptr);
-            CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
-            {
-                clients_partial_decryption_m[i]->run(
-                    Network::ServiceType::COFHE_REQUEST,
-                    request, &res[i]);
-            }
-            Vector<PartDecryptionResult> pdrs;
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
-            {
-                pdrs.push_back(crypto_system_m.deserialize_part_decryption_result(PartialDecryptionResponse::from_string((res[i])->data()).data()));
-            }
-            auto res_ = crypto_system_m.combine_part_decryption_results(ct, pdrs);
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
-            {
-                delete res[i];
-            }
-            return res_;
+            auto request = PartialDecryptionRequest(0, PartialDecryptionRequest::DataType::SINGLE, crypto_system_m.serialize_ciphertext(ct));
+            auto network = network_snapshot();
+            auto subsets = plan_partial_decryptions({1}, network);
+            auto decryption = start_partial_decryption(std::move(request), 1, subsets[0], network);
+            return std::async(std::launch::deferred, [this, ct = std::move(ct), decryption = std::move(decryption)]() mutable
+                              {
+                wait_partial_decryption(decryption);
+                Vector<PartDecryptionResult> pdrs;
+                for (auto &response : decryption->responses)
+                {
+                    pdrs.push_back(crypto_system_m.deserialize_part_decryption_result(PartialDecryptionResponse::from_string(std::move(response.data())).data()));
+                }
+                return crypto_system_m.combine_part_decryption_results(ct, pdrs, decryption->parties, decryption->network.total_nodes); });
         }
 
         Tensor<PlainText *> decrypt_tensor(Tensor<CipherText *> ct)
         {
-            if (clients_partial_decryption_m.size() < network_details_m.cryptosystem_details().threshold)
-            {
-                reinit_partial_decryption_clients();
-            }
-            auto request = CoFHENodeRequest(CoFHENodeRequest::RequestType::PartialDecryption, PartialDecryptionRequest(part_decryption_index_m, PartialDecryptionRequest::DataType::TENSOR, crypto_system_m.serialize_ciphertext_tensor(ct)).to_string());
-            std::vector<CoFHE::CoFHENodeResponse *> res(network_details_m.cryptosystem_details().threshold);
-            CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
-            {
-                clients_partial_decryption_m[i]->run(
-                    Network::ServiceType::COFHE_REQUEST,
-                    request, &res[i]);
-            }
-            Vector<Tensor<PartDecryptionResult *>> pdrs;
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
+            return decrypt_tensor_async(std::move(ct)).get();
+        }
+
+        // as decrypt_async, the ciphertexts of ct are used again by the combine step and must outlive the future.
+        // With more CoFHE nodes than the threshold a large tensor is split into chunks, and each chunk is
+        // decrypted by its own threshold subset of nodes, chosen by the load and speed of every node.
+        // A chunk whose nodes are slow or fail is sent to other nodes as well, the first answers win.
+        std::future<Tensor<PlainText *>> decrypt_tensor_async(Tensor<CipherText *> ct)
+        {
+            auto network = network_snapshot();
+            auto chunk_sizes = split_partial_decryption(ct.num_elements(), network);
+            auto subsets = plan_partial_decryptions(chunk_sizes, network);
+            if (chunk_sizes.size() == 1)
             {
-                pdrs.push_back(crypto_system_m.deserialize_part_decryption_result_tensor(PartialDecryptionResponse::from_string((res[i])->data()).data()));
+                auto pending = send_partial_decryption_tensor(ct, subsets[0], network);
+                return std::async(std::launch::deferred, [this, pending = std::move(pending)]() mutable
+                                  { return combine_partial_decryption_tensor(pending); });
             }
-            auto res_ = crypto_system_m.combine_part_decryption_results_tensor(ct, pdrs);
-            for (size_t i = 0; i < network_details_m.cryptosystem_details().threshold; i++)
+            auto flat = ct;
+            flat.flatten();
+            std::vector<PendingTensorDecryption> chunks;
+            size_t first = 0;
+            for (size_t c = 0; c < chunk_sizes.size(); c++)
             {
-                delete res[i];
+                Tensor<CipherText *> chunk(Vector<size_t>{chunk_sizes[c]}, nullptr);
+                for (size_t i = 0; i < chunk_sizes[c]; i++)
+                {
+                    chunk.at(i) = flat.at(first + i);
+                }
+                chunks.push_back(send_partial_decryption_tensor(std::move(chunk), subsets[c], network));
+                first += chunk_sizes[c];
             }
-            return res_;
+            return std::async(std::launch::deferred, [this, shape = ct.shape(), num_elements = ct.num_elements(), chunks = std::move(chunks)]() mutable
+                              {
+                Tensor<PlainText *> result(Vector<size_t>{num_elements}, nullptr);
+                size_t first = 0;
+                for (auto &chunk : chunks)
+                {
+                    auto part = combine_partial_decryption_tensor(chunk);
+                    for (size_t i = 0; i < part.num_elements(); i++)
+                    {
+                        result.at(first + i) = part.at(i);
+                    }
+                    first += part.num_elements();
+                }
+                result.reshape(shape);
+                return result; });
         }
 
         CryptoSystem &crypto_system() { return crypto_system_m; }
@@ -182,31 +202,164 @@ namespace CoFHE
         }
 
     private:
-        // reinit_partial_decryption_clients might change it
-        mutable NetworkDetails network_details_m;
+        // the parameters a decryption is planned, waited for and combined with, read once so that a
+        // reinit_partial_decryption_clients in between does not mix those of two networks
+        struct NetworkSnapshot
+        {
+            size_t threshold;
+            size_t total_nodes;
+            size_t num_nodes;
+        };
+
+        // The cost of a partial decryption on a node, as observed on the answers so far. It is
+        // apart from the node so that the response callbacks can update it without holding the
+        // node, whose pool owns the connections the callbacks run on.
+        struct DecryptionStats
+        {
+            std::mutex mutex;
+            // moving average of the milliseconds per ciphertext, 0 until the first answer
+            double ms_per_element = 0;
+            // ciphertexts sent and not answered yet
+            size_t pending_elements = 0;
+
+            void dispatched(size_t elements)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending_elements += elements;
+            }
+
+            // a failed request is not counted, its time says nothing about the speed of the node
+            void completed(size_t elements, double ms, bool ok)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending_elements -= std::min(pending_elements, elements);
+                if (!ok || elements == 0)
+                    return;
+                double sample = ms / elements;
+                ms_per_element = ms_per_element == 0 ? sample : 0.7 * ms_per_element + 0.3 * sample;
+            }
+        };
+
+        // A CoFHE node with its Shamir evaluation index (its join order)
+        struct DecryptionNode
+        {
+            DecryptionNode(std::shared_ptr<Network::ClientPool> pool, size_t party) : pool(std::move(pool)), party(party) {}
+
+            std::shared_ptr<Network::ClientPool> pool;
+            size_t party;
+            std::shared_ptr<DecryptionStats> stats = std::make_shared<DecryptionStats>();
+        };
+
+        // Answer times per ciphertext of recent partial decryptions on any node, kept apart by size
+        // class (the bit width of the ciphertext count) as the round trip dominates small requests.
+        struct LatencyHistory
+        {
+            static constexpr size_t SAMPLES = 256;
+
+            std::mutex mutex;
+            std::array<std::vector<double>, 65> samples;
+            std::array<size_t, 65> next{};
+
+            void record(size_t elements, double ms)
+            {
+                if (elements == 0)
+                    return;
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t c = std::bit_width(elements);
+                if (samples[c].size() < SAMPLES)
+                    samples[c].push_back(ms / elements);
+                else
+                    samples[c][next[c]++ % SAMPLES] = ms / elements;
+            }
+
+            // the q quantile in milliseconds for that many ciphertexts, 0 before any answer of that size
+            double percentile(size_t elements, double q)
+            {
+                if (elements == 0)
+                    return 0;
+                std::vector<double> sorted;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    sorted = samples[std::bit_width(elements)];
+                }
+                if (sorted.empty())
+                    return 0;
+                size_t k = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+                std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+                return sorted[k] * elements;
+            }
+        };
+
+        // One partial decryption request and the nodes it went to, filled in by the response
+        // callbacks. Any threshold of answers combine, the first ones to arrive are used.
+        struct PartialDecryption
+        {
+            PartialDecryption(PartialDecryptionRequest request, size_t elements, NetworkSnapshot network) : request(std::move(request)), elements(elements), network(network), started(std::chrono::steady_clock::now()) {}
+
+            // the request and the CoFHE node request around it in the version of the connection it goes out on,
+            // the ciphertexts are shared by every encoding
+            Network::BufferChain encode(Network::ProtocolVersion ver) const
+            {
+                return CoFHENodeRequest(CoFHENodeRequest::RequestType::PartialDecryption, request.to_buffers(ver)).to_buffers(ver);
+            }
+
+            PartialDecryptionRequest request;
+            size_t elements;
+            NetworkSnapshot network;
+            std::chrono::steady_clock::time_point started;
+            std::mutex mutex;
+            std::condition_variable cv;
+            // the Shamir indices of the nodes asked, not the nodes: the response callbacks hold this
+            // and must not keep the connections of the nodes alive
+            std::vector<size_t> asked;
+            // the Shamir indices of the answers, in order of arrival
+            std::vector<size_t> parties;
+            std::vector<CoFHENodeResponse> responses;
+            size_t failed = 0;
+            std::exception_ptr error;
+            // set once threshold answers are in, later ones are dropped
+            bool done = false;
+        };
+
+        // the partial decryption of one tensor or chunk, combined when the result is taken
+        struct PendingTensorDecryption
+        {
+            Tensor<CipherText *> ct;
+            std::shared_ptr<PartialDecryption> decryption;
+        };
+
+        // reinit_partial_decryption_clients replaces it, read under clients_mutex_m after init
+        NetworkDetails network_details_m;
+        Network::ProtocolVersion protocol_version_m;
         CryptoSystem crypto_system_m;
         typename CryptoSystem::PublicKey public_key_m;
-        std::vector<std::unique_ptr<Network::Client>> clients_partial_decryption_m;
-        std::unique_ptr<Network::Client> client_trusted_node_m;
+        // guards the partial decryption nodes and the network details, which reinit_partial_decryption_clients replaces
+        std::mutex clients_mutex_m;
+        // every reachable CoFHE node, any threshold of them can decrypt together
+        std::vector<std::shared_ptr<DecryptionNode>> decryption_nodes_m;
+        // shared with the response callbacks, which may outlive the client
+        std::shared_ptr<LatencyHistory> latency_m = std::make_shared<LatencyHistory>();
+        std::shared_ptr<Network::ClientPool> client_trusted_node_m;
         std::mutex beavers_triplets_mutex_m;
         std::vector<std::array<typename CryptoSystem::CipherText *, 3>> beavers_triplets_m;
         size_t beavers_triplets_index_m = 0;
-        size_t part_decryption_index_m = 0;
 
         void init()
         {
+            size_t party = 0;
             for (const auto &node : network_details_m.nodes())
             {
                 try
                 {
                     if (node.type == NodeType::CoFHE_NODE)
                     {
-                        if (clients_partial_decryption_m.size() < network_details_m.cryptosystem_details().threshold)
-                            clients_partial_decryption_m.push_back(std::make_unique<Network::Client>(node.ip, node.port, true));
+                        size_t node_party = party++;
+                        decryption_nodes_m.push_back(std::make_shared<DecryptionNode>(std::make_shared<Network::ClientPool>(node.ip, node.port, CLIENT_POOL_SIZE, protocol_version_m), node_party));
                     }
                     else if (node.type == NodeType::SETUP_NODE && client_trusted_node_m == nullptr)
                     {
-                        client_trusted_node_m = std::make_unique<Network::Client>(node.ip, node.port, true);
+                        // triplet and network details requests are rare and already serialized
+                        client_trusted_node_m = std::make_shared<Network::ClientPool>(node.ip, node.port, 1, protocol_version_m);
                     }
                 }
                 catch (const std::exception &e)
@@ -229,69 +382,337 @@ namespace CoFHE
             delete res;
         }
 
-        void reinit_partial_decryption_clients()
+        NetworkSnapshot network_snapshot()
         {
-            clients_partial_decryption_m.clear();
-            SetupNodeRequest req = SetupNodeRequest(SetupNodeRequest::RequestType::NetworkDetailsRequest, NetworkDetailsRequest(NetworkDetailsRequest::RequestType::GET, "").to_string());
-            SetupNodeResponse *res;
-            client_trusted_node_m->run(Network::ServiceType::SETUP_REQUEST, req, &res);
-            network_details_m = NetworkDetails::from_string(NetworkDetailsResponse::from_string(res->data()).data());
-            clients_partial_decryption_m.clear();
-            std::vector<size_t> partial_decryption_clients;
-            size_t i = 0;
-            for (const auto &node : network_details_m.nodes())
+            std::lock_guard<std::mutex> lock(clients_mutex_m);
+            return NetworkSnapshot{network_details_m.cryptosystem_details().threshold, network_details_m.cryptosystem_details().total_nodes, decryption_nodes_m.size()};
+        }
+
+        // chunk sizes for a tensor of n ciphertexts, a single chunk when every node takes part anyway
+        std::vector<size_t> split_partial_decryption(size_t n, const NetworkSnapshot &network)
+        {
+            size_t num_chunks = 1;
+            if (network.num_nodes > network.threshold)
+            {
+                num_chunks = std::max<size_t>(1, std::min(n / PARTIAL_DECRYPTION_CHUNK_SIZE, network.num_nodes * PARTIAL_DECRYPTION_CHUNKS_PER_NODE));
+            }
+            std::vector<size_t> chunk_sizes(num_chunks, n / num_chunks);
+            for (size_t c = 0; c < n % num_chunks; c++)
+            {
+                chunk_sizes[c]++;
+            }
+            return chunk_sizes;
+        }
+
+        // A threshold subset of nodes for every chunk. Each chunk goes to the nodes that would be
+        // done with it first: the work they already have plus the chunk, times their cost per
+        // ciphertext. Nodes without an answer yet are assumed to be as fast as the average. A network
+        // that is short of nodes is asked for again, network is updated to it then.
+        std::vector<std::vector<std::shared_ptr<DecryptionNode>>> plan_partial_decryptions(const std::vector<size_t> &chunk_sizes, NetworkSnapshot &network)
+        {
+            std::vector<std::shared_ptr<DecryptionNode>> nodes = healthy_decryption_nodes(network.threshold);
+            if (nodes.size() < network.threshold)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(clients_mutex_m);
+                    reinit_partial_decryption_clients();
+                }
+                network = network_snapshot();
+                nodes = healthy_decryption_nodes(network.threshold);
+            }
+            size_t threshold = network.threshold;
+            if (nodes.size() < threshold)
+            {
+                throw std::runtime_error("Not enough partial decryption clients");
+            }
+            std::vector<double> cost, busy;
+            estimate_decryption_costs(nodes, cost, busy);
+            std::vector<std::vector<std::shared_ptr<DecryptionNode>>> subsets;
+            std::vector<size_t> order(nodes.size());
+            for (size_t chunk_size : chunk_sizes)
+            {
+                std::iota(order.begin(), order.end(), 0);
+                std::partial_sort(order.begin(), order.begin() + threshold, order.end(), [&](size_t a, size_t b)
+                                  { return busy[a] + chunk_size * cost[a] < busy[b] + chunk_size * cost[b]; });
+                std::vector<std::shared_ptr<DecryptionNode>> subset;
+                for (size_t k = 0; k < threshold; k++)
+                {
+                    busy[order[k]] += chunk_size * cost[order[k]];
+                    subset.push_back(nodes[order[k]]);
+                }
+                subsets.push_back(std::move(subset));
+            }
+            return subsets;
+        }
+
+        // up to count healthy nodes whose party is not in exclude that would be done first with that
+        // many ciphertexts, for a partial decryption whose nodes are too slow or failed
+        std::vector<std::shared_ptr<DecryptionNode>> pick_decryption_nodes(size_t count, size_t elements, size_t threshold, const std::vector<size_t> &exclude)
+        {
+            std::vector<std::shared_ptr<DecryptionNode>> nodes;
+            for (const auto &node : healthy_decryption_nodes(threshold))
+            {
+                if (std::find(exclude.begin(), exclude.end(), node->party) == exclude.end())
+                    nodes.push_back(node);
+            }
+            count = std::min(count, nodes.size());
+            std::vector<double> cost, busy;
+            estimate_decryption_costs(nodes, cost, busy);
+            std::vector<size_t> order(nodes.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](size_t a, size_t b)
+                              { return busy[a] + elements * cost[a] < busy[b] + elements * cost[b]; });
+            std::vector<std::shared_ptr<DecryptionNode>> picked;
+            for (size_t k = 0; k < count; k++)
+            {
+                picked.push_back(nodes[order[k]]);
+            }
+            return picked;
+        }
+
+        // the milliseconds per ciphertext of every node and the milliseconds of work it already has;
+        // nodes without an answer yet are assumed to be as fast as the average
+        void estimate_decryption_costs(const std::vector<std::shared_ptr<DecryptionNode>> &nodes, std::vector<double> &cost, std::vector<double> &busy)
+        {
+            cost.assign(nodes.size(), 0);
+            busy.assign(nodes.size(), 0);
+            double known = 0;
+            size_t num_known = 0;
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                std::lock_guard<std::mutex> node_lock(nodes[i]->stats->mutex);
+                cost[i] = nodes[i]->stats->ms_per_element;
+                busy[i] = nodes[i]->stats->pending_elements;
+                if (cost[i] > 0)
+                {
+                    known += cost[i];
+                    num_known++;
+                }
+            }
+            for (size_t i = 0; i < nodes.size(); i++)
             {
+                if (cost[i] == 0)
+                    cost[i] = num_known > 0 ? known / num_known : 1;
+                busy[i] *= cost[i];
+            }
+        }
+
+        // the connections of a node are only retried when fewer than threshold nodes are left,
+        // without clients_mutex_m held since reconnecting blocks
+        std::vector<std::shared_ptr<DecryptionNode>> healthy_decryption_nodes(size_t threshold)
+        {
+            std::vector<std::shared_ptr<DecryptionNode>> all;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex_m);
+                all = decryption_nodes_m;
+            }
+            std::vector<std::shared_ptr<DecryptionNode>> nodes;
+            for (const auto &node : all)
+            {
+                if (node->pool->healthy() > 0)
+                    nodes.push_back(node);
+            }
+            for (size_t i = 0; nodes.size() < threshold && i < all.size(); i++)
+            {
+                if (all[i]->pool->healthy() == 0 && all[i]->pool->health_check() > 0)
+                    nodes.push_back(all[i]);
+            }
+            return nodes;
+        }
+
+        // the request goes to every node of the subset at once
+        std::shared_ptr<PartialDecryption> start_partial_decryption(PartialDecryptionRequest request, size_t elements, const std::vector<std::shared_ptr<DecryptionNode>> &subset, const NetworkSnapshot &network)
+        {
+            auto decryption = std::make_shared<PartialDecryption>(std::move(request), elements, network);
+            for (const auto &node : subset)
+            {
+                send_partial_decryption(decryption, node);
+            }
+            return decryption;
+        }
+
+        // over the least busy connection of the node, the time to the answer is recorded as its speed;
+        // a node without connection counts as a failed answer, so that another one is asked instead
+        void send_partial_decryption(const std::shared_ptr<PartialDecryption> &decryption, const std::shared_ptr<DecryptionNode> &node)
+        {
+            {
+                std::lock_guard<std::mutex> lock(decryption->mutex);
+                decryption->asked.push_back(node->party);
+            }
+            auto latency = latency_m;
+            auto started = std::chrono::steady_clock::now();
+            // the callback belongs to a connection of the node, so it holds the statistics only: holding
+            // the node would keep that connection alive past the client and have it destroyed on its own I/O thread
+            auto stats = node->stats;
+            size_t party = node->party;
+            auto on_response = [decryption, stats, party, latency, started](std::exception_ptr error, Network::Response res)
+            {
+                size_t elements = decryption->elements;
                 try
                 {
-                    if (node.type == NodeType::CoFHE_NODE)
+                    auto response = Network::Client::decode_response<CoFHENodeResponse>(error, std::move(res));
+                    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+                    stats->completed(elements, ms, true);
+                    latency->record(elements, ms);
+                    std::lock_guard<std::mutex> lock(decryption->mutex);
+                    if (!decryption->done)
                     {
-                        if (clients_partial_decryption_m.size() < network_details_m.cryptosystem_details().threshold)
-                        {
-                            clients_partial_decryption_m.push_back(std::make_unique<Network::Client>(node.ip, node.port, true));
-                            partial_decryption_clients.push_back(++i);
-                        }
+                        decryption->parties.push_back(party);
+                        decryption->responses.push_back(std::move(response));
                     }
                 }
-                catch (const std::exception &e)
+                catch (...)
                 {
-                    std::cerr << e.what() << '\n';
+                    stats->completed(elements, 0, false);
+                    std::lock_guard<std::mutex> lock(decryption->mutex);
+                    decryption->failed++;
+                    if (!decryption->error)
+                        decryption->error = std::current_exception();
                 }
+                decryption->cv.notify_all();
+            };
+            stats->dispatched(decryption->elements);
+            std::shared_ptr<Network::Client> client;
+            try
+            {
+                client = node->pool->checkout();
             }
-            if (clients_partial_decryption_m.size() < network_details_m.cryptosystem_details().threshold)
+            catch (...)
             {
-                throw std::runtime_error("Not enough partial decryption clients");
+                on_response(std::current_exception(), Network::Response());
+                return;
+            }
+            client->async_request(Network::ServiceType::COFHE_REQUEST, decryption->encode(client->protocol_version()), on_response, std::chrono::milliseconds(PARTIAL_DECRYPTION_TIMEOUT_MS));
+        }
+
+        // Waits for the first threshold answers. A node that failed or missed its deadline is
+        // replaced at once. Once the answers take longer than PARTIAL_DECRYPTION_HEDGE_PERCENTILE
+        // of recent ones of that size, the request is also sent to as many nodes that were not
+        // asked yet as answers are missing, and whichever threshold answers come first are combined.
+        // Shamir shares need no matching share id, any threshold of nodes decrypt together.
+        // On a compute worker the core is left to other requests until the answers are in.
+        void wait_partial_decryption(const std::shared_ptr<PartialDecryption> &decryption)
+        {
+            // before the lock, so that the slot is taken back after the lock is released
+            Network::ComputeExecutor::RemoteWait remote;
+            size_t threshold = decryption->network.threshold;
+            double hedge_ms = latency_m->percentile(decryption->elements, PARTIAL_DECRYPTION_HEDGE_PERCENTILE);
+            bool hedging = hedge_ms > 0;
+            auto hedge_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(std::max<double>(hedge_ms, PARTIAL_DECRYPTION_HEDGE_MIN_MS)));
+            auto hedge_at = decryption->started + hedge_delay;
+            auto outstanding = [&]()
+            { return decryption->asked.size() - decryption->responses.size() - decryption->failed; };
+            std::unique_lock<std::mutex> lock(decryption->mutex);
+            while (decryption->responses.size() < threshold)
+            {
+                bool short_of_nodes = decryption->responses.size() + outstanding() < threshold;
+                bool late = hedging && std::chrono::steady_clock::now() >= hedge_at;
+                if (short_of_nodes || late)
+                {
+                    size_t count = threshold - decryption->responses.size() - (late ? 0 : outstanding());
+                    auto asked = decryption->asked;
+                    lock.unlock();
+                    auto extra = pick_decryption_nodes(count, decryption->elements, threshold, asked);
+                    for (const auto &node : extra)
+                    {
+                        send_partial_decryption(decryption, node);
+                    }
+                    lock.lock();
+                    if (extra.empty())
+                    {
+                        if (decryption->responses.size() + outstanding() < threshold)
+                        {
+                            if (decryption->error)
+                                std::rethrow_exception(decryption->error);
+                            throw std::runtime_error("Not enough partial decryption clients");
+                        }
+                        // every node is asked already, only the deadlines are left
+                        hedging = false;
+                    }
+                    hedge_at = std::chrono::steady_clock::now() + hedge_delay;
+                    continue;
+                }
+                auto ready = [&]()
+                { return decryption->responses.size() >= threshold || decryption->responses.size() + outstanding() < threshold; };
+                if (hedging)
+                    decryption->cv.wait_until(lock, hedge_at, ready);
+                else
+                    decryption->cv.wait(lock, ready);
             }
-            part_decryption_index_m = combinationSequenceNumber(network_details_m.cryptosystem_details().total_nodes, network_details_m.cryptosystem_details().threshold, partial_decryption_clients);
+            decryption->done = true;
+            decryption->parties.resize(threshold);
+            decryption->responses.erase(decryption->responses.begin() + threshold, decryption->responses.end());
         }
 
-        int binomialCoefficient(int n, int k)
+        PendingTensorDecryption send_partial_decryption_tensor(Tensor<CipherText *> ct, const std::vector<std::shared_ptr<DecryptionNode>> &subset, const NetworkSnapshot &network)
         {
-            if (k > n)
-                return 0;
-            if (k == 0 || k == n)
-                return 1;
+            auto request = PartialDecryptionRequest(0, PartialDecryptionRequest::DataType::TENSOR, crypto_system_m.serialize_ciphertext_tensor(ct));
+            size_t elements = ct.num_elements();
+            return PendingTensorDecryption{std::move(ct), start_partial_decryption(std::move(request), elements, subset, network)};
+        }
 
-            int result = 1;
-            for (int i = 1; i <= k; ++i)
+        Tensor<PlainText *> combine_partial_decryption_tensor(PendingTensorDecryption &pending)
+        {
+            wait_partial_decryption(pending.decryption);
+            const auto &parties = pending.decryption->parties;
+            Vector<String> pdrs_data;
+            for (auto &response : pending.decryption->responses)
+            {
+                pdrs_data.push_back(std::move(PartialDecryptionResponse::from_string(std::move(response.data())).data()));
+            }
+            if constexpr (requires { crypto_system_m.view_part_decryption_result_tensor(pdrs_data[0]); })
             {
-                result *= (n - i + 1);
-                result /= i;
+                // combine straight out of the responses
+                Vector<PartDecryptionResultTensorView> pdrs;
+                for (const auto &data : pdrs_data)
+                {
+                    pdrs.push_back(crypto_system_m.view_part_decryption_result_tensor(data));
+                }
+                return crypto_system_m.combine_part_decryption_results_tensor(pending.ct, pdrs, parties, pending.decryption->network.total_nodes);
+            }
+            else
+            {
+                Vector<Tensor<PartDecryptionResult *>> pdrs;
+                for (const auto &data : pdrs_data)
+                {
+                    pdrs.push_back(crypto_system_m.deserialize_part_decryption_result_tensor(data));
+                }
+                return crypto_system_m.combine_part_decryption_results_tensor(pending.ct, pdrs, parties, pending.decryption->network.total_nodes);
             }
-            return result;
         }
 
-        int combinationSequenceNumber(int n, int k, const std::vector<size_t> &combination)
+        // called with clients_mutex_m held, the nodes that are still reachable keep their connections and statistics
+        void reinit_partial_decryption_clients()
         {
-            int rank = 0;
-            for (int i = 0; i < k; ++i)
+            // the current nodes are kept if the setup node cannot be asked
+            SetupNodeRequest req = SetupNodeRequest(SetupNodeRequest::RequestType::NetworkDetailsRequest, NetworkDetailsRequest(NetworkDetailsRequest::RequestType::GET, "").to_string());
+            SetupNodeResponse *res;
+            client_trusted_node_m->run(Network::ServiceType::SETUP_REQUEST, req, &res);
+            network_details_m = NetworkDetails::from_string(NetworkDetailsResponse::from_string(res->data()).data());
+            delete res;
+            auto previous = std::move(decryption_nodes_m);
+            decryption_nodes_m.clear();
+            size_t party = 0;
+            for (const auto &node : network_details_m.nodes())
             {
-                int start = (i == 0) ? 1 : combination[i - 1] + 1;
-                for (int j = start; j < combination[i]; ++j)
+                if (node.type != NodeType::CoFHE_NODE)
+                    continue;
+                try
                 {
-                    rank += binomialCoefficient(n - j, k - i - 1);
+                    std::shared_ptr<DecryptionNode> kept;
+                    for (const auto &p : previous)
+                    {
+                        if (p->pool->address() == node.ip && p->pool->port() == node.port && p->party == party && p->pool->healthy() > 0)
+                            kept = p;
+                    }
+                    decryption_nodes_m.push_back(kept != nullptr ? kept : std::make_shared<DecryptionNode>(std::make_shared<Network::ClientPool>(node.ip, node.port, CLIENT_POOL_SIZE, protocol_version_m), party));
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << e.what() << '\n';
                 }
+                party++;
             }
-            return rank + 1;
         }
     };
 } // namespace CoFHE
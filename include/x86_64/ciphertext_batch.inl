@@ -0,0 +1,92 @@
+// Ciphertexts stored as structure of arrays. The a, b and c of c1 and of c2
+// each live in one limb arena, at a fixed number of limbs per element taken
+// from the discriminant of the form (the coefficients of a reduced form are
+// below it), with a signed limb count per element as in mpz. A batch is six
+// allocations whatever its size instead of seven per ciphertext. Elements are
+// read back as forms with c1(i) and c2(i), the accessors of the tensor views,
+// and serialize_ciphertext_batch writes the tensor wire format straight out of
+// the arenas.
+class CiphertextBatch
+{
+public:
+    static constexpr size_t NUM_COEFFICIENTS = 6;
+
+    CiphertextBatch() = default;
+
+    CiphertextBatch(const Vector<size_t> &shape, const BICYCL::Mpz &disc_G, const BICYCL::Mpz &disc_Delta) : shape_m(shape)
+    {
+        num_elements_m = 1;
+        for (auto dim : shape_m)
+        {
+            if (dim != 0 && num_elements_m > std::numeric_limits<size_t>::max() / dim)
+            {
+                throw std::invalid_argument("Tensor shape too large");
+            }
+            num_elements_m *= dim;
+        }
+        capacity_m[0] = mpz_size((mpz_srcptr)(disc_G));
+        capacity_m[1] = mpz_size((mpz_srcptr)(disc_Delta));
+        for (size_t k = 0; k < 6; k++)
+        {
+            limbs_m[k].assign(num_elements_m * capacity_m[k / 3], 0);
+            sizes_m[k].assign(num_elements_m, 0);
+        }
+    }
+
+    const Vector<size_t> &shape() const { return shape_m; }
+    size_t ndim() const { return shape_m.size(); }
+    size_t num_elements() const { return num_elements_m; }
+
+    // element i (flat index), from any thread as long as each i is set by one of them
+    void set(size_t i, const BICYCL::QFI &c1, const BICYCL::QFI &c2)
+    {
+        const BICYCL::QFI *forms[2] = {&c1, &c2};
+        for (size_t j = 0; j < 2; j++)
+        {
+            store(i, j * 3, forms[j]->a());
+            store(i, j * 3 + 1, forms[j]->b());
+            store(i, j * 3 + 2, forms[j]->c());
+        }
+    }
+
+    BICYCL::QFI c1(size_t i) const { return form(i, 0); }
+    BICYCL::QFI c2(size_t i) const { return form(i, 1); }
+
+    // coefficient k (a, b, c of c1 then of c2) of element i as a read-only mpz over the arena, valid while the batch is
+    mpz_srcptr coefficient(size_t i, size_t k, mpz_t view) const
+    {
+        return mpz_roinit_n(view, limbs_m[k].data() + i * capacity_m[k / 3], sizes_m[k][i]);
+    }
+
+private:
+    Vector<size_t> shape_m;
+    size_t num_elements_m = 0;
+    size_t capacity_m[2] = {0, 0};
+    Vector<mp_limb_t> limbs_m[6];
+    Vector<mp_size_t> sizes_m[6];
+
+    void store(size_t i, size_t k, const BICYCL::Mpz &v)
+    {
+        mpz_srcptr x = (mpz_srcptr)(v);
+        size_t n = mpz_size(x);
+        if (n > capacity_m[k / 3])
+        {
+            throw std::invalid_argument("Form coefficient larger than the discriminant");
+        }
+        mp_limb_t *dst = limbs_m[k].data() + i * capacity_m[k / 3];
+        for (size_t l = 0; l < n; l++)
+            dst[l] = mpz_getlimbn(x, l);
+        sizes_m[k][i] = mpz_sgn(x) < 0 ? -(mp_size_t)(n) : (mp_size_t)(n);
+    }
+
+    BICYCL::QFI form(size_t i, size_t j) const
+    {
+        mpz_t view, v[3];
+        for (size_t c = 0; c < 3; c++)
+        {
+            mpz_init_set(v[c], coefficient(i, j * 3 + c, view));
+        }
+        // the forms were valid when they were set
+        return BICYCL::QFI(BICYCL::Mpz(std::move(v[0])), BICYCL::Mpz(std::move(v[1])), BICYCL::Mpz(std::move(v[2])), true);
+    }
+};
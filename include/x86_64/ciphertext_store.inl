@@ -0,0 +1,177 @@
+// A ciphertext tensor file is an 8 byte magic followed by the exact bytes of
+// serialize_ciphertext_tensor (uncompressed): ndim, shape, the pointer table
+// of 6 offsets per element, then the mpz_export data. The file is mapped
+// read-only and element i is only decoded, once, when it is first touched.
+const char CIPHERTEXT_TENSOR_FILE_MAGIC[8] = {'C', 'o', 'F', 'H', 'E', 'C', 'T', '1'};
+
+class MappedCiphertextTensor
+{
+public:
+    using CipherText = BICYCL::CL_HSM2k::CipherText;
+
+    explicit MappedCiphertextTensor(const String &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            int err = errno;
+            ::close(fd);
+            throw std::runtime_error("Cannot stat " + path + ": " + std::strerror(err));
+        }
+        size_m = (size_t)(st.st_size);
+        if (size_m < sizeof(CIPHERTEXT_TENSOR_FILE_MAGIC) + 4)
+        {
+            ::close(fd);
+            throw std::invalid_argument(path + " is not a ciphertext tensor file");
+        }
+        void *p = mmap(nullptr, size_m, PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map " + path + ": " + std::strerror(err));
+        }
+        base_m = (const char *)(p);
+        try
+        {
+            parse_header(path);
+        }
+        catch (...)
+        {
+            munmap((void *)(base_m), size_m);
+            throw;
+        }
+        elements_m.reset(new std::atomic<CipherText *>[num_elements_m]);
+        for (size_t i = 0; i < num_elements_m; i++)
+            elements_m[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    MappedCiphertextTensor(const MappedCiphertextTensor &) = delete;
+    MappedCiphertextTensor &operator=(const MappedCiphertextTensor &) = delete;
+
+    ~MappedCiphertextTensor()
+    {
+        for (size_t i = 0; i < num_elements_m; i++)
+            delete elements_m[i].load(std::memory_order_relaxed);
+        munmap((void *)(base_m), size_m);
+    }
+
+    const Vector<size_t> &shape() const { return shape_m; }
+    size_t ndim() const { return shape_m.size(); }
+    size_t num_elements() const { return num_elements_m; }
+
+    // decodes element i (flat index) from the mapping, without caching it
+    CipherText load(size_t i) const
+    {
+        if (i >= num_elements_m)
+        {
+            throw std::out_of_range("Ciphertext index out of range");
+        }
+        const uint64_t sign_bit = (uint64_t)(1) << 63;
+        uint64_t offsets[7];
+        memcpy(offsets, table_m + 8 * 6 * i, 8 * (i + 1 < num_elements_m ? 7 : 6));
+        if (i + 1 == num_elements_m)
+            offsets[6] = data_size_m;
+        BICYCL::Mpz v[6];
+        for (size_t j = 0; j < 6; j++)
+        {
+            uint64_t begin = offsets[j] & ~sign_bit, end = offsets[j + 1] & ~sign_bit;
+            if (begin > end || end > data_size_m)
+            {
+                throw std::invalid_argument("Corrupt ciphertext tensor file offsets");
+            }
+            mpz_t s;
+            mpz_init(s);
+            mpz_import(s, end - begin, -1, 1, -1, 0, data_m + begin);
+            if (offsets[j] & sign_bit)
+                mpz_neg(s, s);
+            v[j] = BICYCL::Mpz(std::move(s));
+        }
+        return CipherText(BICYCL::QFI(v[0], v[1], v[2]), BICYCL::QFI(v[3], v[4], v[5]));
+    }
+
+    // element i, decoded on first use and kept for the lifetime of the mapping, safe from any thread
+    const CipherText &at(size_t i) const
+    {
+        CipherText *ct = elements_m[i].load(std::memory_order_acquire);
+        if (ct)
+            return *ct;
+        CipherText *decoded = new CipherText(load(i));
+        if (elements_m[i].compare_exchange_strong(ct, decoded, std::memory_order_acq_rel))
+            return *decoded;
+        delete decoded;
+        return *ct;
+    }
+
+    // the forms of element i through at(), the accessors of the tensor views, so the
+    // elementwise operations read a stored tensor as they read a serialized one
+    const BICYCL::QFI &c1(size_t i) const { return at(i).c1(); }
+    const BICYCL::QFI &c2(size_t i) const { return at(i).c2(); }
+
+    // all elements, decoded in parallel; the pointers belong to this object
+    Tensor<CipherText *> tensor() const
+    {
+        Tensor<CipherText *> t(Vector<size_t>{num_elements_m}, nullptr);
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements_m; i++)
+        {
+            t.at(i) = const_cast<CipherText *>(&at(i));
+        }
+        t.reshape(shape_m);
+        return t;
+    }
+
+private:
+    const char *base_m = nullptr;
+    size_t size_m = 0;
+    Vector<size_t> shape_m;
+    size_t num_elements_m = 0;
+    const char *table_m = nullptr;
+    const char *data_m = nullptr;
+    uint64_t data_size_m = 0;
+    std::unique_ptr<std::atomic<CipherText *>[]> elements_m;
+
+    void parse_header(const String &path)
+    {
+        if (memcmp(base_m, CIPHERTEXT_TENSOR_FILE_MAGIC, sizeof(CIPHERTEXT_TENSOR_FILE_MAGIC)) != 0)
+        {
+            throw std::invalid_argument(path + " is not a ciphertext tensor file");
+        }
+        const char *p = base_m + sizeof(CIPHERTEXT_TENSOR_FILE_MAGIC);
+        size_t remaining = size_m - sizeof(CIPHERTEXT_TENSOR_FILE_MAGIC);
+        uint32_t ndim;
+        memcpy(&ndim, p, 4);
+        p += 4;
+        remaining -= 4;
+        if (remaining / 4 < ndim)
+        {
+            throw std::invalid_argument(path + " is truncated");
+        }
+        shape_m.resize(ndim);
+        num_elements_m = 1;
+        for (size_t i = 0; i < ndim; i++)
+        {
+            uint32_t dim;
+            memcpy(&dim, p, 4);
+            p += 4;
+            shape_m[i] = dim;
+            if (dim != 0 && num_elements_m > std::numeric_limits<size_t>::max() / dim)
+            {
+                throw std::invalid_argument("Tensor shape too large");
+            }
+            num_elements_m *= dim;
+        }
+        remaining -= 4 * ndim;
+        if (num_elements_m == 0 || remaining / 48 < num_elements_m)
+        {
+            throw std::invalid_argument(path + " is truncated");
+        }
+        table_m = p;
+        data_m = p + 48 * num_elements_m;
+        data_size_m = remaining - 48 * num_elements_m;
+    }
+};
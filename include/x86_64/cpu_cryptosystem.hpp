@@ -5,7 +5,26 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <array>
 #include <memory>
+#include <numeric>
+#include <algorithm>
+#include <limits>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include "bicycl.hpp"
 // we need mpn_scan1
 #include "gmp.h"
@@ -15,10 +34,28 @@
 #include "./common/vector.hpp"
 #include "./common/tensor.hpp"
 #include "./common/pointers.hpp"
+#include "./common/synchronization.hpp"
 #include "./openmp.hpp"
 
+#ifndef CoFHE_THRESHOLD_DELTA_BITS
+// plaintext bits of the class group over k, they hold the power of two in n! that a
+// threshold decryption among n parties multiplies the plaintext by, 31 covers n <= 32
+#define CoFHE_THRESHOLD_DELTA_BITS 31
+#endif
+#ifndef CoFHE_SHAMIR_STATISTICAL_SECURITY
+// t - 1 key shares tell at most 2^-this about the secret key
+#define CoFHE_SHAMIR_STATISTICAL_SECURITY 40
+#endif
+
 namespace CoFHE
 {
+#include "qfi.inl"
+#include "random_streams.inl"
+#include "randomness_pool.inl"
+#include "ciphertext_store.inl"
+#include "tensor_views.inl"
+#include "ciphertext_batch.inl"
+#include "tensor_stream.inl"
 
     class CPUCryptoSystem
     {
@@ -30,15 +67,14 @@ namespace CoFHE
         using CipherText = BICYCL::CL_HSM2k::CipherText;
         using PartDecryptionResult = BICYCL::QFI;
 
-        CPUCryptoSystem(uint32_t security_level, uint32_t k, bool compact = false) : rand_gen(), hsm2k(BICYCL::CL_HSM2k(security_level, k, rand_gen, compact)), sec_level(security_level), k(k)
+        CPUCryptoSystem(uint32_t security_level, uint32_t k, bool compact = false) : CPUCryptoSystem(security_level, k, compact, BICYCL::RandGen(), std::make_shared<RandomStreams>()) {}
+        // the class group, the keys and every random value drawn from seed, for reproducible runs
+        CPUCryptoSystem(uint32_t security_level, uint32_t k, bool compact, uint64_t seed) : CPUCryptoSystem(security_level, k, compact, BICYCL::RandGen(BICYCL::Mpz((unsigned long)(seed))), std::make_shared<RandomStreams>(seed)) {}
+        CPUCryptoSystem(const CPUCryptoSystem &other) : rand_gen(), hsm2k(other.hsm2k), sec_level(other.sec_level), k(other.k), fixed_base_tables(other.fixed_base_tables), randomness_pool(other.randomness_pool), random_streams(other.random_streams), multi_exponent_window(other.multi_exponent_window), compress_tensor_forms(other.compress_tensor_forms)
         {
             init();
         }
-        CPUCryptoSystem(const CPUCryptoSystem &other) : rand_gen(), hsm2k(other.hsm2k), sec_level(other.sec_level), k(other.k)
-        {
-            init();
-        }
-        CPUCryptoSystem(CPUCryptoSystem &&other) : rand_gen(), hsm2k(std::move(other.hsm2k)), sec_level(other.sec_level), k(other.k)
+        CPUCryptoSystem(CPUCryptoSystem &&other) : rand_gen(), hsm2k(std::move(other.hsm2k)), sec_level(other.sec_level), k(other.k), fixed_base_tables(other.fixed_base_tables), randomness_pool(other.randomness_pool), random_streams(other.random_streams), multi_exponent_window(other.multi_exponent_window), compress_tensor_forms(other.compress_tensor_forms)
         {
             init();
         }
@@ -50,6 +86,11 @@ namespace CoFHE
                 hsm2k = other.hsm2k;
                 sec_level = other.sec_level;
                 k = other.k;
+                fixed_base_tables = other.fixed_base_tables;
+                randomness_pool = other.randomness_pool;
+                random_streams = other.random_streams;
+                multi_exponent_window = other.multi_exponent_window;
+                compress_tensor_forms = other.compress_tensor_forms;
                 init();
             }
             return *this;
@@ -62,6 +103,11 @@ namespace CoFHE
                 hsm2k = std::move(other.hsm2k);
                 sec_level = other.sec_level;
                 k = other.k;
+                fixed_base_tables = other.fixed_base_tables;
+                randomness_pool = other.randomness_pool;
+                random_streams = other.random_streams;
+                multi_exponent_window = other.multi_exponent_window;
+                compress_tensor_forms = other.compress_tensor_forms;
                 init();
             }
             return *this;
@@ -74,6 +120,10 @@ namespace CoFHE
         }
         SecretKey keygen() const;
         PublicKey keygen(const SecretKey &sk) const;
+        // a secret key that keygen(sk, threshold, num_parties) can share, throws if num_parties is
+        // more than CoFHE_THRESHOLD_DELTA_BITS supports
+        SecretKey threshold_keygen(size_t num_parties) const;
+        // integer Shamir sharing, one share per party
         Vector<Vector<SecretKeyShare>> keygen(const SecretKey &sk, size_t threshold, size_t num_parties) const;
         CipherText encrypt(const PublicKey &pk, const PlainText &pt) const;
         Vector<CipherText *> encrypt_vector(const PublicKey &pk, const Vector<PlainText *> &pt) const;
@@ -84,21 +134,41 @@ namespace CoFHE
         PartDecryptionResult part_decrypt(const SecretKeyShare &sks, const CipherText &ct) const;
         Vector<PartDecryptionResult *> part_decrypt_vector(const SecretKeyShare &sks, const Vector<CipherText *> &ct) const;
         Tensor<PartDecryptionResult *> part_decrypt_tensor(const SecretKeyShare &sks, const Tensor<CipherText *> &ct) const;
+        // pdrs[j] comes from party parties[j] (0 based) of the num_parties the key was shared among,
+        // any threshold of them in any order
         PlainText combine_part_decryption_results(const CipherText &ct,
-                                                  const Vector<PartDecryptionResult> &pdrs) const;
-        Vector<PlainText *> combine_part_decryption_results_vector(const CipherText &ct,
-                                                                   const Vector<PartDecryptionResult *> &pdrs) const;
+                                                  const Vector<PartDecryptionResult> &pdrs,
+                                                  const Vector<size_t> &parties, size_t num_parties) const;
+        // pdrs[j][i] is the partial decryption of ct[i] by party parties[j]
+        Vector<PlainText *> combine_part_decryption_results_vector(const Vector<CipherText *> &ct,
+                                                                   const Vector<Vector<PartDecryptionResult *>> &pdrs,
+                                                                   const Vector<size_t> &parties, size_t num_parties) const;
+        Tensor<PlainText *> combine_part_decryption_results_tensor(const Tensor<CipherText *> &ct,
+                                                                   const Vector<Tensor<PartDecryptionResult *>> &pdrs,
+                                                                   const Vector<size_t> &parties, size_t num_parties) const;
+        // straight out of serialized tensors, see view_ciphertext_tensor
+        Tensor<PartDecryptionResult *> part_decrypt_tensor(const SecretKeyShare &sks, const CiphertextTensorView &ct) const;
         Tensor<PlainText *> combine_part_decryption_results_tensor(const Tensor<CipherText *> &ct,
-                                                                   const Vector<Tensor<PartDecryptionResult *>> &pdrs) const;
+                                                                   const Vector<PartDecryptionResultTensorView> &pdrs,
+                                                                   const Vector<size_t> &parties, size_t num_parties) const;
+        Tensor<PlainText *> combine_part_decryption_results_tensor(const CiphertextTensorView &ct,
+                                                                   const Vector<PartDecryptionResultTensorView> &pdrs,
+                                                                   const Vector<size_t> &parties, size_t num_parties) const;
         CipherText add_ciphertexts(const PublicKey &pk, const CipherText &ct1, const CipherText &ct2) const;
         CipherText scal_ciphertext(const PublicKey &pk, const PlainText &s, const CipherText &ct) const;
+        CipherText subtract_ciphertexts(const PublicKey &pk, const CipherText &ct1, const CipherText &ct2) const;
+        CipherText add_plaintext_to_ciphertext(const PublicKey &pk, const PlainText &pt, const CipherText &ct) const;
 
         Vector<CipherText *> add_ciphertext_vectors(const PublicKey &pk, const Vector<CipherText *> &ct1, const Vector<CipherText *> &ct2) const;
         Vector<CipherText *> scal_ciphertext_vector(const PublicKey &pk, const PlainText &s, const Vector<CipherText *> &ct) const;
         Vector<CipherText *> scal_ciphertext_vector(const PublicKey &pk, const Vector<PlainText *> &s, const Vector<CipherText *> &ct) const;
 
         Tensor<CipherText *> add_ciphertext_tensors(const PublicKey &pk, const Tensor<CipherText *> &ct1, const Tensor<CipherText *> &ct2) const;
+        Tensor<CipherText *> subtract_ciphertext_tensors(const PublicKey &pk, const Tensor<CipherText *> &ct1, const Tensor<CipherText *> &ct2) const;
+        Tensor<CipherText *> add_plaintext_to_ciphertext_tensors(const PublicKey &pk, const Tensor<PlainText *> &pt, const Tensor<CipherText *> &ct) const;
         Tensor<CipherText *> scal_ciphertext_tensors(const PublicKey &pk, const Tensor<PlainText *> &s, const Tensor<CipherText *> &ct) const;
+        // s (n x m) times ct (m x p, or a vector of size m), res[i][k] = prod_j ct[j][k]^s[i][j]
+        Tensor<CipherText *> matmul_plaintext_ciphertext_tensors(const PublicKey &pk, const Tensor<PlainText *> &s, const Tensor<CipherText *> &ct) const;
 
         PlainText generate_random_plaintext() const;
         Vector<PlainText> generate_random_beavers_triplet() const;
@@ -135,10 +205,87 @@ namespace CoFHE
         Tensor<CipherText *> deserialize_ciphertext_tensor(const String &data) const;
         Tensor<PartDecryptionResult *> deserialize_part_decryption_result_tensor(const String &data) const;
 
+        // read-only views over serialize_*_tensor output, the data has to outlive them
+        CiphertextTensorView view_ciphertext_tensor(const String &data) const { return CiphertextTensorView(data, hsm2k.Cl_G().discriminant(), hsm2k.Cl_Delta().discriminant()); }
+        PartDecryptionResultTensorView view_part_decryption_result_tensor(const String &data) const { return PartDecryptionResultTensorView(data, hsm2k.Cl_Delta().discriminant()); }
+
+        // structure of arrays storage, sized for the forms of this system
+        CiphertextBatch make_ciphertext_batch(const Vector<size_t> &shape) const { return CiphertextBatch(shape, hsm2k.Cl_G().discriminant(), hsm2k.Cl_Delta().discriminant()); }
+        // the format of serialize_ciphertext_tensor, compressed or not as it would be
+        String serialize_ciphertext_batch(const CiphertextBatch &batch) const;
+        // elementwise on serialized tensors: the operands are decoded one element at a time and
+        // the result goes into a batch, no ciphertext is allocated on its own
+        CiphertextBatch add_ciphertext_tensors(const PublicKey &pk, const CiphertextTensorView &ct1, const CiphertextTensorView &ct2) const;
+        CiphertextBatch subtract_ciphertext_tensors(const PublicKey &pk, const CiphertextTensorView &ct1, const CiphertextTensorView &ct2) const;
+        // the chunked format of tensor_stream.inl, a block per next(); deserialize_ciphertext_tensor
+        // reads the whole stream back, CipherTextTensorStreamReader reads it as it arrives
+        TensorStreamWriter<CiphertextBatch> ciphertext_batch_stream(CiphertextBatch batch, size_t block_elements = CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS) const { return TensorStreamWriter<CiphertextBatch>(std::move(batch), block_elements); }
+        TensorStreamWriter<CiphertextTensorSource> ciphertext_tensor_stream(const Tensor<CipherText *> &ct, bool owns_elements, size_t block_elements = CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS) const { return TensorStreamWriter<CiphertextTensorSource>(CiphertextTensorSource(ct, owns_elements), block_elements); }
+        using CipherTextTensorStreamReader = TensorStreamReader<CipherText>;
+
+        // on-disk tensors, opened as a read-only mapping whose elements are decoded on first use
+        void save_ciphertext_tensor(const String &path, const Tensor<CipherText *> &ct) const;
+        std::shared_ptr<MappedCiphertextTensor> open_ciphertext_tensor(const String &path) const;
+        // elementwise with a stored tensor on either side, its elements are decoded once and kept by the mapping
+        CiphertextBatch add_ciphertext_tensors(const PublicKey &pk, const MappedCiphertextTensor &ct1, const CiphertextTensorView &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, false); }
+        CiphertextBatch add_ciphertext_tensors(const PublicKey &pk, const CiphertextTensorView &ct1, const MappedCiphertextTensor &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, false); }
+        CiphertextBatch add_ciphertext_tensors(const PublicKey &pk, const MappedCiphertextTensor &ct1, const MappedCiphertextTensor &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, false); }
+        CiphertextBatch subtract_ciphertext_tensors(const PublicKey &pk, const MappedCiphertextTensor &ct1, const CiphertextTensorView &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, true); }
+        CiphertextBatch subtract_ciphertext_tensors(const PublicKey &pk, const CiphertextTensorView &ct1, const MappedCiphertextTensor &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, true); }
+        CiphertextBatch subtract_ciphertext_tensors(const PublicKey &pk, const MappedCiphertextTensor &ct1, const MappedCiphertextTensor &ct2) const { return this->add_ciphertext_sources(pk, ct1, ct2, true); }
+
+        // builds the fixed-base tables for h and pk now instead of on the first encryption
+        void precompute_public_key(const PublicKey &pk) const;
+        // memory budget per fixed-base table, 0 disables the tables
+        void set_fixed_base_table_memory_budget(size_t bytes) { fixed_base_tables->set_memory_budget(bytes); }
+
+        // (h^r, pk^r) pairs are produced on background threads, encryptions and
+        // re-randomizations under pk then take one instead of exponentiating
+        void start_randomness_pool(const PublicKey &pk, size_t low_watermark = CoFHE_RANDOMNESS_POOL_LOW_WATERMARK,
+                                   size_t high_watermark = CoFHE_RANDOMNESS_POOL_HIGH_WATERMARK, size_t num_threads = 1) const;
+        void stop_randomness_pool() const { randomness_pool->stop(); }
+        size_t randomness_pool_size() const { return randomness_pool->size(); }
+        // true if the pool, shared by all copies of this cryptosystem, is already filling for pk
+        bool randomness_pool_running(const PublicKey &pk) const { return randomness_pool->running(pk.elt()); }
+
+        // r[i] = f^(*n[i]), the precomputation on f is shared by all exponents, r must hold count forms
+        void multi_exponentiate(const BICYCL::ClassGroup &cl, BICYCL::QFI *r, const BICYCL::QFI &f, const BICYCL::Mpz *const *n, size_t count) const;
+        // c1[i], c2[i] = components of ct^(*s[i]), without re-randomization
+        void scal_ciphertext_multi(const CipherText &ct, const PlainText *const *s, size_t count, BICYCL::QFI *c1, BICYCL::QFI *c2) const;
+        // c1, c2 = components of prod cts[i]^(*s[i]) (bucketed multi-exponentiation), without re-randomization
+        void multi_scal_accumulate(const CipherText *const *cts, const PlainText *const *s, size_t count, BICYCL::QFI &c1, BICYCL::QFI &c2) const;
+        // encrypted dot product of s and cts
+        CipherText multi_scal_accumulate(const PublicKey &pk, const Vector<PlainText *> &s, const Vector<CipherText *> &cts) const;
+        // window of the multi-exponentiation engine, 0 picks it from the exponents
+        void set_multi_exponent_window(size_t w) { multi_exponent_window = w; }
+        size_t get_multi_exponent_window() const { return multi_exponent_window; }
+        // send ciphertext and partial decryption tensors without the c of each form, the
+        // receiver recomputes it from the discriminant; deserialization accepts both formats
+        void set_compress_tensor_forms(bool compress) { compress_tensor_forms = compress; }
+        bool get_compress_tensor_forms() const { return compress_tensor_forms; }
+
+        // reproducible keys and randomness for benchmarks, the streams restart from this seed;
+        // the class group is only reproducible when the constructor is given the seed
+        void set_random_seed(uint64_t seed) const { random_streams->set_seed(seed); }
+
         BICYCL::RandGen &get_rand_gen() { return rand_gen; }
         const BICYCL::CL_HSM2k &get_hsm2k() const { return hsm2k; }
+        // plaintexts live mod 2^k, hsm2k.M() is larger by CoFHE_THRESHOLD_DELTA_BITS
+        uint32_t plaintext_bits() const { return k; }
+        BICYCL::Mpz plaintext_modulus() const
+        {
+            mpz_t M;
+            mpz_init(M);
+            mpz_setbit(M, k);
+            return BICYCL::Mpz(std::move(M));
+        }
 
     private:
+        CPUCryptoSystem(uint32_t security_level, uint32_t k, bool compact, const BICYCL::RandGen &group_rand_gen, std::shared_ptr<RandomStreams> streams) : rand_gen(group_rand_gen), hsm2k(BICYCL::CL_HSM2k(security_level, k + CoFHE_THRESHOLD_DELTA_BITS, rand_gen, compact)), sec_level(security_level), k(k), fixed_base_tables(std::make_shared<QFIFixedBaseTableCache>()), randomness_pool(std::make_shared<EncryptionRandomnessPool>()), random_streams(std::move(streams)), multi_exponent_window(CoFHE_MULTI_EXPONENT_WINDOW), compress_tensor_forms(CoFHE_COMPRESS_TENSOR_FORMS)
+        {
+            init();
+        }
+
         mutable BICYCL::RandGen rand_gen;
         BICYCL::CL_HSM2k hsm2k;
         uint32_t sec_level;
@@ -146,6 +293,45 @@ namespace CoFHE
         mpf_t scaling_factor;
         mpf_t mM;
         mpf_t mM_half;
+        std::shared_ptr<QFIFixedBaseTableCache> fixed_base_tables;
+        std::shared_ptr<EncryptionRandomnessPool> randomness_pool;
+        // the randomness of keys, encryptions, plaintexts and triplets, safe from any thread
+        std::shared_ptr<RandomStreams> random_streams;
+        size_t multi_exponent_window;
+        bool compress_tensor_forms;
+
+        // the fixed-base tables of h and pk, null where the budget has no room for one; looked up
+        // once per call and handed to the elements of its loops
+        struct EncryptionTables
+        {
+            std::shared_ptr<const QFIFixedBaseTable> h;
+            std::shared_ptr<const QFIFixedBaseTable> pk;
+        };
+        static EncryptionTables encryption_tables(const BICYCL::CL_HSM2k &hsm2k, QFIFixedBaseTableCache &cache, const PublicKey &pk);
+        EncryptionTables encryption_tables(const PublicKey &pk) const;
+        // hr = h^r and pkr = pk^r (lifted to Cl_Delta), through the fixed-base tables
+        static void encryption_randomness(const BICYCL::CL_HSM2k &hsm2k, const EncryptionTables &tables, const PublicKey &pk, const BICYCL::Mpz &r, BICYCL::QFI &hr, BICYCL::QFI &pkr);
+        // same with a fresh r, from the randomness pool when it has a pair for pk
+        void encryption_randomness(const PublicKey &pk, BICYCL::QFI &hr, BICYCL::QFI &pkr) const;
+        // r from the stream reserved for one element of a loop
+        void encryption_randomness(const PublicKey &pk, const EncryptionTables &tables, uint64_t stream_id, BICYCL::QFI &hr, BICYCL::QFI &pkr) const;
+        PlainText decrypt(const QFIRecodedExponent &sk, const CipherText &ct) const;
+        PartDecryptionResult part_decrypt(const QFIRecodedExponent &sks, const CipherText &ct) const;
+        // s as a signed exponent in [-2^(k-1), 2^(k-1)), negative plaintexts sit in the upper half of Z/2^kZ
+        BICYCL::Mpz signed_scalar(const PlainText &s) const;
+        // r = f^n for a possibly negative n, exponentiates by |n| and inverts
+        void signed_nupow(const BICYCL::ClassGroup &cl, BICYCL::QFI &r, const BICYCL::QFI &f, const BICYCL::Mpz &n) const;
+        // c1[i], c2[i] = components of cts[i]^(*s[i]), positions sharing a ciphertext go through one multi-exponentiation
+        void scal_ciphertexts_grouped(const Vector<const CipherText *> &cts, const Vector<const PlainText *> &s, BICYCL::QFI *c1, BICYCL::QFI *c2) const;
+        // ct1[i] . ct2[i], or ct1[i] . ct2[i]^-1, for operands read through c1(i) and c2(i)
+        template <typename A, typename B>
+        CiphertextBatch add_ciphertext_sources(const PublicKey &pk, const A &ct1, const B &ct2, bool subtract) const;
+        // the combine step with the c2 of element i and the partial decryptions of it fetched through the accessors
+        template <typename C2, typename D>
+        Tensor<PlainText *> combine_part_decryption_results_tensor(const Vector<size_t> &shape, C2 c2, D d, size_t t,
+                                                                   const Vector<size_t> &parties, size_t num_parties) const;
+        // the full six coefficient layout, whatever compress_tensor_forms says
+        String serialize_ciphertext_tensor_uncompressed(const Tensor<CipherText *> &ct_cpu) const;
 
         void init()
         {
@@ -160,17 +346,25 @@ namespace CoFHE
             mpf_div_ui(this->mM_half, this->mM, 2);
         }
 
+        // the class group works mod 2^(k + CoFHE_THRESHOLD_DELTA_BITS), plaintexts are taken and
+        // given back mod 2^k; reducing is a ring morphism so the homomorphic ops agree mod 2^k
         BICYCL::CL_HSM2k::ClearText to_plaintext(const PlainText &pt) const
         {
+            if (pt.sgn() < 0 || pt.nbits() > k)
+            {
+                throw std::range_error("Cleartext is negative or too large");
+            }
             return BICYCL::CL_HSM2k::ClearText(hsm2k, pt);
         }
 
         BICYCL::Mpz to_mpz(const BICYCL::CL_HSM2k::ClearText &ct) const
         {
-            return ct;
+            BICYCL::Mpz m;
+            BICYCL::Mpz::mod2k(m, ct, k);
+            return m;
         }
+
     };
-#include "qfi.inl"
 #include "cpu_cryptosystem.inl"
 #include "cpu_cryptosystem_distributed.inl"
 #include "cpu_cryptosystem_vector_ops.inl"
@@ -1,6 +1,6 @@
 inline CPUCryptoSystem::SecretKey CPUCryptoSystem::keygen() const
 {
-    return hsm2k.keygen(rand_gen);
+    return CPUCryptoSystem::SecretKey(hsm2k, random_streams->random_mpz(hsm2k.secretkey_bound()));
 }
 
 inline CPUCryptoSystem::PublicKey CPUCryptoSystem::keygen(const CPUCryptoSystem::SecretKey &sk) const
@@ -8,29 +8,209 @@ inline CPUCryptoSystem::PublicKey CPUCryptoSystem::keygen(const CPUCryptoSystem:
     return hsm2k.keygen(sk);
 }
 
+inline CPUCryptoSystem::EncryptionTables CPUCryptoSystem::encryption_tables(const BICYCL::CL_HSM2k &hsm2k, QFIFixedBaseTableCache &cache, const CPUCryptoSystem::PublicKey &pk)
+{
+    size_t max_bits = hsm2k.encrypt_randomness_bound().nbits();
+    return EncryptionTables{cache.get(hsm2k.Cl_G(), hsm2k.h(), max_bits), cache.get(hsm2k.Cl_G(), pk.elt(), max_bits)};
+}
+
+inline CPUCryptoSystem::EncryptionTables CPUCryptoSystem::encryption_tables(const CPUCryptoSystem::PublicKey &pk) const
+{
+    return CPUCryptoSystem::encryption_tables(hsm2k, *fixed_base_tables, pk);
+}
+
+inline void CPUCryptoSystem::encryption_randomness(const BICYCL::CL_HSM2k &hsm2k, const EncryptionTables &tables, const CPUCryptoSystem::PublicKey &pk, const BICYCL::Mpz &r, BICYCL::QFI &hr, BICYCL::QFI &pkr)
+{
+    if (!tables.h || !tables.h->power(hr, r))
+        hsm2k.power_of_h(hr, r);
+    if (!tables.pk || !tables.pk->power(pkr, r))
+        pk.exponentiation(hsm2k, pkr, r);
+    if (hsm2k.compact_variant())
+        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+}
+
+inline void CPUCryptoSystem::encryption_randomness(const CPUCryptoSystem::PublicKey &pk, BICYCL::QFI &hr, BICYCL::QFI &pkr) const
+{
+    uint64_t stream_id = random_streams->reserve(1);
+    if (randomness_pool->take(pk.elt(), hr, pkr))
+        return;
+    BICYCL::Mpz r = random_streams->sequence_stream(stream_id).random_mpz(hsm2k.encrypt_randomness_bound());
+    CPUCryptoSystem::encryption_randomness(hsm2k, this->encryption_tables(pk), pk, r, hr, pkr);
+}
+
+inline void CPUCryptoSystem::encryption_randomness(const CPUCryptoSystem::PublicKey &pk, const EncryptionTables &tables, uint64_t stream_id, BICYCL::QFI &hr, BICYCL::QFI &pkr) const
+{
+    if (randomness_pool->take(pk.elt(), hr, pkr))
+        return;
+    BICYCL::Mpz r = random_streams->sequence_stream(stream_id).random_mpz(hsm2k.encrypt_randomness_bound());
+    CPUCryptoSystem::encryption_randomness(hsm2k, tables, pk, r, hr, pkr);
+}
+
+inline void CPUCryptoSystem::start_randomness_pool(const CPUCryptoSystem::PublicKey &pk, size_t low_watermark, size_t high_watermark, size_t num_threads) const
+{
+    // the workers keep their own copy of the group and key, they do not depend on this object
+    auto hsm2k_copy = std::make_shared<const BICYCL::CL_HSM2k>(hsm2k);
+    auto tables = this->encryption_tables(pk);
+    auto streams = random_streams;
+    randomness_pool->start(pk.elt(), [hsm2k_copy, tables, streams, pk](BICYCL::QFI &hr, BICYCL::QFI &pkr)
+                           {
+                               BICYCL::Mpz r = streams->random_mpz(hsm2k_copy->encrypt_randomness_bound());
+                               CPUCryptoSystem::encryption_randomness(*hsm2k_copy, tables, pk, r, hr, pkr); },
+                           low_watermark, high_watermark, num_threads);
+}
+
+inline void CPUCryptoSystem::precompute_public_key(const CPUCryptoSystem::PublicKey &pk) const
+{
+    this->encryption_tables(pk);
+}
+
 inline CPUCryptoSystem::CipherText CPUCryptoSystem::encrypt(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::PlainText &pt) const
 {
-    return hsm2k.encrypt(pk, this->to_plaintext(pt), rand_gen);
+    BICYCL::QFI c1, pkr;
+    this->encryption_randomness(pk, c1, pkr);
+    return CPUCryptoSystem::CipherText{hsm2k, this->to_plaintext(pt), c1, pkr};
 }
 
 inline CPUCryptoSystem::PlainText CPUCryptoSystem::decrypt(const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::CipherText &ct) const
 {
-    return this->to_mpz(hsm2k.decrypt(sk, ct));
+    return this->decrypt(QFIRecodedExponent(sk), ct);
+}
+
+inline CPUCryptoSystem::PlainText CPUCryptoSystem::decrypt(const QFIRecodedExponent &sk, const CPUCryptoSystem::CipherText &ct) const
+{
+    // c2 * (c1^sk)^-1 = f^m, as in CL_HSM2k::decrypt
+    BICYCL::QFI d = this->part_decrypt(sk, ct);
+    hsm2k.Cl_Delta().nucompinv(d, ct.c2(), d);
+    return this->to_mpz(BICYCL::CL_HSM2k::ClearText(hsm2k, hsm2k.dlog_in_F(d)));
 }
 
 inline CPUCryptoSystem::CipherText CPUCryptoSystem::add_ciphertexts(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::CipherText &ct1, const CPUCryptoSystem::CipherText &ct2) const
 {
-    return hsm2k.add_ciphertexts(pk, ct1, ct2, rand_gen);
+    BICYCL::QFI c1, c2;
+    this->encryption_randomness(pk, c1, c2);
+    hsm2k.Cl_G().nucomp(c1, c1, ct1.c1());
+    hsm2k.Cl_G().nucomp(c1, c1, ct2.c1());
+    hsm2k.Cl_Delta().nucomp(c2, c2, ct1.c2());
+    hsm2k.Cl_Delta().nucomp(c2, c2, ct2.c2());
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+}
+
+inline CPUCryptoSystem::CipherText CPUCryptoSystem::subtract_ciphertexts(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::CipherText &ct1, const CPUCryptoSystem::CipherText &ct2) const
+{
+    BICYCL::QFI c1, c2;
+    this->encryption_randomness(pk, c1, c2);
+    hsm2k.Cl_G().nucomp(c1, c1, ct1.c1());
+    hsm2k.Cl_G().nucompinv(c1, c1, ct2.c1());
+    hsm2k.Cl_Delta().nucomp(c2, c2, ct1.c2());
+    hsm2k.Cl_Delta().nucompinv(c2, c2, ct2.c2());
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+}
+
+inline CPUCryptoSystem::CipherText CPUCryptoSystem::add_plaintext_to_ciphertext(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::PlainText &pt, const CPUCryptoSystem::CipherText &ct) const
+{
+    // c2 * f^m encrypts the sum, f^m needs no exponentiation; re-randomized whatever
+    // ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS says, as add_ciphertexts, so the result cannot be linked to ct
+    BICYCL::Mpz m;
+    BICYCL::Mpz::mod2k(m, pt, k);
+    BICYCL::QFI fm = hsm2k.power_of_f(m);
+    BICYCL::QFI c1, c2;
+    this->encryption_randomness(pk, c1, c2);
+    hsm2k.Cl_G().nucomp(c1, c1, ct.c1());
+    hsm2k.Cl_Delta().nucomp(c2, c2, ct.c2());
+    hsm2k.Cl_Delta().nucomp(c2, c2, fm);
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
 }
 
 inline CPUCryptoSystem::CipherText CPUCryptoSystem::scal_ciphertext(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::PlainText &s, const CPUCryptoSystem::CipherText &ct) const
 {
-    return hsm2k.scal_ciphertexts(pk, ct, s, rand_gen);
+    BICYCL::QFI hr, pkr, c1, c2;
+    this->encryption_randomness(pk, hr, pkr);
+    BICYCL::Mpz n = this->signed_scalar(s);
+    this->signed_nupow(hsm2k.Cl_G(), c1, ct.c1(), n);
+    hsm2k.Cl_G().nucomp(c1, c1, hr);
+    this->signed_nupow(hsm2k.Cl_Delta(), c2, ct.c2(), n);
+    hsm2k.Cl_Delta().nucomp(c2, c2, pkr);
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+}
+
+inline BICYCL::Mpz CPUCryptoSystem::signed_scalar(const CPUCryptoSystem::PlainText &s) const
+{
+    BICYCL::Mpz n;
+    BICYCL::Mpz::mod2k(n, s, k);
+    if (n.nbits() == k)
+        BICYCL::Mpz::sub(n, n, this->plaintext_modulus());
+    return n;
+}
+
+inline void CPUCryptoSystem::signed_nupow(const BICYCL::ClassGroup &cl, BICYCL::QFI &r, const BICYCL::QFI &f, const BICYCL::Mpz &n) const
+{
+    if (n.sgn() >= 0)
+    {
+        cl.nupow(r, f, n);
+        return;
+    }
+    BICYCL::Mpz abs_n(n);
+    abs_n.neg();
+    cl.nupow(r, f, abs_n);
+    r.neg();
+}
+
+inline void CPUCryptoSystem::multi_exponentiate(const BICYCL::ClassGroup &cl, BICYCL::QFI *r, const BICYCL::QFI &f, const BICYCL::Mpz *const *n, size_t count) const
+{
+    size_t max_bits = 0;
+    for (size_t i = 0; i < count; i++)
+        max_bits = std::max(max_bits, n[i]->nbits());
+    auto &engine = QFIMultiExponentiation::thread_instance();
+    engine.set_base(f, cl.default_nucomp_bound(), multi_exponent_window, count, max_bits);
+    engine.power_many(r, n, count);
+}
+
+inline void CPUCryptoSystem::scal_ciphertext_multi(const CPUCryptoSystem::CipherText &ct, const CPUCryptoSystem::PlainText *const *s, size_t count, BICYCL::QFI *c1, BICYCL::QFI *c2) const
+{
+    Vector<BICYCL::Mpz> n(count);
+    Vector<const BICYCL::Mpz *> n_ptrs(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        n[i] = this->signed_scalar(*s[i]);
+        n_ptrs[i] = &n[i];
+    }
+    this->multi_exponentiate(hsm2k.Cl_G(), c1, ct.c1(), n_ptrs.data(), count);
+    this->multi_exponentiate(hsm2k.Cl_Delta(), c2, ct.c2(), n_ptrs.data(), count);
+}
+
+inline void CPUCryptoSystem::multi_scal_accumulate(const CPUCryptoSystem::CipherText *const *cts, const CPUCryptoSystem::PlainText *const *s, size_t count, BICYCL::QFI &c1, BICYCL::QFI &c2) const
+{
+    Vector<BICYCL::Mpz> n(count);
+    Vector<const BICYCL::Mpz *> n_ptrs(count);
+    Vector<const BICYCL::QFI *> c1s(count), c2s(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        n[i] = this->signed_scalar(*s[i]);
+        n_ptrs[i] = &n[i];
+        c1s[i] = &cts[i]->c1();
+        c2s[i] = &cts[i]->c2();
+    }
+    qfi_multi_power(hsm2k.Cl_G(), c1, c1s.data(), n_ptrs.data(), count);
+    qfi_multi_power(hsm2k.Cl_Delta(), c2, c2s.data(), n_ptrs.data(), count);
+}
+
+inline CPUCryptoSystem::CipherText CPUCryptoSystem::multi_scal_accumulate(const CPUCryptoSystem::PublicKey &pk, const Vector<CPUCryptoSystem::PlainText *> &s, const Vector<CPUCryptoSystem::CipherText *> &cts) const
+{
+    if (s.size() != cts.size())
+    {
+        throw std::invalid_argument("Vector sizes must be equal");
+    }
+    BICYCL::QFI hr, pkr, c1, c2;
+    this->encryption_randomness(pk, hr, pkr);
+    this->multi_scal_accumulate(cts.data(), s.data(), cts.size(), c1, c2);
+    hsm2k.Cl_G().nucomp(c1, c1, hr);
+    hsm2k.Cl_Delta().nucomp(c2, c2, pkr);
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
 }
 
 inline CPUCryptoSystem::PlainText CPUCryptoSystem::generate_random_plaintext() const
 {
-    return BICYCL::Mpz{rand_gen.random_mpz(hsm2k.cleartext_bound())};
+    return random_streams->random_mpz(this->plaintext_modulus());
 }
 
 inline Vector<CPUCryptoSystem::PlainText> CPUCryptoSystem::generate_random_beavers_triplet() const
@@ -40,8 +220,8 @@ inline Vector<CPUCryptoSystem::PlainText> CPUCryptoSystem::generate_random_beave
     // this will make the multiplication of the two plaintexts to be in the clear text bound
     // can cause overflow if the k is less than 20
     auto bound = BICYCL::Mpz{(unsigned long)(10)};
-    res.push_back(BICYCL::Mpz{rand_gen.random_mpz(bound)});
-    res.push_back(BICYCL::Mpz{rand_gen.random_mpz(bound)});
+    res.push_back(random_streams->random_mpz(bound));
+    res.push_back(random_streams->random_mpz(bound));
     res.push_back(multiply_plaintexts(res[0], res[1]));
     return res;
 }
@@ -94,7 +274,12 @@ inline CPUCryptoSystem::PlainText CPUCryptoSystem::negate_plaintext(const CPUCry
 
 inline CPUCryptoSystem::CipherText CPUCryptoSystem::negate_ciphertext(const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::CipherText &ct) const
 {
-    return hsm2k.scal_ciphertexts(pk, ct, this->make_plaintext(-1), rand_gen);
+    // the inverse of (a, b, c) is (a, -b, c), no need to exponentiate by 2^k - 1
+    BICYCL::QFI c1, c2;
+    this->encryption_randomness(pk, c1, c2);
+    hsm2k.Cl_G().nucompinv(c1, c1, ct.c1());
+    hsm2k.Cl_Delta().nucompinv(c2, c2, ct.c2());
+    return CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
 }
 
 inline CPUCryptoSystem::PlainText CPUCryptoSystem::add_plaintexts(const CPUCryptoSystem::PlainText &pt1, const CPUCryptoSystem::PlainText &pt2) const
@@ -123,7 +308,7 @@ inline float CPUCryptoSystem::get_float_from_plaintext(const CPUCryptoSystem::Pl
 
 inline String CPUCryptoSystem::serialize() const
 {
-    return "CPUCryptoSystem " + std::to_string(sec_level) + " " + std::to_string(hsm2k.k()) + " " + std::to_string(hsm2k.compact_variant());
+    return "CPUCryptoSystem " + std::to_string(sec_level) + " " + std::to_string(k) + " " + std::to_string(hsm2k.compact_variant());
 }
 
 inline CPUCryptoSystem CPUCryptoSystem::deserialize(const String &data)
@@ -181,15 +366,95 @@ inline CPUCryptoSystem::PublicKey CPUCryptoSystem::deserialize_public_key(const
     return CPUCryptoSystem::PublicKey(hsm2k, BICYCL::QFI{BICYCL::Mpz{a_str}, BICYCL::Mpz{b_str}, BICYCL::Mpz{c_str}});
 }
 
+// Single elements use the tensor layout with ndim = 0 (one element, its
+// coefficients in the pointer table, then the mpz_export data) behind a two
+// byte tag. The decimal text format never starts with a zero byte, so it is
+// still accepted from older peers.
+const unsigned char SINGLE_ELEMENT_FORMAT_MARKER = 0;
+const unsigned char SINGLE_ELEMENT_FORMAT_VERSION = 1;
+
+inline String serialize_single_element(const BICYCL::Mpz *const *coefficients, size_t count)
+{
+    const uint64_t sign_bit = (uint64_t)(1) << 63;
+    Vector<uint64_t> data_offsets(count);
+    uint64_t last_offset = 0;
+    for (size_t j = 0; j < count; j++)
+    {
+        data_offsets[j] = last_offset | (coefficients[j]->sgn() < 0 ? sign_bit : (uint64_t)(0));
+        last_offset += mpz_sizeinbase((mpz_srcptr)(*coefficients[j]), 2) / 8 + 1;
+    }
+    size_t header_size = 2 + 4 + 8 * count;
+    String data(header_size + last_offset, 0);
+    char *data_ptr = data.data();
+    data_ptr[0] = (char)(SINGLE_ELEMENT_FORMAT_MARKER);
+    data_ptr[1] = (char)(SINGLE_ELEMENT_FORMAT_VERSION);
+    uint32_t ndim = 0;
+    memcpy(data_ptr + 2, &ndim, 4);
+    memcpy(data_ptr + 6, data_offsets.data(), 8 * count);
+    data_ptr += header_size;
+    for (size_t j = 0; j < count; j++)
+        mpz_export(data_ptr + (data_offsets[j] & ~sign_bit), NULL, -1, 1, -1, 0, (mpz_srcptr)(*coefficients[j]));
+    return data;
+}
+
+inline bool is_single_element_binary(const String &data)
+{
+    return !data.empty() && (unsigned char)(data[0]) == SINGLE_ELEMENT_FORMAT_MARKER;
+}
+
+inline Vector<BICYCL::Mpz> deserialize_single_element(const String &data, size_t count)
+{
+    const uint64_t sign_bit = (uint64_t)(1) << 63;
+    size_t header_size = 2 + 4 + 8 * count;
+    if (data.size() < header_size)
+    {
+        throw std::invalid_argument("Truncated single element data");
+    }
+    if ((unsigned char)(data[1]) != SINGLE_ELEMENT_FORMAT_VERSION)
+    {
+        throw std::invalid_argument("Unsupported single element format version " + std::to_string((unsigned char)(data[1])));
+    }
+    uint32_t ndim;
+    memcpy(&ndim, data.data() + 2, 4);
+    if (ndim != 0)
+    {
+        throw std::invalid_argument("Single element data must have ndim 0");
+    }
+    Vector<uint64_t> data_offsets(count + 1);
+    memcpy(data_offsets.data(), data.data() + 6, 8 * count);
+    data_offsets[count] = data.size() - header_size;
+    const char *data_ptr = data.data() + header_size;
+    Vector<BICYCL::Mpz> coefficients;
+    coefficients.reserve(count);
+    for (size_t j = 0; j < count; j++)
+    {
+        uint64_t begin = data_offsets[j] & ~sign_bit, end = data_offsets[j + 1] & ~sign_bit;
+        if (begin > end || end > data.size() - header_size)
+        {
+            throw std::invalid_argument("Corrupt single element offsets");
+        }
+        mpz_t v;
+        mpz_init(v);
+        mpz_import(v, end - begin, -1, 1, -1, 0, data_ptr + begin);
+        if (data_offsets[j] & sign_bit)
+            mpz_neg(v, v);
+        coefficients.push_back(BICYCL::Mpz(std::move(v)));
+    }
+    return coefficients;
+}
+
 inline String CPUCryptoSystem::serialize_plaintext(const CPUCryptoSystem::PlainText &s) const
 {
-    std::stringstream ss;
-    ss << s;
-    return ss.str();
+    const BICYCL::Mpz *coefficients[] = {&s};
+    return serialize_single_element(coefficients, 1);
 }
 
 inline CPUCryptoSystem::PlainText CPUCryptoSystem::deserialize_plaintext(const String &data) const
 {
+    if (is_single_element_binary(data))
+    {
+        return std::move(deserialize_single_element(data, 1)[0]);
+    }
     std::stringstream ss{data};
     BICYCL::Mpz s;
     ss >> s;
@@ -198,13 +463,17 @@ inline CPUCryptoSystem::PlainText CPUCryptoSystem::deserialize_plaintext(const S
 
 inline String CPUCryptoSystem::serialize_ciphertext(const CPUCryptoSystem::CipherText &ct) const
 {
-    std::stringstream ss;
-    ss << ct.c1().a() << " " << ct.c1().b() << " " << ct.c1().c() << " " << ct.c2().a() << " " << ct.c2().b() << " " << ct.c2().c();
-    return ss.str();
+    const BICYCL::Mpz *coefficients[] = {&ct.c1().a(), &ct.c1().b(), &ct.c1().c(), &ct.c2().a(), &ct.c2().b(), &ct.c2().c()};
+    return serialize_single_element(coefficients, 6);
 }
 
 inline CPUCryptoSystem::CipherText CPUCryptoSystem::deserialize_ciphertext(const String &data) const
 {
+    if (is_single_element_binary(data))
+    {
+        auto v = deserialize_single_element(data, 6);
+        return CPUCryptoSystem::CipherText(BICYCL::QFI{v[0], v[1], v[2]}, BICYCL::QFI{v[3], v[4], v[5]});
+    }
     std::stringstream ss{data};
     std::string c1_a_str, c1_b_str, c1_c_str, c2_a_str, c2_b_str, c2_c_str;
     ss >> c1_a_str >> c1_b_str >> c1_c_str >> c2_a_str >> c2_b_str >> c2_c_str;
@@ -213,13 +482,17 @@ inline CPUCryptoSystem::CipherText CPUCryptoSystem::deserialize_ciphertext(const
 
 inline String CPUCryptoSystem::serialize_part_decryption_result(const CPUCryptoSystem::PartDecryptionResult &pdr) const
 {
-    std::stringstream ss;
-    ss << pdr.a() << " " << pdr.b() << " " << pdr.c();
-    return ss.str();
+    const BICYCL::Mpz *coefficients[] = {&pdr.a(), &pdr.b(), &pdr.c()};
+    return serialize_single_element(coefficients, 3);
 }
 
 inline CPUCryptoSystem::PartDecryptionResult CPUCryptoSystem::deserialize_part_decryption_result(const String &data) const
 {
+    if (is_single_element_binary(data))
+    {
+        auto v = deserialize_single_element(data, 3);
+        return CPUCryptoSystem::PartDecryptionResult{v[0], v[1], v[2]};
+    }
     std::stringstream ss{data};
     std::string a_str, b_str, c_str;
     ss >> a_str >> b_str >> c_str;
@@ -314,10 +587,155 @@ inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::deserialize_plainte
             plaintexts.at(num_elements - 1)->neg();
         }
     }
+    plaintexts.reshape(shape_vec);
     return plaintexts;
 }
 
+inline bool is_compressed_forms(const String &data)
+{
+    uint32_t ndim = 0;
+    if (data.size() >= 4)
+        memcpy(&ndim, data.data(), 4);
+    return (ndim & COMPRESSED_FORMS_BIT) != 0;
+}
+
+// forms holds forms_per_element forms for each element, in order
+inline String serialize_compressed_forms(const Vector<size_t> &shape, const Vector<const BICYCL::QFI *> &forms)
+{
+    const uint64_t sign_bit = (uint64_t)(1) << 63;
+    size_t num_coefficients = forms.size() * 2;
+    Vector<uint64_t> data_offsets(num_coefficients);
+    uint64_t last_offset = 0;
+    for (size_t i = 0; i < forms.size(); i++)
+    {
+        data_offsets[i * 2] = last_offset;
+        last_offset += mpz_sizeinbase((mpz_srcptr)(forms[i]->a()), 2) / 8 + 1;
+        data_offsets[i * 2 + 1] = last_offset | (forms[i]->b().sgn() < 0 ? sign_bit : (uint64_t)(0));
+        last_offset += mpz_sizeinbase((mpz_srcptr)(forms[i]->b()), 2) / 8 + 1;
+    }
+    size_t header_size = 4 + 4 * shape.size() + 8 * num_coefficients;
+    String data(header_size + last_offset, 0);
+    char *data_ptr = data.data();
+    uint32_t ndim = (uint32_t)(shape.size()) | COMPRESSED_FORMS_BIT;
+    memcpy(data_ptr, &ndim, 4);
+    data_ptr += 4;
+    for (size_t i = 0; i < shape.size(); i++)
+    {
+        uint32_t dim = shape[i];
+        memcpy(data_ptr, &dim, 4);
+        data_ptr += 4;
+    }
+    memcpy(data_ptr, data_offsets.data(), 8 * num_coefficients);
+    data_ptr += 8 * num_coefficients;
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < forms.size(); i++)
+    {
+        mpz_export(data_ptr + data_offsets[i * 2], NULL, -1, 1, -1, 0, (mpz_srcptr)(forms[i]->a()));
+        mpz_export(data_ptr + (data_offsets[i * 2 + 1] & ~sign_bit), NULL, -1, 1, -1, 0, (mpz_srcptr)(forms[i]->b()));
+    }
+    return data;
+}
+
+// the form j of every element has discriminant *discriminants[j]
+inline Vector<BICYCL::QFI> deserialize_compressed_forms(const String &data, const Vector<const BICYCL::Mpz *> &discriminants, Vector<size_t> &shape)
+{
+    const uint64_t sign_bit = (uint64_t)(1) << 63;
+    const char *data_ptr = data.data();
+    const char *data_end = data.data() + data.size();
+    uint32_t ndim;
+    memcpy(&ndim, data_ptr, 4);
+    ndim &= ~COMPRESSED_FORMS_BIT;
+    data_ptr += 4;
+    if ((size_t)(data_end - data_ptr) < 4 * (size_t)(ndim))
+    {
+        throw std::invalid_argument("Truncated compressed forms");
+    }
+    shape.assign(ndim, 0);
+    uint64_t num_elements = 1;
+    for (size_t i = 0; i < ndim; i++)
+    {
+        uint32_t dim;
+        memcpy(&dim, data_ptr, 4);
+        data_ptr += 4;
+        shape[i] = dim;
+        if (dim != 0 && num_elements > std::numeric_limits<uint64_t>::max() / dim)
+        {
+            throw std::invalid_argument("Tensor shape too large");
+        }
+        num_elements *= dim;
+    }
+    if (num_elements > std::numeric_limits<uint64_t>::max() / discriminants.size())
+    {
+        throw std::invalid_argument("Tensor shape too large");
+    }
+    size_t num_forms = num_elements * discriminants.size();
+    if ((uint64_t)(data_end - data_ptr) / 16 < num_forms)
+    {
+        throw std::invalid_argument("Truncated compressed forms");
+    }
+    Vector<uint64_t> data_offsets(num_forms * 2 + 1);
+    memcpy(data_offsets.data(), data_ptr, 16 * num_forms);
+    data_ptr += 16 * num_forms;
+    data_offsets[num_forms * 2] = data_end - data_ptr;
+    for (size_t i = 0; i < num_forms * 2; i++)
+    {
+        // a is positive, only the offset of b carries a sign
+        if ((i % 2 == 0 && (data_offsets[i] & sign_bit)) ||
+            (data_offsets[i] & ~sign_bit) > (data_offsets[i + 1] & ~sign_bit) || (data_offsets[i + 1] & ~sign_bit) > (uint64_t)(data_end - data_ptr))
+        {
+            throw std::invalid_argument("Corrupt compressed form offsets");
+        }
+    }
+
+    Vector<BICYCL::QFI> forms(num_forms);
+    std::atomic<bool> invalid{false};
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_forms; i++)
+    {
+        mpz_t a, b, c, four_a;
+        mpz_inits(a, b, c, four_a, NULL);
+        uint64_t a_begin = data_offsets[i * 2] & ~sign_bit, b_begin = data_offsets[i * 2 + 1] & ~sign_bit, b_end = data_offsets[i * 2 + 2] & ~sign_bit;
+        mpz_import(a, b_begin - a_begin, -1, 1, -1, 0, data_ptr + a_begin);
+        mpz_import(b, b_end - b_begin, -1, 1, -1, 0, data_ptr + b_begin);
+        if (data_offsets[i * 2 + 1] & sign_bit)
+            mpz_neg(b, b);
+        // c = (b^2 - disc) / 4a
+        mpz_mul(c, b, b);
+        mpz_sub(c, c, (mpz_srcptr)(*discriminants[i % discriminants.size()]));
+        mpz_mul_2exp(four_a, a, 2);
+        if (mpz_sgn(a) <= 0 || !mpz_divisible_p(c, four_a))
+        {
+            invalid.store(true, std::memory_order_relaxed);
+            mpz_clears(a, b, c, four_a, NULL);
+            continue;
+        }
+        mpz_divexact(c, c, four_a);
+        mpz_clear(four_a);
+        forms[i] = BICYCL::QFI(BICYCL::Mpz(std::move(a)), BICYCL::Mpz(std::move(b)), BICYCL::Mpz(std::move(c)), true);
+    }
+    if (invalid.load())
+    {
+        throw std::invalid_argument("Compressed form does not match the discriminant");
+    }
+    return forms;
+}
+
 inline String CPUCryptoSystem::serialize_ciphertext_tensor(const Tensor<CPUCryptoSystem::CipherText *> &ct_cpu) const
+{
+    if (compress_tensor_forms)
+    {
+        auto ct_cpu_flattened = ct_cpu;
+        ct_cpu_flattened.flatten();
+        Vector<const BICYCL::QFI *> forms(ct_cpu.num_elements() * 2);
+        for (size_t i = 0; i < ct_cpu.num_elements(); i++)
+        {
+            forms[i * 2] = &ct_cpu_flattened.at(i)->c1();
+            forms[i * 2 + 1] = &ct_cpu_flattened.at(i)->c2();
+        }
+        return serialize_compressed_forms(ct_cpu.shape(), forms);
+    }
+    return this->serialize_ciphertext_tensor_uncompressed(ct_cpu);
+}
+
+inline String CPUCryptoSystem::serialize_ciphertext_tensor_uncompressed(const Tensor<CPUCryptoSystem::CipherText *> &ct_cpu) const
 {   // the format is binary
     // the first 4 bytes are ndim, then next n*4 bytes are the shape, then the pointer table
     // the pointer table points to the actual bingnums data, each entry is 8 bytes
@@ -391,8 +809,70 @@ inline String CPUCryptoSystem::serialize_ciphertext_tensor(const Tensor<CPUCrypt
     return data;
 }
 
+inline String CPUCryptoSystem::serialize_ciphertext_batch(const CiphertextBatch &batch) const
+{
+    // the layouts of serialize_ciphertext_tensor and serialize_compressed_forms, exported from the arenas
+    const uint64_t sign_bit = (uint64_t)(1) << 63;
+    size_t per_form = compress_tensor_forms ? 2 : 3;
+    size_t num_coefficients = batch.num_elements() * 2 * per_form;
+    Vector<uint64_t> data_offsets(num_coefficients);
+    uint64_t last_offset = 0;
+    for (size_t i = 0; i < batch.num_elements(); i++)
+    {
+        for (size_t j = 0; j < 2 * per_form; j++)
+        {
+            mpz_t view;
+            mpz_srcptr x = batch.coefficient(i, (j / per_form) * 3 + j % per_form, view);
+            data_offsets[i * 2 * per_form + j] = last_offset | (mpz_sgn(x) < 0 ? sign_bit : (uint64_t)(0));
+            last_offset += mpz_sizeinbase(x, 2) / 8 + 1;
+        }
+    }
+    size_t header_size = 4 + 4 * batch.ndim() + 8 * num_coefficients;
+    String data(header_size + last_offset, 0);
+    char *data_ptr = data.data();
+    uint32_t ndim = (uint32_t)(batch.ndim()) | (compress_tensor_forms ? COMPRESSED_FORMS_BIT : 0);
+    memcpy(data_ptr, &ndim, 4);
+    data_ptr += 4;
+    for (size_t i = 0; i < batch.ndim(); i++)
+    {
+        uint32_t dim = batch.shape()[i];
+        memcpy(data_ptr, &dim, 4);
+        data_ptr += 4;
+    }
+    memcpy(data_ptr, data_offsets.data(), 8 * num_coefficients);
+    data_ptr += 8 * num_coefficients;
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < batch.num_elements(); i++)
+    {
+        for (size_t j = 0; j < 2 * per_form; j++)
+        {
+            mpz_t view;
+            mpz_srcptr x = batch.coefficient(i, (j / per_form) * 3 + j % per_form, view);
+            mpz_export(data_ptr + (data_offsets[i * 2 * per_form + j] & ~sign_bit), NULL, -1, 1, -1, 0, x);
+        }
+    }
+    return data;
+}
+
 inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::deserialize_ciphertext_tensor(const String &data) const
 {
+    if (is_tensor_stream(data))
+    {
+        return read_tensor_stream<CPUCryptoSystem::CipherText>(data);
+    }
+    if (is_compressed_forms(data))
+    {
+        // c1 lives in Cl_G, c2 in Cl_Delta
+        Vector<size_t> shape;
+        auto forms = deserialize_compressed_forms(data, {&hsm2k.Cl_G().discriminant(), &hsm2k.Cl_Delta().discriminant()}, shape);
+        Tensor<CPUCryptoSystem::CipherText *> ciphertexts(shape, nullptr);
+        ciphertexts.flatten();
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ciphertexts.num_elements(); i++)
+        {
+            ciphertexts.at(i) = new CPUCryptoSystem::CipherText(std::move(forms[i * 2]), std::move(forms[i * 2 + 1]));
+        }
+        ciphertexts.reshape(shape);
+        return ciphertexts;
+    }
     uint32_t ndim;
     const char *data_ptr = data.data();
     memcpy(&ndim, data_ptr, 4);
@@ -512,6 +992,13 @@ inline String CPUCryptoSystem::serialize_part_decryption_result_tensor(const Ten
     uint32_t ndim = pdr_cpu.ndim();
     auto pdr_cpu_flattened = pdr_cpu;
     pdr_cpu_flattened.flatten();
+    if (compress_tensor_forms)
+    {
+        Vector<const BICYCL::QFI *> forms(pdr_cpu.num_elements());
+        for (size_t i = 0; i < pdr_cpu.num_elements(); i++)
+            forms[i] = pdr_cpu_flattened.at(i);
+        return serialize_compressed_forms(pdr_cpu.shape(), forms);
+    }
     size_t data_size = 4 + 4 * ndim + 8 * pdr_cpu.num_elements() * 3;
     std::vector<uint64_t> data_offsets(pdr_cpu.num_elements() * 3);
     uint64_t last_offset = 0;
@@ -559,6 +1046,20 @@ inline String CPUCryptoSystem::serialize_part_decryption_result_tensor(const Ten
 
 inline Tensor<CPUCryptoSystem::PartDecryptionResult *> CPUCryptoSystem::deserialize_part_decryption_result_tensor(const String &data) const
 {
+    if (is_compressed_forms(data))
+    {
+        // partial decryptions are lifted to Cl_Delta
+        Vector<size_t> shape;
+        auto forms = deserialize_compressed_forms(data, {&hsm2k.Cl_Delta().discriminant()}, shape);
+        Tensor<CPUCryptoSystem::PartDecryptionResult *> part_decryption_results(shape, nullptr);
+        part_decryption_results.flatten();
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < part_decryption_results.num_elements(); i++)
+        {
+            part_decryption_results.at(i) = new CPUCryptoSystem::PartDecryptionResult(std::move(forms[i]));
+        }
+        part_decryption_results.reshape(shape);
+        return part_decryption_results;
+    }
     uint32_t ndim;
     const char *data_ptr = data.data();
     memcpy(&ndim, data_ptr, 4);
@@ -632,4 +1133,37 @@ inline Tensor<CPUCryptoSystem::PartDecryptionResult *> CPUCryptoSystem::deserial
     }
     part_decryption_results.reshape(shape_vec);
     return part_decryption_results;
-}
\ No newline at end of file
+}
+
+inline void CPUCryptoSystem::save_ciphertext_tensor(const String &path, const Tensor<CPUCryptoSystem::CipherText *> &ct) const
+{
+    if (ct.num_elements() == 0)
+    {
+        throw std::invalid_argument("Cannot save an empty ciphertext tensor");
+    }
+    String data = this->serialize_ciphertext_tensor_uncompressed(ct);
+    // written next to the target and renamed, a reader never maps a partial file
+    String tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file.write(CIPHERTEXT_TENSOR_FILE_MAGIC, sizeof(CIPHERTEXT_TENSOR_FILE_MAGIC));
+        file.write(data.data(), data.size());
+        file.close();
+        if (!file)
+        {
+            std::remove(tmp_path.c_str());
+            throw std::runtime_error("Cannot write " + tmp_path);
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        int err = errno;
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Cannot rename " + tmp_path + " to " + path + ": " + std::strerror(err));
+    }
+}
+
+inline std::shared_ptr<MappedCiphertextTensor> CPUCryptoSystem::open_ciphertext_tensor(const String &path) const
+{
+    return std::make_shared<MappedCiphertextTensor>(path);
+}
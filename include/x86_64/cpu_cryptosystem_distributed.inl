@@ -1,244 +1,193 @@
 template <typename T>
 using Array = std::vector<T>;
 
-template <typename T>
-using Matrix = Vector<Vector<T>>;
-
-struct AccessStructure
+// Integer Shamir sharing with Shoup's scaled Lagrange coefficients. With
+// delta = n!, party i (0 based) holds f(i + 1) for a polynomial f of degree
+// t - 1 over the integers with f(0) = sk, and any t parties recover
+// delta . sk = sum_i (delta . L_i(0)) . f(i + 1), the scaled coefficients being
+// integers. Each party holds one share and a decryption combines t of them,
+// the class group order being unknown there is no reduction to rely on.
+//
+// The combine gets f^(delta . m) and not f^m. The secret key is drawn as for
+// keygen(), restricting it to multiples of delta would fix its low bits mod 2^k
+// and with them the low bits of m that pk^r hides. delta is carried in the
+// plaintext instead: the class group has CoFHE_THRESHOLD_DELTA_BITS plaintext
+// bits over k, delta = 2^e . o with e <= CoFHE_THRESHOLD_DELTA_BITS and o odd, so
+// delta . m mod 2^(k + e) still determines m mod 2^k.
+BICYCL::Mpz shamir_delta(size_t num_parties)
 {
-    int t;
-    int n;
-    AccessStructure(int t = 0, int n = 0) : t(t), n(n) {}
-};
+    BICYCL::Mpz delta((unsigned long)(1));
+    for (size_t i = 2; i <= num_parties; i++)
+        BICYCL::Mpz::mul(delta, delta, BICYCL::Mpz((unsigned long)(i)));
+    return delta;
+}
 
-typedef struct
+// the power of two in num_parties!, num_parties minus its number of one bits
+size_t shamir_delta_twos(size_t num_parties)
 {
-    Matrix<int> M;
-    Matrix<int> Sie;
-    int rows;
-    int cols;
-} ISP;
+    size_t ones = 0;
+    for (size_t n = num_parties; n != 0; n >>= 1)
+        ones += n & 1;
+    return num_parties - ones;
+}
 
-Matrix<int> compute_M_OR(const Matrix<int> &Ma, const Matrix<int> &Mb)
+void check_threshold_parties(size_t num_parties)
 {
-    int da = Ma.size();
-    int ea = Ma[0].size();
-    int db = Mb.size();
-    int eb = Mb[0].size();
-
-    int M_OR_rows = da + db;
-    int M_OR_cols = ea + eb - 1;
-
-    Matrix<int> M_OR(M_OR_rows, Vector<int>(M_OR_cols, 0));
-
-    // Fill in the first column with concatenated c(a) and c(b)
-    for (int i = 0; i < da; ++i)
-    {
-        M_OR[i][0] = Ma[i][0];
-    }
-    for (int i = 0; i < db; ++i)
+    if (num_parties == 0 || shamir_delta_twos(num_parties) > CoFHE_THRESHOLD_DELTA_BITS)
     {
-        M_OR[da + i][0] = Mb[i][0];
+        throw std::invalid_argument("Number of parties not supported by CoFHE_THRESHOLD_DELTA_BITS");
     }
-
-    // Fill the remaining columns for Ma with db trailing zeros
-    for (int i = 0; i < da; ++i)
-    {
-        for (int j = 1; j < ea; ++j)
-        {
-            M_OR[i][j] = Ma[i][j];
-        }
-    }
-
-    // Fill the remaining columns for Mb with da leading zeros
-    for (int i = 0; i < db; ++i)
-    {
-        for (int j = 1; j < eb; ++j)
-        {
-            M_OR[da + i][ea + j - 1] = Mb[i][j];
-        }
-    }
-
-    return M_OR;
 }
 
-Matrix<int> compute_M_AND(const Matrix<int> &Ma, const Matrix<int> &Mb)
+// the polynomial coefficients are drawn below delta^2 . secretkey_bound . 2^sigma, so the
+// shares of any t - 1 parties are within 2^-sigma of independent of sk
+BICYCL::Mpz shamir_coefficient_bound(const BICYCL::CL_HSM2k &hsm2k, size_t num_parties)
 {
-    int da = Ma.size();
-    int ea = Ma[0].size();
-    int db = Mb.size();
-    int eb = Mb[0].size();
-
-    int M_AND_rows = da + db;
-    int M_AND_cols = ea + eb;
-
-    Matrix<int> M_AND(M_AND_rows, Vector<int>(M_AND_cols, 0));
-
-    // Fill in the first column with c(a) following db zeros & second column with
-    // c(a) concatenated c(b)
-    for (int i = 0; i < da; ++i)
-    {
-        M_AND[i][0] = Ma[i][0];
-        M_AND[i][1] = Ma[i][0];
-    }
-    for (int i = 0; i < db; ++i)
-    {
-        M_AND[da + i][1] = Mb[i][0];
-    }
-
-    // Fill the remaining columns for Ma with db trailing zeros
-    for (int i = 0; i < da; ++i)
-    {
-        for (int j = 1; j < ea; ++j)
-        {
-            M_AND[i][j + 1] = Ma[i][j];
-        }
-    }
-
-    // Fill the remaining columns for Mb with da leading zeros
-    for (int i = 0; i < db; ++i)
-    {
-        for (int j = 1; j < eb; ++j)
-        {
-            M_AND[da + i][ea + j] = Mb[i][j];
-        }
-    }
-
-    return M_AND;
+    BICYCL::Mpz delta = shamir_delta(num_parties), bound;
+    BICYCL::Mpz::mul(bound, delta, delta);
+    BICYCL::Mpz::mul(bound, bound, hsm2k.secretkey_bound());
+    mpz_t b;
+    mpz_init(b);
+    mpz_mul_2exp(b, (mpz_srcptr)(bound), CoFHE_SHAMIR_STATISTICAL_SECURITY);
+    return BICYCL::Mpz(std::move(b));
 }
 
-Matrix<int> generate_distribution_matrix_M(int n, int t,
-                                           int threshold_combinations)
+// m mod 2^k out of delta . m mod 2^(k + e): the e low bits are zero, shift them
+// out and multiply by the inverse of the odd part of delta mod 2^k
+class ShamirDelta
 {
-    // See https://cs.au.dk/fileadmin/site_files/cs/PhD/PhD_Dissertations__pdf/Thesis-RIT.pdf
-    // Section 3.3.1 : Page 24,25,26
-    Matrix<int> Mu{{1}};
-    Matrix<int> Mt = Mu;
-
-    for (int i = 1; i < t; i++)
+public:
+    ShamirDelta(size_t num_parties, size_t k) : delta_m(shamir_delta(num_parties)), twos_m(shamir_delta_twos(num_parties)), k_m(k)
     {
-        Mt = compute_M_AND(Mt, Mu);
+        check_threshold_parties(num_parties);
+        mpz_t odd, modulus, inverse;
+        mpz_inits(odd, modulus, inverse, NULL);
+        mpz_fdiv_q_2exp(odd, (mpz_srcptr)(delta_m), twos_m);
+        mpz_setbit(modulus, k_m);
+        mpz_invert(inverse, odd, modulus);
+        odd_inverse_m = BICYCL::Mpz(std::move(inverse));
+        mpz_clears(odd, modulus, NULL);
     }
 
-    Matrix<int> M = Mt;
-    for (int i = 1; i < threshold_combinations; i++)
+    const BICYCL::Mpz &delta() const { return delta_m; }
+
+    BICYCL::Mpz unscale(const BICYCL::Mpz &x) const
     {
-        M = compute_M_OR(M, Mt);
+        mpz_t m;
+        mpz_init(m);
+        mpz_fdiv_q_2exp(m, (mpz_srcptr)(x), twos_m);
+        mpz_mul(m, m, (mpz_srcptr)(odd_inverse_m));
+        mpz_fdiv_r_2exp(m, m, k_m);
+        return BICYCL::Mpz(std::move(m));
     }
-    return M;
-}
 
-ISP generate_isp(const AccessStructure &A)
+private:
+    BICYCL::Mpz delta_m;
+    size_t twos_m;
+    size_t k_m;
+    BICYCL::Mpz odd_inverse_m;
+};
+
+Array<BICYCL::Mpz> get_shamir_shares(const BICYCL::CL_HSM2k &hsm2k,
+                                     const RandomStreams &randgen, const BICYCL::Mpz &secret,
+                                     size_t threshold, size_t num_parties)
 {
-    int n = A.n, t = A.t;
-    int threshold_combinations = nCr(n, t);
-    Matrix<int> M = generate_distribution_matrix_M(n, t, threshold_combinations);
+    BICYCL::Mpz bound = shamir_coefficient_bound(hsm2k, num_parties);
+    Array<BICYCL::Mpz> coefficients(threshold);
+    coefficients[0] = secret;
+    for (size_t j = 1; j < threshold; j++)
+        coefficients[j] = randgen.random_mpz(bound);
 
-    // Create the mapping between the rows of M and the threshold combinations of parties (parties are represented by numbers staring from 0)
-    // ith row of Sie contains the row indexes of M corresponding to ith threshold combination of parties when sorted
-    Matrix<int> Sie(threshold_combinations, Array<int>(t, 0));
-    int M_row_num = 0;
-    for (int i = 0; i < threshold_combinations; i++)
+    Array<BICYCL::Mpz> shares(num_parties);
+    for (size_t i = 0; i < num_parties; i++)
     {
-        for (int j = 0; j < t; j++)
+        BICYCL::Mpz x((unsigned long)(i + 1));
+        shares[i] = coefficients[threshold - 1];
+        for (size_t j = threshold - 1; j-- > 0;)
         {
-            Sie[i][j] = M_row_num++;
+            BICYCL::Mpz::mul(shares[i], shares[i], x);
+            BICYCL::Mpz::add(shares[i], shares[i], coefficients[j]);
         }
     }
-
-    ISP isp;
-    isp.M = M;
-    isp.Sie = Sie;
-    isp.rows = M.size();
-    isp.cols = M[0].size();
-
-    return isp;
+    return shares;
 }
 
-// Function to compute rho: ρ := (secret, ρ2, . . . , ρe)⊤; (ρ2, . . . , ρe) ←− [2^(l0+λ), 2^(l0+λ)]^(e−1)
-Array<BICYCL::Mpz> compute_rho(const BICYCL::Mpz &secret, int e, const BICYCL::CL_HSM2k &hsm2k, BICYCL::RandGen &randgen)
+// delta . L_i(0) for the parties that answered, in the order of their partial decryptions
+Array<BICYCL::Mpz> compute_lambda(const Vector<size_t> &parties, size_t num_parties)
 {
-    Array<BICYCL::Mpz> rho(e);
-    rho[0] = secret; // Set ρ(0) = s as per the algorithm
-    for (int i = 1; i < e; i++)
+    for (size_t i = 0; i < parties.size(); i++)
     {
-        rho[i] = randgen.random_mpz(
-            hsm2k.encrypt_randomness_bound()); // This should be random value in
-                                               // range [-2^(l0+λ), 2^(l0+λ)]^(e−1)
+        if (parties[i] >= num_parties)
+            throw std::invalid_argument("Party index out of range");
+        for (size_t j = 0; j < i; j++)
+            if (parties[i] == parties[j])
+                throw std::invalid_argument("Duplicate party in partial decryptions");
     }
-    return rho;
-}
-
-Matrix<BICYCL::Mpz> compute_shares(const ISP &isp, const Array<BICYCL::Mpz> &rho)
-{
-    // See https://eprint.iacr.org/2022/1143.pdf Algorithm 8
-    Matrix<int> M = isp.M;
-    Matrix<int> Sie = isp.Sie;
-    int rows = isp.rows, cols = isp.cols;
-
-    // Shares are computed for each party as per mapping
-    // Shares are stored in the same way as Sie.
-    // ith row of shares matrix contains shares of parties corresponding to ith threshold combination of parties when sorted
-    Matrix<BICYCL::Mpz> shares;
-    for (auto Sp : Sie)
+    BICYCL::Mpz delta = shamir_delta(num_parties);
+    Array<BICYCL::Mpz> lambda(parties.size());
+    for (size_t i = 0; i < parties.size(); i++)
     {
-        Array<BICYCL::Mpz> si;
-        for (int i : Sp)
+        BICYCL::Mpz num(delta), den((unsigned long)(1));
+        for (size_t j = 0; j < parties.size(); j++)
         {
-            BICYCL::Mpz sij(BICYCL::Mpz((unsigned long)(0)));
-            if (i != -1)
-            {
-                for (int j = 0; j < cols; j++)
-                {
-                    BICYCL::Mpz mult;
-                    sij.mul(mult, rho[j], BICYCL::Mpz((unsigned long)(M[i][j])));
-                    sij.add(sij, sij, mult);
-                }
-            }
-            si.push_back(sij);
+            if (j == i)
+                continue;
+            BICYCL::Mpz::mul(num, num, BICYCL::Mpz((unsigned long)(parties[j] + 1)));
+            BICYCL::Mpz::mul(den, den, BICYCL::Mpz((long)(parties[j]) - (long)(parties[i])));
         }
-        shares.push_back(si);
+        mpz_t q;
+        mpz_init(q);
+        mpz_divexact(q, (mpz_srcptr)(num), (mpz_srcptr)(den));
+        lambda[i] = BICYCL::Mpz(std::move(q));
     }
-    return shares;
-}
-
-Matrix<BICYCL::Mpz> get_shares(const BICYCL::CL_HSM2k &hsm2k,
-                                BICYCL::RandGen &randgen, const ISP &isp,
-                               const BICYCL::Mpz& secret)
-{
-    Array<BICYCL::Mpz> rho = compute_rho(secret, isp.cols, hsm2k, randgen);
-    return compute_shares(isp, rho);
+    return lambda;
 }
 
-// Function to compute λ for one threshold combination
-Array<BICYCL::Mpz> compute_lambda(int t)
+// c2^delta . d^-1 = f^(delta . m) with d = prod ds[i]^lambda[i] folded in, so no
+// separate d is built. A coefficient of +-1 is an inversion or a plain
+// composition instead of an exponentiation.
+BICYCL::QFI combine_d(const BICYCL::CL_HSM2k &hsm2k, const BICYCL::QFI &c2,
+                      const BICYCL::QFI *const *ds, size_t count, const Array<BICYCL::Mpz> &lambda, const ShamirDelta &delta)
 {
-    // See https://cs.au.dk/fileadmin/site_files/cs/PhD/PhD_Dissertations__pdf/Thesis-RIT.pdf
-    // Lemma 3.2, Page 26,27
-
-    // One threshold combination contains each party once with just & operator between them
-    // Ex, consider t = 4, threshold combination = x1 & x2 & x3 & x4
-    // From the Lemma 3.2 of above mentioned doc, lambda(f1 & f2) = [...lambda(f1), -(...lambda(f2))]
-    // Also, lambda(xi) = [1], So, lambda(x1 & x2) = [1, -1], lambda((x1 & x2) & x3) = [1, -1, -1] and so on.
-    Array<BICYCL::Mpz> lambda{BICYCL::Mpz((unsigned long)(1))};
-    for (int i = 0; i < t; i++)
+    const auto &Cl_Delta = hsm2k.Cl_Delta();
+    BICYCL::QFI r;
+    Cl_Delta.nupow(r, c2, delta.delta());
+    for (size_t i = 0; i < count; i++)
     {
-        lambda.push_back(BICYCL::Mpz((long)(-1)));
+        int sgn = lambda[i].sgn();
+        if (sgn == 0)
+            continue;
+        if (mpz_cmpabs_ui((mpz_srcptr)(lambda[i]), 1) == 0)
+        {
+            if (sgn > 0)
+                Cl_Delta.nucompinv(r, r, *ds[i]);
+            else
+                Cl_Delta.nucomp(r, r, *ds[i]);
+            continue;
+        }
+        BICYCL::Mpz e(lambda[i]);
+        if (sgn < 0)
+            e.neg();
+        BICYCL::QFI di;
+        Cl_Delta.nupow(di, *ds[i], e);
+        if (sgn > 0)
+            Cl_Delta.nucompinv(r, r, di);
+        else
+            Cl_Delta.nucomp(r, r, di);
     }
-    return lambda;
+    return r;
 }
 
-BICYCL::QFI compute_d(const BICYCL::CL_HSM2k &hsm2k, const Array<BICYCL::QFI> &ds,
-                      const Array<BICYCL::Mpz> &lambda)
+BICYCL::QFI partDecrypt(const BICYCL::CL_HSM2k &hsm2k,
+                        const BICYCL::CL_HSM2k::CipherText &ct, const QFIRecodedExponent &ski)
 {
-    BICYCL::QFI d;
-    for (int i = 0; i < ds.size(); i++)
-    {
-        BICYCL::QFI r;
-        hsm2k.Cl_G().nupow(r, ds[i], lambda[i]);
-        hsm2k.Cl_G().nucomp(d, d, r);
-    }
-    return d;
+    // same as below with the recoding of the share done once
+    BICYCL::QFI di;
+    ski.power(hsm2k.Cl_G(), di, ct.c1());
+    if (hsm2k.compact_variant())
+        hsm2k.from_Cl_DeltaK_to_Cl_Delta(di);
+
+    return di;
 }
 
 BICYCL::QFI partDecrypt(const BICYCL::CL_HSM2k &hsm2k,
@@ -253,67 +202,59 @@ BICYCL::QFI partDecrypt(const BICYCL::CL_HSM2k &hsm2k,
     return di;
 }
 
-BICYCL::CL_HSM2k::ClearText finalDecrypt(const BICYCL::CL_HSM2k &hsm2k,
-                                         const BICYCL::CL_HSM2k::CipherText &ct,
-                                         const Array<BICYCL::QFI> &ds)
+BICYCL::Mpz finalDecrypt(const BICYCL::CL_HSM2k &hsm2k,
+                         const BICYCL::CL_HSM2k::CipherText &ct,
+                         const Array<BICYCL::QFI> &ds,
+                         const Array<BICYCL::Mpz> &lambda,
+                         const ShamirDelta &delta)
 {
     // See https://eprint.iacr.org/2022/1143.pdf Algorithm 11
 
-    Array<BICYCL::Mpz> lambda = compute_lambda(ds.size());
-
-    BICYCL::QFI d = compute_d(hsm2k, ds, lambda);
+    Array<const BICYCL::QFI *> ds_ptrs(ds.size());
+    for (size_t i = 0; i < ds.size(); i++)
+        ds_ptrs[i] = &ds[i];
+    BICYCL::QFI r = combine_d(hsm2k, ct.c2(), ds_ptrs.data(), ds.size(), lambda, delta); /* c2^delta . d^-1 */
 
-    BICYCL::QFI r;
-    hsm2k.Cl_Delta().nucompinv(r, ct.c2(), d); /* c2 . d^-1 */
-
-    return BICYCL::CL_HSM2k::ClearText(hsm2k, hsm2k.dlog_in_F(r));
+    return delta.unscale(hsm2k.dlog_in_F(r));
 }
 
-Vector<size_t> get_next_lexio_combination(Vector<size_t> &current_combination, int n, int t)
+inline CPUCryptoSystem::SecretKey CPUCryptoSystem::threshold_keygen(size_t num_parties) const
 {
-    Vector<size_t> next_combination = current_combination;
-    int j = t - 1;
-    while (j >= 0 && next_combination[j] == n - t + j)
-    {
-        j--;
-    }
-    if (j >= 0)
-    {
-        next_combination[j]++;
-        for (int k = j + 1; k < t; k++)
-        {
-            next_combination[k] = next_combination[j] + k - j;
-        }
-    }
-    return next_combination;
+    // any key can be shared, delta goes into the plaintext and not into sk
+    check_threshold_parties(num_parties);
+    return this->keygen();
 }
 
 inline Vector<Vector<CPUCryptoSystem::SecretKeyShare>> CPUCryptoSystem::keygen(const CPUCryptoSystem::SecretKey& sk,  size_t threshold,size_t num_parties) const
 {
-    auto isp = generate_isp(AccessStructure(threshold, num_parties));
-    auto shares = get_shares(hsm2k, rand_gen, isp, sk);
-    // contains shares of each party for each threshold combination
-    Vector<Vector<CPUCryptoSystem::SecretKeyShare>> secret_key_shares(num_parties);
-    Vector<size_t> current_threshold_combination(num_parties, 0);
-    for (size_t i = 0; i < num_parties; i++)
-        current_threshold_combination[i] = i;
-    for (size_t i = 0; i < nCr(num_parties, threshold); i++)
+    if (threshold == 0 || threshold > num_parties)
     {
-        for (size_t j = 0; j < threshold; j++)
-        {
-            secret_key_shares[current_threshold_combination[j]].push_back(shares[i][j]);
-        }
-        current_threshold_combination = get_next_lexio_combination(current_threshold_combination, num_parties, threshold);
+        throw std::invalid_argument("Invalid threshold");
     }
+    check_threshold_parties(num_parties);
+    auto shares = get_shamir_shares(hsm2k, *random_streams, sk, threshold, num_parties);
+    // one share per party
+    Vector<Vector<CPUCryptoSystem::SecretKeyShare>> secret_key_shares(num_parties);
+    for (size_t i = 0; i < num_parties; i++)
+        secret_key_shares[i].push_back(shares[i]);
     return secret_key_shares;
 }
 
 inline CPUCryptoSystem::PartDecryptionResult CPUCryptoSystem::part_decrypt(const CPUCryptoSystem::SecretKeyShare &sks, const CPUCryptoSystem::CipherText &ct) const
+{
+    return this->part_decrypt(QFIRecodedExponent(sks), ct);
+}
+
+inline CPUCryptoSystem::PartDecryptionResult CPUCryptoSystem::part_decrypt(const QFIRecodedExponent &sks, const CPUCryptoSystem::CipherText &ct) const
 {
     return partDecrypt(hsm2k, ct, sks);
 }
 
-inline CPUCryptoSystem::PlainText CPUCryptoSystem::combine_part_decryption_results(const CPUCryptoSystem::CipherText &ct, const Vector<CPUCryptoSystem::PartDecryptionResult> &pdrs) const
+inline CPUCryptoSystem::PlainText CPUCryptoSystem::combine_part_decryption_results(const CPUCryptoSystem::CipherText &ct, const Vector<CPUCryptoSystem::PartDecryptionResult> &pdrs, const Vector<size_t> &parties, size_t num_parties) const
 {
-    return this->to_mpz(finalDecrypt(hsm2k, ct, pdrs));
+    if (parties.size() != pdrs.size())
+    {
+        throw std::invalid_argument("One party index per partial decryption is required");
+    }
+    return finalDecrypt(hsm2k, ct, pdrs, compute_lambda(parties, num_parties), ShamirDelta(num_parties, k));
 }
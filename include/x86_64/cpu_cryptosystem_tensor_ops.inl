@@ -4,12 +4,8 @@ inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::encrypt_tensor(con
     auto pt_cpu_flattened = pt_cpu;
     pt_cpu_flattened.flatten();
     ct_cpu.flatten();
-    auto r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI c1, pkr;
-    hsm2k.power_of_h(c1, r);
-    pk_cpu.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk_cpu, c1, pkr);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < pt_cpu.num_elements(); i++)
     {
         ct_cpu.at(i) = new CPUCryptoSystem::CipherText(hsm2k, this->to_plaintext(*pt_cpu_flattened[i]), c1, pkr);
@@ -24,9 +20,10 @@ inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::decrypt_tensor(cons
     auto ct_cpu_flattened = ct_cpu;
     ct_cpu_flattened.flatten();
     pt_cpu.flatten();
+    const QFIRecodedExponent sk_recoded(sk_cpu);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct_cpu.num_elements(); i++)
     {
-        pt_cpu[i] = new CPUCryptoSystem::PlainText(this->decrypt(sk_cpu, *ct_cpu_flattened[i]));
+        pt_cpu[i] = new CPUCryptoSystem::PlainText(this->decrypt(sk_recoded, *ct_cpu_flattened[i]));
     }
     pt_cpu.reshape(ct_cpu.shape());
     return pt_cpu;
@@ -38,35 +35,45 @@ inline Tensor<CPUCryptoSystem::PartDecryptionResult *> CPUCryptoSystem::part_dec
     auto ct_cpu_flattened = ct_cpu;
     ct_cpu_flattened.flatten();
     pdr_cpu.flatten();
+    const QFIRecodedExponent sks_recoded(sks_cpu);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct_cpu.num_elements(); i++)
     {
-        pdr_cpu[i] = new CPUCryptoSystem::PartDecryptionResult(this->part_decrypt(sks_cpu, *ct_cpu_flattened[i]));
+        pdr_cpu[i] = new CPUCryptoSystem::PartDecryptionResult(this->part_decrypt(sks_recoded, *ct_cpu_flattened[i]));
     }
     pdr_cpu.reshape(ct_cpu.shape());
     return pdr_cpu;
 };
 
 inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_tensor(const Tensor<CPUCryptoSystem::CipherText *> &ct_cpu,
-                                                                                                    const Vector<Tensor<CPUCryptoSystem::PartDecryptionResult *>> &pdrs_cpu) const
+                                                                                                    const Vector<Tensor<CPUCryptoSystem::PartDecryptionResult *>> &pdrs_cpu,
+                                                                                                    const Vector<size_t> &parties, size_t num_parties) const
 {
+    if (parties.size() != pdrs_cpu.size())
+    {
+        throw std::invalid_argument("One party index per partial decryption is required");
+    }
     Tensor<CPUCryptoSystem::PlainText *> pt_cpu(pdrs_cpu[0].shape(), nullptr);
     auto ct_cpu_flattened = ct_cpu;
     ct_cpu_flattened.flatten();
-    Vector<Tensor<CPUCryptoSystem::PartDecryptionResult *>> pdrs_cpu_flattened;
-    for (size_t i = 0; i < pdrs_cpu.size(); i++)
-    {
-        pdrs_cpu_flattened.push_back(pdrs_cpu[i]);
-        pdrs_cpu_flattened[i].flatten();
-    }
     pt_cpu.flatten();
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct_cpu.num_elements(); i++)
+    // the coefficients depend on the party set only, not on the element
+    size_t t = pdrs_cpu.size(), num_elements = ct_cpu.num_elements();
+    Array<BICYCL::Mpz> lambda = compute_lambda(parties, num_parties);
+    ShamirDelta delta(num_parties, k);
+    Vector<const CPUCryptoSystem::PartDecryptionResult *> ds(num_elements * t);
+    for (size_t j = 0; j < t; j++)
     {
-        Vector<CPUCryptoSystem::PartDecryptionResult> pdrs_vec(pdrs_cpu.size());
-        for (size_t j = 0; j < pdrs_cpu.size(); j++)
+        auto pdrs_flattened = pdrs_cpu[j];
+        pdrs_flattened.flatten();
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
         {
-            pdrs_vec[j] = *pdrs_cpu_flattened[j][i];
+            ds[i * t + j] = pdrs_flattened[i];
         }
-        pt_cpu[i] = new CPUCryptoSystem::PlainText(this->combine_part_decryption_results(*ct_cpu_flattened[i], pdrs_vec));
+    }
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
+    {
+        BICYCL::QFI r = combine_d(hsm2k, ct_cpu_flattened[i]->c2(), ds.data() + i * t, t, lambda, delta);
+        pt_cpu[i] = new CPUCryptoSystem::PlainText(delta.unscale(hsm2k.dlog_in_F(r)));
     }
     pt_cpu.reshape(pdrs_cpu[0].shape());
     return pt_cpu;
@@ -134,59 +141,46 @@ inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::negate_plaintext_te
 
 inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::negate_ciphertext_tensor(const CPUCryptoSystem::PublicKey &pk, const Tensor<CPUCryptoSystem::CipherText *> &ct) const
 {
-    auto s = this->make_plaintext(-1);
     auto cts = ct;
     cts.flatten();
     Tensor<CPUCryptoSystem::CipherText *> res(ct.shape(), nullptr);
     res.flatten();
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(cts.size());
     Vector<BICYCL::QFI> hr_vec(cts.size()), pkr_vec(cts.size());
     // see the comment in add_ciphertext_vectors
+    uint64_t first_stream = random_streams->reserve(cts.size());
+    auto tables = this->encryption_tables(pk);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
     (void)(pk);
 #endif
-    auto Cl_G = hsm2k.Cl_G();
-    auto Cl_Delta = hsm2k.Cl_Delta();
+    // the inverse of (a, b, c) is (a, -b, c), no need to exponentiate by 2^k - 1
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.num_elements(); i++)
     {
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
         BICYCL::QFI c1(hr), c2(pkr);
-        Cl_G.nupow(c1, cts.at(i)->c1(), s);
-        Cl_G.nucomp(c1, c1, hr);
-        Cl_Delta.nupow(c2, cts.at(i)->c2(), s);
-        Cl_Delta.nucomp(c2, c2, pkr);
+        hsm2k.Cl_G().nucompinv(c1, c1, cts.at(i)->c1());
+        hsm2k.Cl_Delta().nucompinv(c2, c2, cts.at(i)->c2());
 #else
         BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
-        Cl_G.nupow(c1, cts.at(i)->c1(), s);
-        Cl_G.nucomp(c1, c1, hr_vec[i]);
-        Cl_Delta.nupow(c2, cts.at(i)->c2(), s);
-        Cl_Delta.nucomp(c2, c2, pkr_vec[i]);
+        hsm2k.Cl_G().nucompinv(c1, c1, cts.at(i)->c1());
+        hsm2k.Cl_Delta().nucompinv(c2, c2, cts.at(i)->c2());
 #endif
 #else
-        BICYCL::QFI c1, c2;
-        Cl_G.nupow(c1, cts.at(i)->c1(), s);
-        Cl_Delta.nupow(c2, cts.at(i)->c2(), s);
+        BICYCL::QFI c1(cts.at(i)->c1()), c2(cts.at(i)->c2());
+        c1.neg();
+        c2.neg();
 #endif
         res.at(i) = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
     }
@@ -211,26 +205,19 @@ inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::add_ciphertext_ten
     Tensor<CPUCryptoSystem::CipherText *> res_vec({ct1_cpu.num_elements()}, nullptr);
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk_cpu.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk_cpu, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(ct1.size());
-    Vector<BICYCL::QFI> hr_vec(ct1.size()), pkr_vec(ct1.size());
+    Vector<BICYCL::QFI> hr_vec(ct1_cpu.num_elements()), pkr_vec(ct1_cpu.num_elements());
     // Batch optimization can be done similiar to other nupow
     // port the precomputation version of nupow
     // Although do we need to do this?
     // As at this hierarchy, we can do parallelization
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct1.size(); i++)
+    uint64_t first_stream = random_streams->reserve(ct1_cpu.num_elements());
+    auto tables = this->encryption_tables(pk_cpu);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct1_cpu.num_elements(); i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk_cpu.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
@@ -266,6 +253,129 @@ inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::add_ciphertext_ten
     return res_vec;
 };
 
+inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::subtract_ciphertext_tensors(const PublicKey &pk_cpu, const Tensor<CPUCryptoSystem::CipherText *> &ct1_cpu_, const Tensor<CPUCryptoSystem::CipherText *> &ct2_cpu_) const
+{
+    if (ct1_cpu_.is_zero_degree() && ct2_cpu_.is_zero_degree())
+    {
+        return Tensor<CPUCryptoSystem::CipherText *>(new CPUCryptoSystem::CipherText(this->subtract_ciphertexts(pk_cpu, *ct1_cpu_.get_value(), *ct2_cpu_.get_value())));
+    }
+    if (ct1_cpu_.shape() != ct2_cpu_.shape())
+    {
+        throw std::invalid_argument("Tensor shapes must be equal");
+    }
+    auto ct1_cpu = ct1_cpu_, ct2_cpu = ct2_cpu_;
+    auto res_shape = ct1_cpu.shape();
+    ct1_cpu.flatten();
+    ct2_cpu.flatten();
+    Tensor<CPUCryptoSystem::CipherText *> res_vec({ct1_cpu.num_elements()}, nullptr);
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+    BICYCL::QFI hr, pkr;
+    this->encryption_randomness(pk_cpu, hr, pkr);
+#else
+    Vector<BICYCL::QFI> hr_vec(ct1_cpu.num_elements()), pkr_vec(ct1_cpu.num_elements());
+    // see the comment in add_ciphertext_tensors
+    uint64_t first_stream = random_streams->reserve(ct1_cpu.num_elements());
+    auto tables = this->encryption_tables(pk_cpu);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct1_cpu.num_elements(); i++)
+    {
+        this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
+    }
+#endif
+#else
+    (void)(pk_cpu);
+#endif
+    auto Cl_G = hsm2k.Cl_G();
+    auto Cl_Delta = hsm2k.Cl_Delta();
+    auto num_elements = ct1_cpu.num_elements();
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
+    {
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+        BICYCL::QFI c1(hr), c2(pkr);
+        Cl_G.nucomp(c1, c1, ct1_cpu[i]->c1());
+        Cl_G.nucompinv(c1, c1, ct2_cpu[i]->c1());
+        Cl_Delta.nucomp(c2, c2, ct1_cpu[i]->c2());
+        Cl_Delta.nucompinv(c2, c2, ct2_cpu[i]->c2());
+#else
+        BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
+        Cl_G.nucomp(c1, c1, ct1_cpu[i]->c1());
+        Cl_G.nucompinv(c1, c1, ct2_cpu[i]->c1());
+        Cl_Delta.nucomp(c2, c2, ct1_cpu[i]->c2());
+        Cl_Delta.nucompinv(c2, c2, ct2_cpu[i]->c2());
+#endif
+#else
+        BICYCL::QFI c1, c2;
+        Cl_G.nucompinv(c1, ct1_cpu[i]->c1(), ct2_cpu[i]->c1());
+        Cl_Delta.nucompinv(c2, ct1_cpu[i]->c2(), ct2_cpu[i]->c2());
+#endif
+        res_vec[i] = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+    }
+    res_vec.reshape(res_shape);
+    return res_vec;
+};
+
+inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::add_plaintext_to_ciphertext_tensors(const PublicKey &pk_cpu, const Tensor<CPUCryptoSystem::PlainText *> &pt_cpu_, const Tensor<CPUCryptoSystem::CipherText *> &ct_cpu_) const
+{
+    if (pt_cpu_.is_zero_degree() && ct_cpu_.is_zero_degree())
+    {
+        return Tensor<CPUCryptoSystem::CipherText *>(new CPUCryptoSystem::CipherText(this->add_plaintext_to_ciphertext(pk_cpu, *pt_cpu_.get_value(), *ct_cpu_.get_value())));
+    }
+    if (pt_cpu_.shape() != ct_cpu_.shape())
+    {
+        throw std::invalid_argument("Tensor shapes must be equal");
+    }
+    auto pt_cpu = pt_cpu_;
+    auto ct_cpu = ct_cpu_;
+    auto res_shape = ct_cpu.shape();
+    pt_cpu.flatten();
+    ct_cpu.flatten();
+    Tensor<CPUCryptoSystem::CipherText *> res_vec({ct_cpu.num_elements()}, nullptr);
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+    BICYCL::QFI hr, pkr;
+    this->encryption_randomness(pk_cpu, hr, pkr);
+#else
+    Vector<BICYCL::QFI> hr_vec(ct_cpu.num_elements()), pkr_vec(ct_cpu.num_elements());
+    // see the comment in add_ciphertext_tensors
+    uint64_t first_stream = random_streams->reserve(ct_cpu.num_elements());
+    auto tables = this->encryption_tables(pk_cpu);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct_cpu.num_elements(); i++)
+    {
+        this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
+    }
+#endif
+#else
+    (void)(pk_cpu);
+#endif
+    auto Cl_G = hsm2k.Cl_G();
+    auto Cl_Delta = hsm2k.Cl_Delta();
+    auto num_elements = ct_cpu.num_elements();
+    // c2 * f^m, see add_plaintext_to_ciphertext
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
+    {
+        BICYCL::Mpz m;
+        BICYCL::Mpz::mod2k(m, *pt_cpu[i], k);
+        BICYCL::QFI fm = hsm2k.power_of_f(m);
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+        BICYCL::QFI c1(hr), c2(pkr);
+#else
+        BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
+#endif
+        Cl_G.nucomp(c1, c1, ct_cpu[i]->c1());
+        Cl_Delta.nucomp(c2, c2, ct_cpu[i]->c2());
+        Cl_Delta.nucomp(c2, c2, fm);
+#else
+        BICYCL::QFI c1(ct_cpu[i]->c1()), c2;
+        Cl_Delta.nucomp(c2, ct_cpu[i]->c2(), fm);
+#endif
+        res_vec[i] = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+    }
+    res_vec.reshape(res_shape);
+    return res_vec;
+}
+
 inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::scal_ciphertext_tensors(const CPUCryptoSystem::PublicKey &pk_cpu, const Tensor<CPUCryptoSystem::PlainText *> &s_cpu, const Tensor<CPUCryptoSystem::CipherText *> &cts) const
 {
     if (s_cpu.ndim() > 2 || cts.ndim() > 2)
@@ -286,177 +396,379 @@ inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::scal_ciphertext_te
         Tensor<CPUCryptoSystem::CipherText *> res_vec(cts.shape(), nullptr);
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-        BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
         BICYCL::QFI hr, pkr;
-        hsm2k.power_of_h(hr, r);
-        pk_cpu.exponentiation(hsm2k, pkr, r);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+        this->encryption_randomness(pk_cpu, hr, pkr);
 #else
-        Vector<BICYCL::Mpz> r_vec(cts.size());
         Vector<BICYCL::QFI> hr_vec(cts.size()), pkr_vec(cts.size());
         // Batch optimization can be done similiar to other nupow
         // port the precomputation version of nupow
         // Although do we need to do this?
         // As at this hierarchy, we can do parallelization
+        uint64_t first_stream = random_streams->reserve(cts.size());
+        auto tables = this->encryption_tables(pk_cpu);
         CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < cts.size(); i++)
         {
-            r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-            hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-            pk_cpu.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-            if (hsm2k.compact_variant())
-                hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+            this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
         }
 #endif
 #else
         (void)(pk_cpu);
 #endif
-        auto Cl_G = hsm2k.Cl_G();
-        auto Cl_Delta = hsm2k.Cl_Delta();
+        Vector<const CPUCryptoSystem::CipherText *> cts_vec(cts.size());
+        Vector<const CPUCryptoSystem::PlainText *> s_vec(cts.size());
+        for (size_t i = 0; i < cts.size(); i++)
+        {
+            cts_vec[i] = cts.at(i);
+            s_vec[i] = s_cpu.at(i);
+        }
+        Vector<BICYCL::QFI> c1_pows(cts.size()), c2_pows(cts.size());
+        this->scal_ciphertexts_grouped(cts_vec, s_vec, c1_pows.data(), c2_pows.data());
         CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < cts.size(); i++)
         {
+            BICYCL::QFI c1(std::move(c1_pows[i])), c2(std::move(c2_pows[i]));
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-            BICYCL::QFI c1(hr), c2(pkr);
-            Cl_G.nupow(c1, cts.at(i)->c1(), *s_cpu[i]);
-            Cl_G.nucomp(c1, c1, hr);
-            Cl_Delta.nupow(c2, cts.at(i)->c2(), *s_cpu[i]);
-            Cl_Delta.nucomp(c2, c2, pkr);
+            hsm2k.Cl_G().nucomp(c1, c1, hr);
+            hsm2k.Cl_Delta().nucomp(c2, c2, pkr);
 #else
-            BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
-            Cl_G.nupow(c1, cts.at(i)->c1(), *s_cpu[i]);
-            Cl_G.nucomp(c1, c1, hr_vec[i]);
-            Cl_Delta.nupow(c2, cts.at(i)->c2(), *s_cpu[i]);
-            Cl_Delta.nucomp(c2, c2, pkr_vec[i]);
+            hsm2k.Cl_G().nucomp(c1, c1, hr_vec[i]);
+            hsm2k.Cl_Delta().nucomp(c2, c2, pkr_vec[i]);
 #endif
-#else
-            BICYCL::QFI c1, c2;
-            Cl_G.nupow(c1, cts.at(i)->c1(), *s_cpu[i]);
-            Cl_Delta.nupow(c2, cts.at(i)->c2(), *s_cpu[i]);
 #endif
             res_vec.at(i)= new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
         }
         return res_vec;
     }
 
-    if (s_cpu.ndim() > 2 || cts.ndim() > 2)
+    // res[i][k] = prod_j cts[i][j]^s[j][k], each output one multi-exponentiation as in
+    // matmul_plaintext_ciphertext_tensors, with the roles of the operands swapped
+    if (s_cpu.ndim() != 2 || cts.ndim() != 2)
     {
-        throw std::invalid_argument("Tensors must be 0D, 1D or 2D for now");
+        throw std::invalid_argument("Tensors must both be vectors or both be matrices");
+    }
+    size_t n = cts.shape()[0], m = cts.shape()[1], p = s_cpu.shape()[1];
+    if (s_cpu.shape()[0] != m)
+    {
+        throw std::invalid_argument("Inner dimensions must be equal");
     }
     auto s_cpu_flattened = s_cpu;
     auto cts_flattened = cts;
     s_cpu_flattened.flatten();
     cts_flattened.flatten();
-    Tensor<CPUCryptoSystem::CipherText *> res_mat({cts.shape()[0], s_cpu.shape()[1]}, nullptr);
-    res_mat.flatten();
-    CPUCryptoSystem::CipherText zero = this->encrypt(pk_cpu, this->make_plaintext(0));
-    for (size_t i = 0; i < res_mat.num_elements(); i++)
+    // the signed exponents of a column of s are shared by the n outputs of that column, the bases
+    // of a row of cts by the p outputs of that row
+    Vector<BICYCL::Mpz> s_signed(p * m);
+    Vector<const BICYCL::Mpz *> s_ptrs(p * m);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < p * m; i++)
     {
-        res_mat[i] = new CPUCryptoSystem::CipherText(zero);
+        size_t k = i / m, j = i % m;
+        s_signed[i] = this->signed_scalar(*s_cpu_flattened.at(j * p + k));
+        s_ptrs[i] = &s_signed[i];
+    }
+    Vector<const BICYCL::QFI *> c1_rows(n * m), c2_rows(n * m);
+    for (size_t i = 0; i < n * m; i++)
+    {
+        c1_rows[i] = &cts_flattened.at(i)->c1();
+        c2_rows[i] = &cts_flattened.at(i)->c2();
     }
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk_cpu.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk_cpu, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(ct1.num_elements());
-    Vector<BICYCL::QFI> hr_vec(ct1.num_elements()), pkr_vec(ct1.num_elements());
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct1.num_elements(); i++)
+    Vector<BICYCL::QFI> hr_vec(n * p), pkr_vec(n * p);
+    uint64_t first_stream = random_streams->reserve(n * p);
+    auto tables = this->encryption_tables(pk_cpu);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < n * p; i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk_cpu.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
     (void)(pk_cpu);
 #endif
-    auto Cl_G = hsm2k.Cl_G();
-    auto Cl_Delta = hsm2k.Cl_Delta();
-    size_t n = cts.shape()[0], m = cts.shape()[1], p = s_cpu.shape()[1];
-    BICYCL::Mpz **s_vec = new BICYCL::Mpz *[m * p];
-    // to make sure tensor is contiguous
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < m; i++)
+    const auto &Cl_G = hsm2k.Cl_G();
+    const auto &Cl_Delta = hsm2k.Cl_Delta();
+    Tensor<CPUCryptoSystem::CipherText *> res_mat({n * p}, nullptr);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++) for (size_t k = 0; k < p; k++)
     {
-        for (size_t j = 0; j < p; j++)
+        BICYCL::QFI c1, c2;
+        qfi_multi_power(Cl_G, c1, c1_rows.data() + i * m, s_ptrs.data() + k * m, m);
+        qfi_multi_power(Cl_Delta, c2, c2_rows.data() + i * m, s_ptrs.data() + k * m, m);
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+        Cl_G.nucomp(c1, c1, hr);
+        Cl_Delta.nucomp(c2, c2, pkr);
+#else
+        Cl_G.nucomp(c1, c1, hr_vec[i * p + k]);
+        Cl_Delta.nucomp(c2, c2, pkr_vec[i * p + k]);
+#endif
+#endif
+        res_mat.at(i * p + k) = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+    }
+    res_mat.reshape({n, p});
+    return res_mat;
+}
+
+inline Tensor<CPUCryptoSystem::CipherText *> CPUCryptoSystem::matmul_plaintext_ciphertext_tensors(const CPUCryptoSystem::PublicKey &pk_cpu, const Tensor<CPUCryptoSystem::PlainText *> &s_cpu, const Tensor<CPUCryptoSystem::CipherText *> &cts) const
+{
+    if (s_cpu.ndim() != 2 || cts.ndim() < 1 || cts.ndim() > 2)
+    {
+        throw std::invalid_argument("Plaintext must be 2D and ciphertext 1D or 2D");
+    }
+    size_t n = s_cpu.shape()[0], m = s_cpu.shape()[1];
+    size_t p = cts.ndim() == 2 ? cts.shape()[1] : 1;
+    if (cts.shape()[0] != m)
+    {
+        throw std::invalid_argument("Inner dimensions must be equal");
+    }
+    auto s_cpu_flattened = s_cpu;
+    auto cts_flattened = cts;
+    s_cpu_flattened.flatten();
+    cts_flattened.flatten();
+    // signed exponents are shared by the p outputs of a row, the bases by the n outputs of a column
+    Vector<BICYCL::Mpz> s_signed(n * m);
+    Vector<const BICYCL::Mpz *> s_ptrs(n * m);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < n * m; i++)
+    {
+        s_signed[i] = this->signed_scalar(*s_cpu_flattened.at(i));
+        s_ptrs[i] = &s_signed[i];
+    }
+    Vector<const BICYCL::QFI *> c1_cols(p * m), c2_cols(p * m);
+    for (size_t k = 0; k < p; k++)
+    {
+        for (size_t j = 0; j < m; j++)
         {
-            s_vec[i * p + j] = new BICYCL::Mpz(*s_cpu_flattened.at(i * p + j));
+            c1_cols[k * m + j] = &cts_flattened.at(j * p + k)->c1();
+            c2_cols[k * m + j] = &cts_flattened.at(j * p + k)->c2();
         }
     }
-    BICYCL::QFI **c1_nupows_arr = new BICYCL::QFI *[n * m * p];
-    BICYCL::QFI **c2_nupows_arr = new BICYCL::QFI *[n * m * p];
-    auto cl_g_bound = Cl_G.default_nucomp_bound();
-    auto cl_delta_bound = Cl_Delta.default_nucomp_bound();
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++) for (size_t j = 0; j < m; j++)
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+    BICYCL::QFI hr, pkr;
+    this->encryption_randomness(pk_cpu, hr, pkr);
+#else
+    Vector<BICYCL::QFI> hr_vec(n * p), pkr_vec(n * p);
+    uint64_t first_stream = random_streams->reserve(n * p);
+    auto tables = this->encryption_tables(pk_cpu);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < n * p; i++)
+    {
+        this->encryption_randomness(pk_cpu, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
+    }
+#endif
+#else
+    (void)(pk_cpu);
+#endif
+    const auto &Cl_G = hsm2k.Cl_G();
+    const auto &Cl_Delta = hsm2k.Cl_Delta();
+    Tensor<CPUCryptoSystem::CipherText *> res({n * p}, nullptr);
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++) for (size_t k = 0; k < p; k++)
     {
+        BICYCL::QFI c1, c2;
+        qfi_multi_power(Cl_G, c1, c1_cols.data() + k * m, s_ptrs.data() + i * m, m);
+        qfi_multi_power(Cl_Delta, c2, c2_cols.data() + k * m, s_ptrs.data() + i * m, m);
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+        Cl_G.nucomp(c1, c1, hr);
+        Cl_Delta.nucomp(c2, c2, pkr);
+#else
+        Cl_G.nucomp(c1, c1, hr_vec[i * p + k]);
+        Cl_Delta.nucomp(c2, c2, pkr_vec[i * p + k]);
+#endif
+#endif
+        res.at(i * p + k) = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
+    }
+    if (cts.ndim() == 2)
+        res.reshape({n, p});
+    else
+        res.reshape({n});
+    return res;
+}
+
+inline Tensor<CPUCryptoSystem::PartDecryptionResult *> CPUCryptoSystem::part_decrypt_tensor(const CPUCryptoSystem::SecretKeyShare &sks_cpu, const CiphertextTensorView &ct) const
+{
+    const QFIRecodedExponent sks_recoded(sks_cpu);
+    Tensor<CPUCryptoSystem::PartDecryptionResult *> pdr_cpu(Vector<size_t>{ct.num_elements()}, nullptr);
+    std::atomic<bool> invalid{false};
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < ct.num_elements(); i++)
+    {
+        try
         {
-            qfi_nupow(c1_nupows_arr + i * m * p + j * p, cts_flattened.at(i * m + j)->c1(), s_vec + j * p, p, cl_g_bound);
-            qfi_nupow(c2_nupows_arr + i * m * p + j * p, cts_flattened.at(i * m + j)->c2(), s_vec + j * p, p, cl_delta_bound);
+            // only c1 is decoded, c2 is never touched
+            BICYCL::QFI di;
+            sks_recoded.power(hsm2k.Cl_G(), di, ct.c1(i));
+            if (hsm2k.compact_variant())
+                hsm2k.from_Cl_DeltaK_to_Cl_Delta(di);
+            pdr_cpu[i] = new CPUCryptoSystem::PartDecryptionResult(std::move(di));
         }
+        catch (const std::exception &)
+        {
+            invalid.store(true, std::memory_order_relaxed);
+        }
+    }
+    if (invalid.load())
+    {
+        for (size_t i = 0; i < ct.num_elements(); i++)
+            delete pdr_cpu[i];
+        throw std::invalid_argument("Invalid ciphertext in tensor");
+    }
+    pdr_cpu.reshape(ct.shape());
+    return pdr_cpu;
+}
+
+template <typename A, typename B>
+inline CiphertextBatch CPUCryptoSystem::add_ciphertext_sources(const CPUCryptoSystem::PublicKey &pk_cpu, const A &ct1, const B &ct2, bool subtract) const
+{
+    if (ct1.shape() != ct2.shape())
+    {
+        throw std::invalid_argument("Tensor shapes must be equal");
     }
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++)
+    auto num_elements = ct1.num_elements();
+    CiphertextBatch res = this->make_ciphertext_batch(ct1.shape());
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+    BICYCL::QFI hr, pkr;
+    this->encryption_randomness(pk_cpu, hr, pkr);
+#else
+    uint64_t first_stream = random_streams->reserve(num_elements);
+    auto tables = this->encryption_tables(pk_cpu);
+#endif
+#else
+    (void)(pk_cpu);
+#endif
+    const auto &Cl_G = hsm2k.Cl_G();
+    const auto &Cl_Delta = hsm2k.Cl_Delta();
+    std::atomic<bool> invalid{false};
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
     {
-        for (size_t k = 0; k < p; k++)
+        try
         {
-            for (size_t j = 0; j < m; j++)
+            BICYCL::QFI c1, c2;
+            if (subtract)
             {
-                Cl_G.nucomp(res_mat.at(i * p + k)->c1(),
-                            res_mat.at(i * p + k)->c1(),
-                            *(c1_nupows_arr[i * m * p + j * p + k]));
-                Cl_Delta.nucomp(res_mat.at(i * p + k)->c2(),
-                                res_mat.at(i * p + k)->c2(),
-                                *(c2_nupows_arr[i * m * p + j * p + k]));
+                Cl_G.nucompinv(c1, ct1.c1(i), ct2.c1(i));
+                Cl_Delta.nucompinv(c2, ct1.c2(i), ct2.c2(i));
             }
+            else
+            {
+                Cl_G.nucomp(c1, ct1.c1(i), ct2.c1(i));
+                Cl_Delta.nucomp(c2, ct1.c2(i), ct2.c2(i));
+            }
+#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
+#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
+            Cl_G.nucomp(c1, c1, hr);
+            Cl_Delta.nucomp(c2, c2, pkr);
+#else
+            BICYCL::QFI hr, pkr;
+            this->encryption_randomness(pk_cpu, tables, first_stream + i, hr, pkr);
+            Cl_G.nucomp(c1, c1, hr);
+            Cl_Delta.nucomp(c2, c2, pkr);
+#endif
+#endif
+            res.set(i, c1, c2);
+        }
+        catch (const std::exception &)
+        {
+            invalid.store(true, std::memory_order_relaxed);
         }
     }
-    for (size_t i = 0; i < m * p; i++)
+    if (invalid.load())
     {
-        delete s_vec[i];
+        throw std::invalid_argument("Invalid ciphertext in tensor");
     }
-    delete[] s_vec;
-    for (size_t i = 0; i < n * m * p; i++)
+    return res;
+}
+
+inline CiphertextBatch CPUCryptoSystem::add_ciphertext_tensors(const CPUCryptoSystem::PublicKey &pk, const CiphertextTensorView &ct1, const CiphertextTensorView &ct2) const
+{
+    return this->add_ciphertext_sources(pk, ct1, ct2, false);
+}
+
+inline CiphertextBatch CPUCryptoSystem::subtract_ciphertext_tensors(const CPUCryptoSystem::PublicKey &pk, const CiphertextTensorView &ct1, const CiphertextTensorView &ct2) const
+{
+    return this->add_ciphertext_sources(pk, ct1, ct2, true);
+}
+
+template <typename C2, typename D>
+inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_tensor(const Vector<size_t> &shape, C2 c2, D d, size_t t,
+                                                                                                    const Vector<size_t> &parties, size_t num_parties) const
+{
+    if (parties.size() != t)
     {
-        delete c1_nupows_arr[i];
-        delete c2_nupows_arr[i];
+        throw std::invalid_argument("One party index per partial decryption is required");
     }
-    delete[] c1_nupows_arr;
-    delete[] c2_nupows_arr;
+    size_t num_elements = 1;
+    for (auto dim : shape)
+        num_elements *= dim;
+    Array<BICYCL::Mpz> lambda = compute_lambda(parties, num_parties);
+    ShamirDelta delta(num_parties, k);
+    Tensor<CPUCryptoSystem::PlainText *> pt_cpu(Vector<size_t>{num_elements}, nullptr);
+    std::atomic<bool> invalid{false};
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_elements; i++)
+    {
+        try
+        {
+            Array<BICYCL::QFI> ds(t);
+            Array<const BICYCL::QFI *> ds_ptrs(t);
+            for (size_t j = 0; j < t; j++)
+            {
+                ds[j] = d(j, i);
+                ds_ptrs[j] = &ds[j];
+            }
+            BICYCL::QFI r = combine_d(hsm2k, c2(i), ds_ptrs.data(), t, lambda, delta);
+            pt_cpu[i] = new CPUCryptoSystem::PlainText(delta.unscale(hsm2k.dlog_in_F(r)));
+        }
+        catch (const std::exception &)
+        {
+            invalid.store(true, std::memory_order_relaxed);
+        }
+    }
+    if (invalid.load())
+    {
+        for (size_t i = 0; i < num_elements; i++)
+            delete pt_cpu[i];
+        throw std::invalid_argument("Invalid partial decryption in tensor");
+    }
+    pt_cpu.reshape(shape);
+    return pt_cpu;
+}
 
-#ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
-#ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++)
+inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_tensor(const Tensor<CPUCryptoSystem::CipherText *> &ct_cpu,
+                                                                                                    const Vector<PartDecryptionResultTensorView> &pdrs,
+                                                                                                    const Vector<size_t> &parties, size_t num_parties) const
+{
+    for (const auto &pdr : pdrs)
     {
-        for (size_t k = 0; k < p; k++)
+        if (pdr.num_elements() != ct_cpu.num_elements())
         {
-            Cl_G().nucomp(res_mat[i * p + k]->c1(),
-                          res_mat[i * p + k]->c1(),
-                          hr);
-            Cl_G().nucomp(res_mat[i * p + k]->c2(),
-                          res_mat[i * p + k]->c2(),
-                          pkr);
+            throw std::invalid_argument("Partial decryptions do not match the ciphertext tensor");
         }
-    };
-#else
-    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE_COLLAPSE_2 for (size_t i = 0; i < n; i++)
+    }
+    auto ct_cpu_flattened = ct_cpu;
+    ct_cpu_flattened.flatten();
+    return this->combine_part_decryption_results_tensor(
+        ct_cpu.shape(), [&ct_cpu_flattened](size_t i) -> const BICYCL::QFI &
+        { return ct_cpu_flattened[i]->c2(); },
+        [&pdrs](size_t j, size_t i)
+        { return pdrs[j].at(i); },
+        pdrs.size(), parties, num_parties);
+}
+
+inline Tensor<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_tensor(const CiphertextTensorView &ct,
+                                                                                                    const Vector<PartDecryptionResultTensorView> &pdrs,
+                                                                                                    const Vector<size_t> &parties, size_t num_parties) const
+{
+    for (const auto &pdr : pdrs)
     {
-        for (size_t k = 0; k < p; k++)
+        if (pdr.num_elements() != ct.num_elements())
         {
-            Cl_G().nucomp(res_mat[i * p + k]->c1(),
-                          res_mat[i * p + k]->c1(),
-                          hr_vec[i]);
-            Cl_G().nucomp(res_mat[i * p + k]->c2(),
-                          res_mat[i * p + k]->c2(),
-                          pkr_vec[i]);
+            throw std::invalid_argument("Partial decryptions do not match the ciphertext tensor");
         }
-    };
-#endif
-#endif
-    res_mat.reshape({n, p});
-    return res_mat;
+    }
+    return this->combine_part_decryption_results_tensor(
+        ct.shape(), [&ct](size_t i)
+        { return ct.c2(i); },
+        [&pdrs](size_t j, size_t i)
+        { return pdrs[j].at(i); },
+        pdrs.size(), parties, num_parties);
 }
@@ -4,12 +4,8 @@
 inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::encrypt_vector(const CPUCryptoSystem::PublicKey &pk, const Vector<CPUCryptoSystem::PlainText*> &pts) const
 {
     Vector<CPUCryptoSystem::CipherText *> res_vec(pts.size());
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI c1, pkr;
-    hsm2k.power_of_h(c1, r);
-    pk.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk, c1, pkr);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < pts.size(); i++)
     {
         res_vec[i] = new CPUCryptoSystem::CipherText{hsm2k, this->to_plaintext(*pts[i]), c1, pkr};
@@ -20,10 +16,11 @@ inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::encrypt_vector(con
 inline Vector<CPUCryptoSystem::PlainText *> CPUCryptoSystem::decrypt_vector(const CPUCryptoSystem::SecretKey &sk, const Vector<CPUCryptoSystem::CipherText *> &cts) const
 {
     Vector<CPUCryptoSystem::PlainText *> res_vec(cts.size());
+    const QFIRecodedExponent sk_recoded(sk);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
-        res_vec[i] = new CPUCryptoSystem::PlainText{this->to_mpz(hsm2k.decrypt(sk, *cts[i]))};
+        res_vec[i] = new CPUCryptoSystem::PlainText{this->decrypt(sk_recoded, *cts[i])};
     }
     return res_vec;
 }
@@ -31,30 +28,93 @@ inline Vector<CPUCryptoSystem::PlainText *> CPUCryptoSystem::decrypt_vector(cons
 inline Vector<CPUCryptoSystem::PartDecryptionResult *> CPUCryptoSystem::part_decrypt_vector(const CPUCryptoSystem::SecretKeyShare &sks, const Vector<CPUCryptoSystem::CipherText *> &cts) const
 {
     Vector<CPUCryptoSystem::PartDecryptionResult *> res_vec(cts.size());
+    const QFIRecodedExponent sks_recoded(sks);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
-        res_vec[i] = new CPUCryptoSystem::PartDecryptionResult{part_decrypt(sks, *cts[i])};
+        res_vec[i] = new CPUCryptoSystem::PartDecryptionResult{part_decrypt(sks_recoded, *cts[i])};
     }
     return res_vec;
 }
 
-inline Vector<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_vector(const CPUCryptoSystem::CipherText &ct, const Vector<CPUCryptoSystem::PartDecryptionResult *> &pdrs) const
+inline Vector<CPUCryptoSystem::PlainText *> CPUCryptoSystem::combine_part_decryption_results_vector(const Vector<CPUCryptoSystem::CipherText *> &ct,
+                                                                                                    const Vector<Vector<CPUCryptoSystem::PartDecryptionResult *>> &pdrs,
+                                                                                                    const Vector<size_t> &parties, size_t num_parties) const
 {
-    Vector<CPUCryptoSystem::PlainText *> res_vec(pdrs.size());
+    if (parties.size() != pdrs.size())
+    {
+        throw std::invalid_argument("One party index per partial decryption is required");
+    }
+    for (const auto &pdr : pdrs)
+    {
+        if (pdr.size() != ct.size())
+        {
+            throw std::invalid_argument("Partial decryptions do not match the ciphertext vector");
+        }
+    }
+    // the coefficients depend on the party set only, not on the element
+    size_t t = pdrs.size();
+    Array<BICYCL::Mpz> lambda = compute_lambda(parties, num_parties);
+    ShamirDelta delta(num_parties, k);
+    Vector<CPUCryptoSystem::PlainText *> res_vec(ct.size());
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
-    for (size_t i = 0; i < pdrs.size(); i++)
+    for (size_t i = 0; i < ct.size(); i++)
     {
-        Vector<CPUCryptoSystem::PartDecryptionResult> pdrs_vec{pdrs.size()};
-        for (size_t j = 0; j < pdrs.size(); j++)
+        Array<const BICYCL::QFI *> ds(t);
+        for (size_t j = 0; j < t; j++)
         {
-            pdrs_vec[j] = *pdrs[j];
+            ds[j] = pdrs[j][i];
         }
-        res_vec[i] = new CPUCryptoSystem::PlainText{combine_part_decryption_results(ct, pdrs_vec)};
+        BICYCL::QFI r = combine_d(hsm2k, ct[i]->c2(), ds.data(), t, lambda, delta);
+        res_vec[i] = new CPUCryptoSystem::PlainText(delta.unscale(hsm2k.dlog_in_F(r)));
     }
     return res_vec;
 }
 
+inline void CPUCryptoSystem::scal_ciphertexts_grouped(const Vector<const CPUCryptoSystem::CipherText *> &cts, const Vector<const CPUCryptoSystem::PlainText *> &s, BICYCL::QFI *c1, BICYCL::QFI *c2) const
+{
+    Vector<size_t> order(cts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&cts](size_t i, size_t j)
+                     { return std::less<const CPUCryptoSystem::CipherText *>()(cts[i], cts[j]); });
+    Vector<size_t> group_starts;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        if (i == 0 || cts[order[i]] != cts[order[i - 1]])
+            group_starts.push_back(i);
+    }
+    group_starts.push_back(order.size());
+    const auto &Cl_G = hsm2k.Cl_G();
+    const auto &Cl_Delta = hsm2k.Cl_Delta();
+    size_t num_groups = group_starts.size() - 1;
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t g = 0; g < num_groups; g++)
+    {
+        size_t begin = group_starts[g], end = group_starts[g + 1];
+        const CPUCryptoSystem::CipherText &ct = *cts[order[begin]];
+        if (end - begin == 1)
+        {
+            BICYCL::Mpz n = this->signed_scalar(*s[order[begin]]);
+            this->signed_nupow(Cl_G, c1[order[begin]], ct.c1(), n);
+            this->signed_nupow(Cl_Delta, c2[order[begin]], ct.c2(), n);
+            continue;
+        }
+        Vector<BICYCL::Mpz> n(end - begin);
+        size_t max_bits = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            n[i - begin] = this->signed_scalar(*s[order[i]]);
+            max_bits = std::max(max_bits, n[i - begin].nbits());
+        }
+        auto &engine = QFIMultiExponentiation::thread_instance();
+        engine.set_base(ct.c1(), Cl_G.default_nucomp_bound(), multi_exponent_window, end - begin, max_bits);
+        for (size_t i = begin; i < end; i++)
+            engine.power(c1[order[i]], n[i - begin]);
+        engine.set_base(ct.c2(), Cl_Delta.default_nucomp_bound(), multi_exponent_window, end - begin, max_bits);
+        for (size_t i = begin; i < end; i++)
+            engine.power(c2[order[i]], n[i - begin]);
+    }
+}
+
 inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::add_ciphertext_vectors(const CPUCryptoSystem::PublicKey &pk, const Vector<CPUCryptoSystem::CipherText *> &ct1, const Vector<CPUCryptoSystem::CipherText *> &ct2) const
 {
     if (ct1.size() != ct2.size())
@@ -64,27 +124,20 @@ inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::add_ciphertext_vec
     Vector<CPUCryptoSystem::CipherText *> res_vec(ct1.size());
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(ct1.size());
     Vector<BICYCL::QFI> hr_vec(ct1.size()), pkr_vec(ct1.size());
     // Batch optimization can be done similiar to other nupow
     // port the precomputation version of nupow
     // Although do we need to do this?
     // As at this hierarchy, we can do parallelization
+    uint64_t first_stream = random_streams->reserve(ct1.size());
+    auto tables = this->encryption_tables(pk);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < ct1.size(); i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
@@ -128,52 +181,36 @@ inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::scal_ciphertext_ve
     Vector<CPUCryptoSystem::CipherText *> res_vec(cts.size());
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(cts.size());
     Vector<BICYCL::QFI> hr_vec(cts.size()), pkr_vec(cts.size());
     // see the comment in add_ciphertext_vectors
+    uint64_t first_stream = random_streams->reserve(cts.size());
+    auto tables = this->encryption_tables(pk);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
     (void)(pk);
 #endif
-    auto Cl_G = hsm2k.Cl_G();
-    auto Cl_Delta = hsm2k.Cl_Delta();
+    Vector<BICYCL::QFI> c1_pows(cts.size()), c2_pows(cts.size());
+    this->scal_ciphertexts_grouped(Vector<const CPUCryptoSystem::CipherText *>(cts.begin(), cts.end()), Vector<const CPUCryptoSystem::PlainText *>(cts.size(), &s), c1_pows.data(), c2_pows.data());
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
+        BICYCL::QFI c1(std::move(c1_pows[i])), c2(std::move(c2_pows[i]));
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-        BICYCL::QFI c1(hr), c2(pkr);
-        Cl_G.nupow(c1, cts[i]->c1(), s);
-        Cl_G.nucomp(c1, c1, hr);
-        Cl_Delta.nupow(c2, cts[i]->c2(), s);
-        Cl_Delta.nucomp(c2, c2, pkr);
+        hsm2k.Cl_G().nucomp(c1, c1, hr);
+        hsm2k.Cl_Delta().nucomp(c2, c2, pkr);
 #else
-        BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
-        Cl_G.nupow(c1, cts[i]->c1(), s);
-        Cl_G.nucomp(c1, c1, hr_vec[i]);
-        Cl_Delta.nupow(c2, cts[i]->c2(), s);
-        Cl_Delta.nucomp(c2, c2, pkr_vec[i]);
+        hsm2k.Cl_G().nucomp(c1, c1, hr_vec[i]);
+        hsm2k.Cl_Delta().nucomp(c2, c2, pkr_vec[i]);
 #endif
-#else
-        BICYCL::QFI c1, c2;
-        Cl_G.nupow(c1, cts[i]->c1(), s);
-        Cl_Delta.nupow(c2, cts[i]->c2(), s);
 #endif
         res_vec[i] = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
     }
@@ -189,52 +226,36 @@ inline Vector<CPUCryptoSystem::CipherText *> CPUCryptoSystem::scal_ciphertext_ve
     Vector<CPUCryptoSystem::CipherText *> res_vec(cts.size());
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-    BICYCL::Mpz r = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
     BICYCL::QFI hr, pkr;
-    hsm2k.power_of_h(hr, r);
-    pk.exponentiation(hsm2k, pkr, r);
-    if (hsm2k.compact_variant())
-        hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr);
+    this->encryption_randomness(pk, hr, pkr);
 #else
-    Vector<BICYCL::Mpz> r_vec(cts.size());
     Vector<BICYCL::QFI> hr_vec(cts.size()), pkr_vec(cts.size());
     // see the comment in add_ciphertext_vectors
+    uint64_t first_stream = random_streams->reserve(cts.size());
+    auto tables = this->encryption_tables(pk);
     CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
-        r_vec[i] = rand_gen.random_mpz(hsm2k.encrypt_randomness_bound());
-        hsm2k.power_of_h(hr_vec[i], r_vec[i]);
-        pk.exponentiation(hsm2k, pkr_vec[i], r_vec[i]);
-        if (hsm2k.compact_variant())
-            hsm2k.from_Cl_DeltaK_to_Cl_Delta(pkr_vec[i]);
+        this->encryption_randomness(pk, tables, first_stream + i, hr_vec[i], pkr_vec[i]);
     }
 #endif
 #else
     (void)(pk);
 #endif
-    auto Cl_G = hsm2k.Cl_G();
-    auto Cl_Delta = hsm2k.Cl_Delta();
-#pragma omp parallel for schedule(static)
+    Vector<BICYCL::QFI> c1_pows(cts.size()), c2_pows(cts.size());
+    this->scal_ciphertexts_grouped(Vector<const CPUCryptoSystem::CipherText *>(cts.begin(), cts.end()), Vector<const CPUCryptoSystem::PlainText *>(s_cpu.begin(), s_cpu.end()), c1_pows.data(), c2_pows.data());
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE
     for (size_t i = 0; i < cts.size(); i++)
     {
+        BICYCL::QFI c1(std::move(c1_pows[i])), c2(std::move(c2_pows[i]));
 #ifdef ADD_RANDOMNESS_IN_HOMOMORPHIC_OPERATIONS
 #ifndef DIFFERENT_RANDOMNESS_FOR_EACH_OPERATION
-        BICYCL::QFI c1(hr), c2(pkr);
-        Cl_G.nupow(c1, cts[i]->c1(), *s_cpu[i]);
-        Cl_G.nucomp(c1, c1, hr);
-        Cl_Delta.nupow(c2, cts[i]->c2(), *s_cpu[i]);
-        Cl_Delta.nucomp(c2, c2, pkr);
+        hsm2k.Cl_G().nucomp(c1, c1, hr);
+        hsm2k.Cl_Delta().nucomp(c2, c2, pkr);
 #else
-        BICYCL::QFI c1(hr_vec[i]), c2(pkr_vec[i]);
-        Cl_G.nupow(c1, cts[i]->c1(), *s_cpu[i]);
-        Cl_G.nucomp(c1, c1, hr_vec[i]);
-        Cl_Delta.nupow(c2, cts[i]->c2(), *s_cpu[i]);
-        Cl_Delta.nucomp(c2, c2, pkr_vec[i]);
+        hsm2k.Cl_G().nucomp(c1, c1, hr_vec[i]);
+        hsm2k.Cl_Delta().nucomp(c2, c2, pkr_vec[i]);
 #endif
-#else
-        BICYCL::QFI c1, c2;
-        Cl_G.nupow(c1, cts[i]->c1(), *s_cpu[i]);
-        Cl_Delta.nupow(c2, cts[i]->c2(), *s_cpu[i]);
 #endif
         res_vec[i] = new CPUCryptoSystem::CipherText(std::move(c1), std::move(c2));
     }
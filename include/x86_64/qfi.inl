@@ -1,135 +1,585 @@
+// returns bits [pos, pos+w) of |n|, w must be smaller than the limb size
+inline mp_limb_t qfi_extract_window(mpz_srcptr n, size_t pos, size_t w)
+{
+    size_t limb_idx = pos / GMP_NUMB_BITS;
+    size_t shift = pos % GMP_NUMB_BITS;
+    size_t size = mpz_size(n);
+    if (limb_idx >= size)
+        return 0;
+    mp_limb_t res = mpz_getlimbn(n, limb_idx) >> shift;
+    if (shift + w > GMP_NUMB_BITS && limb_idx + 1 < size)
+        res |= mpz_getlimbn(n, limb_idx + 1) << (GMP_NUMB_BITS - shift);
+    return res & ((mp_limb_t(1) << w) - 1);
+}
+
+inline bool qfi_equal(const BICYCL::QFI &f1, const BICYCL::QFI &f2)
+{
+    return mpz_cmp((mpz_srcptr)(f1.a()), (mpz_srcptr)(f2.a())) == 0 &&
+           mpz_cmp((mpz_srcptr)(f1.b()), (mpz_srcptr)(f2.b())) == 0 &&
+           mpz_cmp((mpz_srcptr)(f1.c()), (mpz_srcptr)(f2.c())) == 0;
+}
+
+#ifndef CoFHE_COMPRESS_TENSOR_FORMS
+// 1 makes ciphertext and partial decryption tensors go on the wire without c
+#define CoFHE_COMPRESS_TENSOR_FORMS 0
+#endif
+// Compressed tensors of forms: the top bit of ndim is set and only a and b of
+// each form are written, in the pointer table layout of the full format. A
+// reduced form has c = (b^2 - disc) / 4a, the receiver recomputes it.
+const uint32_t COMPRESSED_FORMS_BIT = (uint32_t)(1) << 31;
+// Ciphertext tensors in blocks, see tensor_stream.inl
+const uint32_t TENSOR_STREAM_BIT = (uint32_t)(1) << 30;
+
+#ifndef CoFHE_MULTI_EXPONENT_WINDOW
+// 0 picks the window from the number and size of the exponents
+#define CoFHE_MULTI_EXPONENT_WINDOW 0
+#endif
+#define CoFHE_MULTI_EXPONENT_MAX_WINDOW 10
+
+// One base, many exponents. The odd powers of the base are computed once and
+// shared by all exponents, every exponent is then a left to right wNAF pass.
+// All scratch is kept between calls, use thread_instance() from parallel code.
+class QFIMultiExponentiation
+{
+public:
+    QFIMultiExponentiation() : w_m(0), has_one_m(false) {}
+
+    // window 0 picks the window for count exponents of max_bits bits
+    void set_base(const BICYCL::QFI &f, const BICYCL::Mpz &L, size_t window, size_t count, size_t max_bits)
+    {
+        size_t w = window == 0 ? choose_window(count, max_bits) : std::min<size_t>(std::max<size_t>(window, 2), CoFHE_MULTI_EXPONENT_MAX_WINDOW);
+        set_base_odd_powers(f, L, w, size_t(1) << (w - 2));
+    }
+
+    // only the first u odd powers, for exponents recoded at window w whose digits are all below 2u
+    void set_base_odd_powers(const BICYCL::QFI &f, const BICYCL::Mpz &L, size_t w, size_t u)
+    {
+        w_m = w;
+        L_m = L;
+        has_one_m = false;
+        if (table_m.size() < u)
+            table_m.resize(u);
+        /* table_m[i] = f^(2*i+1) for 0 <= i < u */
+        table_m[0] = f;
+        if (u > 1)
+        {
+            BICYCL::QFI::nudupl(ff_m, f, L_m, tmp_m);
+            for (size_t i = 1; i < u; i++)
+                BICYCL::QFI::nucomp(table_m[i], table_m[i - 1], ff_m, L_m, 0, tmp_m);
+        }
+    }
+
+    void power(BICYCL::QFI &r, const BICYCL::Mpz &n)
+    {
+        size_t top = recode(n, w_m, digits_m);
+        power_recoded(r, digits_m.data(), top, n.sgn() < 0);
+    }
+
+    // r = f^n for an exponent already recoded with recode() at the window of this base
+    void power_recoded(BICYCL::QFI &r, const int32_t *digits, size_t top, bool negative)
+    {
+        if (top == 0)
+        {
+            if (!has_one_m)
+            {
+                // f * f^-1, the neutral form of the class group of f
+                BICYCL::QFI::nucomp(one_m, table_m[0], table_m[0], L_m, 1, tmp_m);
+                has_one_m = true;
+            }
+            r = one_m;
+            return;
+        }
+        int32_t d = digits[top - 1];
+        r = table_m[(d < 0 ? -d : d) >> 1];
+        if (d < 0)
+            r.neg();
+        for (size_t i = top - 1; i-- > 0;)
+        {
+            BICYCL::QFI::nudupl(r, r, L_m, tmp_m);
+            d = digits[i];
+            if (d != 0)
+                BICYCL::QFI::nucomp(r, r, table_m[(d < 0 ? -d : d) >> 1], L_m, d < 0, tmp_m);
+        }
+        if (negative)
+            r.neg();
+    }
+
+    // r[i] = f^(*n[i]), r must hold count forms
+    void power_many(BICYCL::QFI *r, const BICYCL::Mpz *const *n, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            power(r[i], *n[i]);
+    }
+
+    size_t window() const { return w_m; }
+
+    // nudupl and nucomp calls of set_base_odd_powers(u) followed by power_recoded(digits, top)
+    static size_t group_operations(const int32_t *digits, size_t top, size_t u)
+    {
+        if (top == 0)
+            return 0;
+        size_t nonzero = 0;
+        for (size_t i = 0; i < top; i++)
+            nonzero += digits[i] != 0;
+        return (u > 1 ? u : 0) + (top - 1) + (nonzero - 1);
+    }
+
+    static size_t choose_window(size_t count, size_t max_bits)
+    {
+        // table costs 2^(w-2) compositions, each exponent ~max_bits/(w+1)
+        size_t best_w = 2;
+        double best_cost = std::numeric_limits<double>::max();
+        for (size_t w = 2; w <= CoFHE_MULTI_EXPONENT_MAX_WINDOW; w++)
+        {
+            double cost = double(size_t(1) << (w - 2)) + double(count) * double(max_bits) / double(w + 1);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_w = w;
+            }
+        }
+        return best_w;
+    }
+
+    static QFIMultiExponentiation &thread_instance()
+    {
+        thread_local QFIMultiExponentiation instance;
+        return instance;
+    }
+
+    // width-w NAF of |n| into digits, returns the number of digits
+    static size_t recode(const BICYCL::Mpz &n, size_t w, std::vector<int32_t> &digits)
+    {
+        if (n.sgn() == 0)
+            return 0;
+        size_t nbits = mpz_sizeinbase((mpz_srcptr)(n), 2);
+        if (digits.size() < nbits + w + 1)
+            digits.resize(nbits + w + 1);
+        const int32_t pow2w = int32_t(1) << w;
+        const int32_t half = int32_t(1) << (w - 1);
+        mp_limb_t carry = 0;
+        size_t i = 0, top = 0;
+        while (i < nbits || carry)
+        {
+            mp_limb_t bit = (i < nbits ? qfi_extract_window((mpz_srcptr)(n), i, 1) : 0) + carry;
+            if (bit == 1)
+            {
+                int32_t v = int32_t(qfi_extract_window((mpz_srcptr)(n), i, w) + carry);
+                int32_t d = v;
+                carry = 0;
+                if (v >= half)
+                {
+                    d = v - pow2w;
+                    carry = 1;
+                }
+                digits[i] = d;
+                top = i + 1;
+                for (size_t j = 1; j < w; j++)
+                    digits[i + j] = 0;
+                i += w;
+            }
+            else
+            {
+                carry = bit >> 1;
+                digits[i] = 0;
+                i++;
+            }
+        }
+        return top;
+    }
+
+private:
+    size_t w_m;
+    BICYCL::Mpz L_m;
+    BICYCL::QFI one_m;
+    bool has_one_m;
+    BICYCL::QFI ff_m;
+    std::vector<BICYCL::QFI> table_m;
+    std::vector<int32_t> digits_m;
+    BICYCL::QFI::OpsAuxVars tmp_m;
+};
+
 inline void qfi_nupow(BICYCL::QFI **r_, const BICYCL::QFI &f, BICYCL::Mpz **n_, size_t count,
                       const BICYCL::Mpz &L)
 {
     if (count == 0)
         return;
-
+    size_t max_bits = 0;
     for (size_t i = 0; i < count; i++)
     {
         r_[i] = new BICYCL::QFI();
+        max_bits = std::max(max_bits, n_[i]->nbits());
     }
+    auto &engine = QFIMultiExponentiation::thread_instance();
+    engine.set_base(f, L, CoFHE_MULTI_EXPONENT_WINDOW, count, max_bits);
+    for (size_t i = 0; i < count; i++)
+        engine.power(*r_[i], *n_[i]);
+}
 
-    BICYCL::QFI::OpsAuxVars tmp;
+// A fixed exponent (secret key or key share) recoded once for all the
+// exponentiations of one call. The base changes every time so its odd powers
+// are still built per exponentiation, only the ones the digits use.
+class QFIRecodedExponent
+{
+public:
+    explicit QFIRecodedExponent(const BICYCL::Mpz &n)
+        : negative_m(n.sgn() < 0), w_m(QFIMultiExponentiation::choose_window(1, std::max<size_t>(n.nbits(), 1))),
+          top_m(QFIMultiExponentiation::recode(n, w_m, digits_m))
+    {
+        int32_t largest = 1;
+        for (size_t i = 0; i < top_m; i++)
+            largest = std::max(largest, digits_m[i] < 0 ? -digits_m[i] : digits_m[i]);
+        u_m = size_t(largest >> 1) + 1;
+    }
 
-    /* implem of wNAF*: a left to right wNAF (see Brian King, ACNS 2008) */
-    const mp_limb_t w = 7;
-    const mp_limb_t pow2w = (1UL << w);
-    const mp_limb_t u = (1UL << (w - 2));
+    void power(const BICYCL::ClassGroup &cl, BICYCL::QFI &r, const BICYCL::QFI &f) const
+    {
+        if (top_m == 0)
+        {
+            r = cl.one();
+            return;
+        }
+        auto &engine = QFIMultiExponentiation::thread_instance();
+        engine.set_base_odd_powers(f, cl.default_nucomp_bound(), w_m, u_m);
+        engine.power_recoded(r, digits_m.data(), top_m, negative_m);
+    }
+
+    // nudupl and nucomp calls of one power()
+    size_t group_operations() const { return QFIMultiExponentiation::group_operations(digits_m.data(), top_m, u_m); }
 
-    /* precomputation: tab[i] = f^(2*i+1)  for 0 <= i < u = 2^(w-2) */
-    BICYCL::QFI ff(f);
-    BICYCL::QFI tab[u];
+private:
+    bool negative_m;
+    std::vector<int32_t> digits_m;
+    size_t w_m;
+    size_t top_m;
+    size_t u_m;
+};
 
-    BICYCL::QFI::nudupl(ff, f, L, tmp);
-    tab[0] = f;
-    for (mp_limb_t i = 1; i < u; i++)
-        BICYCL::QFI::nucomp(tab[i], tab[i - 1], ff, L, 0, tmp); /* tab[i] <- tab[i-1]*ff */
-    auto tab_end = std::chrono::high_resolution_clock::now();
-    std::unordered_map<size_t, BICYCL::QFI> cache;
+#ifndef CoFHE_FIXED_BASE_TABLE_MEMORY_BUDGET
+// per table, one table for h and one for each public key in use
+#define CoFHE_FIXED_BASE_TABLE_MEMORY_BUDGET (size_t(8) << 20)
+#endif
+#ifndef CoFHE_FIXED_BASE_TABLE_MAX_WINDOW
+#define CoFHE_FIXED_BASE_TABLE_MAX_WINDOW 8
+#endif
+#ifndef CoFHE_FIXED_BASE_TABLE_CACHE_SIZE
+#define CoFHE_FIXED_BASE_TABLE_CACHE_SIZE 4
+#endif
 
-    auto get_doubled = [&](BICYCL::QFI &r, size_t &curr_degree, size_t doubling_degree,
-                           const BICYCL::Mpz &L, BICYCL::QFI::OpsAuxVars &tmp) -> void
+// Fixed-base exponentiation for a base that is reused many times (h, pk).
+// table[i * 2^(w-1) + j] = f^((j+1) * 2^(w*i)), the exponent is recoded in
+// signed radix 2^w so an exponentiation is one nucomp per window and no squarings.
+class QFIFixedBaseTable
+{
+public:
+    QFIFixedBaseTable(const BICYCL::ClassGroup &cl, const BICYCL::QFI &f, size_t max_bits, size_t w)
+        : base_m(f), one_m(cl.one()), L_m(cl.default_nucomp_bound()), w_m(w),
+          num_windows_m(num_windows(max_bits, w)), max_bits_m(max_bits)
     {
-        size_t final_degree = (1 << doubling_degree) * curr_degree;
-        if (cache.find(curr_degree) == cache.end())
-            cache[curr_degree] = BICYCL::QFI(r);
-        if (cache.find(final_degree) != cache.end())
+        size_t half = size_t(1) << (w_m - 1);
+        table_m.resize(num_windows_m * half);
+        // f^(2^(w*i)) for each window, the only serial part
+        std::vector<BICYCL::QFI> bases(num_windows_m);
         {
-            curr_degree = final_degree;
-            r = BICYCL::QFI(cache[final_degree]);
+            BICYCL::QFI::OpsAuxVars tmp;
+            bases[0] = f;
+            for (size_t i = 1; i < num_windows_m; i++)
+            {
+                bases[i] = bases[i - 1];
+                for (size_t j = 0; j < w_m; j++)
+                    BICYCL::QFI::nudupl(bases[i], bases[i], L_m, tmp);
+            }
+        }
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t i = 0; i < num_windows_m; i++)
+        {
+            BICYCL::QFI::OpsAuxVars tmp;
+            BICYCL::QFI *row = table_m.data() + i * half;
+            row[0] = bases[i];
+            if (half > 1)
+                BICYCL::QFI::nudupl(row[1], bases[i], L_m, tmp);
+            for (size_t j = 2; j < half; j++)
+                BICYCL::QFI::nucomp(row[j], row[j - 1], bases[i], L_m, 0, tmp);
         }
-        else
+    }
+
+    // largest window whose table fits in memory_budget, 0 if none does
+    static size_t choose_window(const BICYCL::QFI &f, size_t max_bits, size_t memory_budget)
+    {
+        size_t entry_size = sizeof(BICYCL::QFI) + sizeof(mp_limb_t) * (mpz_size((mpz_srcptr)(f.a())) + mpz_size((mpz_srcptr)(f.b())) + mpz_size((mpz_srcptr)(f.c())) + 3);
+        for (size_t w = CoFHE_FIXED_BASE_TABLE_MAX_WINDOW; w >= 2; w--)
         {
-            size_t already_doubled_degree = 0;
-            // size_t intermediate_degree = final_degree/2;
-            // for (size_t i = doubling_degree-1;i>0; --i) {
-            //     if (cache.find(intermediate_degree) != cache.end()) {
-            //         r = QFI(cache[intermediate_degree]);
-            //         curr_degree = intermediate_degree;
-            //         already_doubled_degree = i;
-            //         break;
-            //     }
-            //     intermediate_degree/=2;
-            // }
+            if (num_windows(max_bits, w) * (size_t(1) << (w - 1)) * entry_size <= memory_budget)
+                return w;
+        }
+        return 0;
+    }
 
-            for (size_t i = 1; i <= doubling_degree - already_doubled_degree; i++)
+    // returns false if n does not fit in the table, r is untouched then
+    bool power(BICYCL::QFI &r, const BICYCL::Mpz &n) const
+    {
+        if (n.sgn() == 0)
+        {
+            r = one_m;
+            return true;
+        }
+        if (mpz_sizeinbase((mpz_srcptr)(n), 2) > max_bits_m)
+            return false;
+        thread_local BICYCL::QFI::OpsAuxVars tmp;
+        const mp_limb_t half = mp_limb_t(1) << (w_m - 1);
+        const mp_limb_t pow2w = mp_limb_t(1) << w_m;
+        mp_limb_t carry = 0;
+        bool started = false;
+        for (size_t i = 0; i < num_windows_m; i++)
+        {
+            mp_limb_t d = qfi_extract_window((mpz_srcptr)(n), i * w_m, w_m) + carry;
+            bool neg = false;
+            carry = 0;
+            if (d > half)
             {
-                BICYCL::QFI::nudupl(r, r, L, tmp);
-                cache[curr_degree * 2] = BICYCL::QFI(r);
-                curr_degree *= 2;
+                d = pow2w - d;
+                neg = true;
+                carry = 1;
+            }
+            if (d == 0)
+                continue;
+            const BICYCL::QFI &t = table_m[i * half + d - 1];
+            if (!started)
+            {
+                r = t;
+                if (neg)
+                    r.neg();
+                started = true;
+            }
+            else
+            {
+                BICYCL::QFI::nucomp(r, r, t, L_m, neg, tmp);
             }
         }
-    };
+        if (n.sgn() < 0)
+            r.neg();
+        return true;
+    }
+
+    const BICYCL::QFI &base() const { return base_m; }
+    size_t window() const { return w_m; }
+
+    // nudupl and nucomp calls of set_base_odd_powers(u) followed by power_recoded(digits, top)
+    static size_t group_operations(const int32_t *digits, size_t top, size_t u)
+    {
+        if (top == 0)
+            return 0;
+        size_t nonzero = 0;
+        for (size_t i = 0; i < top; i++)
+            nonzero += digits[i] != 0;
+        return (u > 1 ? u : 0) + (top - 1) + (nonzero - 1);
+    }
+    size_t max_bits() const { return max_bits_m; }
+
+private:
+    BICYCL::QFI base_m;
+    BICYCL::QFI one_m;
+    BICYCL::Mpz L_m;
+    size_t w_m;
+    size_t num_windows_m;
+    size_t max_bits_m;
+    std::vector<BICYCL::QFI> table_m;
 
-    for (size_t exp_idx = 0; exp_idx < count; exp_idx++)
+    // one extra bit for the carry of the signed recoding
+    static size_t num_windows(size_t max_bits, size_t w)
     {
-        BICYCL::Mpz &n = *n_[exp_idx];
-        BICYCL::QFI &r = *r_[exp_idx];
-        size_t curr_degree = 0;
+        return (max_bits + 1 + w - 1) / w;
+    }
+};
 
-        int j = n.nbits() - 1;
-        mp_limb_t c;
+// Tables are built lazily on first use of a base and shared between copies
+// of the cryptosystem. A table is built without the lock held, so lookups of
+// the bases that are already there are not held up by it.
+class QFIFixedBaseTableCache
+{
+public:
+    explicit QFIFixedBaseTableCache(size_t memory_budget = CoFHE_FIXED_BASE_TABLE_MEMORY_BUDGET) : memory_budget_m(memory_budget) {}
 
+    std::shared_ptr<const QFIFixedBaseTable> get(const BICYCL::ClassGroup &cl, const BICYCL::QFI &f, size_t max_bits)
+    {
+        size_t memory_budget, generation;
         {
-            /* for the first digit we know that dj=1 and c=0 */
-            mp_limb_t m = n.extract_bits((size_t)j, w);
-            c = m & 0x1;                    /* d_{j-w+1} */
-            mp_limb_t t = m + (m & 0x1);    /* + d_{j-w+1} */
-            size_t val2 = mpn_scan1(&t, 0); /* note: m cannot be zero */
-            size_t tau = val2 < w ? val2 : w - 1;
-            t >>= tau;
+            LockGuard lock(mutex_m);
+            if (auto table = find(f, max_bits))
+                return table;
+            memory_budget = memory_budget_m;
+            generation = generation_m;
+        }
+        size_t w = QFIFixedBaseTable::choose_window(f, max_bits, memory_budget);
+        if (w == 0)
+            return nullptr;
+        auto table = std::make_shared<const QFIFixedBaseTable>(cl, f, max_bits, w);
+        LockGuard lock(mutex_m);
+        // another thread may have built the same table meanwhile, the first one is kept
+        if (auto built = find(f, max_bits))
+            return built;
+        // the budget changed while it was built, the table is used once but not kept
+        if (generation != generation_m)
+            return table;
+        tables_m.push_back(table);
+        if (tables_m.size() > CoFHE_FIXED_BASE_TABLE_CACHE_SIZE)
+            tables_m.erase(tables_m.begin());
+        return table;
+    }
+
+    void set_memory_budget(size_t memory_budget)
+    {
+        LockGuard lock(mutex_m);
+        memory_budget_m = memory_budget;
+        generation_m++;
+        tables_m.clear();
+    }
+
+    size_t memory_budget() const { return memory_budget_m; }
+
+private:
+    Mutex mutex_m;
+    size_t memory_budget_m;
+    size_t generation_m = 0;
+    std::vector<std::shared_ptr<const QFIFixedBaseTable>> tables_m;
 
-            r = t == 2 ? ff : tab[t >> 1];
-            curr_degree = t == 2 ? 2 : ((t >> 1) * 2 + 1);
-            size_t b = ((size_t)j) < w - 1 ? tau + 1 + j - w : tau;
-            get_doubled(r, curr_degree, b, L, tmp);
-            j -= w;
+    // called with mutex_m held
+    std::shared_ptr<const QFIFixedBaseTable> find(const BICYCL::QFI &f, size_t max_bits) const
+    {
+        for (auto &table : tables_m)
+        {
+            if (table->max_bits() >= max_bits && qfi_equal(table->base(), f))
+                return table;
         }
+        return nullptr;
+    }
+};
+
+#ifndef CoFHE_MULTI_POWER_MAX_WINDOW
+#define CoFHE_MULTI_POWER_MAX_WINDOW 14
+#endif
 
-        while (j >= 0)
+// bucket width minimizing windows * (count + 2^w), the squarings do not depend on it
+inline size_t qfi_multi_power_window(size_t count, size_t max_bits)
+{
+    size_t best_w = 1, best_cost = std::numeric_limits<size_t>::max();
+    for (size_t w = 1; w <= CoFHE_MULTI_POWER_MAX_WINDOW; w++)
+    {
+        size_t cost = ((max_bits + w) / w) * (count + (size_t(1) << w));
+        if (cost < best_cost)
         {
-            mp_limb_t m = n.extract_bits((size_t)j, w);
-            mp_limb_t dj = (m >> (w - 1)) & 0x1;
-            mp_limb_t djmwp1 = m & 0x1;
+            best_cost = cost;
+            best_w = w;
+        }
+    }
+    return best_w;
+}
 
-            if (c == dj)
+// r = prod f[i]^(*n[i]) with Pippenger's bucket method. Exponents are recoded
+// in signed radix 2^w, so a window needs 2^(w-1) buckets; a negative digit
+// composes with the inverse of the base, which nucomp does for free. Per window
+// this is count compositions into the buckets and 2^w to sum them, against
+// count full exponentiations for the naive product.
+inline void qfi_multi_power(const BICYCL::ClassGroup &cl, BICYCL::QFI &r, const BICYCL::QFI *const *f, const BICYCL::Mpz *const *n, size_t count, size_t w = 0)
+{
+    size_t max_bits = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (n[i]->sgn() != 0)
+            max_bits = std::max(max_bits, mpz_sizeinbase((mpz_srcptr)(*n[i]), 2));
+    }
+    if (max_bits == 0)
+    {
+        r = cl.one();
+        return;
+    }
+    if (w == 0)
+        w = qfi_multi_power_window(count, max_bits);
+    const BICYCL::Mpz &L = cl.default_nucomp_bound();
+    // one extra bit for the carry of the signed recoding
+    const size_t num_windows = (max_bits + w) / w;
+    const size_t half = size_t(1) << (w - 1);
+    thread_local std::vector<int32_t> digits;
+    thread_local std::vector<BICYCL::QFI> buckets;
+    thread_local std::vector<char> has_bucket;
+    thread_local BICYCL::QFI::OpsAuxVars tmp;
+    digits.assign(count * num_windows, 0);
+    if (buckets.size() < half)
+        buckets.resize(half);
+    for (size_t i = 0; i < count; i++)
+    {
+        int32_t carry = 0;
+        int32_t sign = n[i]->sgn() < 0 ? -1 : 1;
+        for (size_t j = 0; j < num_windows; j++)
+        {
+            int32_t d = int32_t(qfi_extract_window((mpz_srcptr)(*n[i]), j * w, w)) + carry;
+            carry = 0;
+            if (d > int32_t(half))
             {
-                get_doubled(r, curr_degree, 1, L, tmp);
-                j -= 1;
+                d -= int32_t(size_t(1) << w);
+                carry = 1;
             }
-            else
+            digits[i * num_windows + j] = sign * d;
+        }
+    }
+    bool started = false;
+    BICYCL::QFI sum, acc;
+    for (size_t j = num_windows; j-- > 0;)
+    {
+        if (started)
+        {
+            for (size_t k = 0; k < w; k++)
+                BICYCL::QFI::nudupl(r, r, L, tmp);
+        }
+        has_bucket.assign(half, 0);
+        for (size_t i = 0; i < count; i++)
+        {
+            int32_t d = digits[i * num_windows + j];
+            if (d == 0)
+                continue;
+            bool neg = d < 0;
+            size_t b = size_t(neg ? -d : d) - 1;
+            if (!has_bucket[b])
             {
-                int neg = c;
-                mp_limb_t t = m + djmwp1;
-                t = c ? (pow2w - t) : t;
-                c = djmwp1;
-
-                size_t val2 = t > 0 ? mpn_scan1(&t, 0) : w - 1;
-                size_t tau = val2 < w ? val2 : w - 1;
-                t >>= tau;
-                get_doubled(r, curr_degree, (w - tau), L, tmp);
-                BICYCL::QFI::nucomp(r, r, t == 2 ? ff : tab[t >> 1], L, neg, tmp);
+                buckets[b] = *f[i];
                 if (neg)
-                {
-                    curr_degree -= ((t == 2) ? 2 : ((t >> 1) * 2 + 1));
-                }
+                    buckets[b].neg();
+                has_bucket[b] = 1;
+            }
+            else
+            {
+                BICYCL::QFI::nucomp(buckets[b], buckets[b], *f[i], L, neg, tmp);
+            }
+        }
+        // sum_b (b + 1) * bucket[b] with running sums from the top bucket
+        bool has_sum = false, has_acc = false;
+        for (size_t b = half; b-- > 0;)
+        {
+            if (has_bucket[b])
+            {
+                if (has_sum)
+                    BICYCL::QFI::nucomp(sum, sum, buckets[b], L, 0, tmp);
                 else
-                {
-                    curr_degree += ((t == 2) ? 2 : ((t >> 1) * 2 + 1));
-                }
-                size_t b = ((size_t)j) < w - 1 ? tau + 1 + j - w : tau;
-                get_doubled(r, curr_degree, b, L, tmp);
-                j -= w;
+                    sum = buckets[b];
+                has_sum = true;
+            }
+            if (has_sum)
+            {
+                if (has_acc)
+                    BICYCL::QFI::nucomp(acc, acc, sum, L, 0, tmp);
+                else
+                    acc = sum;
+                has_acc = true;
             }
         }
-
-        if (c)
-            BICYCL::QFI::nucomp(r, r, tab[0], L, 1, tmp);
-        curr_degree += 1;
-
-        if (n.sgn() < 0)
+        if (has_acc)
         {
-            r.neg();
+            if (started)
+                BICYCL::QFI::nucomp(r, r, acc, L, 0, tmp);
+            else
+                r = acc;
+            started = true;
         }
     }
+    if (!started)
+        r = cl.one();
 }
@@ -0,0 +1,114 @@
+// Counter-based randomness: AES-256-CTR under one master key, every stream
+// has its own 64 bit id in the IV, so streams never overlap and no state is
+// shared between them. Stream ids are handed out in call order, a single draw
+// takes the next one and a parallel loop reserves one per index, so a seeded
+// run draws the same values whatever thread computes an element.
+class RandomStream
+{
+public:
+    RandomStream() = default;
+    RandomStream(const unsigned char *key, uint64_t id) { reset(key, id); }
+    RandomStream(const RandomStream &) = delete;
+    RandomStream &operator=(const RandomStream &) = delete;
+    RandomStream(RandomStream &&other) noexcept : ctx_m(other.ctx_m) { other.ctx_m = nullptr; }
+    RandomStream &operator=(RandomStream &&other) noexcept
+    {
+        std::swap(ctx_m, other.ctx_m);
+        return *this;
+    }
+    ~RandomStream()
+    {
+        if (ctx_m)
+            EVP_CIPHER_CTX_free(ctx_m);
+    }
+
+    // iv = id (big endian) || 64 bit block counter starting at 0
+    void reset(const unsigned char *key, uint64_t id)
+    {
+        if (!ctx_m && !(ctx_m = EVP_CIPHER_CTX_new()))
+            throw std::runtime_error("EVP_CIPHER_CTX_new failed");
+        unsigned char iv[16] = {};
+        for (int i = 0; i < 8; i++)
+            iv[i] = (unsigned char)(id >> (56 - 8 * i));
+        if (EVP_EncryptInit_ex(ctx_m, EVP_aes_256_ctr(), nullptr, key, iv) != 1)
+            throw std::runtime_error("EVP_EncryptInit_ex failed");
+    }
+
+    void bytes(unsigned char *out, size_t n)
+    {
+        static const unsigned char zeros[256] = {};
+        while (n > 0)
+        {
+            int chunk = (int)(std::min(n, sizeof(zeros)));
+            int len = 0;
+            if (EVP_EncryptUpdate(ctx_m, out, &len, zeros, chunk) != 1 || len != chunk)
+                throw std::runtime_error("EVP_EncryptUpdate failed");
+            out += chunk;
+            n -= chunk;
+        }
+    }
+
+    // uniform in [0, bound), by rejection on the bit length of bound
+    BICYCL::Mpz random_mpz(const BICYCL::Mpz &bound)
+    {
+        if (bound.sgn() <= 0)
+            throw std::invalid_argument("Random bound must be positive");
+        size_t nbits = bound.nbits(), nbytes = (nbits + 7) / 8;
+        thread_local Vector<unsigned char> buf;
+        buf.resize(nbytes);
+        mpz_t r;
+        mpz_init2(r, nbits);
+        do
+        {
+            bytes(buf.data(), nbytes);
+            buf[0] &= (unsigned char)(0xff >> (8 * nbytes - nbits));
+            mpz_import(r, nbytes, 1, 1, 1, 0, buf.data());
+        } while (mpz_cmp(r, (mpz_srcptr)(bound)) >= 0);
+        return BICYCL::Mpz(std::move(r));
+    }
+
+private:
+    EVP_CIPHER_CTX *ctx_m = nullptr;
+};
+
+class RandomStreams
+{
+public:
+    // a fresh master key from the OS
+    RandomStreams()
+    {
+        if (RAND_bytes(key_m, sizeof(key_m)) != 1)
+            throw std::runtime_error("RAND_bytes failed");
+    }
+    explicit RandomStreams(uint64_t seed) { set_seed(seed); }
+    RandomStreams(const RandomStreams &) = delete;
+    RandomStreams &operator=(const RandomStreams &) = delete;
+
+    // master key = SHA-256(seed), for reproducible runs, not for production keys
+    void set_seed(uint64_t seed)
+    {
+        unsigned char s[8];
+        for (int i = 0; i < 8; i++)
+            s[i] = (unsigned char)(seed >> (56 - 8 * i));
+        LockGuard lock(mutex_m);
+        if (EVP_Digest(s, sizeof(s), key_m, nullptr, EVP_sha256(), nullptr) != 1)
+            throw std::runtime_error("EVP_Digest failed");
+        next_id_m.store(0, std::memory_order_relaxed);
+    }
+
+    // ids of n consecutive streams, element i of a loop draws from sequence_stream(first + i)
+    uint64_t reserve(uint64_t n) const { return next_id_m.fetch_add(n, std::memory_order_relaxed); }
+
+    RandomStream sequence_stream(uint64_t id) const
+    {
+        LockGuard lock(mutex_m);
+        return RandomStream(key_m, id);
+    }
+
+    BICYCL::Mpz random_mpz(const BICYCL::Mpz &bound) const { return sequence_stream(reserve(1)).random_mpz(bound); }
+
+private:
+    mutable Mutex mutex_m;
+    unsigned char key_m[32];
+    mutable std::atomic<uint64_t> next_id_m{0};
+};
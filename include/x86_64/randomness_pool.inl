@@ -0,0 +1,138 @@
+#ifndef CoFHE_RANDOMNESS_POOL_LOW_WATERMARK
+#define CoFHE_RANDOMNESS_POOL_LOW_WATERMARK 256
+#endif
+#ifndef CoFHE_RANDOMNESS_POOL_HIGH_WATERMARK
+#define CoFHE_RANDOMNESS_POOL_HIGH_WATERMARK 1024
+#endif
+
+// Offline part of encryption: (h^r, pk^r) pairs for one public key, produced
+// by background threads. Refilling starts when the pool drops below the low
+// watermark and stops at the high watermark, so the workers stay idle while
+// the online path keeps up.
+class EncryptionRandomnessPool
+{
+public:
+    // draws its own randomness, from the worker thread
+    using Producer = std::function<void(BICYCL::QFI &, BICYCL::QFI &)>;
+
+    EncryptionRandomnessPool() = default;
+    EncryptionRandomnessPool(const EncryptionRandomnessPool &) = delete;
+    EncryptionRandomnessPool &operator=(const EncryptionRandomnessPool &) = delete;
+    ~EncryptionRandomnessPool() { stop(); }
+
+    void start(const BICYCL::QFI &pk_elt, Producer producer, size_t low_watermark, size_t high_watermark, size_t num_threads)
+    {
+        if (low_watermark > high_watermark || high_watermark == 0 || num_threads == 0)
+        {
+            throw std::invalid_argument("Invalid randomness pool watermarks");
+        }
+        stop();
+        std::unique_lock<Mutex> lock(mutex_m);
+        pk_elt_m = pk_elt;
+        producer_m = std::move(producer);
+        low_watermark_m = low_watermark;
+        high_watermark_m = high_watermark;
+        refill_m = true;
+        stop_m = false;
+        running_m = true;
+        for (size_t i = 0; i < num_threads; i++)
+            workers_m.emplace_back([this]
+                                   { run(); });
+    }
+
+    void stop()
+    {
+        {
+            std::unique_lock<Mutex> lock(mutex_m);
+            if (!running_m)
+                return;
+            stop_m = true;
+            running_m = false;
+        }
+        cv_m.notify_all();
+        for (auto &worker : workers_m)
+            worker.join();
+        workers_m.clear();
+        std::unique_lock<Mutex> lock(mutex_m);
+        pairs_m.clear();
+        producer_m = nullptr;
+    }
+
+    // false if the pool is not running for this key or is empty, the caller computes the pair itself then
+    bool take(const BICYCL::QFI &pk_elt, BICYCL::QFI &hr, BICYCL::QFI &pkr)
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        if (!running_m || !qfi_equal(pk_elt_m, pk_elt))
+            return false;
+        bool found = !pairs_m.empty();
+        if (found)
+        {
+            hr = std::move(pairs_m.back().first);
+            pkr = std::move(pairs_m.back().second);
+            pairs_m.pop_back();
+        }
+        if (!refill_m && pairs_m.size() < low_watermark_m)
+        {
+            refill_m = true;
+            cv_m.notify_all();
+        }
+        return found;
+    }
+
+    size_t size() const
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        return pairs_m.size();
+    }
+
+    bool running() const
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        return running_m;
+    }
+
+    bool running(const BICYCL::QFI &pk_elt) const
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        return running_m && qfi_equal(pk_elt_m, pk_elt);
+    }
+
+private:
+    mutable Mutex mutex_m;
+    std::condition_variable cv_m;
+    std::vector<std::thread> workers_m;
+    std::vector<std::pair<BICYCL::QFI, BICYCL::QFI>> pairs_m;
+    BICYCL::QFI pk_elt_m;
+    Producer producer_m;
+    size_t low_watermark_m = 0;
+    size_t high_watermark_m = 0;
+    size_t in_flight_m = 0;
+    bool refill_m = false;
+    bool stop_m = false;
+    bool running_m = false;
+
+    void run()
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        while (!stop_m)
+        {
+            if (!refill_m || pairs_m.size() + in_flight_m >= high_watermark_m)
+            {
+                if (pairs_m.size() >= high_watermark_m)
+                    refill_m = false;
+                cv_m.wait(lock, [this]
+                          { return stop_m || (refill_m && pairs_m.size() + in_flight_m < high_watermark_m); });
+                continue;
+            }
+            in_flight_m++;
+            lock.unlock();
+            BICYCL::QFI hr, pkr;
+            producer_m(hr, pkr);
+            lock.lock();
+            in_flight_m--;
+            pairs_m.emplace_back(std::move(hr), std::move(pkr));
+            if (pairs_m.size() >= high_watermark_m)
+                refill_m = false;
+        }
+    }
+};
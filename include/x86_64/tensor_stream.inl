@@ -0,0 +1,492 @@
+#ifndef CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS
+// elements per block of the chunked tensor format, one block goes out per chunk frame
+#define CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS 4096
+#endif
+#ifndef CoFHE_TENSOR_STREAM_MIN_ELEMENTS
+// smaller ciphertext tensor results of the compute handler go out in one piece
+#define CoFHE_TENSOR_STREAM_MIN_ELEMENTS 4096
+#endif
+#ifndef CoFHE_TENSOR_STREAM_DECODE_THREADS
+// threads a TensorStreamReader decodes blocks on
+#define CoFHE_TENSOR_STREAM_DECODE_THREADS 2
+#endif
+#ifndef CoFHE_TENSOR_STREAM_QUEUE_BLOCKS
+// blocks a TensorStreamReader holds before feed waits for the decoding threads
+#define CoFHE_TENSOR_STREAM_QUEUE_BLOCKS 8
+#endif
+
+// Chunked tensor format, for tensors that are sent while they are serialized
+// and decoded while they arrive. A stream header
+//   u32 ndim | TENSOR_STREAM_BIT, u32 coefficients per element, u32 block elements, u32 shape[ndim]
+// is followed by self-describing blocks
+//   u32 count, u64 payload size, u64 offsets[count * coefficients], payload
+// where the offsets are relative to the payload, the top bit is the sign and
+// the payload is the mpz_export data, as in the one piece format.
+inline bool is_tensor_stream(const String &data)
+{
+    uint32_t ndim = 0;
+    if (data.size() >= 4)
+        memcpy(&ndim, data.data(), 4);
+    return (ndim & TENSOR_STREAM_BIT) != 0 && (ndim & COMPRESSED_FORMS_BIT) == 0;
+}
+
+template <typename T>
+struct TensorStreamElement;
+
+template <>
+struct TensorStreamElement<BICYCL::CL_HSM2k::CipherText>
+{
+    static constexpr size_t NUM_COEFFICIENTS = 6;
+    static BICYCL::CL_HSM2k::CipherText *make(BICYCL::Mpz *v)
+    {
+        return new BICYCL::CL_HSM2k::CipherText(BICYCL::QFI(v[0], v[1], v[2]), BICYCL::QFI(v[3], v[4], v[5]));
+    }
+};
+
+// the ciphertexts of a tensor as a source of TensorStreamWriter, an owning
+// source deletes them once the stream is done with them
+class CiphertextTensorSource
+{
+public:
+    static constexpr size_t NUM_COEFFICIENTS = 6;
+
+    CiphertextTensorSource(const Tensor<BICYCL::CL_HSM2k::CipherText *> &ct, bool owns_elements) : shape_m(ct.shape()), tensor_m(ct), owns_m(owns_elements)
+    {
+        tensor_m.flatten();
+    }
+    CiphertextTensorSource(CiphertextTensorSource &&other) : shape_m(std::move(other.shape_m)), tensor_m(other.tensor_m), owns_m(other.owns_m)
+    {
+        other.owns_m = false;
+    }
+    CiphertextTensorSource(const CiphertextTensorSource &) = delete;
+    CiphertextTensorSource &operator=(const CiphertextTensorSource &) = delete;
+    ~CiphertextTensorSource()
+    {
+        if (owns_m)
+        {
+            for (size_t i = 0; i < tensor_m.num_elements(); i++)
+                delete tensor_m.at(i);
+        }
+    }
+
+    const Vector<size_t> &shape() const { return shape_m; }
+    size_t ndim() const { return shape_m.size(); }
+    size_t num_elements() const { return tensor_m.num_elements(); }
+
+    mpz_srcptr coefficient(size_t i, size_t k, mpz_t) const
+    {
+        const auto &ct = *tensor_m.at(i);
+        const BICYCL::QFI &f = k < 3 ? ct.c1() : ct.c2();
+        const BICYCL::Mpz &v = k % 3 == 0 ? f.a() : (k % 3 == 1 ? f.b() : f.c());
+        return (mpz_srcptr)(v);
+    }
+
+private:
+    Vector<size_t> shape_m;
+    Tensor<BICYCL::CL_HSM2k::CipherText *> tensor_m;
+    bool owns_m;
+};
+
+// Writes a tensor in the chunked format a block at a time. The layout of every
+// block is worked out up front from the coefficient sizes, so the size of the
+// whole stream is known before anything is exported. next() hands out the
+// stream header and then one block per call, its elements exported in
+// parallel, so only the block being sent is held. Source is a CiphertextBatch
+// or a CiphertextTensorSource.
+template <typename Source>
+class TensorStreamWriter
+{
+public:
+    TensorStreamWriter(Source source, size_t block_elements = CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS) : source_m(std::move(source)), block_elements_m(block_elements)
+    {
+        if (block_elements == 0 || block_elements > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::invalid_argument("Block size must be positive and fit in 32 bits");
+        }
+        size_m = 12 + 4 * source_m.ndim();
+        for (size_t first = 0; first < source_m.num_elements(); first += block_elements_m)
+        {
+            size_t count = std::min(block_elements_m, source_m.num_elements() - first);
+            uint64_t payload_size = 0;
+            for (size_t i = first; i < first + count; i++)
+            {
+                for (size_t k = 0; k < C; k++)
+                {
+                    mpz_t view;
+                    payload_size += mpz_sizeinbase(source_m.coefficient(i, k, view), 2) / 8 + 1;
+                }
+            }
+            payload_sizes_m.push_back(payload_size);
+            size_m += 12 + 8 * count * C + payload_size;
+        }
+    }
+
+    // bytes of the whole stream
+    size_t size() const { return size_m; }
+
+    // the stream header on the first call, then one block per call; false once everything is out
+    bool next(String &chunk)
+    {
+        if (!header_sent_m)
+        {
+            header_sent_m = true;
+            uint32_t header[3] = {(uint32_t)(source_m.ndim()) | TENSOR_STREAM_BIT, (uint32_t)(C), (uint32_t)(block_elements_m)};
+            chunk.assign(12 + 4 * source_m.ndim(), 0);
+            memcpy(chunk.data(), header, 12);
+            for (size_t i = 0; i < source_m.ndim(); i++)
+            {
+                uint32_t dim = source_m.shape()[i];
+                memcpy(chunk.data() + 12 + 4 * i, &dim, 4);
+            }
+            return true;
+        }
+        if (next_block_m == payload_sizes_m.size())
+        {
+            return false;
+        }
+        const uint64_t sign_bit = (uint64_t)(1) << 63;
+        size_t first = next_block_m * block_elements_m;
+        uint32_t count = (uint32_t)(std::min(block_elements_m, source_m.num_elements() - first));
+        uint64_t payload_size = payload_sizes_m[next_block_m++];
+        Vector<uint64_t> data_offsets(count * C);
+        uint64_t last_offset = 0;
+        for (size_t k = 0; k < count * C; k++)
+        {
+            mpz_t view;
+            mpz_srcptr x = source_m.coefficient(first + k / C, k % C, view);
+            data_offsets[k] = last_offset | (mpz_sgn(x) < 0 ? sign_bit : (uint64_t)(0));
+            last_offset += mpz_sizeinbase(x, 2) / 8 + 1;
+        }
+        size_t header_size = 12 + 8 * data_offsets.size();
+        chunk.assign(header_size + payload_size, 0);
+        memcpy(chunk.data(), &count, 4);
+        memcpy(chunk.data() + 4, &payload_size, 8);
+        memcpy(chunk.data() + 12, data_offsets.data(), 8 * data_offsets.size());
+        char *payload = chunk.data() + header_size;
+        CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t k = 0; k < count * C; k++)
+        {
+            mpz_t view;
+            mpz_export(payload + (data_offsets[k] & ~sign_bit), NULL, -1, 1, -1, 0, source_m.coefficient(first + k / C, k % C, view));
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t C = Source::NUM_COEFFICIENTS;
+
+    Source source_m;
+    size_t block_elements_m;
+    Vector<uint64_t> payload_sizes_m;
+    size_t size_m;
+    size_t next_block_m = 0;
+    bool header_sent_m = false;
+};
+
+// the parts of the chunked format both readers need
+template <typename T>
+struct TensorStreamFormat
+{
+    static constexpr size_t C = TensorStreamElement<T>::NUM_COEFFICIENTS;
+
+    // the size of the stream header at p, 0 while it is incomplete
+    static size_t header(const char *p, size_t available, Vector<size_t> &shape, size_t &num_elements, size_t &block_elements)
+    {
+        uint32_t header[3];
+        if (available < 12)
+            return 0;
+        memcpy(header, p, 12);
+        if ((header[0] & COMPRESSED_FORMS_BIT) || !(header[0] & TENSOR_STREAM_BIT) || header[1] != C || header[2] == 0)
+        {
+            throw std::invalid_argument("Not a tensor stream of this element type");
+        }
+        size_t ndim = header[0] & ~TENSOR_STREAM_BIT;
+        if (available < 12 + 4 * ndim)
+            return 0;
+        shape.resize(ndim);
+        num_elements = 1;
+        for (size_t i = 0; i < ndim; i++)
+        {
+            uint32_t dim;
+            memcpy(&dim, p + 12 + 4 * i, 4);
+            shape[i] = dim;
+            if (dim != 0 && num_elements > std::numeric_limits<size_t>::max() / dim)
+            {
+                throw std::invalid_argument("Tensor shape too large");
+            }
+            num_elements *= dim;
+        }
+        block_elements = header[2];
+        return 12 + 4 * ndim;
+    }
+
+    // the size of the block at p holding at most remaining elements, 0 while it is incomplete
+    static size_t block(const char *p, size_t available, size_t block_elements, size_t remaining, uint32_t &count)
+    {
+        if (available < 12)
+            return 0;
+        uint64_t payload_size;
+        memcpy(&count, p, 4);
+        memcpy(&payload_size, p + 4, 8);
+        if (count == 0 || count > block_elements || count > remaining || payload_size > ((uint64_t)(1) << 62))
+        {
+            throw std::invalid_argument("Invalid tensor stream block");
+        }
+        size_t block_size = 12 + 8 * (size_t)(count) * C + payload_size;
+        return available < block_size ? 0 : block_size;
+    }
+
+    // the elements of a complete block into out, from the flat index first on
+    static void decode(const char *p, Tensor<T *> &out, size_t first)
+    {
+        const uint64_t sign_bit = (uint64_t)(1) << 63;
+        uint32_t count;
+        uint64_t payload_size;
+        memcpy(&count, p, 4);
+        memcpy(&payload_size, p + 4, 8);
+        Vector<uint64_t> data_offsets(count * C + 1);
+        memcpy(data_offsets.data(), p + 12, 8 * count * C);
+        data_offsets[count * C] = payload_size;
+        const char *payload = p + 12 + 8 * count * C;
+        for (size_t k = 0; k < count * C; k++)
+        {
+            uint64_t begin = data_offsets[k] & ~sign_bit, end = data_offsets[k + 1] & ~sign_bit;
+            if (begin > end || end > payload_size)
+            {
+                throw std::invalid_argument("Corrupt tensor stream offsets");
+            }
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            BICYCL::Mpz v[C];
+            for (size_t j = 0; j < C; j++)
+            {
+                size_t k = i * C + j;
+                uint64_t begin = data_offsets[k] & ~sign_bit, end = data_offsets[k + 1] & ~sign_bit;
+                mpz_t s;
+                mpz_init(s);
+                mpz_import(s, end - begin, -1, 1, -1, 0, payload + begin);
+                if (data_offsets[k] & sign_bit)
+                    mpz_neg(s, s);
+                v[j] = BICYCL::Mpz(std::move(s));
+            }
+            out.at(first + i) = TensorStreamElement<T>::make(v);
+        }
+    }
+};
+
+// a whole stream already in memory, the blocks are decoded in parallel
+template <typename T>
+Tensor<T *> read_tensor_stream(const String &data)
+{
+    using Format = TensorStreamFormat<T>;
+    Vector<size_t> shape;
+    size_t num_elements = 0, block_elements = 0;
+    size_t pos = Format::header(data.data(), data.size(), shape, num_elements, block_elements);
+    if (pos == 0)
+    {
+        throw std::invalid_argument("Truncated tensor stream");
+    }
+    Vector<size_t> blocks, firsts;
+    size_t seen = 0;
+    while (seen < num_elements)
+    {
+        uint32_t count;
+        size_t size = Format::block(data.data() + pos, data.size() - pos, block_elements, num_elements - seen, count);
+        if (size == 0)
+        {
+            throw std::invalid_argument("Truncated tensor stream");
+        }
+        blocks.push_back(pos);
+        firsts.push_back(seen);
+        pos += size;
+        seen += count;
+    }
+    if (pos != data.size())
+    {
+        throw std::invalid_argument("Trailing data after the tensor stream");
+    }
+    Tensor<T *> tensor(Vector<size_t>{num_elements}, nullptr);
+    std::atomic<bool> invalid{false};
+    CoFHE_PARALLEL_FOR_STATIC_SCHEDULE for (size_t b = 0; b < blocks.size(); b++)
+    {
+        try
+        {
+            Format::decode(data.data() + blocks[b], tensor, firsts[b]);
+        }
+        catch (const std::exception &)
+        {
+            invalid.store(true, std::memory_order_relaxed);
+        }
+    }
+    if (invalid.load())
+    {
+        for (size_t i = 0; i < num_elements; i++)
+            delete tensor.at(i);
+        throw std::invalid_argument("Corrupt tensor stream offsets");
+    }
+    tensor.reshape(shape);
+    return tensor;
+}
+
+// Takes the chunked format in pieces of any size, as they come off the
+// socket. Every complete block is queued to a few decoding threads and decoded
+// straight into its place in the tensor, so decoding overlaps the transfer.
+// feed() waits while CoFHE_TENSOR_STREAM_QUEUE_BLOCKS blocks are queued, which
+// holds the sender back instead of buffering the whole tensor.
+template <typename T>
+class TensorStreamReader
+{
+public:
+    explicit TensorStreamReader(size_t num_threads = CoFHE_TENSOR_STREAM_DECODE_THREADS, size_t queue_blocks = CoFHE_TENSOR_STREAM_QUEUE_BLOCKS) : queue_blocks_m(queue_blocks)
+    {
+        if (num_threads == 0 || queue_blocks == 0)
+        {
+            throw std::invalid_argument("A tensor stream reader needs a thread and a queue slot");
+        }
+        for (size_t i = 0; i < num_threads; i++)
+            workers_m.emplace_back([this]
+                                   { run(); });
+    }
+    TensorStreamReader(const TensorStreamReader &) = delete;
+    TensorStreamReader &operator=(const TensorStreamReader &) = delete;
+    ~TensorStreamReader()
+    {
+        stop();
+        if (!finished_m)
+        {
+            for (size_t i = 0; i < tensor_m.num_elements(); i++)
+                delete tensor_m.at(i);
+        }
+    }
+
+    void feed(const char *data, size_t size)
+    {
+        pending_m.append(data, size);
+        size_t consumed = 0;
+        while (parse(consumed))
+            ;
+        pending_m.erase(0, consumed);
+    }
+
+    void feed(std::string_view data) { feed(data.data(), data.size()); }
+
+    bool complete() const { return header_parsed_m && elements_seen_m == num_elements_m && pending_m.empty(); }
+
+    // waits for the queued blocks, the caller owns the elements of the returned tensor
+    Tensor<T *> finish()
+    {
+        stop();
+        if (error_m)
+            std::rethrow_exception(error_m);
+        if (!complete())
+        {
+            throw std::invalid_argument("Tensor stream ended before all blocks arrived");
+        }
+        finished_m = true;
+        tensor_m.reshape(shape_m);
+        return tensor_m;
+    }
+
+private:
+    using Format = TensorStreamFormat<T>;
+
+    struct Block
+    {
+        size_t first;
+        String data;
+    };
+
+    size_t queue_blocks_m;
+    String pending_m;
+    bool header_parsed_m = false;
+    bool finished_m = false;
+    Vector<size_t> shape_m;
+    size_t num_elements_m = 0;
+    size_t block_elements_m = 0;
+    size_t elements_seen_m = 0;
+    Tensor<T *> tensor_m{Vector<size_t>{0}, nullptr};
+
+    Mutex mutex_m;
+    std::condition_variable_any queued_m;
+    std::condition_variable_any room_m;
+    std::vector<std::thread> workers_m;
+    std::deque<Block> queue_m;
+    std::exception_ptr error_m;
+    bool stop_m = false;
+
+    // takes the header or one block off pending_m at consumed, false if it is not complete yet
+    bool parse(size_t &consumed)
+    {
+        const char *p = pending_m.data() + consumed;
+        size_t available = pending_m.size() - consumed;
+        if (!header_parsed_m)
+        {
+            size_t size = Format::header(p, available, shape_m, num_elements_m, block_elements_m);
+            if (size == 0)
+                return false;
+            tensor_m = Tensor<T *>(Vector<size_t>{num_elements_m}, nullptr);
+            header_parsed_m = true;
+            consumed += size;
+            return true;
+        }
+        if (available > 0 && elements_seen_m == num_elements_m)
+        {
+            throw std::invalid_argument("Trailing data after the tensor stream");
+        }
+        uint32_t count;
+        size_t size = elements_seen_m == num_elements_m ? 0 : Format::block(p, available, block_elements_m, num_elements_m - elements_seen_m, count);
+        if (size == 0)
+            return false;
+        {
+            std::unique_lock<Mutex> lock(mutex_m);
+            room_m.wait(lock, [this]
+                        { return queue_m.size() < queue_blocks_m || stop_m; });
+            queue_m.push_back(Block{elements_seen_m, String(p, size)});
+        }
+        queued_m.notify_one();
+        elements_seen_m += count;
+        consumed += size;
+        return true;
+    }
+
+    void stop()
+    {
+        {
+            LockGuard lock(mutex_m);
+            stop_m = true;
+        }
+        queued_m.notify_all();
+        room_m.notify_all();
+        for (auto &worker : workers_m)
+            worker.join();
+        workers_m.clear();
+    }
+
+    // the workers drain the queue before they return
+    void run()
+    {
+        std::unique_lock<Mutex> lock(mutex_m);
+        while (true)
+        {
+            queued_m.wait(lock, [this]
+                          { return stop_m || !queue_m.empty(); });
+            if (queue_m.empty())
+                return;
+            Block block = std::move(queue_m.front());
+            queue_m.pop_front();
+            room_m.notify_one();
+            lock.unlock();
+            try
+            {
+                Format::decode(block.data.data(), tensor_m, block.first);
+            }
+            catch (...)
+            {
+                LockGuard error_lock(mutex_m);
+                if (!error_m)
+                    error_m = std::current_exception();
+            }
+            lock.lock();
+        }
+    }
+};
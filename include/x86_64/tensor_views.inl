@@ -0,0 +1,163 @@
+// Read-only views over a serialized tensor of forms (ciphertexts or partial
+// decryptions, full or compressed format). The header and pointer table are
+// checked once, a form is decoded straight from the buffer when it is asked
+// for, and nothing else is. Part decryption only ever decodes c1 and the
+// combine step only c2, instead of deserializing whole tensors first. The
+// buffer has to outlive the view.
+class FormTensorView
+{
+public:
+    FormTensorView() = default;
+
+    // discriminants[j] is the discriminant of the form j of every element, for the compressed format
+    FormTensorView(const char *data, size_t size, size_t forms_per_element, const Vector<const BICYCL::Mpz *> &discriminants)
+        : data_m(data), discriminants_m(discriminants), forms_per_element_m(forms_per_element)
+    {
+        const uint64_t sign_bit = (uint64_t)(1) << 63;
+        if (size < 4)
+        {
+            throw std::invalid_argument("Truncated tensor data");
+        }
+        uint32_t ndim;
+        memcpy(&ndim, data, 4);
+        compressed_m = (ndim & COMPRESSED_FORMS_BIT) != 0;
+        ndim &= ~COMPRESSED_FORMS_BIT;
+        if (ndim & TENSOR_STREAM_BIT)
+        {
+            throw std::invalid_argument("Tensor streams are read with read_tensor_stream, not viewed");
+        }
+        if (compressed_m && discriminants_m.size() != forms_per_element_m)
+        {
+            throw std::invalid_argument("Compressed forms need one discriminant per form of an element");
+        }
+        size_t header_size = 4 + 4 * (size_t)(ndim);
+        if (size < header_size)
+        {
+            throw std::invalid_argument("Truncated tensor data");
+        }
+        shape_m.resize(ndim);
+        num_elements_m = 1;
+        for (size_t i = 0; i < ndim; i++)
+        {
+            uint32_t dim;
+            memcpy(&dim, data + 4 + 4 * i, 4);
+            shape_m[i] = dim;
+            if (dim != 0 && num_elements_m > std::numeric_limits<size_t>::max() / dim)
+            {
+                throw std::invalid_argument("Tensor shape too large");
+            }
+            num_elements_m *= dim;
+        }
+        if (forms_per_element_m != 0 && num_elements_m > std::numeric_limits<size_t>::max() / (forms_per_element_m * coefficients_per_form()))
+        {
+            throw std::invalid_argument("Tensor shape too large");
+        }
+        size_t num_coefficients = num_elements_m * forms_per_element_m * coefficients_per_form();
+        if ((size - header_size) / 8 < num_coefficients)
+        {
+            throw std::invalid_argument("Truncated tensor data");
+        }
+        table_m = data + header_size;
+        payload_m = table_m + 8 * num_coefficients;
+        payload_size_m = size - header_size - 8 * num_coefficients;
+        // the offsets are increasing, checking them here makes every decode in bounds
+        uint64_t previous = 0;
+        for (size_t k = 0; k < num_coefficients; k++)
+        {
+            uint64_t offset;
+            memcpy(&offset, table_m + 8 * k, 8);
+            offset &= ~sign_bit;
+            if (offset < previous || offset > payload_size_m)
+            {
+                throw std::invalid_argument("Corrupt tensor offsets");
+            }
+            previous = offset;
+        }
+    }
+
+    const Vector<size_t> &shape() const { return shape_m; }
+    size_t ndim() const { return shape_m.size(); }
+    size_t num_elements() const { return num_elements_m; }
+    bool compressed() const { return compressed_m; }
+
+    // form j of element i (flat index)
+    BICYCL::QFI form(size_t i, size_t j) const
+    {
+        size_t first = (i * forms_per_element_m + j) * coefficients_per_form();
+        mpz_t a, b, c;
+        mpz_inits(a, b, c, NULL);
+        coefficient(first, a);
+        coefficient(first + 1, b);
+        if (!compressed_m)
+        {
+            coefficient(first + 2, c);
+            return BICYCL::QFI(BICYCL::Mpz(std::move(a)), BICYCL::Mpz(std::move(b)), BICYCL::Mpz(std::move(c)));
+        }
+        // c = (b^2 - disc) / 4a
+        mpz_t four_a;
+        mpz_init(four_a);
+        mpz_mul(c, b, b);
+        mpz_sub(c, c, (mpz_srcptr)(*discriminants_m[j]));
+        mpz_mul_2exp(four_a, a, 2);
+        bool valid = mpz_sgn(a) > 0 && mpz_divisible_p(c, four_a);
+        if (valid)
+            mpz_divexact(c, c, four_a);
+        mpz_clear(four_a);
+        if (!valid)
+        {
+            mpz_clears(a, b, c, NULL);
+            throw std::invalid_argument("Compressed form does not match the discriminant");
+        }
+        return BICYCL::QFI(BICYCL::Mpz(std::move(a)), BICYCL::Mpz(std::move(b)), BICYCL::Mpz(std::move(c)), true);
+    }
+
+private:
+    const char *data_m = nullptr;
+    const char *table_m = nullptr;
+    const char *payload_m = nullptr;
+    uint64_t payload_size_m = 0;
+    Vector<size_t> shape_m;
+    size_t num_elements_m = 0;
+    Vector<const BICYCL::Mpz *> discriminants_m;
+    size_t forms_per_element_m = 0;
+    bool compressed_m = false;
+
+    size_t coefficients_per_form() const { return compressed_m ? 2 : 3; }
+
+    void coefficient(size_t k, mpz_t v) const
+    {
+        const uint64_t sign_bit = (uint64_t)(1) << 63;
+        size_t num_coefficients = num_elements_m * forms_per_element_m * coefficients_per_form();
+        uint64_t offset, end = payload_size_m;
+        memcpy(&offset, table_m + 8 * k, 8);
+        if (k + 1 < num_coefficients)
+        {
+            memcpy(&end, table_m + 8 * (k + 1), 8);
+            end &= ~sign_bit;
+        }
+        mpz_import(v, end - (offset & ~sign_bit), -1, 1, -1, 0, payload_m + (offset & ~sign_bit));
+        if (offset & sign_bit)
+            mpz_neg(v, v);
+    }
+};
+
+class CiphertextTensorView : public FormTensorView
+{
+public:
+    CiphertextTensorView() = default;
+    CiphertextTensorView(const String &data, const BICYCL::Mpz &disc_G, const BICYCL::Mpz &disc_Delta)
+        : FormTensorView(data.data(), data.size(), 2, {&disc_G, &disc_Delta}) {}
+
+    BICYCL::QFI c1(size_t i) const { return form(i, 0); }
+    BICYCL::QFI c2(size_t i) const { return form(i, 1); }
+};
+
+class PartDecryptionResultTensorView : public FormTensorView
+{
+public:
+    PartDecryptionResultTensorView() = default;
+    PartDecryptionResultTensorView(const String &data, const BICYCL::Mpz &disc_Delta)
+        : FormTensorView(data.data(), data.size(), 1, {&disc_Delta}) {}
+
+    BICYCL::QFI at(size_t i) const { return form(i, 0); }
+};
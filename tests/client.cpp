@@ -0,0 +1,440 @@
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "node/client.hpp"
+#include "node/client_pool.hpp"
+#include "node/server.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+using namespace CoFHE::Network;
+
+#define TEST_ADDRESS "127.0.0.1"
+#define TEST_PORT "48731"
+#define TEST_STALL_PORT "48732"
+#define TEST_BUSY_PORT "48733"
+#define TEST_CHUNK_PORT "48734"
+
+// answers with the data of the request after sleeping for the milliseconds it starts with
+class DelayHandler
+{
+public:
+    using RequestType = ComputeRequest;
+    using ResponseType = ComputeResponse;
+
+    ComputeResponse handle_request(const ComputeRequest &request)
+    {
+        const auto &data = request.operation().operands()[0].data();
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::stoi(data)));
+        return ComputeResponse(ComputeResponse::Status::OK, data);
+    }
+};
+
+ComputeRequest delayed(int ms, int tag)
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    return ComputeRequest(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::UNARY, ComputeRequest::ComputeOperation::DECRYPT,
+                                                                   {Operand(ComputeRequest::DataType::SINGLE, ComputeRequest::DataEncrytionType::CIPHERTEXT, std::to_string(ms) + " " + std::to_string(tag))}));
+}
+
+// "<i>;" for i < count, one per next() after sleeping ms; fails instead of piece fail_at if it is set
+class CountingChunks : public ChunkSource
+{
+public:
+    CountingChunks(int count, int fail_at, int ms) : count_m(count), fail_at_m(fail_at), ms_m(ms)
+    {
+        for (int i = 0; i < count; i++)
+            size_m += std::to_string(i).size() + 1;
+    }
+    size_t size() const override { return size_m; }
+    bool next(std::string &chunk) override
+    {
+        if (next_m == count_m)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms_m));
+        if (fail_at_m > 0 && next_m == fail_at_m)
+            throw std::runtime_error("source failed");
+        chunk = std::to_string(next_m++) + ";";
+        return true;
+    }
+
+private:
+    int count_m, fail_at_m, ms_m;
+    int next_m = 0;
+    size_t size_m = 0;
+};
+
+std::string counted(int count)
+{
+    std::string data;
+    for (int i = 0; i < count; i++)
+        data += std::to_string(i) + ";";
+    return data;
+}
+
+// "count fail_at ms" is answered with a chunked response of CountingChunks, a count of 0 with the data at once
+class ChunkHandler
+{
+public:
+    using RequestType = ComputeRequest;
+    using ResponseType = ComputeResponse;
+
+    ComputeResponse handle_request(const ComputeRequest &request)
+    {
+        std::istringstream in(request.operation().operands()[0].data());
+        int count = 0, fail_at = 0, ms = 0;
+        in >> count >> fail_at >> ms;
+        if (count == 0)
+            return ComputeResponse(ComputeResponse::Status::OK, request.operation().operands()[0].data());
+        return ComputeResponse(ComputeResponse::Status::OK, std::make_shared<CountingChunks>(count, fail_at, ms));
+    }
+};
+
+ComputeRequest chunked(int count, int fail_at, int ms)
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    return ComputeRequest(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::UNARY, ComputeRequest::ComputeOperation::DECRYPT,
+                                                                   {Operand(ComputeRequest::DataType::SINGLE, ComputeRequest::DataEncrytionType::CIPHERTEXT, std::to_string(count) + " " + std::to_string(fail_at) + " " + std::to_string(ms))}));
+}
+
+template <typename E, typename F>
+bool throws(F &&f)
+{
+    try
+    {
+        f();
+    }
+    catch (const E &)
+    {
+        return true;
+    }
+    return false;
+}
+
+// accepts connections and never answers their TLS handshake, until released; later ones are closed at once
+class StallingListener
+{
+public:
+    StallingListener(const std::string &port) : acceptor_m(io_context_m, tcp::endpoint(asio::ip::make_address(TEST_ADDRESS), static_cast<unsigned short>(std::stoi(port))))
+    {
+        do_accept();
+        thread_m = std::thread([this]()
+                               { io_context_m.run(); });
+    }
+
+    ~StallingListener()
+    {
+        asio::post(io_context_m, [this]()
+                   {
+            acceptor_m.close();
+            sockets_m.clear(); });
+        thread_m.join();
+    }
+
+    void release()
+    {
+        asio::post(io_context_m, [this]()
+                   {
+            released_m = true;
+            sockets_m.clear(); });
+    }
+
+private:
+    asio::io_context io_context_m;
+    tcp::acceptor acceptor_m;
+    std::vector<tcp::socket> sockets_m;
+    bool released_m = false;
+    std::thread thread_m;
+
+    void do_accept()
+    {
+        acceptor_m.async_accept([this](const std::error_code &error, tcp::socket socket)
+                                {
+            if (error)
+                return;
+            if (!released_m)
+                sockets_m.push_back(std::move(socket));
+            do_accept(); });
+    }
+};
+
+// V2 responses come back as they finish and each goes to its own request, V1 ones in order
+void test_pipelining()
+{
+    Client client(TEST_ADDRESS, TEST_PORT, true);
+    std::vector<std::future<ComputeResponse>> futures;
+    for (int i = 0; i < 8; i++)
+        futures.push_back(client.run_async(ServiceType::COMPUTE_REQUEST, delayed(i == 0 ? 400 : 0, i)));
+    for (int i = 1; i < 8; i++)
+        CHECK(futures[i].get().data() == "0 " + std::to_string(i));
+    // the slow first request is still running when the ones behind it are answered
+    CHECK(futures[0].wait_for(std::chrono::milliseconds::zero()) != std::future_status::ready);
+    CHECK(futures[0].get().data() == "400 0");
+    CHECK(client.in_flight() == 0);
+
+    Client v1_client(TEST_ADDRESS, TEST_PORT, true);
+    v1_client.set_protocol_version(ProtocolVersion::V1);
+    futures.clear();
+    for (int i = 0; i < 4; i++)
+        futures.push_back(v1_client.run_async(ServiceType::COMPUTE_REQUEST, delayed(i == 0 ? 100 : 0, i)));
+    for (int i = 0; i < 4; i++)
+        CHECK(futures[i].get().data() == std::to_string(i == 0 ? 100 : 0) + " " + std::to_string(i));
+}
+
+// an expired request fails at once, its late response is dropped and the connection stays usable
+void test_deadlines(ProtocolVersion ver)
+{
+    Client client(TEST_ADDRESS, TEST_PORT, true);
+    client.set_protocol_version(ver);
+    auto slow = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(300, 1), std::chrono::milliseconds(100));
+    auto fast = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 2));
+    CHECK(throws<DeadlineExceeded>([&]
+                                   { slow.get(); }));
+    // a V1 server answers the expired request first, that response must not go to this one
+    CHECK(fast.get().data() == "0 2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    CHECK(client.is_open());
+    CHECK(client.in_flight() == 0);
+    CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 3)).get().data() == "0 3");
+
+    // every request expired, the next one still gets its own response
+    auto lost = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(200, 4), std::chrono::milliseconds(50));
+    CHECK(throws<DeadlineExceeded>([&]
+                                   { lost.get(); }));
+    CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 5)).get().data() == "0 5");
+}
+
+// run throws the error of the request and leaves the response alone
+void test_run_errors()
+{
+    Client client(TEST_ADDRESS, TEST_PORT, true);
+    client.set_timeout(std::chrono::milliseconds(50));
+    ComputeResponse *res = nullptr;
+    CHECK(throws<DeadlineExceeded>([&]
+                                   { client.run(ServiceType::COMPUTE_REQUEST, delayed(200, 1), &res); }));
+    CHECK(res == nullptr);
+    client.set_timeout(std::chrono::milliseconds::zero());
+    client.run(ServiceType::COMPUTE_REQUEST, delayed(0, 2), &res);
+    CHECK(res != nullptr && res->data() == "0 2");
+    delete res;
+    res = nullptr;
+
+    client.close();
+    CHECK(throws<std::runtime_error>([&]
+                                     { client.run(ServiceType::COMPUTE_REQUEST, delayed(0, 3), &res); }));
+    CHECK(res == nullptr);
+}
+
+// checkout spreads the callers over the connections and skips the closed ones, health_check reopens them
+void test_pool()
+{
+    ClientPool pool(TEST_ADDRESS, TEST_PORT, 3);
+    CHECK(pool.healthy() == 3);
+    auto slow = pool.run_async(ServiceType::COMPUTE_REQUEST, delayed(200, 1));
+    auto client = pool.checkout();
+    CHECK(client->in_flight() == 0);
+    CHECK(client->run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 2)).get().data() == "0 2");
+
+    client->close();
+    for (int i = 0; i < 100 && client->is_open(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(pool.healthy() == 2);
+    for (int i = 0; i < 4; i++)
+        CHECK(pool.checkout() != client);
+    CHECK(pool.health_check() == 3);
+    CHECK(slow.get().data() == "200 1");
+    client.reset();
+
+    CHECK(throws<std::runtime_error>([]
+                                     { ClientPool(TEST_ADDRESS, TEST_STALL_PORT, 2); }));
+}
+
+// a health check that hangs in the TLS handshake does not hold up the pool, a checkout waits for it
+void test_pool_reconnect_unlocked()
+{
+    std::unique_ptr<ClientPool> pool;
+    {
+        Server<DelayHandler, ComputeRequest, ComputeResponse> server(TEST_ADDRESS, TEST_STALL_PORT, DelayHandler(), 1, 1);
+        std::thread server_thread([&server]
+                                  { server.run(); });
+        pool = std::make_unique<ClientPool>(TEST_ADDRESS, TEST_STALL_PORT, 2);
+        server.stop();
+        server_thread.join();
+    }
+    // the connections only notice the server is gone with their next request
+    for (int i = 0; i < 10 && pool->healthy() > 0; i++)
+    {
+        try
+        {
+            pool->run_async(ServiceType::COMPUTE_REQUEST, delayed(0, i)).get();
+        }
+        catch (const std::exception &)
+        {
+        }
+    }
+    CHECK(pool->healthy() == 0);
+
+    StallingListener listener(TEST_STALL_PORT);
+    auto health_check = std::async(std::launch::async, [&pool]()
+                                   { return pool->health_check(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto healthy = std::async(std::launch::async, [&pool]()
+                              { return pool->healthy(); });
+    CHECK(healthy.wait_for(std::chrono::seconds(1)) == std::future_status::ready);
+    auto checkout = std::async(std::launch::async, [&pool]()
+                               { return pool->checkout(); });
+    CHECK(checkout.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready);
+    listener.release();
+    CHECK(health_check.get() == 0);
+    CHECK(throws<std::runtime_error>([&]
+                                     { checkout.get(); }));
+    CHECK(healthy.get() == 0);
+}
+
+// one worker per hardware thread by default, and a task is refused once the queue is full
+void test_compute_executor()
+{
+    ComputeExecutor executor;
+    CHECK(executor.stats().threads == std::min<size_t>(COMPUTE_PARALLEL_REQUESTS, std::max<size_t>(1, std::thread::hardware_concurrency())));
+    CHECK(executor.stats().wait_threads == COMPUTE_WAIT_THREAD_COUNT);
+    CHECK(throws<std::invalid_argument>([]
+                                        { ComputeExecutor(1, 0); }));
+
+    ComputeExecutor small(1, 1);
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::promise<void> started;
+    CHECK(small.try_submit([released, &started]()
+                           { started.set_value(); released.wait(); }));
+    started.get_future().wait();
+    CHECK(small.try_submit([released]()
+                           { released.wait(); }));
+    CHECK(!small.try_submit([]() {}));
+    auto stats = small.stats();
+    CHECK(stats.running == 1 && stats.queue_depth == 1 && stats.rejected == 1);
+    release.set_value();
+
+    // a task waiting on other nodes leaves its slot to the next one and takes it back afterwards
+    ComputeExecutor one_slot(1, 4, 1);
+    std::promise<void> answer;
+    auto answered = answer.get_future().share();
+    std::promise<void> waiting, computed, resumed;
+    CHECK(one_slot.try_submit([answered, &waiting, &resumed]()
+                              {
+        {
+            ComputeExecutor::RemoteWait remote;
+            waiting.set_value();
+            answered.wait();
+        }
+        resumed.set_value(); }));
+    waiting.get_future().wait();
+    CHECK(one_slot.try_submit([&computed]()
+                              { computed.set_value(); }));
+    CHECK(computed.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    CHECK(one_slot.stats().waiting == 1);
+    answer.set_value();
+    CHECK(resumed.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    // outside of a task it does nothing
+    {
+        ComputeExecutor::RemoteWait remote;
+    }
+    CHECK(one_slot.stats().waiting == 0);
+}
+
+// a request the executor has no room for is answered BUSY at once, without waiting for the running ones
+void test_busy()
+{
+    Server<DelayHandler, ComputeRequest, ComputeResponse> server(TEST_ADDRESS, TEST_BUSY_PORT, DelayHandler(), 1, 1, 1);
+    std::thread server_thread([&server]
+                              { server.run(); });
+    {
+        Client client(TEST_ADDRESS, TEST_BUSY_PORT, true);
+        auto running = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(400, 1));
+        for (int i = 0; i < 100 && server.compute_stats().running == 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto queued = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 2));
+        auto rejected = client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 3));
+        CHECK(throws<ServerBusy>([&]
+                                 { rejected.get(); }));
+        CHECK(running.wait_for(std::chrono::milliseconds::zero()) != std::future_status::ready);
+        CHECK(running.get().data() == "400 1");
+        CHECK(queued.get().data() == "0 2");
+        CHECK(server.compute_stats().rejected == 1);
+        // the connection stays usable, a retry goes through once there is room
+        CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, delayed(0, 4)).get().data() == "0 4");
+    }
+    server.stop();
+    server_thread.join();
+}
+
+// a chunked response is put back together or handed over piece by piece, other responses go out between its
+// chunks, a failure midway fails the request and V1 gets it in one frame
+void test_chunked_responses()
+{
+    Server<ChunkHandler, ComputeRequest, ComputeResponse> server(TEST_ADDRESS, TEST_CHUNK_PORT, ChunkHandler(), 1, 2);
+    std::thread server_thread([&server]
+                              { server.run(); });
+    {
+        Client client(TEST_ADDRESS, TEST_CHUNK_PORT, true);
+        // more chunks than the window, the producer parks and is resumed
+        CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, chunked(3 * SERVER_CHUNK_WINDOW, 0, 0)).get().data() == counted(3 * SERVER_CHUNK_WINDOW));
+
+        std::mutex mutex;
+        std::vector<std::string> pieces;
+        std::promise<Response> done;
+        client.async_request(ServiceType::COMPUTE_REQUEST, chunked(10, 0, 30).to_buffers(), [&done](std::exception_ptr error, Response res)
+                             {
+            if (error)
+                done.set_exception(error);
+            else
+                done.set_value(std::move(res)); }, std::chrono::milliseconds::zero(), [&mutex, &pieces](std::string_view piece)
+                             {
+            std::lock_guard<std::mutex> lock(mutex);
+            pieces.emplace_back(piece); });
+        // answered while the chunked one is still being produced
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, chunked(0, 0, 0)).get().data() == "0 0 0");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            CHECK(pieces.size() < 11);
+        }
+        auto res = done.get_future().get();
+        CHECK(res.status() == Response::Status::OK);
+        CHECK(res.data().empty());
+        std::string joined;
+        for (const auto &piece : pieces)
+            joined += piece;
+        // the header of the compute response comes first, then the pieces in order
+        CHECK(joined.size() > ComputeResponse::V2_HEADER_SIZE && joined.substr(ComputeResponse::V2_HEADER_SIZE) == counted(10));
+
+        CHECK(throws<std::runtime_error>([&]
+                                         { client.run_async(ServiceType::COMPUTE_REQUEST, chunked(6, 3, 0)).get(); }));
+        CHECK(client.run_async(ServiceType::COMPUTE_REQUEST, chunked(2, 0, 0)).get().data() == counted(2));
+        CHECK(client.in_flight() == 0);
+
+        Client v1_client(TEST_ADDRESS, TEST_CHUNK_PORT, true);
+        v1_client.set_protocol_version(ProtocolVersion::V1);
+        CHECK(v1_client.run_async(ServiceType::COMPUTE_REQUEST, chunked(3 * SERVER_CHUNK_WINDOW, 0, 0)).get().data() == counted(3 * SERVER_CHUNK_WINDOW));
+    }
+    server.stop();
+    server_thread.join();
+}
+
+int main()
+{
+    Server<DelayHandler, ComputeRequest, ComputeResponse> server(TEST_ADDRESS, TEST_PORT, DelayHandler(), 2, 4);
+    std::thread server_thread([&server]
+                              { server.run(); });
+    test_pipelining();
+    test_deadlines(ProtocolVersion::V2);
+    test_deadlines(ProtocolVersion::V1);
+    test_run_errors();
+    test_pool();
+    test_pool_reconnect_unlocked();
+    test_compute_executor();
+    test_busy();
+    test_chunked_responses();
+    server.stop();
+    server_thread.join();
+    return test_result();
+}
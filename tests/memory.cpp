@@ -0,0 +1,153 @@
+#include <thread>
+#include "common/memory.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+Arena::Header *header(void *p)
+{
+    return static_cast<Arena::Header *>(p) - 1;
+}
+
+// all blocks freed: the bump position goes back to the mark and the next block starts there
+void test_rewind()
+{
+    Arena arena{ArenaOptions()};
+    arena.push_mark();
+    void *p = arena.allocate(100);
+    void *q = arena.allocate(5000);
+    arena.release(header(q));
+    arena.release(header(p));
+    CHECK(arena.pop_mark());
+    // a size class that has never been freed, so it is carved and not recycled
+    void *r = arena.allocate(3000);
+    CHECK(r == p);
+    arena.release(header(r));
+    CHECK(arena.stats().bytes_allocated == 0);
+}
+
+// a block that outlives the scope pins it and keeps its contents
+void test_escape()
+{
+    Arena arena{ArenaOptions()};
+    arena.push_mark();
+    void *p = arena.allocate(100);
+    char *kept = static_cast<char *>(arena.allocate(200));
+    std::memset(kept, 0x5a, 200);
+    arena.release(header(p));
+    CHECK(!arena.pop_mark());
+    void *r = arena.allocate(3000);
+    CHECK(static_cast<char *>(r) > kept);
+    std::memset(r, 0, 3000);
+    bool intact = true;
+    for (size_t i = 0; i < 200; i++)
+        intact = intact && kept[i] == 0x5a;
+    CHECK(intact);
+    arena.release(header(r));
+    arena.release(header(kept));
+    // later scopes are not affected
+    arena.push_mark();
+    arena.release(header(arena.allocate(64)));
+    CHECK(arena.pop_mark());
+}
+
+void test_nested()
+{
+    Arena arena{ArenaOptions()};
+    arena.push_mark();
+    void *outer = arena.allocate(100);
+    arena.push_mark();
+    arena.release(header(arena.allocate(100)));
+    CHECK(arena.pop_mark());
+    arena.release(header(outer));
+    CHECK(arena.pop_mark());
+
+    // the blocks that escape the inner scope count for the outer one
+    arena.push_mark();
+    arena.push_mark();
+    void *inner = arena.allocate(100);
+    CHECK(!arena.pop_mark());
+    arena.release(header(inner));
+    CHECK(arena.pop_mark());
+}
+
+// a block freed by another thread is handed back before the scope ends
+void test_remote_release()
+{
+    Arena arena{ArenaOptions()};
+    arena.push_mark();
+    void *p = arena.allocate(100);
+    std::thread([&arena, p]
+                { arena.release_remote(header(p)); })
+        .join();
+    CHECK(arena.stats().bytes_allocated == 0);
+    CHECK(arena.pop_mark());
+}
+
+// blocks beyond the largest size class come from malloc and do not pin a scope
+void test_unpooled()
+{
+    Arena arena{ArenaOptions()};
+    size_t unpooled = Arena::unpooled_bytes().load();
+    arena.push_mark();
+    void *p = arena.allocate(size_t(1) << 20);
+    CHECK(header(p)->owner == nullptr);
+    CHECK(Arena::unpooled_bytes().load() > unpooled);
+    CHECK(arena.pop_mark());
+    Arena::deallocate_unpooled(header(p));
+    CHECK(Arena::unpooled_bytes().load() == unpooled);
+}
+
+// GMP through the installed allocator: scoped temporaries, a value grown inside
+// the scope and used after it, and an mpz freed on another thread
+void test_gmp_scope()
+{
+    mpz_t kept, expected;
+    mpz_init(kept);
+    mpz_init(expected);
+    mpz_ui_pow_ui(expected, 3, 5000);
+    {
+        ArenaScope scope;
+        mpz_t t;
+        mpz_init(t);
+        for (int i = 0; i < 100; i++)
+            mpz_ui_pow_ui(t, 7, 100 + i);
+        mpz_clear(t);
+        mpz_ui_pow_ui(kept, 3, 5000);
+    }
+    for (int i = 0; i < 100; i++)
+    {
+        ArenaScope scope;
+        mpz_t t;
+        mpz_init(t);
+        mpz_ui_pow_ui(t, 5, 1000 + i);
+        mpz_clear(t);
+    }
+    CHECK(mpz_cmp(kept, expected) == 0);
+
+    mpz_t moved;
+    {
+        ArenaScope scope;
+        mpz_init_set(moved, expected);
+        std::thread([&moved]
+                    { mpz_clear(moved); })
+            .join();
+    }
+    CHECK(gmp_thread_arena_stats().num_allocations > 0);
+    mpz_clear(kept);
+    mpz_clear(expected);
+}
+
+int main()
+{
+    // before anything allocates through GMP
+    install_gmp_arena_allocator();
+    CHECK(gmp_arena_allocator_installed());
+    test_rewind();
+    test_escape();
+    test_nested();
+    test_remote_release();
+    test_unpooled();
+    test_gmp_scope();
+    return test_result();
+}
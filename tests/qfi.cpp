@@ -0,0 +1,190 @@
+#include <thread>
+#include "cofhe.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+// f^n for any sign of n through the plain BICYCL exponentiation
+BICYCL::QFI reference_power(const BICYCL::ClassGroup &cl, const BICYCL::QFI &f, const BICYCL::Mpz &n)
+{
+    BICYCL::Mpz abs_n(n);
+    if (abs_n.sgn() < 0)
+        abs_n.neg();
+    BICYCL::QFI r;
+    cl.nupow(r, f, abs_n);
+    if (n.sgn() < 0)
+        r.neg();
+    return r;
+}
+
+BICYCL::Mpz power_of_two(size_t e)
+{
+    mpz_t v;
+    mpz_init(v);
+    mpz_setbit(v, e);
+    return BICYCL::Mpz(std::move(v));
+}
+
+// zero, small and full size exponents of both signs
+Vector<BICYCL::Mpz> test_exponents(BICYCL::RandGen &rand_gen, size_t max_bits)
+{
+    Vector<BICYCL::Mpz> exponents;
+    exponents.push_back(BICYCL::Mpz(0UL));
+    exponents.push_back(BICYCL::Mpz(1UL));
+    exponents.push_back(BICYCL::Mpz(-1L));
+    exponents.push_back(BICYCL::Mpz(-12345L));
+    for (size_t bits : {7ul, 64ul, 65ul, max_bits / 2, max_bits - 1, max_bits})
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            BICYCL::Mpz n = rand_gen.random_mpz_2exp(bits);
+            exponents.push_back(n);
+            n.neg();
+            exponents.push_back(n);
+        }
+    }
+    // all ones and a lone top bit, the extremes of the carry of the signed recodings
+    BICYCL::Mpz ones;
+    BICYCL::Mpz::sub(ones, power_of_two(max_bits), BICYCL::Mpz(1UL));
+    exponents.push_back(power_of_two(max_bits - 1));
+    exponents.push_back(ones);
+    ones.neg();
+    exponents.push_back(ones);
+    return exponents;
+}
+
+void test_fixed_base_table(const CPUCryptoSystem &cs, BICYCL::RandGen &rand_gen)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    size_t max_bits = hsm2k.encrypt_randomness_bound().nbits();
+    for (size_t w : {2ul, 5ul, 8ul})
+    {
+        QFIFixedBaseTable table(hsm2k.Cl_G(), hsm2k.h(), max_bits, w);
+        for (const auto &n : test_exponents(rand_gen, max_bits))
+        {
+            BICYCL::QFI r;
+            CHECK(table.power(r, n));
+            CHECK(qfi_equal(r, reference_power(hsm2k.Cl_G(), hsm2k.h(), n)));
+        }
+        // exponents beyond the table are refused and leave r alone
+        BICYCL::QFI r = hsm2k.h();
+        CHECK(!table.power(r, power_of_two(max_bits + 1)));
+        CHECK(qfi_equal(r, hsm2k.h()));
+    }
+}
+
+// one table per base, also for threads that miss it at the same time; a budget without room gives none
+void test_fixed_base_table_cache(const CPUCryptoSystem &cs)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    size_t max_bits = hsm2k.encrypt_randomness_bound().nbits();
+    QFIFixedBaseTableCache cache(size_t(1) << 20);
+    Vector<std::shared_ptr<const QFIFixedBaseTable>> tables(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < tables.size(); i++)
+        threads.emplace_back([&, i]()
+                             { tables[i] = cache.get(hsm2k.Cl_G(), hsm2k.h(), max_bits); });
+    for (auto &thread : threads)
+        thread.join();
+    auto table = cache.get(hsm2k.Cl_G(), hsm2k.h(), max_bits);
+    CHECK(table != nullptr);
+    CHECK(cache.get(hsm2k.Cl_G(), hsm2k.h(), max_bits) == table);
+    for (const auto &t : tables)
+        CHECK(t != nullptr && qfi_equal(t->base(), hsm2k.h()));
+    BICYCL::QFI r;
+    CHECK(table->power(r, BICYCL::Mpz(12345UL)));
+    CHECK(qfi_equal(r, reference_power(hsm2k.Cl_G(), hsm2k.h(), BICYCL::Mpz(12345UL))));
+
+    cache.set_memory_budget(0);
+    CHECK(cache.get(hsm2k.Cl_G(), hsm2k.h(), max_bits) == nullptr);
+}
+
+void test_multi_exponentiation(const CPUCryptoSystem &cs, BICYCL::RandGen &rand_gen)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    size_t max_bits = hsm2k.encrypt_randomness_bound().nbits();
+    Vector<BICYCL::Mpz> exponents = test_exponents(rand_gen, max_bits);
+    for (size_t w : {0ul, 2ul, 3ul, 5ul, 8ul, 10ul})
+    {
+        auto &engine = QFIMultiExponentiation::thread_instance();
+        engine.set_base(hsm2k.h(), hsm2k.Cl_G().default_nucomp_bound(), w, exponents.size(), max_bits);
+        for (const auto &n : exponents)
+        {
+            BICYCL::QFI r;
+            engine.power(r, n);
+            CHECK(qfi_equal(r, reference_power(hsm2k.Cl_G(), hsm2k.h(), n)));
+        }
+    }
+    Vector<BICYCL::Mpz *> n_ptrs(exponents.size());
+    Vector<BICYCL::QFI *> r_ptrs(exponents.size());
+    for (size_t i = 0; i < exponents.size(); i++)
+        n_ptrs[i] = &exponents[i];
+    qfi_nupow(r_ptrs.data(), hsm2k.h(), n_ptrs.data(), exponents.size(), hsm2k.Cl_G().default_nucomp_bound());
+    for (size_t i = 0; i < exponents.size(); i++)
+    {
+        CHECK(qfi_equal(*r_ptrs[i], reference_power(hsm2k.Cl_G(), hsm2k.h(), exponents[i])));
+        delete r_ptrs[i];
+    }
+    for (const auto &n : exponents)
+    {
+        QFIRecodedExponent recoded(n);
+        BICYCL::QFI r;
+        recoded.power(hsm2k.Cl_G(), r, hsm2k.h());
+        CHECK(qfi_equal(r, reference_power(hsm2k.Cl_G(), hsm2k.h(), n)));
+        // the odd powers the digits never use are not built
+        size_t w = QFIMultiExponentiation::choose_window(1, std::max<size_t>(n.nbits(), 1));
+        std::vector<int32_t> digits;
+        size_t top = QFIMultiExponentiation::recode(n, w, digits);
+        CHECK(recoded.group_operations() <= QFIMultiExponentiation::group_operations(digits.data(), top, size_t(1) << (w - 2)));
+    }
+}
+
+// prod f[i]^n[i] against the product of plain exponentiations
+void test_multi_power(const CPUCryptoSystem &cs, BICYCL::RandGen &rand_gen)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    const auto &cl = hsm2k.Cl_G();
+    size_t max_bits = hsm2k.encrypt_randomness_bound().nbits();
+    Vector<BICYCL::Mpz> exponents = test_exponents(rand_gen, max_bits);
+    Vector<BICYCL::QFI> bases(exponents.size());
+    for (size_t i = 0; i < bases.size(); i++)
+        cl.nupow(bases[i], hsm2k.h(), rand_gen.random_mpz_2exp(64));
+    for (size_t count : {1ul, 2ul, 7ul, exponents.size()})
+    {
+        Vector<const BICYCL::QFI *> f(count);
+        Vector<const BICYCL::Mpz *> n(count);
+        BICYCL::QFI expected = cl.one();
+        for (size_t i = 0; i < count; i++)
+        {
+            // spread the exponents of every size over the small counts too
+            size_t j = (i * 7 + count) % exponents.size();
+            f[i] = &bases[j];
+            n[i] = &exponents[j];
+            cl.nucomp(expected, expected, reference_power(cl, bases[j], exponents[j]));
+        }
+        for (size_t w : {0ul, 1ul, 2ul, 4ul, 6ul})
+        {
+            BICYCL::QFI r;
+            qfi_multi_power(cl, r, f.data(), n.data(), count, w);
+            CHECK(qfi_equal(r, expected));
+        }
+    }
+    // all zero exponents give the neutral form
+    BICYCL::Mpz zero(0UL);
+    const BICYCL::QFI *f = &bases[0];
+    const BICYCL::Mpz *n = &zero;
+    BICYCL::QFI r;
+    qfi_multi_power(cl, r, &f, &n, 1);
+    CHECK(qfi_equal(r, cl.one()));
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    BICYCL::RandGen rand_gen(BICYCL::Mpz(42UL));
+    test_fixed_base_table(cs, rand_gen);
+    test_fixed_base_table_cache(cs);
+    test_multi_exponentiation(cs, rand_gen);
+    test_multi_power(cs, rand_gen);
+    return test_result();
+}
@@ -0,0 +1,122 @@
+#include "cofhe.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+bool ciphertext_equal(const CPUCryptoSystem::CipherText &a, const CPUCryptoSystem::CipherText &b)
+{
+    return qfi_equal(a.c1(), b.c1()) && qfi_equal(a.c2(), b.c2());
+}
+
+void set_threads(int n)
+{
+#ifdef OPENMP
+    omp_set_num_threads(n);
+#else
+    (void)(n);
+#endif
+}
+
+// two cryptosystems built from the same seed draw the same keys, shares and encryptions
+void test_seeded_construction()
+{
+    CPUCryptoSystem cs1(128, 32, false, 7), cs2(128, 32, false, 7), cs3(128, 32, false, 8);
+    auto sk1 = cs1.keygen(), sk2 = cs2.keygen(), sk3 = cs3.keygen();
+    CHECK(sk1 == sk2);
+    CHECK(!(sk1 == sk3));
+    auto pk1 = cs1.keygen(sk1), pk2 = cs2.keygen(sk2);
+    CHECK(qfi_equal(pk1.elt(), pk2.elt()));
+    CHECK(ciphertext_equal(cs1.encrypt(pk1, BICYCL::Mpz(42UL)), cs2.encrypt(pk2, BICYCL::Mpz(42UL))));
+    CHECK(cs1.generate_random_plaintext() == cs2.generate_random_plaintext());
+
+    auto tsk1 = cs1.threshold_keygen(3), tsk2 = cs2.threshold_keygen(3);
+    CHECK(tsk1 == tsk2);
+    auto shares1 = cs1.keygen(tsk1, 2, 3), shares2 = cs2.keygen(tsk2, 2, 3);
+    for (size_t i = 0; i < 3; i++)
+        CHECK(shares1[i][0] == shares2[i][0]);
+}
+
+// set_random_seed restarts the draws, the same calls give the same values again
+void test_reseed(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk)
+{
+    cs.set_random_seed(5);
+    auto sk = cs.keygen();
+    auto ct = cs.encrypt(pk, BICYCL::Mpz(3UL));
+    auto pt = cs.generate_random_plaintext();
+    cs.set_random_seed(5);
+    CHECK(cs.keygen() == sk);
+    CHECK(ciphertext_equal(cs.encrypt(pk, BICYCL::Mpz(3UL)), ct));
+    CHECK(cs.generate_random_plaintext() == pt);
+}
+
+// stream ids only come from reserve, the same seed hands out the same ids and the same draws
+void test_reserved_streams()
+{
+    RandomStreams streams1(5), streams2(5);
+    uint64_t first1 = streams1.reserve(4), first2 = streams2.reserve(4);
+    CHECK(first1 == first2);
+    CHECK(streams1.reserve(1) == first1 + 4);
+    BICYCL::Mpz bound(4294967295UL);
+    auto r1 = streams1.sequence_stream(first1 + 3).random_mpz(bound);
+    auto r2 = streams2.sequence_stream(first2 + 3).random_mpz(bound);
+    auto r3 = streams1.sequence_stream(first1 + 2).random_mpz(bound);
+    CHECK(r1 == r2);
+    CHECK(!(r1 == r3));
+    streams1.set_seed(5);
+    CHECK(streams1.reserve(4) == first1);
+}
+
+// every element of a re-randomized op draws from the stream of its index, so the
+// result does not depend on the threads that computed it
+void test_loops_thread_independent(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t n = 16;
+    Tensor<CPUCryptoSystem::PlainText *> pt({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        pt[i] = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(i)));
+    auto ct = cs.encrypt_tensor(pk, pt);
+
+    Vector<Tensor<CPUCryptoSystem::CipherText *>> sums;
+    Vector<CPUCryptoSystem::CipherText> after;
+    for (int threads : {1, 4, 3})
+    {
+        set_threads(threads);
+        cs.set_random_seed(11);
+        sums.push_back(cs.add_ciphertext_tensors(pk, ct, ct));
+        // and the draws that follow the loop
+        after.push_back(cs.encrypt(pk, BICYCL::Mpz(1UL)));
+    }
+    for (size_t r = 1; r < sums.size(); r++)
+    {
+        for (size_t i = 0; i < n; i++)
+            CHECK(ciphertext_equal(*sums[r][i], *sums[0][i]));
+        CHECK(ciphertext_equal(after[r], after[0]));
+    }
+    auto decrypted = cs.decrypt_tensor(sk, sums[0]);
+    for (size_t i = 0; i < n; i++)
+        CHECK(*decrypted[i] == BICYCL::Mpz((unsigned long)(2 * i)));
+
+    for (auto &sum : sums)
+    {
+        for (size_t i = 0; i < n; i++)
+            delete sum[i];
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        delete decrypted[i];
+        delete ct[i];
+        delete pt[i];
+    }
+}
+
+int main()
+{
+    test_seeded_construction();
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    auto sk = cs.keygen();
+    auto pk = cs.keygen(sk);
+    test_reseed(cs, pk);
+    test_reserved_streams();
+    test_loops_thread_independent(cs, sk, pk);
+    return test_result();
+}
@@ -0,0 +1,78 @@
+#include "cofhe.hpp"
+#include "smpc/beavers_triplet_generation.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+void wait_for_pool(const CPUCryptoSystem &cs, size_t size)
+{
+    for (int i = 0; i < 6000 && cs.randomness_pool_size() < size; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
+
+void test_pool(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    cs.start_randomness_pool(pk, 4, 8, 2);
+    CHECK(cs.randomness_pool_running(pk));
+    wait_for_pool(cs, 8);
+    CHECK(cs.randomness_pool_size() == 8);
+
+    // encryptions take pairs from the pool and still decrypt
+    for (unsigned long m : {0ul, 1ul, 12345ul})
+    {
+        auto ct = cs.encrypt(pk, BICYCL::Mpz(m));
+        CHECK(cs.decrypt(sk, ct) == BICYCL::Mpz(m));
+    }
+    CHECK(cs.randomness_pool_size() < 8);
+
+    // dropping below the low watermark refills up to the high one
+    while (cs.randomness_pool_size() >= 4)
+        cs.encrypt(pk, BICYCL::Mpz(1UL));
+    wait_for_pool(cs, 8);
+    CHECK(cs.randomness_pool_size() == 8);
+
+    // a pool for pk is not used for other keys
+    auto other_pk = cs.keygen(cs.keygen());
+    CHECK(!cs.randomness_pool_running(other_pk));
+    auto ct = cs.encrypt(other_pk, BICYCL::Mpz(5UL));
+    (void)(ct);
+    CHECK(cs.randomness_pool_size() == 8);
+}
+
+// the generator runs on a copy of the cryptosystem, which shares the pool
+void test_triplet_generator(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    wait_for_pool(cs, 8);
+    BeaversTripletGenerator<CPUCryptoSystem> generator(cs, pk);
+    CHECK(cs.randomness_pool_running(pk));
+    CHECK(cs.randomness_pool_size() == 8);
+
+    const size_t size = 4;
+    auto triplets = generator.generate(size);
+    auto pt = cs.decrypt_tensor(sk, triplets);
+    for (size_t i = 0; i < size; i++)
+    {
+        BICYCL::Mpz c;
+        BICYCL::Mpz::mul(c, *pt.at(i, 0), *pt.at(i, 1));
+        BICYCL::Mpz::mod(c, c, cs.plaintext_modulus());
+        CHECK(*pt.at(i, 2) == c);
+        for (size_t j = 0; j < 3; j++)
+        {
+            delete pt.at(i, j);
+            delete triplets.at(i, j);
+        }
+    }
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    auto sk = cs.keygen();
+    auto pk = cs.keygen(sk);
+    test_pool(cs, sk, pk);
+    test_triplet_generator(cs, sk, pk);
+    cs.stop_randomness_pool();
+    CHECK(!cs.randomness_pool_running(pk));
+    CHECK(cs.randomness_pool_size() == 0);
+    return test_result();
+}
@@ -0,0 +1,448 @@
+#include <filesystem>
+#include "cofhe.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+bool ciphertext_equal(const CPUCryptoSystem::CipherText &a, const CPUCryptoSystem::CipherText &b)
+{
+    return qfi_equal(a.c1(), b.c1()) && qfi_equal(a.c2(), b.c2());
+}
+
+String decimal(const BICYCL::Mpz &v)
+{
+    char *s = mpz_get_str(nullptr, 10, (mpz_srcptr)(v));
+    String str(s);
+    void (*free_function)(void *, size_t);
+    mp_get_memory_functions(nullptr, nullptr, &free_function);
+    free_function(s, str.size() + 1);
+    return str;
+}
+
+template <typename F>
+bool throws_invalid_argument(F &&f)
+{
+    try
+    {
+        f();
+    }
+    catch (const std::invalid_argument &)
+    {
+        return true;
+    }
+    return false;
+}
+
+// single elements go through the binary format and still read the old decimal text
+void test_single_elements(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk)
+{
+    mpz_t v;
+    mpz_init(v);
+    mpz_ui_pow_ui(v, 3, 200);
+    BICYCL::Mpz big(std::move(v)), negative(big);
+    negative.neg();
+    for (const auto &pt : {BICYCL::Mpz(0UL), BICYCL::Mpz(1UL), BICYCL::Mpz(255UL), BICYCL::Mpz(256UL), big, negative})
+    {
+        String data = cs.serialize_plaintext(pt);
+        CHECK(data[0] == 0);
+        CHECK(cs.deserialize_plaintext(data) == pt);
+        CHECK(cs.deserialize_plaintext(decimal(pt)) == pt);
+    }
+
+    auto ct = cs.encrypt(pk, BICYCL::Mpz(77UL));
+    CHECK(ciphertext_equal(cs.deserialize_ciphertext(cs.serialize_ciphertext(ct)), ct));
+    String ct_text;
+    for (const auto *f : {&ct.c1(), &ct.c2()})
+        ct_text += decimal(f->a()) + " " + decimal(f->b()) + " " + decimal(f->c()) + " ";
+    CHECK(ciphertext_equal(cs.deserialize_ciphertext(ct_text), ct));
+
+    const auto &pdr = ct.c2();
+    CHECK(qfi_equal(cs.deserialize_part_decryption_result(cs.serialize_part_decryption_result(pdr)), pdr));
+    String pdr_text = decimal(pdr.a()) + " " + decimal(pdr.b()) + " " + decimal(pdr.c());
+    CHECK(qfi_equal(cs.deserialize_part_decryption_result(pdr_text), pdr));
+
+    // unknown versions, truncated headers and offsets past the end are refused
+    String data = cs.serialize_ciphertext(ct);
+    String bad_version = data;
+    bad_version[1] = 2;
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext(bad_version); }));
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext(data.substr(0, 20)); }));
+    String bad_offset = data;
+    uint64_t offset = (uint64_t)(1) << 40;
+    memcpy(bad_offset.data() + 6 + 8, &offset, 8);
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext(bad_offset); }));
+}
+
+Tensor<CPUCryptoSystem::CipherText *> encrypt_values(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, size_t n)
+{
+    Tensor<CPUCryptoSystem::CipherText *> ct({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        ct[i] = new CPUCryptoSystem::CipherText(cs.encrypt(pk, BICYCL::Mpz((unsigned long)(1000 * i + 7))));
+    return ct;
+}
+
+template <typename T>
+void free_tensor(Tensor<T *> &t)
+{
+    t.flatten();
+    for (size_t i = 0; i < t.num_elements(); i++)
+        delete t[i];
+}
+
+uint32_t raw_ndim(const String &data)
+{
+    uint32_t ndim;
+    memcpy(&ndim, data.data(), 4);
+    return ndim;
+}
+
+// tensors of forms without c: smaller, flagged in ndim, read back by any cryptosystem
+void test_compressed_tensors(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::SecretKeyShare &sks)
+{
+    CPUCryptoSystem compressing(cs);
+    compressing.set_compress_tensor_forms(true);
+    const size_t rows = 2, cols = 3;
+    auto ct = encrypt_values(cs, pk, rows * cols);
+    ct.reshape({rows, cols});
+    auto pdr = cs.part_decrypt_tensor(sks, ct);
+
+    String full = cs.serialize_ciphertext_tensor(ct), compressed = compressing.serialize_ciphertext_tensor(ct);
+    CHECK(raw_ndim(full) == 2);
+    CHECK(raw_ndim(compressed) == (2 | COMPRESSED_FORMS_BIT));
+    CHECK(compressed.size() < full.size());
+    for (const auto &data : {full, compressed})
+    {
+        auto back = cs.deserialize_ciphertext_tensor(data);
+        CHECK(back.shape() == ct.shape());
+        for (size_t i = 0; i < rows; i++)
+        {
+            for (size_t j = 0; j < cols; j++)
+                CHECK(ciphertext_equal(*back.at(i, j), *ct.at(i, j)));
+        }
+        free_tensor(back);
+    }
+
+    String pdr_full = cs.serialize_part_decryption_result_tensor(pdr), pdr_compressed = compressing.serialize_part_decryption_result_tensor(pdr);
+    CHECK(pdr_compressed.size() < pdr_full.size());
+    for (const auto &data : {pdr_full, pdr_compressed})
+    {
+        auto back = compressing.deserialize_part_decryption_result_tensor(data);
+        CHECK(back.shape() == pdr.shape());
+        for (size_t i = 0; i < rows; i++)
+        {
+            for (size_t j = 0; j < cols; j++)
+                CHECK(qfi_equal(*back.at(i, j), *pdr.at(i, j)));
+        }
+        free_tensor(back);
+    }
+
+    // a b of the wrong parity gives no integral c
+    size_t payload = 4 + 4 * 2 + 16 * rows * cols * 2;
+    uint64_t b_offset;
+    memcpy(&b_offset, compressed.data() + 4 + 4 * 2 + 8, 8);
+    String corrupt = compressed;
+    corrupt[payload + (b_offset & ~((uint64_t)(1) << 63))] ^= 1;
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(corrupt); }));
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(compressed.substr(0, payload - 8)); }));
+    // the offset of an a with the sign bit of a b
+    String signed_a = compressed;
+    signed_a[4 + 4 * 2 + 16 + 7] |= (char)(0x80);
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(signed_a); }));
+    // dimensions whose product wraps around 2^64
+    String wrapping(4 + 4 * 3 + 16, 0);
+    uint32_t header[4] = {3 | COMPRESSED_FORMS_BIT, 1u << 31, 1u << 31, 1u << 2};
+    memcpy(wrapping.data(), header, sizeof(header));
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(wrapping); }));
+
+    free_tensor(pdr);
+    free_tensor(ct);
+}
+
+// the file is the uncompressed layout whatever the setting, elements decode on demand
+void test_ciphertext_store(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk)
+{
+    CPUCryptoSystem compressing(cs);
+    compressing.set_compress_tensor_forms(true);
+    const size_t rows = 3, cols = 4;
+    auto ct = encrypt_values(cs, pk, rows * cols);
+    ct.reshape({rows, cols});
+    String path = (std::filesystem::temp_directory_path() / ("cofhe_store_test_" + std::to_string(getpid()))).string();
+    compressing.save_ciphertext_tensor(path, ct);
+    CHECK(!std::filesystem::exists(path + ".tmp"));
+
+    auto mapped = cs.open_ciphertext_tensor(path);
+    CHECK(mapped->shape() == ct.shape());
+    CHECK(mapped->num_elements() == rows * cols);
+    auto flat = ct;
+    flat.flatten();
+    for (size_t i = 0; i < rows * cols; i++)
+    {
+        CHECK(ciphertext_equal(mapped->load(i), *flat[i]));
+        CHECK(&mapped->at(i) == &mapped->at(i));
+    }
+    auto all = mapped->tensor();
+    CHECK(all.shape() == ct.shape());
+    for (size_t i = 0; i < rows; i++)
+    {
+        for (size_t j = 0; j < cols; j++)
+        {
+            CHECK(ciphertext_equal(*all.at(i, j), *ct.at(i, j)));
+            CHECK(all.at(i, j) == &mapped->at(i * cols + j));
+        }
+    }
+    bool out_of_range = false;
+    try
+    {
+        mapped->load(rows * cols);
+    }
+    catch (const std::out_of_range &)
+    {
+        out_of_range = true;
+    }
+    CHECK(out_of_range);
+
+    // the same element from many threads is decoded into one object
+    {
+        auto fresh = cs.open_ciphertext_tensor(path);
+        Vector<const CPUCryptoSystem::CipherText *> seen(4);
+        Vector<std::thread> threads;
+        for (size_t t = 0; t < seen.size(); t++)
+            threads.emplace_back([&fresh, &seen, t]
+                                 { seen[t] = &fresh->at(5); });
+        for (auto &thread : threads)
+            thread.join();
+        for (size_t t = 1; t < seen.size(); t++)
+            CHECK(seen[t] == seen[0]);
+        CHECK(ciphertext_equal(*seen[0], *flat[5]));
+    }
+
+    // a file that is not a store, a missing one and an empty tensor
+    mapped.reset();
+    {
+        std::ofstream other(path, std::ios::binary | std::ios::trunc);
+        other << "not a ciphertext tensor file at all";
+    }
+    CHECK(throws_invalid_argument([&]
+                                  { cs.open_ciphertext_tensor(path); }));
+    std::filesystem::remove(path);
+    bool missing = false;
+    try
+    {
+        cs.open_ciphertext_tensor(path);
+    }
+    catch (const std::runtime_error &)
+    {
+        missing = true;
+    }
+    CHECK(missing);
+    Tensor<CPUCryptoSystem::CipherText *> empty({0}, nullptr);
+    CHECK(throws_invalid_argument([&]
+                                  { cs.save_ciphertext_tensor(path, empty); }));
+
+    free_tensor(ct);
+}
+
+// views decode single forms straight from full or compressed buffers
+void test_tensor_views(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, const CPUCryptoSystem::SecretKeyShare &sks)
+{
+    CPUCryptoSystem compressing(cs);
+    compressing.set_compress_tensor_forms(true);
+    const size_t rows = 2, cols = 2;
+    auto ct = encrypt_values(cs, pk, rows * cols);
+    ct.reshape({rows, cols});
+    auto pdr = cs.part_decrypt_tensor(sks, ct);
+    auto flat = ct;
+    auto pdr_flat = pdr;
+    flat.flatten();
+    pdr_flat.flatten();
+
+    for (const CPUCryptoSystem *serializer : {&cs, (const CPUCryptoSystem *)(&compressing)})
+    {
+        String ct_data = serializer->serialize_ciphertext_tensor(ct);
+        auto view = cs.view_ciphertext_tensor(ct_data);
+        CHECK(view.shape() == ct.shape());
+        CHECK(view.num_elements() == rows * cols);
+        CHECK(view.compressed() == (serializer == &compressing));
+        for (size_t i = 0; i < rows * cols; i++)
+        {
+            CHECK(qfi_equal(view.c1(i), flat[i]->c1()));
+            CHECK(qfi_equal(view.c2(i), flat[i]->c2()));
+        }
+        auto pdr_view_result = cs.part_decrypt_tensor(sks, view);
+        CHECK(pdr_view_result.shape() == pdr.shape());
+        pdr_view_result.flatten();
+        for (size_t i = 0; i < rows * cols; i++)
+            CHECK(qfi_equal(*pdr_view_result[i], *pdr_flat[i]));
+        free_tensor(pdr_view_result);
+
+        String pdr_data = serializer->serialize_part_decryption_result_tensor(pdr);
+        auto pdr_view = cs.view_part_decryption_result_tensor(pdr_data);
+        CHECK(pdr_view.shape() == pdr.shape());
+        for (size_t i = 0; i < rows * cols; i++)
+            CHECK(qfi_equal(pdr_view.at(i), *pdr_flat[i]));
+
+        // the offsets are checked once, up front
+        CHECK(throws_invalid_argument([&]
+                                      { cs.view_ciphertext_tensor(ct_data.substr(0, 4 + 4 * 2 + 8)); }));
+        String corrupt = ct_data;
+        uint64_t offset = (uint64_t)(1) << 40;
+        memcpy(corrupt.data() + 4 + 4 * 2 + 8, &offset, 8);
+        CHECK(throws_invalid_argument([&]
+                                      { cs.view_ciphertext_tensor(corrupt); }));
+    }
+
+    // a shape whose element count wraps to 0, and one whose coefficient count wraps
+    uint32_t wrapping[4] = {3, 1u << 31, 1u << 31, 1u << 2};
+    CHECK(throws_invalid_argument([&]
+                                  { cs.view_ciphertext_tensor(String((const char *)(wrapping), sizeof(wrapping))); }));
+    uint32_t wrapping_coefficients[3] = {2, 1u << 31, 1u << 31};
+    CHECK(throws_invalid_argument([&]
+                                  { cs.view_ciphertext_tensor(String((const char *)(wrapping_coefficients), sizeof(wrapping_coefficients))); }));
+
+    free_tensor(pdr);
+    free_tensor(ct);
+}
+
+// a batch holds the coefficients in its arenas and writes the same formats as a tensor
+void test_ciphertext_batch(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk)
+{
+    CPUCryptoSystem compressing(cs);
+    compressing.set_compress_tensor_forms(true);
+    const size_t rows = 3, cols = 2;
+    auto ct = encrypt_values(cs, pk, rows * cols);
+    ct.reshape({rows, cols});
+    auto flat = ct;
+    flat.flatten();
+    auto batch = cs.make_ciphertext_batch({rows, cols});
+    CHECK(batch.shape() == ct.shape());
+    for (size_t i = 0; i < rows * cols; i++)
+        batch.set(i, flat[i]->c1(), flat[i]->c2());
+    for (size_t i = 0; i < rows * cols; i++)
+    {
+        CHECK(qfi_equal(batch.c1(i), flat[i]->c1()));
+        CHECK(qfi_equal(batch.c2(i), flat[i]->c2()));
+    }
+
+    CHECK(compressing.serialize_ciphertext_batch(batch) == compressing.serialize_ciphertext_tensor(ct));
+    for (const CPUCryptoSystem *serializer : {&cs, (const CPUCryptoSystem *)(&compressing)})
+    {
+        auto back = cs.deserialize_ciphertext_tensor(serializer->serialize_ciphertext_batch(batch));
+        CHECK(back.shape() == ct.shape());
+        for (size_t i = 0; i < rows; i++)
+        {
+            for (size_t j = 0; j < cols; j++)
+                CHECK(ciphertext_equal(*back.at(i, j), *ct.at(i, j)));
+        }
+        free_tensor(back);
+    }
+    free_tensor(ct);
+}
+
+// the whole of a writer's output, pieces as they come
+template <typename Writer>
+String write_all(Writer &&writer)
+{
+    String data, chunk;
+    while (writer.next(chunk))
+        data += chunk;
+    CHECK(data.size() == writer.size());
+    return data;
+}
+
+// tensors and batches in blocks, read back whole or fed to a reader in pieces that split the blocks anywhere
+void test_tensor_streams(const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t rows = 5, cols = 3, block = 4;
+    auto ct = encrypt_values(cs, pk, rows * cols);
+    ct.reshape({rows, cols});
+    auto flat = ct;
+    flat.flatten();
+    auto batch = cs.make_ciphertext_batch({rows, cols});
+    for (size_t i = 0; i < rows * cols; i++)
+        batch.set(i, flat[i]->c1(), flat[i]->c2());
+
+    String from_tensor = write_all(cs.ciphertext_tensor_stream(ct, false, block));
+    CHECK(is_tensor_stream(from_tensor));
+    CHECK(write_all(cs.ciphertext_batch_stream(std::move(batch), block)) == from_tensor);
+    auto check_back = [&](Tensor<CPUCryptoSystem::CipherText *> back)
+    {
+        CHECK(back.shape() == ct.shape());
+        for (size_t i = 0; i < rows; i++)
+        {
+            for (size_t j = 0; j < cols; j++)
+                CHECK(ciphertext_equal(*back.at(i, j), *ct.at(i, j)));
+        }
+        free_tensor(back);
+    };
+    check_back(cs.deserialize_ciphertext_tensor(from_tensor));
+    for (size_t piece : {1, 7, 1000})
+    {
+        CPUCryptoSystem::CipherTextTensorStreamReader reader(2, 1);
+        for (size_t pos = 0; pos < from_tensor.size(); pos += piece)
+        {
+            CHECK(!reader.complete());
+            reader.feed(from_tensor.data() + pos, std::min(piece, from_tensor.size() - pos));
+        }
+        CHECK(reader.complete());
+        check_back(reader.finish());
+    }
+    // a stream is not a tensor with a pointer table
+    CHECK(throws_invalid_argument([&]
+                                  { cs.view_ciphertext_tensor(from_tensor); }));
+
+    // truncated, trailing data, a block claiming more elements than are left and corrupt offsets
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(from_tensor.substr(0, from_tensor.size() - 1)); }));
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(from_tensor + "x"); }));
+    {
+        CPUCryptoSystem::CipherTextTensorStreamReader reader;
+        reader.feed(from_tensor.data(), from_tensor.size() - 1);
+        CHECK(throws_invalid_argument([&]
+                                      { reader.finish(); }));
+    }
+    size_t first_block = 12 + 4 * 2;
+    String too_many = from_tensor;
+    uint32_t count = rows * cols + 1;
+    memcpy(too_many.data() + first_block, &count, 4);
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(too_many); }));
+    String corrupt = from_tensor;
+    uint64_t offset = (uint64_t)(1) << 40;
+    memcpy(corrupt.data() + first_block + 12 + 8, &offset, 8);
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(corrupt); }));
+    {
+        CPUCryptoSystem::CipherTextTensorStreamReader reader;
+        reader.feed(corrupt);
+        CHECK(throws_invalid_argument([&]
+                                      { reader.finish(); }));
+    }
+    // a shape whose element count wraps
+    uint32_t wrapping[6] = {3 | TENSOR_STREAM_BIT, 6, 4, (uint32_t)(1) << 31, (uint32_t)(1) << 31, (uint32_t)(1) << 31};
+    CHECK(throws_invalid_argument([&]
+                                  { cs.deserialize_ciphertext_tensor(String((const char *)(wrapping), sizeof(wrapping))); }));
+    free_tensor(ct);
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    auto sk = cs.keygen();
+    auto pk = cs.keygen(sk);
+    test_single_elements(cs, pk);
+    auto sks = cs.keygen(cs.threshold_keygen(2), 2, 2)[0][0];
+    test_compressed_tensors(cs, pk, sks);
+    test_ciphertext_store(cs, pk);
+    test_tensor_views(cs, pk, sks);
+    test_ciphertext_batch(cs, pk);
+    test_tensor_streams(cs, pk);
+    return test_result();
+}
@@ -0,0 +1,407 @@
+#include <atomic>
+#include <filesystem>
+#include <thread>
+// small enough for the compute results below to go out in blocks
+#define CoFHE_TENSOR_STREAM_MIN_ELEMENTS 4
+#define CoFHE_TENSOR_STREAM_BLOCK_ELEMENTS 3
+#include "cofhe.hpp"
+#include "node/cofhe_node_request_handler.hpp"
+#include "node/compute_request_handler.hpp"
+#include "node/setup_node_request_handler.hpp"
+#include "node/server.hpp"
+#include "smpc/smpc_client.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+using namespace CoFHE::Network;
+
+#define TEST_ADDRESS "127.0.0.1"
+#define TEST_SETUP_PORT 48741
+#define TEST_NUM_NODES 3
+#define TEST_THRESHOLD 2
+
+// how a test node treats the partial decryptions that come in from now on
+struct NodeControl
+{
+    std::atomic<int> delay_ms{0};
+    std::atomic<bool> fail{false};
+    std::atomic<int> requests{0};
+    // requests whose inner partial decryption request is in the V1 text encoding
+    std::atomic<int> v1_requests{0};
+};
+
+// a CoFHE node that can be slowed down or made to fail
+class TestNode
+{
+public:
+    using RequestType = CoFHENodeRequest;
+    using ResponseType = CoFHENodeResponse;
+
+    TestNode(const NetworkDetails &nd, std::shared_ptr<NodeControl> control) : handler_m(nd), control_m(control) {}
+
+    CoFHENodeResponse handle_request(CoFHENodeRequest request)
+    {
+        control_m->requests++;
+        if (!is_wire_v2(request.data()))
+            control_m->v1_requests++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(control_m->delay_ms.load()));
+        if (control_m->fail)
+        {
+            throw std::runtime_error("Node down");
+        }
+        return handler_m.handle_request(std::move(request));
+    }
+
+private:
+    CoFHENodeRequestHandler<CPUCryptoSystem> handler_m;
+    std::shared_ptr<NodeControl> control_m;
+};
+
+// hands out the same Beaver triplet whatever is asked for, the client only wants them at start
+class TestSetupNode
+{
+public:
+    using RequestType = SetupNodeRequest;
+    using ResponseType = SetupNodeResponse;
+
+    TestSetupNode(const std::string &triplets) : triplets_m(triplets) {}
+
+    SetupNodeResponse handle_request(const SetupNodeRequest &)
+    {
+        return SetupNodeResponse(SetupNodeResponse::Status::OK, BeaversTripletResponse(BeaversTripletResponse::Status::OK, triplets_m).to_string());
+    }
+
+private:
+    std::string triplets_m;
+};
+
+template <typename Handler>
+struct RunningServer
+{
+    Server<Handler, typename Handler::RequestType, typename Handler::ResponseType> server;
+    std::thread thread;
+
+    RunningServer(const std::string &port, Handler &&handler) : server(TEST_ADDRESS, port, std::move(handler), 2, 2)
+    {
+        thread = std::thread([this]
+                             { server.run(); });
+    }
+
+    ~RunningServer()
+    {
+        server.stop();
+        thread.join();
+    }
+};
+
+std::string port(size_t i)
+{
+    return std::to_string(TEST_SETUP_PORT + i);
+}
+
+template <typename F>
+bool throws_runtime_error(F &&f)
+{
+    try
+    {
+        f();
+    }
+    catch (const std::runtime_error &)
+    {
+        return true;
+    }
+    return false;
+}
+
+bool decrypts(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, unsigned long value)
+{
+    return client.decrypt(cs.encrypt(pk, BICYCL::Mpz(value))) == BICYCL::Mpz(value);
+}
+
+bool decrypts_tensor(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, size_t n)
+{
+    Tensor<CPUCryptoSystem::PlainText *> pt({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        pt[i] = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(i)));
+    auto ct = cs.encrypt_tensor(pk, pt);
+    auto decrypted = client.decrypt_tensor(ct);
+    bool ok = decrypted.size() == n;
+    for (size_t i = 0; i < n && ok; i++)
+        ok = *decrypted[i] == BICYCL::Mpz((unsigned long)(i));
+    for (size_t i = 0; i < n; i++)
+    {
+        delete decrypted[i];
+        delete ct[i];
+        delete pt[i];
+    }
+    return ok;
+}
+
+// nodes 1 and 2 answer slower, so the client learns to ask node 0 first
+void warm_up(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, std::vector<std::shared_ptr<NodeControl>> &controls)
+{
+    controls[1]->delay_ms = 50;
+    controls[2]->delay_ms = 50;
+    for (unsigned long i = 0; i < 6; i++)
+        CHECK(decrypts(client, cs, pk, i));
+    CHECK(decrypts_tensor(client, cs, pk, 4));
+}
+
+// a node that fails is replaced by another one, the decryption still comes out right; once
+// too few nodes are left the error of the last one is thrown
+void test_failover(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, std::vector<std::shared_ptr<NodeControl>> &controls)
+{
+    controls[0]->fail = true;
+    int asked = controls[0]->requests;
+    for (unsigned long i = 0; i < 4; i++)
+        CHECK(decrypts(client, cs, pk, 100 + i));
+    CHECK(decrypts_tensor(client, cs, pk, 4));
+    // a failed answer does not make the node look slower, it is still asked first
+    CHECK(controls[0]->requests > asked);
+
+    controls[1]->fail = true;
+    CHECK(throws_runtime_error([&]
+                               { decrypts(client, cs, pk, 7); }));
+    controls[0]->fail = false;
+    controls[1]->fail = false;
+    CHECK(decrypts(client, cs, pk, 8));
+}
+
+// a node that stops answering in its usual time gets a hedge to the next node, the
+// decryption does not wait for it
+void test_hedging(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, std::vector<std::shared_ptr<NodeControl>> &controls)
+{
+    controls[0]->delay_ms = 3000;
+    int asked = controls[0]->requests;
+    auto start = std::chrono::steady_clock::now();
+    CHECK(decrypts(client, cs, pk, 42));
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(1500));
+    CHECK(controls[0]->requests > asked);
+    controls[0]->delay_ms = 0;
+}
+
+// a client on V1 connections sends the partial decryption requests inside the frames in V1 as well
+void test_protocol_v1(const NetworkDetails &nd, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, std::vector<std::shared_ptr<NodeControl>> &controls)
+{
+    SMPCClient<CPUCryptoSystem> client(nd, ProtocolVersion::V1);
+    int asked = 0, asked_v1 = 0;
+    for (const auto &control : controls)
+    {
+        asked += control->requests;
+        asked_v1 += control->v1_requests;
+    }
+    CHECK(decrypts(client, cs, pk, 5));
+    CHECK(decrypts_tensor(client, cs, pk, 4));
+    int sent = 0, sent_v1 = 0;
+    for (const auto &control : controls)
+    {
+        sent += control->requests;
+        sent_v1 += control->v1_requests;
+    }
+    CHECK(sent - asked >= 2 * TEST_THRESHOLD);
+    CHECK(sent_v1 - asked_v1 == sent - asked);
+}
+
+// a plaintext matrix times an encrypted one is the matrix product in that order, a @ b
+void test_compute_matmul(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, const NetworkDetails &nd)
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    const size_t n = 2, m = 3, p = 2;
+    Tensor<CPUCryptoSystem::PlainText *> a({n, m}, nullptr), b({m, p}, nullptr);
+    for (size_t i = 0; i < n * m; i++)
+        a.at(i / m, i % m) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(i + 1)));
+    for (size_t i = 0; i < m * p; i++)
+        b.at(i / p, i % p) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(2 * i + 1)));
+    auto ct_b = cs.encrypt_tensor(pk, b);
+
+    ComputeRequestHandler<CPUCryptoSystem> handler(nd);
+    ComputeRequest request(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::BINARY, ComputeRequest::ComputeOperation::MULTIPLY,
+                                                                    {Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::PLAINTEXT, cs.serialize_plaintext_tensor(a)),
+                                                                     Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::CIPHERTEXT, cs.serialize_ciphertext_tensor(ct_b))}));
+    auto response = handler.handle_request(request);
+    CHECK(response.status() == ComputeResponse::Status::OK);
+    if (response.status() == ComputeResponse::Status::OK)
+    {
+        auto res = cs.deserialize_ciphertext_tensor(response.data());
+        CHECK(res.shape() == Vector<size_t>({n, p}));
+        auto decrypted = client.decrypt_tensor(res);
+        res.flatten();
+        decrypted.flatten();
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t k = 0; k < p; k++)
+            {
+                unsigned long expected = 0;
+                for (size_t j = 0; j < m; j++)
+                    expected += (i * m + j + 1) * (2 * (j * p + k) + 1);
+                CHECK(*decrypted.at(i * p + k) == BICYCL::Mpz(expected));
+            }
+        }
+        for (size_t i = 0; i < n * p; i++)
+        {
+            delete decrypted.at(i);
+            delete res.at(i);
+        }
+    }
+    for (size_t i = 0; i < n * m; i++)
+        delete a.at(i / m, i % m);
+    for (size_t i = 0; i < m * p; i++)
+    {
+        delete b.at(i / p, i % p);
+        delete ct_b.at(i / p, i % p);
+    }
+}
+
+// a ciphertext sum on the compute node comes back in blocks of the chunked tensor format with the operand shape
+void test_compute_add(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, const NetworkDetails &nd)
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    const size_t n = 2, m = 2;
+    Tensor<CPUCryptoSystem::PlainText *> a({n, m}, nullptr), b({n, m}, nullptr);
+    for (size_t i = 0; i < n * m; i++)
+    {
+        a.at(i / m, i % m) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(i + 1)));
+        b.at(i / m, i % m) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(10 * i)));
+    }
+    auto ct_a = cs.encrypt_tensor(pk, a), ct_b = cs.encrypt_tensor(pk, b);
+
+    ComputeRequestHandler<CPUCryptoSystem> handler(nd);
+    ComputeRequest request(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::BINARY, ComputeRequest::ComputeOperation::ADD,
+                                                                    {Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::CIPHERTEXT, cs.serialize_ciphertext_tensor(ct_a)),
+                                                                     Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::CIPHERTEXT, cs.serialize_ciphertext_tensor(ct_b))}));
+    auto response = handler.handle_request(request);
+    CHECK(response.status() == ComputeResponse::Status::OK);
+    CHECK(response.chunked());
+    if (response.status() == ComputeResponse::Status::OK)
+    {
+        auto res = cs.deserialize_ciphertext_tensor(response.data());
+        CHECK(res.shape() == Vector<size_t>({n, m}));
+        auto decrypted = client.decrypt_tensor(res);
+        res.flatten();
+        decrypted.flatten();
+        for (size_t i = 0; i < n * m; i++)
+        {
+            CHECK(*decrypted.at(i) == BICYCL::Mpz((unsigned long)(11 * i + 1)));
+            delete decrypted.at(i);
+            delete res.at(i);
+        }
+    }
+    for (size_t i = 0; i < n * m; i++)
+    {
+        delete a.at(i / m, i % m);
+        delete b.at(i / m, i % m);
+        delete ct_a.at(i / m, i % m);
+        delete ct_b.at(i / m, i % m);
+    }
+}
+
+// TENSOR_ID operands name tensors saved in the directory of the compute node, added in place and decrypted
+void test_compute_stored_tensor(SMPCClient<CPUCryptoSystem> &client, const CPUCryptoSystem &cs, const CPUCryptoSystem::PublicKey &pk, const NetworkDetails &nd)
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    const size_t n = 2, m = 2;
+    Tensor<CPUCryptoSystem::PlainText *> a({n, m}, nullptr), b({n, m}, nullptr);
+    for (size_t i = 0; i < n * m; i++)
+    {
+        a.at(i / m, i % m) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(i + 1)));
+        b.at(i / m, i % m) = new CPUCryptoSystem::PlainText(BICYCL::Mpz((unsigned long)(10 * i)));
+    }
+    auto ct_a = cs.encrypt_tensor(pk, a), ct_b = cs.encrypt_tensor(pk, b);
+    auto directory = std::filesystem::temp_directory_path() / ("cofhe_stored_tensors_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    cs.save_ciphertext_tensor((directory / "weights.ct").string(), ct_a);
+
+    ComputeRequestHandler<CPUCryptoSystem> handler(nd, directory.string());
+    ComputeRequest add(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::BINARY, ComputeRequest::ComputeOperation::ADD,
+                                                                {Operand(ComputeRequest::DataType::TENSOR_ID, ComputeRequest::DataEncrytionType::CIPHERTEXT, "weights.ct"),
+                                                                 Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::CIPHERTEXT, cs.serialize_ciphertext_tensor(ct_b))}));
+    auto response = handler.handle_request(add);
+    CHECK(response.status() == ComputeResponse::Status::OK);
+    if (response.status() == ComputeResponse::Status::OK)
+    {
+        auto res = cs.deserialize_ciphertext_tensor(response.data());
+        CHECK(res.shape() == Vector<size_t>({n, m}));
+        auto decrypted = client.decrypt_tensor(res);
+        res.flatten();
+        decrypted.flatten();
+        for (size_t i = 0; i < n * m; i++)
+        {
+            CHECK(*decrypted.at(i) == BICYCL::Mpz((unsigned long)(11 * i + 1)));
+            delete decrypted.at(i);
+            delete res.at(i);
+        }
+    }
+
+    ComputeRequest decrypt(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::UNARY, ComputeRequest::ComputeOperation::DECRYPT,
+                                                                    {Operand(ComputeRequest::DataType::TENSOR_ID, ComputeRequest::DataEncrytionType::CIPHERTEXT, "weights.ct")}));
+    response = handler.handle_request(decrypt);
+    CHECK(response.status() == ComputeResponse::Status::OK);
+    if (response.status() == ComputeResponse::Status::OK)
+    {
+        auto pt = cs.deserialize_plaintext_tensor(response.data());
+        CHECK(pt.shape() == Vector<size_t>({n, m}));
+        pt.flatten();
+        for (size_t i = 0; i < n * m; i++)
+        {
+            CHECK(*pt.at(i) == BICYCL::Mpz((unsigned long)(i + 1)));
+            delete pt.at(i);
+        }
+    }
+
+    // ids are file names in the directory, and a node without one serves none
+    ComputeRequest escape(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::UNARY, ComputeRequest::ComputeOperation::DECRYPT,
+                                                                   {Operand(ComputeRequest::DataType::TENSOR_ID, ComputeRequest::DataEncrytionType::CIPHERTEXT, "../weights.ct")}));
+    CHECK(handler.handle_request(escape).status() == ComputeResponse::Status::ERROR);
+    ComputeRequestHandler<CPUCryptoSystem> no_directory(nd);
+    CHECK(no_directory.handle_request(decrypt).status() == ComputeResponse::Status::ERROR);
+
+    std::filesystem::remove_all(directory);
+    for (size_t i = 0; i < n * m; i++)
+    {
+        delete a.at(i / m, i % m);
+        delete b.at(i / m, i % m);
+        delete ct_a.at(i / m, i % m);
+        delete ct_b.at(i / m, i % m);
+    }
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    auto sk = cs.threshold_keygen(TEST_NUM_NODES);
+    auto pk = cs.keygen(sk);
+    auto shares = cs.keygen(sk, TEST_THRESHOLD, TEST_NUM_NODES);
+
+    std::vector<NodeDetails> nodes = {{TEST_ADDRESS, port(0), NodeType::SETUP_NODE}};
+    for (size_t i = 1; i <= TEST_NUM_NODES; i++)
+        nodes.push_back({TEST_ADDRESS, port(i), NodeType::CoFHE_NODE});
+    CryptoSystemDetails cs_details{CryptoSystemType::CoFHE_CPU, cs.serialize_public_key(pk), 128, 32, TEST_THRESHOLD, TEST_NUM_NODES};
+
+    Tensor<CPUCryptoSystem::CipherText *> triplet(1, 3);
+    for (size_t i = 0; i < 3; i++)
+        triplet.at(0, i) = new CPUCryptoSystem::CipherText(cs.encrypt(pk, BICYCL::Mpz(0UL)));
+    RunningServer<TestSetupNode> setup_node(port(0), TestSetupNode(cs.serialize_ciphertext_tensor(triplet)));
+    std::vector<std::shared_ptr<NodeControl>> controls;
+    std::vector<std::unique_ptr<RunningServer<TestNode>>> cofhe_nodes;
+    for (size_t i = 0; i < TEST_NUM_NODES; i++)
+    {
+        controls.push_back(std::make_shared<NodeControl>());
+        NetworkDetails nd(nodes[i + 1], nodes, cs_details, {cs.serialize_secret_key_share(shares[i][0])});
+        cofhe_nodes.push_back(std::make_unique<RunningServer<TestNode>>(port(i + 1), TestNode(nd, controls[i])));
+    }
+
+    {
+        SMPCClient<CPUCryptoSystem> client(NetworkDetails({TEST_ADDRESS, "0", NodeType::CLIENT_NODE}, nodes, cs_details, {}));
+        warm_up(client, cs, pk, controls);
+        test_failover(client, cs, pk, controls);
+        test_hedging(client, cs, pk, controls);
+        test_compute_matmul(client, cs, pk, NetworkDetails({TEST_ADDRESS, "0", NodeType::COMPUTE_NODE}, nodes, cs_details, {}));
+        test_compute_add(client, cs, pk, NetworkDetails({TEST_ADDRESS, "0", NodeType::COMPUTE_NODE}, nodes, cs_details, {}));
+        test_compute_stored_tensor(client, cs, pk, NetworkDetails({TEST_ADDRESS, "0", NodeType::COMPUTE_NODE}, nodes, cs_details, {}));
+        CHECK(controls[0]->v1_requests == 0 && controls[1]->v1_requests == 0 && controls[2]->v1_requests == 0);
+    }
+    test_protocol_v1(NetworkDetails({TEST_ADDRESS, "0", NodeType::CLIENT_NODE}, nodes, cs_details, {}), cs, pk, controls);
+    for (size_t i = 0; i < 3; i++)
+        delete triplet.at(0, i);
+    return test_result();
+}
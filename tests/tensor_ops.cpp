@@ -0,0 +1,327 @@
+#include <filesystem>
+#include "cofhe.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+// a tensor of the given shape holding the plaintexts, row major
+Tensor<CPUCryptoSystem::PlainText *> plaintext_tensor(const Vector<CPUCryptoSystem::PlainText> &values, const Vector<size_t> &shape)
+{
+    Tensor<CPUCryptoSystem::PlainText *> pt({values.size()}, nullptr);
+    for (size_t i = 0; i < values.size(); i++)
+        pt[i] = new CPUCryptoSystem::PlainText(values[i]);
+    pt.reshape(shape);
+    return pt;
+}
+
+template <typename T>
+void free_tensor(Tensor<T *> &t)
+{
+    t.flatten();
+    for (size_t i = 0; i < t.num_elements(); i++)
+        delete t[i];
+}
+
+// decrypts ct and compares it, reduced mod M, with expected
+void check_tensor(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const Tensor<CPUCryptoSystem::CipherText *> &ct,
+                  const Vector<CPUCryptoSystem::PlainText> &expected, const Vector<size_t> &shape)
+{
+    CHECK(ct.shape() == shape);
+    auto pt = cs.decrypt_tensor(sk, ct);
+    pt.flatten();
+    CHECK(pt.num_elements() == expected.size());
+    for (size_t i = 0; i < pt.num_elements() && i < expected.size(); i++)
+    {
+        BICYCL::Mpz e;
+        BICYCL::Mpz::mod(e, expected[i], cs.plaintext_modulus());
+        CHECK(*pt[i] == e);
+    }
+    free_tensor(pt);
+}
+
+void test_add_subtract_negate(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t rows = 2, cols = 3;
+    Vector<CPUCryptoSystem::PlainText> a, b, sum, difference, negation;
+    for (size_t i = 0; i < rows * cols; i++)
+    {
+        a.push_back(cs.generate_random_plaintext());
+        b.push_back(cs.generate_random_plaintext());
+        BICYCL::Mpz s, d, n;
+        BICYCL::Mpz::add(s, a.back(), b.back());
+        BICYCL::Mpz::sub(d, a.back(), b.back());
+        BICYCL::Mpz::sub(n, cs.plaintext_modulus(), a.back());
+        sum.push_back(s);
+        difference.push_back(d);
+        negation.push_back(n);
+    }
+    auto pt_a = plaintext_tensor(a, {rows, cols}), pt_b = plaintext_tensor(b, {rows, cols});
+    auto ct_a = cs.encrypt_tensor(pk, pt_a), ct_b = cs.encrypt_tensor(pk, pt_b);
+
+    auto ct_sum = cs.add_ciphertext_tensors(pk, ct_a, ct_b);
+    check_tensor(cs, sk, ct_sum, sum, {rows, cols});
+    auto ct_difference = cs.subtract_ciphertext_tensors(pk, ct_a, ct_b);
+    check_tensor(cs, sk, ct_difference, difference, {rows, cols});
+    auto ct_negation = cs.negate_ciphertext_tensor(pk, ct_a);
+    check_tensor(cs, sk, ct_negation, negation, {rows, cols});
+
+    free_tensor(ct_sum);
+    free_tensor(ct_difference);
+    free_tensor(ct_negation);
+    free_tensor(ct_a);
+    free_tensor(ct_b);
+    free_tensor(pt_a);
+    free_tensor(pt_b);
+}
+
+// zero, +-1, both ends of the signed range and random scalars, negative ones as M - |s|
+Vector<CPUCryptoSystem::PlainText> test_scalars(const CPUCryptoSystem &cs, size_t count)
+{
+    const auto M = cs.plaintext_modulus();
+    BICYCL::Mpz minus_one, minus_small, half, half_plus_one;
+    BICYCL::Mpz::sub(minus_one, M, BICYCL::Mpz(1UL));
+    BICYCL::Mpz::sub(minus_small, M, BICYCL::Mpz(12345UL));
+    mpz_t h;
+    mpz_init(h);
+    mpz_setbit(h, cs.plaintext_bits() - 1);
+    half = BICYCL::Mpz(std::move(h));
+    BICYCL::Mpz::add(half_plus_one, half, BICYCL::Mpz(1UL));
+    Vector<CPUCryptoSystem::PlainText> scalars = {BICYCL::Mpz(0UL), BICYCL::Mpz(1UL), minus_one, minus_small, half, half_plus_one};
+    while (scalars.size() < count)
+        scalars.push_back(cs.generate_random_plaintext());
+    scalars.resize(count);
+    return scalars;
+}
+
+BICYCL::Mpz product(const BICYCL::Mpz &a, const BICYCL::Mpz &b)
+{
+    BICYCL::Mpz r;
+    BICYCL::Mpz::mul(r, a, b);
+    return r;
+}
+
+// negative scalars go through the signed recodings of the multi-exponentiation paths
+void test_scal(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t n = 8;
+    auto scalars = test_scalars(cs, n);
+    // half the positions share a ciphertext, so the grouped exponentiation sees every scalar on one base
+    Vector<CPUCryptoSystem::PlainText> values(n);
+    for (size_t i = 0; i < n; i++)
+        values[i] = i % 2 == 0 ? BICYCL::Mpz(7UL) : cs.generate_random_plaintext();
+    auto pt = plaintext_tensor(values, {n});
+    auto ct = cs.encrypt_tensor(pk, pt);
+    // tensors share their storage, the copy of the pointers is a new tensor
+    Tensor<CPUCryptoSystem::CipherText *> ct_shared({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        ct_shared[i] = ct[i % 2 == 0 ? 0 : i];
+    Vector<CPUCryptoSystem::PlainText> expected(n);
+    for (size_t i = 0; i < n; i++)
+        expected[i] = product(values[i], scalars[i]);
+
+    auto s = plaintext_tensor(scalars, {n});
+    auto ct_scaled = cs.scal_ciphertext_tensors(pk, s, ct_shared);
+    check_tensor(cs, sk, ct_scaled, expected, {n});
+    free_tensor(ct_scaled);
+
+    Vector<CPUCryptoSystem::CipherText *> ct_vec(n);
+    Vector<CPUCryptoSystem::PlainText *> s_vec(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        ct_vec[i] = ct_shared[i];
+        s_vec[i] = &scalars[i];
+    }
+    auto ct_vec_scaled = cs.scal_ciphertext_vector(pk, s_vec, ct_vec);
+    Tensor<CPUCryptoSystem::CipherText *> ct_vec_tensor({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        ct_vec_tensor[i] = ct_vec_scaled[i];
+    check_tensor(cs, sk, ct_vec_tensor, expected, {n});
+    free_tensor(ct_vec_tensor);
+
+    // one scalar for every element, here -1
+    auto ct_minus = cs.scal_ciphertext_vector(pk, scalars[2], ct_vec);
+    for (size_t i = 0; i < n; i++)
+    {
+        ct_vec_tensor[i] = ct_minus[i];
+        BICYCL::Mpz::sub(expected[i], cs.plaintext_modulus(), values[i]);
+    }
+    check_tensor(cs, sk, ct_vec_tensor, expected, {n});
+    free_tensor(ct_vec_tensor);
+
+    free_tensor(s);
+    free_tensor(ct);
+    free_tensor(pt);
+}
+
+// ct * f^m decrypts to the sum, including wrap-arounds of negative plaintexts
+void test_add_plaintext(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t rows = 2, cols = 4;
+    auto a = test_scalars(cs, rows * cols), b = test_scalars(cs, rows * cols);
+    std::reverse(b.begin(), b.end());
+    Vector<CPUCryptoSystem::PlainText> sum(rows * cols);
+    for (size_t i = 0; i < rows * cols; i++)
+        BICYCL::Mpz::add(sum[i], a[i], b[i]);
+    auto pt_a = plaintext_tensor(a, {rows, cols}), pt_b = plaintext_tensor(b, {rows, cols});
+    auto ct_b = cs.encrypt_tensor(pk, pt_b);
+
+    auto ct_sum = cs.add_plaintext_to_ciphertext_tensors(pk, pt_a, ct_b);
+    check_tensor(cs, sk, ct_sum, sum, {rows, cols});
+    free_tensor(ct_sum);
+
+    auto ct = cs.encrypt(pk, b[0]);
+    Tensor<CPUCryptoSystem::CipherText *> ct_single({1}, nullptr);
+    ct_single[0] = new CPUCryptoSystem::CipherText(cs.add_plaintext_to_ciphertext(pk, a[0], ct));
+    // re-randomized, the sum does not share its c1 with ct
+    CHECK(!qfi_equal(ct_single[0]->c1(), ct.c1()));
+    check_tensor(cs, sk, ct_single, {sum[0]}, {1});
+    free_tensor(ct_single);
+
+    free_tensor(ct_b);
+    free_tensor(pt_a);
+    free_tensor(pt_b);
+}
+
+// the encrypted dot product of multi_scal_accumulate
+void test_dot_product(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t n = 9;
+    auto s = test_scalars(cs, n), values = test_scalars(cs, n);
+    std::reverse(values.begin(), values.end());
+    BICYCL::Mpz expected(0UL);
+    Vector<CPUCryptoSystem::PlainText *> s_vec(n);
+    Vector<CPUCryptoSystem::CipherText *> ct_vec(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        BICYCL::Mpz::add(expected, expected, product(s[i], values[i]));
+        s_vec[i] = &s[i];
+        ct_vec[i] = new CPUCryptoSystem::CipherText(cs.encrypt(pk, values[i]));
+    }
+    Tensor<CPUCryptoSystem::CipherText *> ct({1}, nullptr);
+    ct[0] = new CPUCryptoSystem::CipherText(cs.multi_scal_accumulate(pk, s_vec, ct_vec));
+    check_tensor(cs, sk, ct, {expected}, {1});
+    free_tensor(ct);
+    for (auto c : ct_vec)
+        delete c;
+}
+
+// res[i][k] = sum_j a[i][j] * b[j][k] for the two matrix products with encrypted a or b
+void test_matrix_products(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t n = 2, m = 4, p = 3;
+    auto a = test_scalars(cs, n * m), b = test_scalars(cs, m * p);
+    std::reverse(b.begin(), b.end());
+    Vector<CPUCryptoSystem::PlainText> expected(n * p);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t k = 0; k < p; k++)
+        {
+            BICYCL::Mpz sum(0UL);
+            for (size_t j = 0; j < m; j++)
+                BICYCL::Mpz::add(sum, sum, product(a[i * m + j], b[j * p + k]));
+            expected[i * p + k] = sum;
+        }
+    }
+    auto pt_a = plaintext_tensor(a, {n, m}), pt_b = plaintext_tensor(b, {m, p});
+    auto ct_a = cs.encrypt_tensor(pk, pt_a), ct_b = cs.encrypt_tensor(pk, pt_b);
+
+    // encrypted on the left, through the 2D branch of scal_ciphertext_tensors
+    auto ct_left = cs.scal_ciphertext_tensors(pk, pt_b, ct_a);
+    check_tensor(cs, sk, ct_left, expected, {n, p});
+    // encrypted on the right
+    auto ct_right = cs.matmul_plaintext_ciphertext_tensors(pk, pt_a, ct_b);
+    check_tensor(cs, sk, ct_right, expected, {n, p});
+
+    free_tensor(ct_left);
+    free_tensor(ct_right);
+    free_tensor(ct_a);
+    free_tensor(ct_b);
+    free_tensor(pt_a);
+    free_tensor(pt_b);
+}
+
+// sums and differences straight out of serialized tensors into a batch
+void test_batch_add_subtract(const CPUCryptoSystem &cs, const CPUCryptoSystem::SecretKey &sk, const CPUCryptoSystem::PublicKey &pk)
+{
+    const size_t rows = 2, cols = 2;
+    Vector<CPUCryptoSystem::PlainText> a, b, sum, difference;
+    for (size_t i = 0; i < rows * cols; i++)
+    {
+        a.push_back(cs.generate_random_plaintext());
+        b.push_back(cs.generate_random_plaintext());
+        BICYCL::Mpz s, d;
+        BICYCL::Mpz::add(s, a.back(), b.back());
+        BICYCL::Mpz::sub(d, a.back(), b.back());
+        sum.push_back(s);
+        difference.push_back(d);
+    }
+    auto pt_a = plaintext_tensor(a, {rows, cols}), pt_b = plaintext_tensor(b, {rows, cols});
+    auto ct_a = cs.encrypt_tensor(pk, pt_a), ct_b = cs.encrypt_tensor(pk, pt_b);
+    String data_a = cs.serialize_ciphertext_tensor(ct_a), data_b = cs.serialize_ciphertext_tensor(ct_b);
+    auto view_a = cs.view_ciphertext_tensor(data_a), view_b = cs.view_ciphertext_tensor(data_b);
+
+    auto ct_sum = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.add_ciphertext_tensors(pk, view_a, view_b)));
+    check_tensor(cs, sk, ct_sum, sum, {rows, cols});
+    auto ct_difference = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.subtract_ciphertext_tensors(pk, view_a, view_b)));
+    check_tensor(cs, sk, ct_difference, difference, {rows, cols});
+
+    // a stored tensor on either side, read through the mapping
+    String path = (std::filesystem::temp_directory_path() / ("cofhe_tensor_ops_" + std::to_string(getpid()))).string();
+    cs.save_ciphertext_tensor(path, ct_a);
+    {
+        auto stored_a = cs.open_ciphertext_tensor(path);
+        auto ct_stored_sum = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.add_ciphertext_tensors(pk, *stored_a, view_b)));
+        check_tensor(cs, sk, ct_stored_sum, sum, {rows, cols});
+        auto ct_stored_difference = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.subtract_ciphertext_tensors(pk, *stored_a, view_b)));
+        check_tensor(cs, sk, ct_stored_difference, difference, {rows, cols});
+        Vector<CPUCryptoSystem::PlainText> reversed;
+        for (const auto &d : difference)
+        {
+            BICYCL::Mpz r;
+            BICYCL::Mpz::sub(r, BICYCL::Mpz(0UL), d);
+            reversed.push_back(r);
+        }
+        auto ct_reversed = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.subtract_ciphertext_tensors(pk, view_b, *stored_a)));
+        check_tensor(cs, sk, ct_reversed, reversed, {rows, cols});
+        auto ct_zero = cs.deserialize_ciphertext_tensor(cs.serialize_ciphertext_batch(cs.subtract_ciphertext_tensors(pk, *stored_a, *stored_a)));
+        check_tensor(cs, sk, ct_zero, Vector<CPUCryptoSystem::PlainText>(rows * cols, BICYCL::Mpz(0UL)), {rows, cols});
+        free_tensor(ct_stored_sum);
+        free_tensor(ct_stored_difference);
+        free_tensor(ct_reversed);
+        free_tensor(ct_zero);
+    }
+    std::filesystem::remove(path);
+
+    String data_vector = cs.serialize_ciphertext_tensor(Tensor<CPUCryptoSystem::CipherText *>(Vector<size_t>{rows * cols}, ct_a.at(0, 0)));
+    bool thrown = false;
+    try
+    {
+        cs.add_ciphertext_tensors(pk, view_a, cs.view_ciphertext_tensor(data_vector));
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    free_tensor(ct_sum);
+    free_tensor(ct_difference);
+    free_tensor(ct_a);
+    free_tensor(ct_b);
+    free_tensor(pt_a);
+    free_tensor(pt_b);
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    auto sk = cs.keygen();
+    auto pk = cs.keygen(sk);
+    test_add_subtract_negate(cs, sk, pk);
+    test_scal(cs, sk, pk);
+    test_add_plaintext(cs, sk, pk);
+    test_dot_product(cs, sk, pk);
+    test_matrix_products(cs, sk, pk);
+    test_batch_add_subtract(cs, sk, pk);
+    return test_result();
+}
@@ -0,0 +1,32 @@
+#ifndef CoFHE_TESTS_TEST_HPP_INCLUDED
+#define CoFHE_TESTS_TEST_HPP_INCLUDED
+
+#include <iostream>
+
+// a failed check is reported and counted, main returns test_result()
+inline int &test_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond)                                                                                 \
+    do                                                                                              \
+    {                                                                                               \
+        if (!(cond))                                                                                \
+        {                                                                                           \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond << std::endl; \
+            test_failures()++;                                                                      \
+        }                                                                                           \
+    } while (0)
+
+inline int test_result()
+{
+    if (test_failures() != 0)
+    {
+        std::cerr << test_failures() << " checks failed" << std::endl;
+    }
+    return test_failures() == 0 ? 0 : 1;
+}
+
+#endif
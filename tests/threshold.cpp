@@ -0,0 +1,232 @@
+#include "cofhe.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+
+// decryptions with the recoded keys match the plain exponentiations
+void test_recoded_keys(const CPUCryptoSystem &cs)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    auto sk = cs.keygen();
+    auto pk = cs.keygen(sk);
+    Vector<CPUCryptoSystem::CipherText> cts;
+    for (unsigned long m : {0ul, 1ul, 77ul, 123456789ul})
+        cts.push_back(cs.encrypt(pk, BICYCL::Mpz(m)));
+    for (size_t i = 0; i < cts.size(); i++)
+        CHECK(cs.decrypt(sk, cts[i]) == hsm2k.decrypt(sk, cts[i]));
+
+    auto threshold_sk = cs.threshold_keygen(3);
+    auto shares = cs.keygen(threshold_sk, 2, 3);
+    for (const auto &party : shares)
+    {
+        for (const auto &sks : party)
+        {
+            for (const auto &ct : cts)
+            {
+                BICYCL::QFI d;
+                hsm2k.Cl_G().nupow(d, ct.c1(), sks);
+                if (hsm2k.compact_variant())
+                    hsm2k.from_Cl_DeltaK_to_Cl_Delta(d);
+                CHECK(qfi_equal(cs.part_decrypt(sks, ct), d));
+            }
+        }
+    }
+}
+
+struct SharedKey
+{
+    CPUCryptoSystem::PublicKey pk;
+    Vector<CPUCryptoSystem::SecretKeyShare> shares;
+};
+
+SharedKey share_key(const CPUCryptoSystem &cs, size_t threshold, size_t num_parties)
+{
+    auto sk = cs.threshold_keygen(num_parties);
+    SharedKey key{cs.keygen(sk), {}};
+    for (const auto &party : cs.keygen(sk, threshold, num_parties))
+        key.shares.push_back(party[0]);
+    return key;
+}
+
+// every combine entry point recovers values from the partial decryptions of parties
+void check_combine(const CPUCryptoSystem &cs, const SharedKey &key, const Vector<size_t> &parties, size_t num_parties,
+                   const Vector<BICYCL::Mpz> &values)
+{
+    size_t n = values.size(), t = parties.size();
+    Tensor<CPUCryptoSystem::CipherText *> ct({n}, nullptr);
+    for (size_t i = 0; i < n; i++)
+        ct[i] = new CPUCryptoSystem::CipherText(cs.encrypt(key.pk, values[i]));
+    Vector<Tensor<CPUCryptoSystem::PartDecryptionResult *>> pdrs;
+    for (size_t j = 0; j < t; j++)
+        pdrs.push_back(cs.part_decrypt_tensor(key.shares[parties[j]], ct));
+
+    for (size_t i = 0; i < n; i++)
+    {
+        Vector<CPUCryptoSystem::PartDecryptionResult> pdrs_i;
+        for (size_t j = 0; j < t; j++)
+            pdrs_i.push_back(*pdrs[j][i]);
+        CHECK(cs.combine_part_decryption_results(*ct[i], pdrs_i, parties, num_parties) == values[i]);
+    }
+
+    auto pt = cs.combine_part_decryption_results_tensor(ct, pdrs, parties, num_parties);
+    for (size_t i = 0; i < n; i++)
+    {
+        CHECK(*pt[i] == values[i]);
+        delete pt[i];
+    }
+
+    // straight out of the serialized tensors
+    String ct_data = cs.serialize_ciphertext_tensor(ct);
+    Vector<String> pdr_data;
+    for (size_t j = 0; j < t; j++)
+        pdr_data.push_back(cs.serialize_part_decryption_result_tensor(pdrs[j]));
+    Vector<PartDecryptionResultTensorView> pdr_views;
+    for (size_t j = 0; j < t; j++)
+        pdr_views.push_back(cs.view_part_decryption_result_tensor(pdr_data[j]));
+    for (const auto &pt_views : {cs.combine_part_decryption_results_tensor(ct, pdr_views, parties, num_parties),
+                                 cs.combine_part_decryption_results_tensor(cs.view_ciphertext_tensor(ct_data), pdr_views, parties, num_parties)})
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            CHECK(*pt_views[i] == values[i]);
+            delete pt_views[i];
+        }
+    }
+
+    Vector<CPUCryptoSystem::CipherText *> ct_vec(n);
+    Vector<Vector<CPUCryptoSystem::PartDecryptionResult *>> pdrs_vec(t, Vector<CPUCryptoSystem::PartDecryptionResult *>(n));
+    for (size_t i = 0; i < n; i++)
+    {
+        ct_vec[i] = ct[i];
+        for (size_t j = 0; j < t; j++)
+            pdrs_vec[j][i] = pdrs[j][i];
+    }
+    auto pt_vec = cs.combine_part_decryption_results_vector(ct_vec, pdrs_vec, parties, num_parties);
+    for (size_t i = 0; i < n; i++)
+    {
+        CHECK(*pt_vec[i] == values[i]);
+        delete pt_vec[i];
+    }
+
+    for (auto &pdr : pdrs)
+    {
+        for (size_t i = 0; i < n; i++)
+            delete pdr[i];
+    }
+    for (size_t i = 0; i < n; i++)
+        delete ct[i];
+}
+
+Vector<BICYCL::Mpz> test_values()
+{
+    return {BICYCL::Mpz(0UL), BICYCL::Mpz(1UL), BICYCL::Mpz(4242UL), BICYCL::Mpz(4294967295UL)};
+}
+
+// all parties, in their own order and shuffled, the coefficients of +-1 included
+void test_combine_all_parties(const CPUCryptoSystem &cs)
+{
+    for (size_t num_parties : {1ul, 2ul, 3ul, 4ul})
+    {
+        auto key = share_key(cs, num_parties, num_parties);
+        Vector<size_t> parties(num_parties);
+        std::iota(parties.begin(), parties.end(), 0);
+        check_combine(cs, key, parties, num_parties, test_values());
+        std::reverse(parties.begin(), parties.end());
+        check_combine(cs, key, parties, num_parties, test_values());
+    }
+}
+
+// any t of the n parties, in any order, not only the first t
+void test_combine_threshold_subsets(const CPUCryptoSystem &cs)
+{
+    const size_t threshold = 3, num_parties = 5;
+    auto key = share_key(cs, threshold, num_parties);
+    for (const auto &parties : {Vector<size_t>{0, 1, 2}, Vector<size_t>{2, 3, 4}, Vector<size_t>{4, 1, 3},
+                                Vector<size_t>{0, 2, 4}, Vector<size_t>{3, 0, 1}, Vector<size_t>{1, 4, 2, 0}})
+        check_combine(cs, key, parties, num_parties, test_values());
+}
+
+// wrong party sets are refused before any exponentiation
+void test_combine_errors(const CPUCryptoSystem &cs)
+{
+    auto key = share_key(cs, 2, 3);
+    auto ct = cs.encrypt(key.pk, BICYCL::Mpz(5UL));
+    Vector<CPUCryptoSystem::PartDecryptionResult> pdrs = {cs.part_decrypt(key.shares[0], ct), cs.part_decrypt(key.shares[1], ct)};
+    for (const auto &parties : {Vector<size_t>{0}, Vector<size_t>{0, 0}, Vector<size_t>{0, 3}})
+    {
+        bool thrown = false;
+        try
+        {
+            cs.combine_part_decryption_results(ct, pdrs, parties, 3);
+        }
+        catch (const std::invalid_argument &)
+        {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+}
+
+// the coefficients hide sk in any t - 1 shares: drawn below delta^2 . secretkey_bound . 2^40,
+// so the shares reach well past the secret key bound
+void test_shamir_bounds(const CPUCryptoSystem &cs)
+{
+    const auto &hsm2k = cs.get_hsm2k();
+    for (size_t num_parties : {2ul, 3ul, 5ul})
+    {
+        BICYCL::Mpz delta = shamir_delta(num_parties), expected;
+        BICYCL::Mpz::mul(expected, delta, delta);
+        BICYCL::Mpz::mul(expected, expected, hsm2k.secretkey_bound());
+        mpz_t sigma40;
+        mpz_init(sigma40);
+        mpz_mul_2exp(sigma40, (mpz_srcptr)(expected), 40);
+        BICYCL::Mpz bound = shamir_coefficient_bound(hsm2k, num_parties);
+        CHECK(mpz_cmp((mpz_srcptr)(bound), sigma40) >= 0);
+        mpz_clear(sigma40);
+
+        auto sk = cs.threshold_keygen(num_parties);
+        size_t largest = 0;
+        for (const auto &party : cs.keygen(sk, 2, num_parties))
+            largest = std::max(largest, party[0].nbits());
+        CHECK(largest + 20 > bound.nbits());
+    }
+}
+
+// any key is shared, not only multiples of n!; parties beyond what the extra plaintext bits
+// carry are refused
+void test_threshold_keys(const CPUCryptoSystem &cs)
+{
+    auto sk = cs.keygen();
+    SharedKey key{cs.keygen(sk), {}};
+    for (const auto &party : cs.keygen(sk, 3, 4))
+        key.shares.push_back(party[0]);
+    check_combine(cs, key, {3, 1, 0}, 4, test_values());
+    // the sum wraps mod 2^k
+    auto ct = cs.add_ciphertexts(key.pk, cs.encrypt(key.pk, BICYCL::Mpz(4294967295UL)), cs.encrypt(key.pk, BICYCL::Mpz(2UL)));
+    Vector<CPUCryptoSystem::PartDecryptionResult> pdrs = {cs.part_decrypt(key.shares[2], ct), cs.part_decrypt(key.shares[0], ct), cs.part_decrypt(key.shares[1], ct)};
+    CHECK(cs.combine_part_decryption_results(ct, pdrs, {2, 0, 1}, 4) == BICYCL::Mpz(1UL));
+    CHECK(cs.decrypt(sk, ct) == BICYCL::Mpz(1UL));
+
+    bool thrown = false;
+    try
+    {
+        cs.threshold_keygen(64);
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+int main()
+{
+    auto cs = make_cryptosystem(128, 32, Device::CPU);
+    test_recoded_keys(cs);
+    test_combine_all_parties(cs);
+    test_combine_threshold_subsets(cs);
+    test_combine_errors(cs);
+    test_shamir_bounds(cs);
+    test_threshold_keys(cs);
+    return test_result();
+}
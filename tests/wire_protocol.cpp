@@ -0,0 +1,315 @@
+#include "node/cofhe_node_request_handler.hpp"
+#include "node/compute_request_handler.hpp"
+#include "./test.hpp"
+
+using namespace CoFHE;
+using namespace CoFHE::Network;
+
+// payload bytes that look like a marker, a text header and a section size
+std::string binary_payload()
+{
+    std::string data = "\xC2"
+                       "12 3\n";
+    for (int i = 0; i < 300; i++)
+        data.push_back(static_cast<char>(i));
+    return data;
+}
+
+template <typename F>
+bool throws_runtime_error(F &&f)
+{
+    try
+    {
+        f();
+    }
+    catch (const std::runtime_error &)
+    {
+        return true;
+    }
+    return false;
+}
+
+// a buffer of a gather write
+struct Span
+{
+    const char *data;
+    size_t size;
+    Span(const char *data, size_t size) : data(data), size(size) {}
+};
+
+// small pieces are merged, large ones are kept as they are; copies of a chain share the
+// pieces and a shared one is copied before it is written through flat
+void test_buffer_chain()
+{
+    BufferChain empty;
+    CHECK(empty.empty());
+    CHECK(empty.pieces().empty());
+    CHECK(empty.flat().empty());
+
+    std::string payload(4096, 'p');
+    const char *payload_data = payload.data();
+    BufferChain chain(std::move(payload));
+    chain.prepend("b").prepend("a");
+    chain.append("y").append("z");
+    CHECK(chain.pieces().size() == 3);
+    CHECK(chain.pieces()[0] == "ab");
+    CHECK(chain.pieces()[1].data() == payload_data);
+    CHECK(chain.pieces()[2] == "yz");
+    // a large piece is not merged into a small one, so it is not copied
+    std::string tail(4096, 't');
+    const char *tail_data = tail.data();
+    chain.append(std::move(tail));
+    CHECK(chain.pieces().size() == 4);
+    CHECK(chain.pieces()[3].data() == tail_data);
+    std::string expected = "ab" + std::string(4096, 'p') + "yz" + std::string(4096, 't');
+    CHECK(chain.size() == expected.size());
+    CHECK(chain.str() == expected);
+    auto buffers = chain.buffers<Span>();
+    CHECK(buffers.size() == 4);
+    CHECK(buffers[1].data == payload_data && buffers[1].size == 4096);
+
+    BufferChain copy = chain;
+    copy.prepend("h");
+    CHECK(copy.pieces()[1].data() == payload_data);
+    CHECK(copy.pieces()[0] == "hab");
+    CHECK(chain.pieces()[0] == "ab");
+    BufferChain joined;
+    joined.append(copy).append(chain);
+    CHECK(joined.pieces().size() == 8);
+    CHECK(joined.str() == "h" + expected + expected);
+
+    // flat joins the pieces, moving out of it empties the chain
+    CHECK(chain.flat() == expected);
+    CHECK(chain.pieces().size() == 1);
+    std::string moved = std::move(chain.flat());
+    CHECK(moved == expected);
+    CHECK(chain.empty());
+    CHECK(copy.str() == "h" + expected);
+
+    BufferChain single(std::string(4096, 's'));
+    const char *single_data = single.pieces()[0].data();
+    BufferChain shared = single;
+    shared.flat()[0] = 'x';
+    CHECK(single.str() == std::string(4096, 's'));
+    CHECK(shared.str() == "x" + std::string(4095, 's'));
+    CHECK(single.flat().data() == single_data);
+
+    // a view borrows the bytes until a small header is merged into it
+    std::string backing = "view data";
+    auto view = BufferChain::view(backing);
+    CHECK(view.pieces()[0].data() == backing.data());
+    view.prepend("h: ");
+    backing[0] = 'V';
+    CHECK(view.str() == "h: view data");
+    std::string big(4096, 'v');
+    auto big_view = BufferChain::view(big);
+    big_view.prepend("h");
+    CHECK(big_view.pieces()[1].data() == big.data());
+    const BufferChain &const_view = big_view;
+    CHECK(const_view.flat() == "h" + big);
+    CHECK(const_view.flat().data() != big.data());
+}
+
+// V2 frames: the 24 byte header, the request id and every status; V1 keeps its text line
+void test_frames()
+{
+    std::string payload = binary_payload();
+    Request request(ProtocolVersion::V2, ServiceType::COFHE_REQUEST, payload);
+    request.header().request_id() = 0x0102030405060708;
+    std::string wire = request.to_string();
+    CHECK(is_wire_v2(wire));
+    CHECK(wire.size() == WIRE_V2_FRAME_HEADER_SIZE + payload.size());
+    auto request_back = Request::from_string(wire);
+    CHECK(request_back.protocol_version() == ProtocolVersion::V2);
+    CHECK(request_back.type() == ServiceType::COFHE_REQUEST);
+    CHECK(request_back.header().request_id() == 0x0102030405060708);
+    CHECK(request_back.data() == payload);
+
+    for (auto status : {Response::Status::OK, Response::Status::ERROR, Response::Status::BUSY})
+    {
+        Response response(ProtocolVersion::V2, ServiceType::COMPUTE_REQUEST, status, payload);
+        response.header().request_id() = 42;
+        auto response_back = Response::from_string(response.to_string());
+        CHECK(response_back.status() == status);
+        CHECK(response_back.type() == ServiceType::COMPUTE_REQUEST);
+        CHECK(response_back.header().request_id() == 42);
+        CHECK(response_back.data() == payload);
+    }
+
+    std::string text_payload = "1 2 3\nsome text";
+    Request v1(ProtocolVersion::V1, ServiceType::SETUP_REQUEST, text_payload);
+    std::string v1_wire = v1.to_string();
+    CHECK(!is_wire_v2(v1_wire));
+    CHECK(std::isdigit(static_cast<unsigned char>(v1_wire[0])));
+    auto v1_back = Request::from_string(v1_wire);
+    CHECK(v1_back.protocol_version() == ProtocolVersion::V1);
+    CHECK(v1_back.type() == ServiceType::SETUP_REQUEST);
+    CHECK(v1_back.data() == text_payload);
+    auto v1_response = Response::from_string(Response(ProtocolVersion::V1, ServiceType::SETUP_REQUEST, Response::Status::ERROR, text_payload).to_string());
+    CHECK(v1_response.status() == Response::Status::ERROR);
+    CHECK(v1_response.data() == text_payload);
+
+    // truncated headers, a data size that does not match and an unknown version
+    CHECK(throws_runtime_error([&]
+                               { Request::from_string(wire.substr(0, WIRE_V2_FRAME_HEADER_SIZE - 1)); }));
+    CHECK(throws_runtime_error([&]
+                               { Request::from_string(wire.substr(0, wire.size() - 1)); }));
+    std::string bad_version = wire;
+    bad_version[1] = 7;
+    CHECK(throws_runtime_error([&]
+                               { Request::from_string(bad_version); }));
+}
+
+// the inner messages in both encodings, with the request framing around them
+void test_nested_messages()
+{
+    std::string payload = binary_payload();
+    for (auto ver : {ProtocolVersion::V1, ProtocolVersion::V2})
+    {
+        PartialDecryptionRequest pdr_request(3, PartialDecryptionRequest::DataType::TENSOR, payload);
+        CoFHENodeRequest node_request(CoFHENodeRequest::RequestType::PartialDecryption, pdr_request.to_buffers(ver));
+        Request request(ver, ServiceType::COFHE_REQUEST, node_request.to_buffers(ver));
+
+        auto request_back = Request::from_string(request.to_string());
+        CHECK(request_back.protocol_version() == ver);
+        auto node_request_back = CoFHENodeRequest::from_string(std::move(request_back.data()));
+        CHECK(node_request_back.header().type() == CoFHENodeRequest::RequestType::PartialDecryption);
+        auto pdr_request_back = PartialDecryptionRequest::from_string(std::move(node_request_back.data()));
+        CHECK(pdr_request_back.sk_share_id() == 3);
+        CHECK(pdr_request_back.data_type() == PartialDecryptionRequest::DataType::TENSOR);
+        CHECK(pdr_request_back.protocol_version() == ver);
+        CHECK(pdr_request_back.data() == payload);
+
+        for (auto status : {CoFHENodeResponse::Status::OK, CoFHENodeResponse::Status::ERROR})
+        {
+            PartialDecryptionResponse pdr_response(PartialDecryptionResponse::Status::ERROR, payload);
+            CoFHENodeResponse node_response(status, pdr_response.to_buffers(ver));
+            auto node_response_back = CoFHENodeResponse::from_string(node_response.to_string(ver));
+            CHECK(node_response_back.header().status() == status);
+            auto pdr_response_back = PartialDecryptionResponse::from_string(std::move(node_response_back.data()));
+            CHECK(pdr_response_back.status() == PartialDecryptionResponse::Status::ERROR);
+            CHECK(pdr_response_back.data() == payload);
+        }
+        auto error_back = CoFHENodeResponse::from_string(CoFHENodeResponse(CoFHENodeResponse::Status::ERROR, std::string("Not implemented")).to_string(ver));
+        CHECK(error_back.header().status() == CoFHENodeResponse::Status::ERROR);
+        CHECK(error_back.data() == "Not implemented");
+
+        auto compute_response_back = ComputeResponse::from_string(ComputeResponse(ComputeResponse::Status::ERROR, payload).to_string(ver));
+        CHECK(compute_response_back.status() == ComputeResponse::Status::ERROR);
+        CHECK(compute_response_back.data() == payload);
+    }
+}
+
+// operands before the last are copied out, the last takes over the buffer
+void test_compute_request()
+{
+    using Operand = ComputeRequest::ComputeOperationOperand;
+    std::string payload = binary_payload();
+    for (auto ver : {ProtocolVersion::V1, ProtocolVersion::V2})
+    {
+        // V1 skips whitespace in front of an operand, its data cannot start with any
+        std::string first = ver == ProtocolVersion::V2 ? payload : "abc\n def";
+        std::vector<Operand> operands = {Operand(ComputeRequest::DataType::TENSOR, ComputeRequest::DataEncrytionType::CIPHERTEXT, first),
+                                         Operand(ComputeRequest::DataType::SINGLE, ComputeRequest::DataEncrytionType::PLAINTEXT, "12345"),
+                                         Operand(ComputeRequest::DataType::TENSOR_ID, ComputeRequest::DataEncrytionType::CIPHERTEXT, first)};
+        ComputeRequest request(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::TERNARY, ComputeRequest::ComputeOperation::ADD, operands));
+        Request frame(ver, ServiceType::COMPUTE_REQUEST, request.to_buffers(ver));
+        auto frame_back = Request::from_string(frame.to_string());
+        auto request_back = ComputeRequest::from_string(std::move(frame_back.data()));
+        const auto &operation = request_back.operation();
+        CHECK(operation.operation_type() == ComputeRequest::ComputeOperationType::TERNARY);
+        CHECK(operation.operation() == ComputeRequest::ComputeOperation::ADD);
+        CHECK(operation.operands().size() == operands.size());
+        for (size_t i = 0; i < operands.size() && i < operation.operands().size(); i++)
+        {
+            CHECK(operation.operands()[i].data_type() == operands[i].data_type());
+            CHECK(operation.operands()[i].encryption_type() == operands[i].encryption_type());
+            CHECK(operation.operands()[i].data() == operands[i].data());
+        }
+    }
+
+    // a V2 request that claims more operands than it holds
+    std::string wire = ComputeRequest(ComputeRequest::ComputeOperationInstance(ComputeRequest::ComputeOperationType::UNARY, ComputeRequest::ComputeOperation::DECRYPT,
+                                                                               {Operand(ComputeRequest::DataType::SINGLE, ComputeRequest::DataEncrytionType::CIPHERTEXT, payload)}))
+                           .to_string();
+    wire[3] = 2;
+    CHECK(throws_runtime_error([&]
+                               { ComputeRequest::from_string(wire); }));
+}
+
+// the pieces of a string, a few bytes each
+class StringChunks : public ChunkSource
+{
+public:
+    StringChunks(std::string data, size_t piece) : data_m(std::move(data)), piece_m(piece) {}
+    size_t size() const override { return data_m.size(); }
+    bool next(std::string &chunk) override
+    {
+        if (pos_m == data_m.size())
+            return false;
+        chunk = data_m.substr(pos_m, piece_m);
+        pos_m += chunk.size();
+        return true;
+    }
+
+private:
+    std::string data_m;
+    size_t piece_m;
+    size_t pos_m = 0;
+};
+
+// chunk flags go through the frame header, a chunked response encodes as the one piece one it stands for
+void test_chunked_responses()
+{
+    std::string payload = binary_payload();
+    Response chunk(ProtocolVersion::V2, ServiceType::COMPUTE_REQUEST, Response::Status::OK, payload);
+    chunk.header().request_id() = 9;
+    chunk.header().flags() = WIRE_V2_CHUNK | WIRE_V2_LAST_CHUNK;
+    auto chunk_back = Response::from_string(chunk.to_string());
+    CHECK(chunk_back.header().flags() == (WIRE_V2_CHUNK | WIRE_V2_LAST_CHUNK));
+    CHECK(chunk_back.header().request_id() == 9);
+    CHECK(chunk_back.data() == payload);
+    CHECK(Response::from_string(Response(ProtocolVersion::V2, ServiceType::COMPUTE_REQUEST, Response::Status::OK, payload).to_string()).header().flags() == 0);
+    // unknown flags and a last chunk that is not a chunk
+    for (uint32_t flags : {4u, WIRE_V2_LAST_CHUNK})
+    {
+        chunk.header().flags() = flags;
+        CHECK(throws_runtime_error([&]
+                                   { Response::from_string(chunk.to_string()); }));
+    }
+
+    for (auto ver : {ProtocolVersion::V1, ProtocolVersion::V2})
+    {
+        std::string expected = ComputeResponse(ComputeResponse::Status::OK, payload).to_string(ver);
+        // drained into one piece where chunks cannot go
+        CHECK(ComputeResponse(ComputeResponse::Status::OK, std::make_shared<StringChunks>(payload, 7)).to_string(ver) == expected);
+        Response response(ver, ServiceType::COMPUTE_REQUEST, Response::Status::OK, std::make_shared<StringChunks>(expected, 7));
+        CHECK(response.chunks() != nullptr);
+        CHECK(response.data_size() == expected.size());
+        auto response_back = Response::from_string(response.to_string());
+        CHECK(response.chunks() == nullptr);
+        CHECK(response_back.data() == expected);
+    }
+    // the V2 chunks are the header of the one piece encoding, then the data
+    ComputeResponse compute_response(ComputeResponse::Status::OK, std::make_shared<StringChunks>(payload, 7));
+    CHECK(compute_response.chunked());
+    auto chunks = compute_response.to_chunks();
+    CHECK(chunks->size() == ComputeResponse::V2_HEADER_SIZE + payload.size());
+    std::string joined, piece;
+    CHECK(chunks->next(piece) && piece.size() == ComputeResponse::V2_HEADER_SIZE);
+    joined = piece;
+    while (chunks->next(piece))
+        joined += piece;
+    CHECK(joined == ComputeResponse(ComputeResponse::Status::OK, payload).to_string());
+    CHECK(ComputeResponse::from_string(joined).data() == payload);
+}
+
+int main()
+{
+    test_buffer_chain();
+    test_frames();
+    test_nested_messages();
+    test_compute_request();
+    test_chunked_responses();
+    return test_result();
+}